@@ -39,6 +39,10 @@ make		|| exit 1
 make install	|| exit 1
 
 mknod /dev/hello_queue c 17 0 || exit 1
+# Extra queues, used when the driver is started with "-args minors=N".
+for minor in 1 2 3; do
+    mknod /dev/hello_queue\${minor} c 17 \${minor} || exit 1
+done
 
 # service up /service/hello_queue -dev /dev/hello_queue || exit 1
 
@@ -11,6 +11,7 @@ void blockdriver_mt_sleep(void);
 void blockdriver_mt_wakeup(thread_id_t id);
 void blockdriver_mt_terminate(void);
 void blockdriver_mt_set_workers(device_id_t id, int workers);
+int blockdriver_mt_set_sched(const char *name);
 thread_id_t blockdriver_mt_get_tid(void);
 
 #endif /* _MINIX_BLOCKDRIVER_MT_H */
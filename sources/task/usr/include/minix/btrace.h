@@ -18,6 +18,8 @@ enum {
   BTREQ_IOCTL
 };
 
+#define BTREQ_NR	(BTREQ_IOCTL + 1)	/* number of request codes */
+
 /* Special result codes. */
 #define BTRES_INPROGRESS	(-997)
 
@@ -32,6 +34,44 @@ typedef struct {
   u32_t finish_time;		/* request service completion time (us) */
 } btrace_entry;			/* (32 bytes) */
 
+/* Message queue statistics of a device, returned by the BIOCTRACEQ ioctl
+ * call. All counts are since the driver (re)started.
+ */
+typedef struct {
+  u32_t depth;			/* requests queued right now */
+  u32_t max_depth;		/* largest number of requests queued */
+  u32_t limit;			/* maximum number of requests queued */
+  u32_t cells;			/* queue cells allocated for all devices */
+  u64_t enqueued;		/* requests queued */
+  u64_t overflows;		/* requests refused because the queue was full */
+} btrace_mqstats;
+
+/* Number of buckets in a latency histogram. Bucket 0 counts the requests that
+ * took less than one microsecond, and bucket i (i > 0) those that took from
+ * 2^(i-1) up to 2^i microseconds. The last bucket also counts any slower ones.
+ */
+#define BTHIST_BUCKETS	24
+
+/* Service time statistics of one request code. */
+typedef struct {
+  u64_t count;			/* requests completed */
+  u64_t errors;			/* requests that failed */
+  u64_t total_time;		/* sum of service times (us) */
+  u32_t max_time;		/* longest service time (us) */
+  u32_t hist[BTHIST_BUCKETS];	/* service time histogram */
+} btrace_hist;
+
+/* Statistics of a device, returned by the BIOCTRACESTATS ioctl call. Like the
+ * message queue statistics, these are kept at all times, whether tracing is
+ * enabled or not. All counts are since the driver (re)started.
+ */
+typedef struct {
+  btrace_mqstats queue;		/* message queue statistics */
+  u32_t busy;			/* requests being serviced right now */
+  u32_t max_busy;		/* most requests serviced at once */
+  btrace_hist op[BTREQ_NR];	/* statistics per request code */
+} btrace_stats;
+
 /* This is the number of btrace_entry structures copied out at once using the
  * BIOCTRACEGET ioctl call.
  */
@@ -2348,6 +2348,7 @@ typedef struct asynmsg
 
 int _ipc_send_intr(endpoint_t dest, message *m_ptr);
 int _ipc_receive_intr(endpoint_t src, message *m_ptr, int *status_ptr);
+int _ipc_receivenb_intr(endpoint_t src, message *m_ptr, int *status_ptr);
 int _ipc_sendrec_intr(endpoint_t src_dest, message *m_ptr);
 int _ipc_sendnb_intr(endpoint_t dest, message *m_ptr);
 int _ipc_notify_intr(endpoint_t dest);
@@ -2392,6 +2393,14 @@ static inline int _ipc_receive(endpoint_t src, message *m_ptr, int *st)
 	return _minix_ipcvecs.receive(src, m_ptr, st);
 }
 
+/* There is no vector for RECEIVENB in the table the kernel hands out, so the
+ * nonblocking receive always traps through the interrupt vector.
+ */
+static inline int _ipc_receivenb(endpoint_t src, message *m_ptr, int *st)
+{
+	return _ipc_receivenb_intr(src, m_ptr, st);
+}
+
 static inline int _ipc_sendrec(endpoint_t src_dest, message *m_ptr)
 {
 	return _minix_ipcvecs.sendrec(src_dest, m_ptr);
@@ -8,6 +8,7 @@
 /* SEF entry points for system processes. */
 void sef_startup(void);
 int sef_receive_status(endpoint_t src, message *m_ptr, int *status_ptr);
+int sef_receive_status_nb(endpoint_t src, message *m_ptr, int *status_ptr);
 endpoint_t sef_self(void);
 void sef_cancel(void);
 void sef_exit(int status);
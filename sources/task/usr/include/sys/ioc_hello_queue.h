@@ -1,6 +1,8 @@
 #ifndef _S_I_HELLO_QUEUE_H
 #define _S_I_HELLO_QUEUE_H
 
+#include <sys/types.h>
+
 /* MSG_SIZE will be different in tests. */
 #define MSG_SIZE 7
 
@@ -9,4 +11,178 @@
 #define HQIOCXCH  _IOW('a', 3, char[2])
 #define HQIOCDEL  _IO('a', 4)
 
+/* Operations of a HQIOCBATCH request. */
+#define HQ_OP_RES 1
+#define HQ_OP_SET 2
+#define HQ_OP_XCH 3
+#define HQ_OP_DEL 4
+
+/* Largest number of operations in one HQIOCBATCH request. */
+#define HQ_BATCH_MAX 64
+
+struct hq_op {
+	int op;			/* HQ_OP_RES, HQ_OP_SET, HQ_OP_XCH or HQ_OP_DEL */
+	int status;		/* set by the driver: 0, an errno value, or
+				 * ECANCELED if not run */
+	char arg[MSG_SIZE < 2 ? 2 : MSG_SIZE]; /* SET message, XCH bytes */
+};
+
+/* Runs nr_ops operations in order, with nothing else in between. The first
+ * failing operation stops the batch; the ones after it are not run.
+ */
+struct hq_batch {
+	int nr_ops;
+	struct hq_op ops[HQ_BATCH_MAX];
+};
+
+#define HQIOCBATCH _IOWR('a', 5, struct hq_batch)
+
+/* Shared-memory producer ring, set up with HQIOCRING. The caller appends
+ * records to the ring and the driver moves their payload to the end of the
+ * queue, in the same order as the caller's other requests on the device:
+ * anything in the ring when a read, write or ioctl arrives goes first.
+ *
+ * A record is a 4-byte length followed by the payload, padded to a multiple
+ * of HQ_RING_ALIGN. head and tail run freely and are taken modulo size; the
+ * payload may wrap around the end of the data area. To add a record:
+ *
+ *	copy the record to HQ_RING_DATA(r) at tail, if size - (tail - head)
+ *	leaves room for it;
+ *	tail += HQ_RING_RECORD(length), after a write barrier;
+ *	full barrier;
+ *	if need_kick is set, clear it and call ioctl(fd, HQIOCKICK).
+ *
+ * The driver sets need_kick whenever it finds the ring empty, so the
+ * doorbell is rung only when the ring goes from empty to non-empty.
+ * The ring keeps its address across a live update of the driver, which
+ * unmaps it from the caller for a moment while moving it to the new instance.
+ */
+struct hq_ring {
+	volatile unsigned int head;	/* next byte the driver reads */
+	volatile unsigned int tail;	/* next byte the caller writes */
+	volatile unsigned int need_kick; /* set by the driver, see above */
+	unsigned int size;		/* size of the data area */
+};
+
+#define HQ_RING_ALIGN	4
+#define HQ_RING_DATA(r)	((char *)(r) + sizeof(struct hq_ring))
+#define HQ_RING_RECORD(length) \
+	(4 + (((length) + HQ_RING_ALIGN - 1) & ~(HQ_RING_ALIGN - 1)))
+
+/* Bounds of the data area size, which is a power of two. */
+#define HQ_RING_MIN	256
+#define HQ_RING_MAX	(1 << 20)
+
+struct hq_ring_setup {
+	size_t size;		/* data area size; 0 detaches the ring */
+	void *addr;		/* set by the driver: the struct hq_ring */
+};
+
+/* One ring per minor device, held by one process at a time. HQIOCKICK
+ * moves the records to the queue and wakes up its readers.
+ */
+#define HQIOCRING _IOWR('a', 6, struct hq_ring_setup)
+#define HQIOCKICK _IO('a', 7)
+
+/* Requests counted by HQIOCSTATS, indices of ops[] and hist[]. */
+#define HQ_STAT_READ	0
+#define HQ_STAT_WRITE	1
+#define HQ_STAT_RES	2
+#define HQ_STAT_SET	3
+#define HQ_STAT_XCH	4
+#define HQ_STAT_DEL	5
+#define HQ_STAT_BATCH	6
+#define HQ_STAT_RING	7	/* HQIOCRING and HQIOCKICK */
+#define HQ_STAT_NR	8
+
+/* Bucket i of a service time histogram counts requests that took from 2^i
+ * up to 2^(i+1) TSC cycles; the last bucket also counts longer ones.
+ */
+#define HQ_HIST_BUCKETS	32
+
+/* Statistics of the queue of one minor device, since the driver started.
+ * Suspended reads are timed until they are suspended; their bytes are
+ * counted when they complete.
+ */
+struct hq_stats {
+	u64_t bytes_in;		/* written, through write(2) or the ring */
+	u64_t bytes_out;	/* read */
+	u64_t ops[HQ_STAT_NR];	/* requests served */
+	u64_t allocs;		/* storage allocations, growing or shrinking */
+	u64_t moves;		/* copies of stored bytes to new places */
+	u64_t bytes_moved;	/* bytes copied by those */
+	u64_t capacity;		/* storage currently allocated */
+	u64_t peak_capacity;	/* largest capacity so far */
+	u64_t hist[HQ_STAT_NR][HQ_HIST_BUCKETS]; /* service times */
+};
+
+#define HQIOCSTATS _IOR('a', 8, struct hq_stats)
+
+/* Framed mode of a minor device, switched on with a non-zero argument. In
+ * framed mode every write(2) and every record of the producer ring is one
+ * record, and every read(2) returns at most one record; what does not fit
+ * in the buffer is dropped with it. FIONREAD gives the length of the next
+ * record, or the number of bytes to read in byte mode. The bytes queued
+ * before the switch are one record.
+ *
+ * The other requests work on the bytes as in byte mode. HQIOCXCH leaves
+ * the records as they are. HQIOCDEL shortens each record by the bytes it
+ * removes from it, and records left empty are gone. HQIOCSET overwrites
+ * the last MSG_SIZE bytes whatever records they are in; the bytes it adds
+ * to a short queue join the last record. HQIOCRES leaves a single record.
+ * Fan-out queues cannot be framed.
+ */
+#define HQIOCFRAMED _IOW('a', 9, int)
+
+/* Priority lanes, with "-args lanes=K" for K up to HQ_MAX_LANES. Every open
+ * file writes to a lane of its own, 0 until it sets another with HQIOCLANE.
+ * A read takes bytes from a single lane: the highest one holding any, or,
+ * with "-args fair=1", each lane in turn, lane i giving up to (i + 1) *
+ * HQ_LANE_QUANTUM bytes a turn, so that no lane starves.
+ *
+ * Lane 0 is the queue as it is without lanes: it holds the initial bytes
+ * and the records of the producer ring, and HQIOCRES, HQIOCSET, HQIOCXCH
+ * and HQIOCDEL work on it alone. Writes waiting for room do not hold back
+ * those to higher lanes. Queues with lanes cannot be fan-out or framed.
+ */
+#define HQ_MAX_LANES	8
+#define HQ_LANE_QUANTUM	4096
+
+#define HQIOCLANE _IOW('a', 10, int)
+
+/* Statistics of one lane. The queueing delay of a read is the time, in TSC
+ * cycles, its first byte spent in the lane; delay[i] counts reads delayed
+ * from 2^i up to 2^(i+1) cycles, as in struct hq_stats. Bytes of lane 0
+ * from before its last HQIOCRES, HQIOCSET or HQIOCDEL are not timed.
+ */
+struct hq_lane_stats {
+	u64_t bytes_in;
+	u64_t bytes_out;
+	u64_t reads;
+	u64_t max_delay;
+	u64_t delay[HQ_HIST_BUCKETS];
+};
+
+struct hq_lanes {
+	int nr_lanes;		/* 1 if the queue has no lanes */
+	struct hq_lane_stats lane[HQ_MAX_LANES];
+};
+
+#define HQIOCLANES _IOR('a', 11, struct hq_lanes)
+
+/* Receive batches of the driver as a whole, any minor answering. With
+ * "-args batch=N" the driver handles up to N requests, all those already
+ * waiting, for each time it blocks to receive, and replies to them at once.
+ * sizes[i] counts batches of i + 1 requests.
+ */
+#define HQ_RECV_MAX	32
+
+struct hq_recv {
+	u64_t batches;
+	u64_t requests;
+	u64_t sizes[HQ_RECV_MAX];
+};
+
+#define HQIOCRECV _IOR('a', 12, struct hq_recv)
+
 #endif /* _S_I_HELLO_QUEUE_H */
@@ -17,8 +17,10 @@ static void usage(char *name)
     "%s start <device> <nr_entries>\n"
     "%s stop <device> <file>\n"
     "%s reset <device>\n"
-    "%s dump <file>\n",
-    name, name, name, name);
+    "%s dump <file>\n"
+    "%s queue <device>\n"
+    "%s live <device> [<interval> [<count>]]\n",
+    name, name, name, name, name, name);
 
   exit(EXIT_FAILURE);
 }
@@ -121,6 +123,112 @@ static void btrace_reset(char *device)
   close(devfd);
 }
 
+static void btrace_queue(char *device)
+{
+  btrace_mqstats mqstats;
+  int devfd;
+
+  if ((devfd = open(device, O_RDONLY)) < 0) {
+	perror("device open");
+	exit(EXIT_FAILURE);
+  }
+
+  if (ioctl(devfd, BIOCTRACEQ, &mqstats) < 0) {
+	perror("ioctl(BIOCTRACEQ)");
+	exit(EXIT_FAILURE);
+  }
+
+  close(devfd);
+
+  printf("depth %u max %u limit %u cells %u\n", mqstats.depth,
+	mqstats.max_depth, mqstats.limit, mqstats.cells);
+  printf("enqueued %llu overflows %llu\n", mqstats.enqueued,
+	mqstats.overflows);
+}
+
+static void get_stats(int devfd, btrace_stats *stats)
+{
+  if (ioctl(devfd, BIOCTRACESTATS, stats) < 0) {
+	perror("ioctl(BIOCTRACESTATS)");
+	exit(EXIT_FAILURE);
+  }
+}
+
+static u32_t hist_percentile(u32_t *hist, u64_t count, int permille)
+{
+  /* Return the upper bound, in microseconds, of the histogram bucket that
+   * holds the given percentile, which is expressed in tenths of a percent.
+   */
+  u64_t need, seen;
+  int i;
+
+  need = (count * permille + 999) / 1000;
+  seen = 0;
+
+  for (i = 0; i < BTHIST_BUCKETS - 1; i++) {
+	seen += hist[i];
+	if (seen >= need) break;
+  }
+
+  return 1 << i;
+}
+
+static void btrace_live(char *device, int interval, int count)
+{
+  static const char *names[BTREQ_NR] = {
+	"OPEN", "CLOSE", "READ", "WRITE", "GATHER", "SCATTER", "IOCTL"
+  };
+  btrace_stats prev, cur;
+  btrace_hist *hp, *pp;
+  u32_t hist[BTHIST_BUCKETS];
+  u64_t n, time;
+  int i, j, devfd;
+
+  if ((devfd = open(device, O_RDONLY)) < 0) {
+	perror("device open");
+	exit(EXIT_FAILURE);
+  }
+
+  get_stats(devfd, &prev);
+
+  /* Print the requests completed in each interval, along with the service
+   * times. The percentiles are upper bounds, as precise as the histogram.
+   */
+  while (count == 0 || count-- > 0) {
+	sleep(interval);
+
+	get_stats(devfd, &cur);
+
+	printf("queue %u (max %u) busy %u (max %u)\n", cur.queue.depth,
+		cur.queue.max_depth, cur.busy, cur.max_busy);
+
+	for (i = 0; i < BTREQ_NR; i++) {
+		hp = &cur.op[i];
+		pp = &prev.op[i];
+
+		if ((n = hp->count - pp->count) == 0)
+			continue;
+
+		for (j = 0; j < BTHIST_BUCKETS; j++)
+			hist[j] = hp->hist[j] - pp->hist[j];
+		time = hp->total_time - pp->total_time;
+
+		printf("  %-8s %6llu/s err %llu avg %llu us p50 %u us "
+			"p99 %u us p99.9 %u us\n", names[i], n / interval,
+			hp->errors - pp->errors, time / n,
+			hist_percentile(hist, n, 500),
+			hist_percentile(hist, n, 990),
+			hist_percentile(hist, n, 999));
+	}
+
+	fflush(stdout);
+
+	prev = cur;
+  }
+
+  close(devfd);
+}
+
 static void dump_entry(btrace_entry *entry)
 {
   switch (entry->request) {
@@ -188,7 +296,7 @@ static void btrace_dump(char *file)
 
 int main(int argc, char **argv)
 {
-  int num;
+  int num, interval;
   char *name = argv[0];
 
   if (argc < 3) usage(name);
@@ -213,6 +321,17 @@ int main(int argc, char **argv)
   else if (!strcmp(argv[1], "dump")) {
 	btrace_dump(argv[2]);
   }
+  else if (!strcmp(argv[1], "queue")) {
+	btrace_queue(argv[2]);
+  }
+  else if (!strcmp(argv[1], "live")) {
+	interval = (argc > 3) ? atoi(argv[3]) : 1;
+	num = (argc > 4) ? atoi(argv[4]) : 0;
+
+	if (interval <= 0 || num < 0) usage(name);
+
+	btrace_live(argv[2], interval, num);
+  }
   else usage(name);
 
   return EXIT_SUCCESS;
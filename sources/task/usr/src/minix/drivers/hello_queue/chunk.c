@@ -0,0 +1,162 @@
+#include "queue.h"
+
+#include <stdlib.h>
+
+// Number of bytes stored in one chunk.
+#define HQ_CHUNK_SIZE 4096
+
+// Number of free chunks the pool keeps for reuse.
+#define HQ_POOL_MAX 64
+
+struct hq_chunk {
+    struct hq_chunk *next;
+    char data[HQ_CHUNK_SIZE];
+};
+
+// Chunk pool shared by all queues. Freed chunks are kept here, so a queue
+// that keeps growing and draining does not hit malloc on every chunk.
+static struct hq_chunk *pool_free;
+static int pool_nr_free;
+
+static struct hq_chunk *chunk_alloc(void) {
+    struct hq_chunk *c;
+
+    if ((c = pool_free) != NULL) {
+        pool_free = c->next;
+        pool_nr_free--;
+    } else if ((c = malloc(sizeof(*c))) == NULL) {
+        return NULL;
+    }
+
+    c->next = NULL;
+    return c;
+}
+
+static void chunk_free(struct hq_chunk *c) {
+    if (pool_nr_free >= HQ_POOL_MAX) {
+        free(c);
+        return;
+    }
+
+    c->next = pool_free;
+    pool_free = c;
+    pool_nr_free++;
+}
+
+// Frees all chunks after c and makes c the last one.
+static void chunk_cut(struct hq_queue *q, struct hq_chunk *c) {
+    struct hq_chunk *next;
+
+    for (next = c->next; next != NULL; next = c->next) {
+        c->next = next->next;
+        chunk_free(next);
+        q->u.chunk.nr_chunks--;
+    }
+    q->u.chunk.last = c;
+    stats_capacity(q, q->u.chunk.nr_chunks * HQ_CHUNK_SIZE);
+}
+
+static int chunk_init(struct hq_queue *q) {
+    q->u.chunk.first = NULL;
+    q->u.chunk.last = NULL;
+    q->u.chunk.head = 0;
+    q->u.chunk.nr_chunks = 0;
+    return OK;
+}
+
+static void chunk_cleanup(struct hq_queue *q) {
+    struct hq_chunk *c;
+
+    while ((c = q->u.chunk.first) != NULL) {
+        q->u.chunk.first = c->next;
+        chunk_free(c);
+    }
+    chunk_init(q);
+    stats_capacity(q, 0);
+}
+
+static int chunk_reserve(struct hq_queue *q, size_t size) {
+    struct hq_chunk *c;
+
+    while (q->u.chunk.nr_chunks * HQ_CHUNK_SIZE - q->u.chunk.head - q->size <
+           size) {
+        if ((c = chunk_alloc()) == NULL) return ENOMEM;
+
+        if (q->u.chunk.last == NULL) {
+            q->u.chunk.first = c;
+        } else {
+            q->u.chunk.last->next = c;
+        }
+        q->u.chunk.last = c;
+        q->u.chunk.nr_chunks++;
+        q->stats.allocs++;
+    }
+
+    stats_capacity(q, q->u.chunk.nr_chunks * HQ_CHUNK_SIZE);
+    return OK;
+}
+
+static size_t chunk_segment(struct hq_queue *q, struct hq_pos *pos,
+                            char **ptr) {
+    /* Offsets are counted from the start of the first chunk. */
+    size_t off = q->u.chunk.head + pos->off;
+
+    if (pos->chunk == NULL || off < pos->chunk_off) {
+        pos->chunk = q->u.chunk.first;
+        pos->chunk_off = 0;
+    }
+    while (off >= pos->chunk_off + HQ_CHUNK_SIZE) {
+        pos->chunk = pos->chunk->next;
+        pos->chunk_off += HQ_CHUNK_SIZE;
+    }
+
+    *ptr = pos->chunk->data + (off - pos->chunk_off);
+    return pos->chunk_off + HQ_CHUNK_SIZE - off;
+}
+
+static void chunk_consume(struct hq_queue *q, size_t size) {
+    struct hq_chunk *c;
+
+    q->u.chunk.head += size;
+    q->size -= size;
+
+    /* Whole chunks are released, nothing is ever moved. */
+    while (q->u.chunk.head >= HQ_CHUNK_SIZE) {
+        c = q->u.chunk.first;
+        if ((q->u.chunk.first = c->next) == NULL) q->u.chunk.last = NULL;
+        chunk_free(c);
+        q->u.chunk.nr_chunks--;
+        q->u.chunk.head -= HQ_CHUNK_SIZE;
+    }
+    stats_capacity(q, q->u.chunk.nr_chunks * HQ_CHUNK_SIZE);
+
+    if (q->size == 0 && q->u.chunk.first == NULL) {
+        q->u.chunk.head = 0;
+    }
+}
+
+static void chunk_truncate(struct hq_queue *q, size_t size) {
+    struct hq_pos pos;
+    char *ptr;
+
+    q->size = size;
+    if (size == 0) {
+        chunk_cleanup(q);
+        return;
+    }
+
+    /* Keep the chunk holding the last byte. */
+    queue_pos(&pos, size - 1);
+    chunk_segment(q, &pos, &ptr);
+    chunk_cut(q, pos.chunk);
+}
+
+const struct hq_backend hq_chunk_backend = {
+    .name = "chunk",
+    .init = chunk_init,
+    .cleanup = chunk_cleanup,
+    .reserve = chunk_reserve,
+    .segment = chunk_segment,
+    .consume = chunk_consume,
+    .truncate = chunk_truncate,
+};
@@ -0,0 +1,153 @@
+#include "queue.h"
+
+#include <stdlib.h>
+
+// Cursors indexed by minor number, counted from HQ_CURSOR_MINOR.
+static struct hq_cursor *cursors[HQ_MAX_CURSORS];
+static int nr_cursors;
+
+static void heap_set(struct hq_queue *q, int i, struct hq_cursor *c) {
+    q->heap[i] = c;
+    c->heap = i;
+}
+
+// Moves the cursor at index i up while it is behind its parent.
+static void heap_up(struct hq_queue *q, int i) {
+    struct hq_cursor *c = q->heap[i];
+    int parent;
+
+    for (; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (q->heap[parent]->pos <= c->pos) break;
+        heap_set(q, i, q->heap[parent]);
+    }
+    heap_set(q, i, c);
+}
+
+// Moves the cursor at index i down while a child is behind it.
+static void heap_down(struct hq_queue *q, int i) {
+    struct hq_cursor *c = q->heap[i];
+    int child;
+
+    for (; (child = 2 * i + 1) < q->nr_cursors; i = child) {
+        if (child + 1 < q->nr_cursors &&
+            q->heap[child + 1]->pos < q->heap[child]->pos) {
+            child++;
+        }
+        if (c->pos <= q->heap[child]->pos) break;
+        heap_set(q, i, q->heap[child]);
+    }
+    heap_set(q, i, c);
+}
+
+// Sets up a cursor in the given slot and adds it to the heap of q.
+static struct hq_cursor *cursor_insert(struct hq_queue *q, int slot,
+                                       u64_t pos) {
+    struct hq_cursor *c;
+
+    if (q->heap == NULL &&
+        (q->heap = malloc(HQ_MAX_CURSORS * sizeof(*q->heap))) == NULL) {
+        return NULL;
+    }
+    if ((c = malloc(sizeof(*c))) == NULL) {
+        /* The heap goes with the last cursor, as on close. */
+        if (q->nr_cursors == 0) {
+            free(q->heap);
+            q->heap = NULL;
+        }
+        return NULL;
+    }
+
+    c->minor = HQ_CURSOR_MINOR + slot;
+    c->q = q;
+    c->pos = pos;
+    c->wait.readers = NULL;
+    c->wait.readers_tail = &c->wait.readers;
+    c->wait.select_endpt = NONE;
+    c->wait.select_ops = 0;
+    c->waiting = FALSE;
+    c->next_waiting = NULL;
+
+    cursors[slot] = c;
+    nr_cursors++;
+
+    q->heap[q->nr_cursors++] = c;
+    heap_up(q, q->nr_cursors - 1);
+    return c;
+}
+
+int cursor_open(struct hq_queue *q, int max, struct hq_cursor **cp) {
+    u64_t pos;
+    int slot;
+
+    if (nr_cursors >= MIN(max, HQ_MAX_CURSORS)) return ENFILE;
+
+    /* Opens are rare; the lowest free minor keeps the numbers small. */
+    for (slot = 0; cursors[slot] != NULL; slot++)
+        ;
+
+    /* A new reader starts with the slowest one, not at bytes that are
+     * only still there until the next reclaim. */
+    pos = q->nr_cursors > 0 ? cursor_min(q) : q->base;
+    if ((*cp = cursor_insert(q, slot, pos)) == NULL) return ENOMEM;
+    return OK;
+}
+
+struct hq_cursor *cursor_restore(struct hq_queue *q, devminor_t minor,
+                                 u64_t pos) {
+    int slot = minor - HQ_CURSOR_MINOR;
+
+    if (slot < 0 || slot >= HQ_MAX_CURSORS || cursors[slot] != NULL) {
+        return NULL;
+    }
+    return cursor_insert(q, slot, pos);
+}
+
+struct hq_cursor *cursor_get(devminor_t minor) {
+    int slot = minor - HQ_CURSOR_MINOR;
+
+    if (slot < 0 || slot >= HQ_MAX_CURSORS) return NULL;
+
+    return cursors[slot];
+}
+
+void cursor_close(struct hq_cursor *c) {
+    struct hq_queue *q = c->q;
+    struct hq_cursor **cp, *last;
+    struct hq_request *r;
+    int i = c->heap;
+
+    /* The last cursor takes the place of the closed one. */
+    if (--q->nr_cursors > i) {
+        last = q->heap[q->nr_cursors];
+        heap_set(q, i, last);
+        heap_up(q, i);
+        heap_down(q, last->heap);
+    }
+
+    if (c->waiting) {
+        for (cp = &q->waiting; *cp != c; cp = &(*cp)->next_waiting)
+            ;
+        *cp = c->next_waiting;
+    }
+    while ((r = c->wait.readers) != NULL) {
+        c->wait.readers = r->next;
+        free(r);
+    }
+
+    cursors[c->minor - HQ_CURSOR_MINOR] = NULL;
+    nr_cursors--;
+    free(c);
+
+    if (q->nr_cursors == 0) {
+        free(q->heap);
+        q->heap = NULL;
+    }
+}
+
+void cursor_advance(struct hq_cursor *c, size_t size) {
+    c->pos += size;
+    heap_down(c->q, c->heap);
+}
+
+u64_t cursor_min(struct hq_queue *q) { return q->heap[0]->pos; }
@@ -0,0 +1,177 @@
+#include "queue.h"
+
+#include <minix/ds.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Smallest capacity of the record index. An index this large is kept for as
+// long as the queue is framed, so there is always room for one record.
+#define FRAME_MIN_CAPACITY 16
+
+#define FRAME_AT(q, i) \
+    ((q)->frames[((q)->frames_head + (i)) & ((q)->frames_cap - 1)])
+
+// Moves the index into a new array of the given capacity, oldest record
+// first.
+static int frame_resize(struct hq_queue *q, size_t capacity) {
+    size_t *frames, i;
+
+    if ((frames = malloc(capacity * sizeof(*frames))) == NULL) return ENOMEM;
+
+    for (i = 0; i < q->nr_frames; i++) {
+        frames[i] = FRAME_AT(q, i);
+    }
+
+    free(q->frames);
+    q->frames = frames;
+    q->frames_cap = capacity;
+    q->frames_head = 0;
+    return OK;
+}
+
+void frame_init(struct hq_queue *q) {
+    q->framed = FALSE;
+    q->frames = NULL;
+    q->frames_cap = 0;
+    q->frames_head = 0;
+    q->nr_frames = 0;
+}
+
+void frame_cleanup(struct hq_queue *q) {
+    free(q->frames);
+    frame_init(q);
+}
+
+int frame_set(struct hq_queue *q, int framed) {
+    int ret;
+
+    if (!framed) {
+        frame_cleanup(q);
+        return OK;
+    }
+    if (q->framed) return OK;
+
+    if ((ret = frame_resize(q, FRAME_MIN_CAPACITY)) != OK) return ret;
+    q->framed = TRUE;
+
+    /* What the queue holds so far is read as one record. */
+    frame_push(q, q->virt + q->size);
+    return OK;
+}
+
+int frame_reserve(struct hq_queue *q) {
+    if (!q->framed || q->nr_frames < q->frames_cap) return OK;
+
+    return frame_resize(q, 2 * q->frames_cap);
+}
+
+void frame_push(struct hq_queue *q, size_t size) {
+    if (!q->framed || size == 0) return;
+
+    q->nr_frames++;
+    FRAME_AT(q, q->nr_frames - 1) = size;
+}
+
+size_t frame_next(struct hq_queue *q) {
+    return q->nr_frames > 0 ? FRAME_AT(q, 0) : 0;
+}
+
+void frame_pop(struct hq_queue *q) {
+    q->frames_head = (q->frames_head + 1) & (q->frames_cap - 1);
+    q->nr_frames--;
+
+    /* Shrink once less than a quarter full, like the ring buffer. */
+    if (q->nr_frames < q->frames_cap / 4 &&
+        q->frames_cap / 2 >= FRAME_MIN_CAPACITY) {
+        frame_resize(q, q->frames_cap / 2);
+    }
+}
+
+void frame_grow(struct hq_queue *q, size_t size) {
+    if (!q->framed || size == 0) return;
+
+    /* There is always room for the first record. */
+    if (q->nr_frames == 0) {
+        frame_push(q, size);
+    } else {
+        FRAME_AT(q, q->nr_frames - 1) += size;
+    }
+}
+
+void frame_reset(struct hq_queue *q, size_t size) {
+    if (!q->framed) return;
+
+    q->frames_head = 0;
+    q->nr_frames = 0;
+    frame_push(q, size);
+}
+
+void frame_del(struct hq_queue *q) {
+    size_t i, kept = 0, start = 0, end, len;
+
+    /* HQIOCDEL takes every third byte of the whole queue, as in byte mode.
+     * Each record loses the ones inside it; records left empty are gone. */
+    for (i = 0; i < q->nr_frames; i++) {
+        end = start + FRAME_AT(q, i);
+        len = FRAME_AT(q, i) - (end / 3 - start / 3);
+        if (len > 0) FRAME_AT(q, kept++) = len;
+        start = end;
+    }
+    q->nr_frames = kept;
+}
+
+int frame_lu_save(struct hq_queue *q) {
+    char key[DS_MAX_KEYLEN];
+    int r;
+
+    if (!q->framed) return OK;
+
+    /* One piece, oldest record first. */
+    if (q->frames_head + q->nr_frames > q->frames_cap &&
+        (r = frame_resize(q, q->frames_cap)) != OK) {
+        return r;
+    }
+
+    snprintf(key, sizeof(key), "hq_framed.%d", q->minor);
+    if ((r = ds_publish_u32(key, q->nr_frames, DSF_OVERWRITE)) != OK)
+        return r;
+    if (q->nr_frames > 0) {
+        snprintf(key, sizeof(key), "hq_frames.%d", q->minor);
+        r = ds_publish_mem(key, q->frames + q->frames_head,
+                           q->nr_frames * sizeof(*q->frames), DSF_OVERWRITE);
+    }
+    return r;
+}
+
+void frame_lu_restore(struct hq_queue *q) {
+    char key[DS_MAX_KEYLEN];
+    size_t capacity = FRAME_MIN_CAPACITY, length, total = 0, i;
+    u32_t nr_frames;
+
+    snprintf(key, sizeof(key), "hq_framed.%d", q->minor);
+    if (ds_retrieve_u32(key, &nr_frames) != OK) return;
+    ds_delete_u32(key);
+
+    while (capacity < nr_frames) capacity *= 2;
+    if (frame_resize(q, capacity) != OK) {
+        printf("hello_queue: cannot keep the records of minor %d\n",
+               q->minor);
+        return;
+    }
+    q->framed = TRUE;
+
+    snprintf(key, sizeof(key), "hq_frames.%d", q->minor);
+    length = nr_frames * sizeof(*q->frames);
+    if (nr_frames > 0 &&
+        ds_retrieve_mem(key, (char *)q->frames, &length) == OK) {
+        q->nr_frames = length / sizeof(*q->frames);
+    }
+    ds_delete_mem(key);
+
+    /* Records that do not add up to the contents are worse than none. */
+    for (i = 0; i < q->nr_frames; i++) total += q->frames[i];
+    if (total != q->virt + q->size) {
+        printf("hello_queue: records of minor %d lost\n", q->minor);
+        frame_reset(q, q->virt + q->size);
+    }
+}
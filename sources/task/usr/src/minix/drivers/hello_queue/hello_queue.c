@@ -2,11 +2,19 @@
 
 #include <minix/chardriver.h>
 #include <minix/drivers.h>
+#include <minix/bdev.h>
 #include <minix/ds.h>
 #include <minix/ioctl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioc_file.h>
 #include <sys/ioc_hello_queue.h>
+#include <sys/select.h>
+
+#include "kernels.h"
+#include "queue.h"
 
 #define HELLO_MESSAGE "Hello, World!\n"
 
@@ -18,215 +26,2009 @@ static int hq_close(devminor_t minor);
 static ssize_t hq_read(devminor_t minor, u64_t position, endpoint_t endpt,
                        cp_grant_id_t grant, size_t size, int flags,
                        cdev_id_t id);
-static ssize_t hq_write(devminor_t UNUSED(minor), u64_t position,
-                        endpoint_t endpt, cp_grant_id_t grant, size_t size,
-                        int UNUSED(flags), cdev_id_t UNUSED(id));
+static ssize_t hq_write(devminor_t minor, u64_t position, endpoint_t endpt,
+                        cp_grant_id_t grant, size_t size, int flags,
+                        cdev_id_t id);
+
+static int hq_ioctl(devminor_t minor, unsigned long request, endpoint_t endpt,
+                    cp_grant_id_t grant, int flags, endpoint_t user_endpt,
+                    cdev_id_t id);
+static int hq_cancel(devminor_t minor, endpoint_t endpt, cdev_id_t id);
+static int hq_select(devminor_t minor, unsigned int ops, endpoint_t endpt);
+static void hq_alarm(clock_t stamp);
+static void hq_other(message *m, int ipc_status);
+
+// Returns the queue of an opened minor device, or NULL.
+static struct hq_queue *hq_get(devminor_t minor);
+
+// Returns the queue behind a queue or cursor minor device, or NULL, and
+// stores the cursor, if any, in *cp.
+static struct hq_queue *hq_lookup(devminor_t minor, struct hq_cursor **cp);
+
+// Allocates an empty queue.
+static struct hq_queue *queue_alloc(devminor_t minor);
+
+// Allocates a queue holding the initial "xyz" contents.
+static struct hq_queue *queue_create(devminor_t minor);
+
+// Initializes a queue with no waiting processes.
+static void queue_init(struct hq_queue *q, devminor_t minor);
+
+// Initializes an empty set of waiters.
+static void waiters_init(struct hq_waiters *w);
+
+// Serves a read through cursor c, or from the queue if c is NULL,
+// possibly by suspending it.
+static ssize_t do_read(struct hq_queue *q, struct hq_cursor *c,
+                       endpoint_t endpt, cp_grant_id_t grant, size_t size,
+                       int flags, cdev_id_t id);
+
+// Serves a write to a lane, possibly by suspending it until there is room.
+static ssize_t do_write(struct hq_queue *q, int lane, endpoint_t endpt,
+                        cp_grant_id_t grant, size_t size, int flags,
+                        cdev_id_t id);
+
+// Returns TRUE if a write of size bytes can go on now.
+static int write_fits(struct hq_queue *q, size_t size);
+
+// Returns TRUE if a write to a lane has to wait behind a suspended one.
+static int writers_ahead(struct hq_queue *q, int lane);
+
+// Returns TRUE if a write to a lane would not be suspended.
+static int queue_writable(struct hq_queue *q, int lane);
+
+// Appends as much of size bytes from the grant to a lane as there is room
+// for. Returns the number of bytes written.
+static ssize_t queue_write(struct hq_queue *q, int lane, endpoint_t endpt,
+                           cp_grant_id_t grant, size_t size);
+
+// Returns the number of bytes there are to read through cursor c, or from
+// the queue if c is NULL.
+static size_t queue_avail(struct hq_queue *q, struct hq_cursor *c);
+
+// Copies up to size bytes to the grant, from the front of the queue or from
+// the position of cursor c, and moves past them. Bytes read from the queue
+// come from one lane only. Returns the number of bytes read.
+static ssize_t queue_read(struct hq_queue *q, struct hq_cursor *c,
+                          endpoint_t endpt, cp_grant_id_t grant, size_t size);
+
+// Copies size bytes at queue offset off to the grant.
+static int queue_copy_out(struct hq_queue *q, size_t off, size_t size,
+                          endpoint_t endpt, cp_grant_id_t grant);
+
+// Removes size bytes from the front of the queue, virtual ones first.
+static void queue_drop(struct hq_queue *q, size_t size);
+
+// Frees the bytes all cursors have read, once there are enough of them.
+static void queue_reclaim(struct hq_queue *q);
+
+// Suspends a request at the end of the list ending in *tail.
+static int request_suspend(struct hq_request ***tail, endpoint_t endpt,
+                           cp_grant_id_t grant, size_t size, int lane,
+                           cdev_id_t id);
+
+// Completes suspended requests and select()s after data was added or
+// removed.
+static void queue_wakeup(struct hq_queue *q);
+
+// Completes the writes that fit now. Returns TRUE if any data was added.
+static int writers_wakeup(struct hq_queue *q);
+
+// Completes the reads and select()s of minor, reading through cursor c or
+// from the queue if c is NULL, for as long as there is data or room in the
+// given lane.
+static void waiters_wakeup(struct hq_queue *q, struct hq_cursor *c,
+                           struct hq_waiters *w, devminor_t minor, int lane);
+
+// Completes the select()s of the open files of a queue with lanes.
+static void files_wakeup(struct hq_queue *q);
+
+// Puts the cursor on the list of its queue's cursors with waiters.
+static void cursor_wait(struct hq_cursor *c);
+
+// Moves what the producer ring holds into the queue, so that it comes
+// before the request being served.
+static void queue_sync(struct hq_queue *q);
+
+// Moves what the producer ring holds into the queue. Returns the number of
+// bytes added.
+static size_t queue_drain(struct hq_queue *q);
+
+// Frees the queue and its storage.
+static void queue_destroy(struct hq_queue *q);
+
+// Journals an operation on the queue, with len bytes of data.
+static void queue_log(struct hq_queue *q, int type, const void *data,
+                      size_t len);
+
+// Journals the last size bytes appended to the queue.
+static void queue_log_tail(struct hq_queue *q, size_t size);
+
+// Journals an operation on a lane other than 0, with len bytes of data.
+// Returns where the data goes, or NULL.
+static char *queue_log_lane(struct hq_queue *q, int type, int lane,
+                            size_t len);
+
+// Journals the whole queue as one snapshot record.
+static void queue_snapshot(struct hq_queue *q);
+
+// Starts the other half of the journal with snapshots of all queues.
+static void hq_snapshot(void);
+
+// Gets the journal records of the request just served on their way.
+static void hq_commit(void);
+
+// Repeats a journal record on restart.
+static int journal_apply(int type, devminor_t minor, const char *data,
+                         size_t len);
+
+// Starts journaling, after replaying the journal if the driver restarted.
+static int hq_journal_init(int type);
+
+// Returns the number of bytes in the queue, virtual ones included.
+static size_t queue_length(struct hq_queue *q);
+
+// Turns the virtual pattern bytes into stored ones, before they are changed.
+static int queue_materialize(struct hq_queue *q);
+
+// Fills size bytes at queue offset off with the pattern, starting at
+// pattern index phase.
+static void fill_pattern(struct hq_queue *q, size_t off, size_t size,
+                         unsigned int phase);
+
+// Copies size pattern bytes, starting at pattern index phase, to the grant.
+static int copy_pattern(endpoint_t endpt, cp_grant_id_t grant, size_t size,
+                        unsigned int phase);
+
+static int do_res(struct hq_queue *q);
+
+static int do_set(struct hq_queue *q, endpoint_t endpt, cp_grant_id_t gid);
+
+static int do_xch(struct hq_queue *q, endpoint_t endpt, cp_grant_id_t gid);
+
+static int do_del(struct hq_queue *q);
+
+static int do_batch(struct hq_queue *q, endpoint_t endpt, cp_grant_id_t gid);
+
+static int do_ring(struct hq_queue *q, endpoint_t endpt, cp_grant_id_t gid,
+                   endpoint_t user_endpt);
+
+static int do_kick(struct hq_queue *q);
+
+static int do_stats(struct hq_queue *q, endpoint_t endpt, cp_grant_id_t gid);
+
+static int do_framed(struct hq_queue *q, endpoint_t endpt, cp_grant_id_t gid);
+
+static int do_lane(devminor_t minor, endpoint_t endpt, cp_grant_id_t gid);
+
+static int do_lanes(struct hq_queue *q, endpoint_t endpt, cp_grant_id_t gid);
+
+static int do_recv(endpoint_t endpt, cp_grant_id_t gid);
+
+// Tells how much the next read through cursor c, or from the queue if c is
+// NULL, can return.
+static int do_nread(struct hq_queue *q, struct hq_cursor *c, endpoint_t endpt,
+                    cp_grant_id_t gid);
+
+// The operations themselves. They leave waking up readers to the caller,
+// so a batch is seen by readers only as a whole.
+static void op_res(struct hq_queue *q);
+
+static int op_set(struct hq_queue *q, const char *msg);
+
+static int op_xch(struct hq_queue *q, const char *msg);
+
+/* SEF functions and variables. */
+static void sef_local_startup(void);
+static int sef_cb_init(int type, sef_init_info_t *info);
+static int sef_cb_lu_state_save(int);
+static int lu_state_restore(endpoint_t old_endpt);
+
+// Saves the contents of a queue to DS.
+static int lu_save_contents(struct hq_queue *q);
+
+// Appends size bytes saved by lu_save_contents() to an empty queue. Returns
+// an error if any of them cannot be retrieved.
+static int lu_restore_contents(struct hq_queue *q, u32_t size);
+
+// Saves the list of suspended requests of a minor device to DS, under the
+// given name. Returns an error if any of it is not saved.
+static int lu_save_requests(const char *name, devminor_t minor,
+                             struct hq_request *list);
+
+// Appends the requests saved by lu_save_requests() to the list ending in
+// *tail.
+static void lu_restore_requests(const char *name, devminor_t minor,
+                                struct hq_request ***tail);
+
+// Saves the waiters of a minor device to DS.
+static int lu_save_waiters(devminor_t minor, struct hq_waiters *w);
+
+// Restores the waiters saved by lu_save_waiters(). Returns TRUE if there
+// were any.
+static int lu_restore_waiters(devminor_t minor, struct hq_waiters *w);
+
+// Saves the cursors of a fan-out queue to DS.
+static int lu_save_cursors(struct hq_queue *q);
+
+// Restores the cursors saved by lu_save_cursors().
+static void lu_restore_cursors(struct hq_queue *q);
+
+// Saves the lanes of a queue to DS.
+static int lu_save_lanes(struct hq_queue *q);
+
+// Restores the lanes saved by lu_save_lanes(). Returns an error if the
+// contents of any lane are lost.
+static int lu_restore_lanes(struct hq_queue *q, endpoint_t old_endpt);
+
+/* Entry points to the hello driver. */
+static struct chardriver hello_tab = {
+    .cdr_open = hq_open,
+    .cdr_close = hq_close,
+    .cdr_read = hq_read,
+    .cdr_write = hq_write,
+    .cdr_ioctl = hq_ioctl,
+    .cdr_cancel = hq_cancel,
+    .cdr_select = hq_select,
+    .cdr_alarm = hq_alarm,
+    .cdr_other = hq_other,
+};
+
+// Number of minor devices used when no "minors" argument is given.
+#define HQ_DEFAULT_MINORS 1
+
+// Largest number of minor devices libchardriver can track.
+#define HQ_MAX_MINORS MAX_NR_OPEN_DEVICES
+
+// Smallest piece of the queue saved under a single DS key on live update.
+#define HQ_LU_PIECE (64 * 1024)
+
+// Largest number of DS keys used to save the contents of one queue.
+#define HQ_LU_MAX_PIECES 16
+
+// Queues indexed by minor number. A queue is allocated on the first open of
+// its minor device.
+static struct hq_queue **hq_queues;
+static int hq_nr_minors;
+
+// Storage backend of new queues, set with "-args backend=ring|chunk".
+static const struct hq_backend *hq_backend = &hq_ring_backend;
+
+// Whether new queues are fan-out queues, set with "-args fanout=1".
+static int hq_fanout;
+
+// Whether new queues are framed, set with "-args framed=1".
+static int hq_framed;
+
+// Number of lanes of new queues, set with "-args lanes=N", and whether they
+// are served in fair mode, set with "-args fair=1".
+static int hq_lanes = 1;
+static int hq_fair;
+
+// Default shrink window, in milliseconds.
+#define HQ_SHRINK_MS 1000
+
+// Bytes all cursors have read are freed in batches of at least this many.
+#define HQ_RECLAIM 4096
+
+// A cursor as saved on live update.
+struct hq_lu_cursor {
+    devminor_t minor;
+    u64_t pos;
+};
+
+// Size of the pattern block. A multiple of 3, so the pattern repeats
+// seamlessly from one copy of the block to the next.
+#define HQ_PATTERN_SIZE (3 * 1024)
+
+// The "xyz" pattern, source of all virtual bytes.
+static char hq_pattern[HQ_PATTERN_SIZE];
+
+static struct hq_queue *hq_get(devminor_t minor) {
+    if (minor < 0 || minor >= hq_nr_minors) return NULL;
+
+    return hq_queues[minor];
+}
+
+static struct hq_queue *hq_lookup(devminor_t minor, struct hq_cursor **cp) {
+    struct hq_queue *q;
+
+    if ((*cp = cursor_get(minor)) != NULL) return (*cp)->q;
+    if ((q = lane_file_get(minor, NULL)) != NULL) return q;
+
+    return hq_get(minor);
+}
+
+static int hq_open(devminor_t minor, int UNUSED(access),
+                   endpoint_t UNUSED(user_endpt)) {
+    struct hq_cursor *c;
+    devminor_t file;
+    int ret;
+
+    if (minor < 0 || minor >= hq_nr_minors) return ENXIO;
+
+    if (hq_queues[minor] == NULL &&
+        (hq_queues[minor] = queue_create(minor)) == NULL) {
+        return ENOMEM;
+    }
+
+    /* Every open file of a queue with lanes has its own lane to write to,
+     * so it too gets a minor number of its own. */
+    if (hq_queues[minor]->lanes != NULL) {
+        if ((ret = lane_file_open(hq_queues[minor],
+                                  HQ_MAX_MINORS - hq_nr_minors, &file)) !=
+            OK) {
+            return ret;
+        }
+        return CDEV_CLONED | file;
+    }
+
+    if (!hq_queues[minor]->fanout) return OK;
+
+    /* Every open file reads through a cursor of its own, which it finds by
+     * the new minor number. Libchardriver remembers every minor ever
+     * opened, so all of them together have to stay within its limit. */
+    if ((ret = cursor_open(hq_queues[minor], HQ_MAX_MINORS - hq_nr_minors,
+                           &c)) != OK) {
+        return ret;
+    }
+    return CDEV_CLONED | c->minor;
+}
+
+static int hq_close(devminor_t minor) {
+    struct hq_cursor *c = cursor_get(minor);
+    struct hq_queue *q;
+
+    lane_file_close(minor);
+    if (c == NULL) return OK;
+
+    /* What the last reader has read goes, the rest waits for the next one.
+     * Otherwise the closed cursor may have been holding bytes back. */
+    q = c->q;
+    if (q->nr_cursors == 1) {
+        queue_drop(q, c->pos - q->base);
+        q->base = c->pos;
+    }
+    cursor_close(c);
+    queue_reclaim(q);
+    queue_wakeup(q);
+    hq_commit();
+    return OK;
+}
+
+static ssize_t hq_read(devminor_t minor, u64_t UNUSED(position),
+                       endpoint_t endpt, cp_grant_id_t grant, size_t size,
+                       int flags, cdev_id_t id) {
+    struct hq_cursor *c;
+    struct hq_queue *q = hq_lookup(minor, &c);
+    u64_t start;
+    ssize_t ret;
+
+    if (q == NULL) return ENXIO;
+
+    start = stats_start();
+    ret = do_read(q, c, endpt, grant, size, flags, id);
+    stats_done(q, HQ_STAT_READ, start);
+    hq_commit();
+    return ret;
+}
+
+static ssize_t do_read(struct hq_queue *q, struct hq_cursor *c,
+                       endpoint_t endpt, cp_grant_id_t grant, size_t size,
+                       int flags, cdev_id_t id) {
+    ssize_t ret;
+
+    /* A fan-out queue is only read through cursors. */
+    if (q->fanout && c == NULL) return ENXIO;
+
+    queue_sync(q);
+
+    if (size == 0) return 0;
+
+    if (queue_avail(q, c) == 0) {
+        /* Non-blocking readers keep the old behaviour and see EOF. */
+        if (flags & CDEV_NONBLOCK) return 0;
+
+        if (c == NULL) {
+            return request_suspend(&q->wait.readers_tail, endpt, grant, size,
+                                   0, id);
+        }
+
+        if ((ret = request_suspend(&c->wait.readers_tail, endpt, grant, size,
+                                   0, id)) == EDONTREPLY) {
+            cursor_wait(c);
+        }
+        return ret;
+    }
+
+    ret = queue_read(q, c, endpt, grant, size);
+
+    /* Writers may fit now. */
+    queue_wakeup(q);
+    return ret;
+}
+
+static ssize_t hq_write(devminor_t minor, u64_t position, endpoint_t endpt,
+                        cp_grant_id_t grant, size_t size, int flags,
+                        cdev_id_t id) {
+    struct hq_cursor *c;
+    struct hq_queue *q = hq_lookup(minor, &c);
+    u64_t start;
+    ssize_t ret;
+    int lane = 0;
+
+    if (q == NULL) return ENXIO;
+    lane_file_get(minor, &lane);
+
+    start = stats_start();
+    ret = do_write(q, lane, endpt, grant, size, flags, id);
+    stats_done(q, HQ_STAT_WRITE, start);
+
+    /* The write is done once it is in the journal, along with the others
+     * that come in while the journal is being written. */
+    if (ret > 0) ret = journal_wait(endpt, id, ret);
+    hq_commit();
+    return ret;
+}
+
+static ssize_t do_write(struct hq_queue *q, int lane, endpoint_t endpt,
+                        cp_grant_id_t grant, size_t size, int flags,
+                        cdev_id_t id) {
+    ssize_t ret;
+
+    queue_sync(q);
+
+    if (size == 0) return 0;
+
+    /* A record is never split, so it must fit under the cap. */
+    if (q->framed && hq_limits.cap > 0 && size > hq_limits.cap) {
+        return EMSGSIZE;
+    }
+
+    /* No write passes one to the same or a higher lane that is waiting
+     * already. */
+    if (writers_ahead(q, lane) || !write_fits(q, size)) {
+        if (flags & CDEV_NONBLOCK) return EAGAIN;
+
+        return request_suspend(&q->writers_tail, endpt, grant, size, lane,
+                               id);
+    }
+
+    if ((ret = queue_write(q, lane, endpt, grant, size)) > 0) {
+        queue_wakeup(q);
+    }
+    return ret;
+}
+
+static int write_fits(struct hq_queue *q, size_t size) {
+    size_t room = queue_room(q);
+
+    /* Writes up to the cap go in whole. Larger ones take what there is. */
+    if (q->framed || hq_limits.cap == 0 || size <= hq_limits.cap) {
+        return room >= size;
+    }
+    return room > 0;
+}
+
+static int writers_ahead(struct hq_queue *q, int lane) {
+    struct hq_request *r;
+
+    for (r = q->writers; r != NULL; r = r->next) {
+        if (r->lane >= lane) return TRUE;
+    }
+    return FALSE;
+}
+
+static int queue_writable(struct hq_queue *q, int lane) {
+    return !writers_ahead(q, lane) && queue_room(q) > 0;
+}
+
+static ssize_t queue_write(struct hq_queue *q, int lane, endpoint_t endpt,
+                           cp_grant_id_t grant, size_t size) {
+    struct hq_queue *s;
+    char *p;
+    int ret;
+
+    size = MIN(size, queue_room(q));
+
+    if (lane > 0) {
+        if ((ret = lane_append(q, lane, endpt, grant, size)) != OK) {
+            return ret;
+        }
+        s = q->lanes[lane].store;
+        if ((p = queue_log_lane(q, HQ_J_LANE, lane, size)) != NULL) {
+            queue_get(s, s->size - size, p, size);
+        }
+    } else {
+        /* Room for the record first, so the write cannot fail halfway. */
+        if ((ret = frame_reserve(q)) != OK) return ret;
+        if ((ret = queue_append(q, endpt, grant, size)) != OK) {
+            return ret;
+        }
+        frame_push(q, size);
+        queue_log_tail(q, size);
+    }
+    lane_wrote(q, lane, size);
+    q->stats.bytes_in += size;
+    queue_throttle(q);
+
+    return size;
+}
+
+static int hq_ioctl(devminor_t minor, unsigned long request, endpoint_t endpt,
+                    cp_grant_id_t grant, int flags, endpoint_t user_endpt,
+                    cdev_id_t id) {
+    struct hq_cursor *c;
+    struct hq_queue *q = hq_lookup(minor, &c);
+    u64_t start;
+    int kind, ret;
+
+    if (q == NULL) return ENXIO;
+
+    start = stats_start();
+    queue_sync(q);
+
+    switch (request) {
+        case HQIOCRES:
+            kind = HQ_STAT_RES;
+            ret = do_res(q);
+            break;
+        case HQIOCSET:
+            kind = HQ_STAT_SET;
+            ret = do_set(q, endpt, grant);
+            break;
+        case HQIOCXCH:
+            kind = HQ_STAT_XCH;
+            ret = do_xch(q, endpt, grant);
+            break;
+        case HQIOCDEL:
+            kind = HQ_STAT_DEL;
+            ret = do_del(q);
+            queue_wakeup(q);
+            break;
+        case HQIOCBATCH:
+            kind = HQ_STAT_BATCH;
+            ret = do_batch(q, endpt, grant);
+            break;
+        case HQIOCRING:
+            kind = HQ_STAT_RING;
+            ret = do_ring(q, endpt, grant, user_endpt);
+            break;
+        case HQIOCKICK:
+            kind = HQ_STAT_RING;
+            ret = do_kick(q);
+            break;
+        case HQIOCSTATS:
+            /* Not counted, so looking does not change what is seen. */
+            return do_stats(q, endpt, grant);
+        case HQIOCFRAMED:
+            return do_framed(q, endpt, grant);
+        case HQIOCLANE:
+            return do_lane(minor, endpt, grant);
+        case HQIOCLANES:
+            return do_lanes(q, endpt, grant);
+        case HQIOCRECV:
+            return do_recv(endpt, grant);
+        case FIONREAD:
+            return do_nread(q, c, endpt, grant);
+        default:
+            return ENOTTY;
+    }
+
+    stats_done(q, kind, start);
+    hq_commit();
+    return ret;
+}
+
+static int hq_cancel(devminor_t minor, endpoint_t endpt, cdev_id_t id) {
+    struct hq_cursor *c;
+    struct hq_queue *q = hq_lookup(minor, &c);
+    struct hq_waiters *w;
+    struct hq_request **rp, *r;
+
+    if (q == NULL) return EDONTREPLY;
+
+    w = c != NULL ? &c->wait : &q->wait;
+    for (rp = &w->readers; (r = *rp) != NULL; rp = &r->next) {
+        if (r->endpt == endpt && r->id == id) {
+            if ((*rp = r->next) == NULL) w->readers_tail = rp;
+            free(r);
+            return EINTR; /* reply to the interrupted read */
+        }
+    }
+
+    for (rp = &q->writers; (r = *rp) != NULL; rp = &r->next) {
+        if (r->endpt == endpt && r->id == id) {
+            if ((*rp = r->next) == NULL) q->writers_tail = rp;
+            free(r);
+
+            /* The writers behind it may fit now. */
+            queue_wakeup(q);
+            hq_commit();
+            return EINTR;
+        }
+    }
+
+    /* The request has already been completed. */
+    return EDONTREPLY;
+}
+
+static int hq_select(devminor_t minor, unsigned int ops, endpoint_t endpt) {
+    struct hq_cursor *c;
+    struct hq_queue *q = hq_lookup(minor, &c);
+    struct hq_waiters *w;
+    unsigned int want_ops, ready_ops = 0;
+    int lane = 0;
+
+    if (q == NULL) return ENXIO;
+    lane_file_get(minor, &lane);
+
+    queue_sync(q);
+
+    want_ops = ops & (CDEV_OP_RD | CDEV_OP_WR | CDEV_OP_ERR);
+
+    /* Reads block on an empty queue, writes on a full one. */
+    if ((want_ops & CDEV_OP_RD) && queue_avail(q, c) > 0) {
+        ready_ops |= CDEV_OP_RD;
+    }
+    if ((want_ops & CDEV_OP_WR) && queue_writable(q, lane)) {
+        ready_ops |= CDEV_OP_WR;
+    }
+
+    /* Remember the caller if it wants to hear about the rest later. A file
+     * of a queue with lanes is answered under its own minor. */
+    want_ops &= ~ready_ops;
+    if ((ops & CDEV_NOTIFY) && want_ops) {
+        if (c != NULL) {
+            w = &c->wait;
+        } else if ((w = lane_file_wait(minor)) == NULL) {
+            w = &q->wait;
+        }
+        w->select_ops |= want_ops;
+        w->select_endpt = endpt;
+        if (c != NULL) cursor_wait(c);
+    }
+
+    hq_commit();
+    return ready_ops;
+}
+
+static void hq_alarm(clock_t UNUSED(stamp)) {
+    struct hq_queue *q;
+    clock_t next = 0, ticks;
+    int minor, i;
+
+    /* Storage set aside to shrink may have had its shrink window. The
+     * alarm is set again once, for the queue that is due first. */
+    queue_alarm_fired();
+    for (minor = 0; minor < hq_nr_minors; minor++) {
+        if ((q = hq_queues[minor]) == NULL || q->backend->trim == NULL) {
+            continue;
+        }
+        for (i = 0; i < q->nr_lanes; i++) {
+            ticks = q->backend->trim(i == 0 ? q : q->lanes[i].store);
+            if (ticks > 0 && (next == 0 || ticks < next)) next = ticks;
+        }
+    }
+    if (next > 0) queue_alarm(next);
+}
+
+static void hq_other(message *m, int UNUSED(ipc_status)) {
+    /* Journal writes complete here. */
+    if (m->m_type == BDEV_REPLY) bdev_reply_asyn(m);
+}
+
+static size_t queue_avail(struct hq_queue *q, struct hq_cursor *c) {
+    if (c == NULL) return queue_length(q) + q->lanes_size;
+
+    return q->base + queue_length(q) - c->pos;
+}
+
+static ssize_t queue_read(struct hq_queue *q, struct hq_cursor *c,
+                          endpoint_t endpt, cp_grant_id_t grant, size_t size) {
+    size_t record = 0;
+    char *p;
+    int lane = 0, ret;
+
+    if (size > queue_avail(q, c)) {
+        size = queue_avail(q, c);
+    }
+
+    /* The lanes other than 0 are plain bytes, with nothing virtual. */
+    if (q->lanes != NULL && (lane = lane_pick(q, &size)) > 0) {
+        if ((ret = queue_copy(q->lanes[lane].store, 0, size, endpt, grant, 0,
+                              TRUE)) != OK) {
+            return ret;
+        }
+        lane_consume(q, lane, size);
+        if ((p = queue_log_lane(q, HQ_J_LDEQ, lane, sizeof(size))) != NULL) {
+            memcpy(p, &size, sizeof(size));
+        }
+        lane_done(q, lane, size);
+        q->stats.bytes_out += size;
+        return size;
+    }
+
+    /* A record is read whole. What does not fit goes with it. */
+    if (q->framed) {
+        record = frame_next(q);
+        size = MIN(size, record);
+    }
+
+    /* Copy the requested part to the caller. */
+    if ((ret = queue_copy_out(q, c != NULL ? c->pos - q->base : 0, size,
+                              endpt, grant)) != OK) {
+        return ret;
+    }
+
+    /* Bytes read through a cursor stay for the other cursors. */
+    if (c != NULL) {
+        cursor_advance(c, size);
+        queue_reclaim(q);
+    } else if (q->framed) {
+        queue_drop(q, record);
+        frame_pop(q);
+    } else {
+        queue_drop(q, size);
+    }
+    lane_done(q, 0, size);
+    q->stats.bytes_out += size;
+
+    /* Return the number of bytes read. */
+    return size;
+}
+
+static int queue_copy_out(struct hq_queue *q, size_t off, size_t size,
+                          endpoint_t endpt, cp_grant_id_t grant) {
+    size_t virt = 0, stored;
+    int ret;
+
+    /* The virtual bytes come straight from the pattern block. */
+    if (off < q->virt) {
+        virt = MIN(size, q->virt - off);
+        if ((ret = copy_pattern(endpt, grant, virt,
+                                (q->virt_phase + off) % 3)) != OK) {
+            return ret;
+        }
+    }
+    if (size > virt) {
+        stored = off + virt - q->virt;
+        xlat_apply(q, stored + size - virt);
+        return queue_copy(q, stored, size - virt, endpt, grant, virt, TRUE);
+    }
+    return OK;
+}
+
+static void queue_drop(struct hq_queue *q, size_t size) {
+    size_t virt = MIN(size, q->virt);
+
+    queue_log(q, HQ_J_DEQ, &size, sizeof(size));
+
+    q->virt -= virt;
+    q->virt_phase = (q->virt_phase + virt) % 3;
+    if (size > virt) queue_consume(q, size - virt);
+}
+
+static void queue_reclaim(struct hq_queue *q) {
+    size_t size;
+
+    /* Without cursors, everything stays for the next one. */
+    if (q->nr_cursors == 0) return;
+
+    /* Writers waiting for room do not wait for a whole batch. */
+    size = cursor_min(q) - q->base;
+    if (size == 0 || (size < HQ_RECLAIM && size < queue_length(q) &&
+                      q->writers == NULL && !q->throttled)) {
+        return;
+    }
+
+    queue_drop(q, size);
+    q->base += size;
+}
+
+static int request_suspend(struct hq_request ***tail, endpoint_t endpt,
+                           cp_grant_id_t grant, size_t size, int lane,
+                           cdev_id_t id) {
+    struct hq_request *r = malloc(sizeof(*r));
+    if (r == NULL) return ENOMEM;
+
+    r->endpt = endpt;
+    r->grant = grant;
+    r->size = size;
+    r->lane = lane;
+    r->id = id;
+    r->next = NULL;
+    **tail = r;
+    *tail = &r->next;
+
+    return EDONTREPLY;
+}
+
+static void queue_wakeup(struct hq_queue *q) {
+    struct hq_cursor *c, *waiting;
+
+    /* Readers make room for writers, whose data wakes up more readers. */
+    do {
+        queue_throttle(q);
+
+        if (!q->fanout) {
+            waiters_wakeup(q, NULL, &q->wait, q->minor, 0);
+            if (q->lanes != NULL) files_wakeup(q);
+            continue;
+        }
+
+        /* Only cursors with waiters are looked at, not every cursor. */
+        waiting = q->waiting;
+        q->waiting = NULL;
+        while ((c = waiting) != NULL) {
+            waiting = c->next_waiting;
+            c->waiting = FALSE;
+
+            waiters_wakeup(q, c, &c->wait, c->minor, 0);
+            if (c->wait.readers != NULL || c->wait.select_ops != 0) {
+                cursor_wait(c);
+            }
+        }
+    } while (writers_wakeup(q));
+}
+
+static int writers_wakeup(struct hq_queue *q) {
+    struct hq_request **rp, *r;
+    ssize_t ret;
+    int hi = -1, added = FALSE;
+
+    /* The producer ring waits for room like the writers do. It is not held
+     * back by the journal: the producer sees its records go at once. */
+    if (queue_drain(q) > 0) added = TRUE;
+
+    /* A write that stays blocks those behind it to the same or a lower
+     * lane, the highest lane blocked so far being hi. */
+    for (rp = &q->writers; (r = *rp) != NULL;) {
+        if (r->lane <= hi || !write_fits(q, r->size)) {
+            hi = MAX(hi, r->lane);
+            rp = &r->next;
+            continue;
+        }
+        if ((*rp = r->next) == NULL) q->writers_tail = rp;
+
+        ret = queue_write(q, r->lane, r->endpt, r->grant, r->size);
+        if ((ret = journal_wait(r->endpt, r->id, ret)) != EDONTREPLY) {
+            chardriver_reply_task(r->endpt, r->id, ret);
+        }
+        free(r);
+        added = TRUE;
+    }
+
+    return added;
+}
+
+static void waiters_wakeup(struct hq_queue *q, struct hq_cursor *c,
+                           struct hq_waiters *w, devminor_t minor, int lane) {
+    struct hq_request *r;
+    unsigned int ops;
+
+    while (queue_avail(q, c) > 0 && (r = w->readers) != NULL) {
+        if ((w->readers = r->next) == NULL) w->readers_tail = &w->readers;
+
+        chardriver_reply_task(r->endpt, r->id,
+                              queue_read(q, c, r->endpt, r->grant, r->size));
+        free(r);
+    }
+
+    ops = 0;
+    if (queue_avail(q, c) > 0) ops |= CDEV_OP_RD;
+    if (queue_writable(q, lane)) ops |= CDEV_OP_WR;
+    if ((ops &= w->select_ops) != 0) {
+        chardriver_reply_select(w->select_endpt, minor, ops);
+        w->select_ops &= ~ops;
+    }
+}
+
+static void files_wakeup(struct hq_queue *q) {
+    struct hq_waiters *w;
+    devminor_t minor;
+    int lane;
+
+    for (minor = HQ_FILE_MINOR; minor < HQ_FILE_MINOR + HQ_MAX_FILES;
+         minor++) {
+        if (lane_file_get(minor, &lane) != q) continue;
+
+        w = lane_file_wait(minor);
+        if (w->select_ops != 0) waiters_wakeup(q, NULL, w, minor, lane);
+    }
+}
+
+static void cursor_wait(struct hq_cursor *c) {
+    if (c->waiting) return;
+
+    c->waiting = TRUE;
+    c->next_waiting = c->q->waiting;
+    c->q->waiting = c;
+}
+
+static void queue_sync(struct hq_queue *q) {
+    if (queue_drain(q) > 0) queue_wakeup(q);
+}
+
+static size_t queue_drain(struct hq_queue *q) {
+    size_t added = shm_drain(q);
+
+    /* The producer writes to lane 0, like the operations. */
+    if (added > 0) {
+        queue_log_tail(q, added);
+        q->stats.bytes_in += added;
+        lane_wrote(q, 0, added);
+    }
+    return added;
+}
+
+static struct hq_queue *queue_alloc(devminor_t minor) {
+    struct hq_queue *q = malloc(sizeof(*q));
+    if (q == NULL) return NULL;
+
+    queue_init(q, minor);
+    xlat_init(q);
+    shm_init(q);
+    frame_init(q);
+    memset(&q->stats, 0, sizeof(q->stats));
+
+    q->virt = 0;
+    q->virt_phase = 0;
+    q->backend = hq_backend;
+    q->size = 0;
+    if (q->backend->init(q) != OK) {
+        free(q);
+        return NULL;
+    }
+    if (lane_init(q, hq_lanes, hq_fair) != OK) {
+        q->backend->cleanup(q);
+        free(q);
+        return NULL;
+    }
+    return q;
+}
+
+static struct hq_queue *queue_create(devminor_t minor) {
+    struct hq_queue *q = queue_alloc(minor);
+    if (q == NULL) return NULL;
+
+    q->virt = DEVICE_SIZE;
+    lane_reset(q);
+    if (hq_framed && frame_set(q, TRUE) != OK) {
+        queue_destroy(q);
+        return NULL;
+    }
+    return q;
+}
+
+static size_t queue_length(struct hq_queue *q) { return q->virt + q->size; }
+
+static int queue_materialize(struct hq_queue *q) {
+    struct hq_queue tmp;
+    struct hq_pos pos;
+    char *p;
+    size_t len;
+    int i, ret;
+
+    if (q->virt == 0) return OK;
+
+    if (q->size == 0) {
+        if ((ret = queue_extend(q, q->virt)) != OK) return ret;
+        fill_pattern(q, 0, q->virt, q->virt_phase);
+        q->virt = 0;
+        return OK;
+    }
+
+    /* Storage only grows at the end, so the pattern and the stored bytes
+     * are put together in new storage, which then replaces the old one. */
+    tmp.backend = q->backend;
+    tmp.size = 0;
+    tmp.stats = q->stats;
+    xlat_init(&tmp);
+    if ((ret = tmp.backend->init(&tmp)) != OK) return ret;
+    if ((ret = queue_extend(&tmp, q->virt + q->size)) != OK) {
+        tmp.backend->cleanup(&tmp);
+        return ret;
+    }
+
+    fill_pattern(&tmp, 0, q->virt, q->virt_phase);
+    for (queue_pos(&pos, 0); pos.off < q->size; pos.off += len) {
+        len = queue_segment(q, &pos, q->size - pos.off, &p);
+        queue_put(&tmp, q->virt + pos.off, p, len);
+    }
+
+    q->backend->cleanup(q);
+    q->u = tmp.u;
+    q->size = tmp.size;
+    q->stats = tmp.stats;
+    stats_move(q, q->size - q->virt);
+    for (i = 0; i < q->nr_xlat; i++) {
+        q->xlat[i].start += q->virt;
+    }
+    q->virt = 0;
+    return OK;
+}
+
+static void queue_init(struct hq_queue *q, devminor_t minor) {
+    q->minor = minor;
+    waiters_init(&q->wait);
+
+    q->writers = NULL;
+    q->writers_tail = &q->writers;
+    q->throttled = FALSE;
+
+    q->fanout = hq_fanout;
+    q->base = 0;
+    q->heap = NULL;
+    q->nr_cursors = 0;
+    q->waiting = NULL;
+}
+
+static void waiters_init(struct hq_waiters *w) {
+    w->readers = NULL;
+    w->readers_tail = &w->readers;
+    w->select_endpt = NONE;
+    w->select_ops = 0;
+}
+
+static void queue_destroy(struct hq_queue *q) {
+    struct hq_request *r;
+
+    while ((r = q->wait.readers) != NULL) {
+        q->wait.readers = r->next;
+        free(r);
+    }
+    while ((r = q->writers) != NULL) {
+        q->writers = r->next;
+        free(r);
+    }
+    while (q->nr_cursors > 0) cursor_close(q->heap[0]);
+    shm_detach(q);
+    frame_cleanup(q);
+    lane_cleanup(q);
+    q->backend->cleanup(q);
+    free(q);
+}
 
-static int hq_ioctl(devminor_t minor, unsigned long request, endpoint_t endpt,
-                    cp_grant_id_t grant, int flags, endpoint_t user_endpt,
-                    cdev_id_t id);
+static void queue_log(struct hq_queue *q, int type, const void *data,
+                      size_t len) {
+    char *p = journal_add(type, q->minor, len);
 
-// Fills buffer with repeating "xyz" string.
-static void fill_buffer();
+    if (p != NULL && len > 0) memcpy(p, data, len);
+}
 
-// Remove size bytes from the front of the buffer.
-static void buffer_down(u64_t size);
+static void queue_log_tail(struct hq_queue *q, size_t size) {
+    char *p = journal_add(HQ_J_ENQ, q->minor, size);
 
-// Make space for size bytes in the buffer.
-static int buffer_up(u64_t size);
+    if (p != NULL) queue_get(q, q->size - size, p, size);
+}
 
-static int do_res();
+static char *queue_log_lane(struct hq_queue *q, int type, int lane,
+                            size_t len) {
+    char *p = journal_add(type, q->minor, 1 + len);
 
-static int do_set(endpoint_t endpt, cp_grant_id_t gid);
+    if (p == NULL) return NULL;
 
-static int do_xch(endpoint_t endpt, cp_grant_id_t gid);
+    p[0] = lane;
+    return p + 1;
+}
 
-static int do_del();
+static void queue_snapshot(struct hq_queue *q) {
+    struct hq_jsnap snap;
+    struct hq_queue *s;
+    char *p;
+    int i;
 
-/* SEF functions and variables. */
-static void sef_local_startup(void);
-static int sef_cb_init(int type, sef_init_info_t *info);
-static int sef_cb_lu_state_save(int);
-static int lu_state_restore(void);
+    xlat_apply(q, q->size);
+    if ((p = journal_add(HQ_J_SNAP, q->minor, sizeof(snap) + q->size)) ==
+        NULL) {
+        return;
+    }
 
-/* Entry points to the hello driver. */
-static struct chardriver hello_tab = {
-    .cdr_open = hq_open,
-    .cdr_close = hq_close,
-    .cdr_read = hq_read,
-    .cdr_write = hq_write,
-    .cdr_ioctl = hq_ioctl,
-};
+    snap.virt = q->virt;
+    snap.virt_phase = q->virt_phase;
+    memcpy(p, &snap, sizeof(snap));
+    queue_get(q, 0, p + sizeof(snap), q->size);
+
+    /* The snapshot leaves the other lanes empty; they follow it. */
+    for (i = 1; i < q->nr_lanes; i++) {
+        s = q->lanes[i].store;
+        if (s->size > 0 &&
+            (p = queue_log_lane(q, HQ_J_LANE, i, s->size)) != NULL) {
+            queue_get(s, 0, p, s->size);
+        }
+    }
+}
 
-// Query buffer.
-char *hq_buffer;
+static void hq_snapshot(void) {
+    int minor;
 
-size_t hq_capacity;
-size_t hq_size;
-size_t hq_head;
+    journal_switch();
+    for (minor = 0; minor < hq_nr_minors; minor++) {
+        if (hq_queues[minor] != NULL) queue_snapshot(hq_queues[minor]);
+    }
 
-static int hq_open(devminor_t UNUSED(minor), int UNUSED(access),
-                   endpoint_t UNUSED(user_endpt)) {
-    return OK;
+    /* The caps keep the snapshots to a fraction of a half, but the queues
+     * of the old instance may have been larger. */
+    if (journal_full()) {
+        printf("hello_queue: queues too large for the journal, "
+               "journaling off\n");
+        journal_stop();
+    }
 }
 
-static int hq_close(devminor_t UNUSED(minor)) { return OK; }
+static void hq_commit(void) {
+    /* A half that has filled up is left for the other one. */
+    if (journal_full()) hq_snapshot();
 
-static ssize_t hq_read(devminor_t UNUSED(minor), u64_t UNUSED(position),
-                       endpoint_t endpt, cp_grant_id_t grant, size_t size,
-                       int UNUSED(flags), cdev_id_t UNUSED(id)) {
-    char *ptr = hq_buffer + hq_head;
+    journal_flush();
+}
+
+static int do_res(struct hq_queue *q) {
+    op_res(q);
+
+    queue_wakeup(q);
+    return OK;
+}
+
+static int do_set(struct hq_queue *q, endpoint_t endpt, cp_grant_id_t gid) {
+    char msg[MSG_SIZE];
     int ret;
 
-    if (size == 0) return 0;
+    if ((ret = sys_safecopyfrom(endpt, gid, 0, (vir_bytes)msg, MSG_SIZE)) !=
+        OK) {
+        return ret;
+    }
+
+    if ((ret = op_set(q, msg)) != OK) return ret;
 
-    if (hq_size == 0) return 0; /* EOF */
+    queue_wakeup(q);
+    return OK;
+}
+
+static int do_xch(struct hq_queue *q, endpoint_t endpt, cp_grant_id_t gid) {
+    char msg[2];
+    int ret;
 
-    if (size > hq_size) {
-        size = hq_size;
+    if ((ret = sys_safecopyfrom(endpt, gid, 0, (vir_bytes)msg, 2)) != OK) {
+        return ret;
     }
 
-    /* Copy the requested part to the caller. */
-    if ((ret = sys_safecopyto(endpt, grant, 0, (vir_bytes)ptr, size)) != OK)
+    return op_xch(q, msg);
+}
+
+static int do_batch(struct hq_queue *q, endpoint_t endpt, cp_grant_id_t gid) {
+    struct hq_batch batch;
+    struct hq_op *op;
+    int i, ret = OK, status = OK;
+
+    /* One copy in and one copy out for the whole batch. */
+    if ((ret = sys_safecopyfrom(endpt, gid, 0, (vir_bytes)&batch,
+                                sizeof(batch))) != OK) {
         return ret;
+    }
+    if (batch.nr_ops < 0 || batch.nr_ops > HQ_BATCH_MAX) return EINVAL;
+
+    for (i = 0; i < batch.nr_ops; i++) {
+        op = &batch.ops[i];
+
+        if (status != OK) {
+            ret = ECANCELED;
+        } else {
+            switch (op->op) {
+                case HQ_OP_RES:
+                    op_res(q);
+                    ret = OK;
+                    break;
+                case HQ_OP_SET:
+                    ret = op_set(q, op->arg);
+                    break;
+                case HQ_OP_XCH:
+                    ret = op_xch(q, op->arg);
+                    break;
+                case HQ_OP_DEL:
+                    ret = do_del(q);
+                    break;
+                default:
+                    ret = EINVAL;
+            }
+            status = ret;
+        }
 
-    buffer_down(size);
+        /* Error codes are negative in here; users expect errno values. */
+        op->status = ret < 0 ? -ret : ret;
+    }
 
-    /* Return the number of bytes read. */
-    return size;
+    /* Readers see the queue only after the whole batch. */
+    queue_wakeup(q);
+
+    if ((ret = sys_safecopyto(endpt, gid, 0, (vir_bytes)&batch,
+                              sizeof(batch))) != OK) {
+        return ret;
+    }
+    return status;
 }
 
-static ssize_t hq_write(devminor_t UNUSED(minor), u64_t position,
-                        endpoint_t endpt, cp_grant_id_t grant, size_t size,
-                        int UNUSED(flags), cdev_id_t UNUSED(id)) {
-    char *ptr;
+static int do_ring(struct hq_queue *q, endpoint_t endpt, cp_grant_id_t gid,
+                   endpoint_t user_endpt) {
+    struct hq_ring_setup setup;
+    vir_bytes addr;
     int ret;
 
-    if (size == 0) return 0;
+    if ((ret = sys_safecopyfrom(endpt, gid, 0, (vir_bytes)&setup,
+                                sizeof(setup))) != OK) {
+        return ret;
+    }
+
+    /* The ring has just been drained, so nothing is lost by detaching. */
+    if (setup.size == 0) {
+        if (q->shm != NULL && q->shm_endpt != user_endpt) return EBUSY;
+        shm_detach(q);
+        return OK;
+    }
 
-    if ((ret = buffer_up(size)) != OK) {
+    if ((ret = shm_attach(q, user_endpt, setup.size, &addr)) != OK) {
         return ret;
     }
-    ptr = hq_buffer + hq_head + hq_size;
 
-    if ((ret = sys_safecopyfrom(endpt, grant, 0, (vir_bytes)ptr, size)) != OK) {
+    setup.addr = (void *)addr;
+    if ((ret = sys_safecopyto(endpt, gid, 0, (vir_bytes)&setup,
+                              sizeof(setup))) != OK) {
+        shm_detach(q);
         return ret;
     }
+    return OK;
+}
 
-    hq_size += size;
-    return size;
+static int do_kick(struct hq_queue *q) {
+    /* hq_ioctl() has drained the ring already. */
+    return q->shm != NULL ? OK : ENXIO;
 }
 
-static int hq_ioctl(devminor_t minor, unsigned long request, endpoint_t endpt,
-                    cp_grant_id_t grant, int flags, endpoint_t user_endpt,
-                    cdev_id_t id) {
-    switch (request) {
-        case HQIOCRES:
-            return do_res();
-        case HQIOCSET:
-            return do_set(endpt, grant);
-        case HQIOCXCH:
-            return do_xch(endpt, grant);
-        case HQIOCDEL:
-            return do_del();
+static int do_stats(struct hq_queue *q, endpoint_t endpt, cp_grant_id_t gid) {
+    return sys_safecopyto(endpt, gid, 0, (vir_bytes)&q->stats,
+                          sizeof(q->stats));
+}
+
+static int do_framed(struct hq_queue *q, endpoint_t endpt, cp_grant_id_t gid) {
+    int framed, ret;
+
+    if ((ret = sys_safecopyfrom(endpt, gid, 0, (vir_bytes)&framed,
+                                sizeof(framed))) != OK) {
+        return ret;
+    }
+
+    /* A cursor may stop in the middle of a record, and so may a read from
+     * another lane. */
+    if (q->fanout || q->lanes != NULL) return EINVAL;
+
+    return frame_set(q, framed != 0);
+}
+
+static int do_lane(devminor_t minor, endpoint_t endpt, cp_grant_id_t gid) {
+    int lane, ret;
+
+    if ((ret = sys_safecopyfrom(endpt, gid, 0, (vir_bytes)&lane,
+                                sizeof(lane))) != OK) {
+        return ret;
     }
 
-    return ENOTTY;
+    return lane_file_set(minor, lane);
 }
 
-static int do_res() {
-    char *ptr = realloc(hq_buffer, DEVICE_SIZE);
-    if (ptr == NULL) return ENOMEM;
+static int do_lanes(struct hq_queue *q, endpoint_t endpt, cp_grant_id_t gid) {
+    struct hq_lanes stats;
 
-    hq_buffer = ptr;
-    hq_capacity = DEVICE_SIZE;
-    hq_size = DEVICE_SIZE;
-    hq_head = 0;
-    fill_buffer();
+    lane_stats(q, &stats);
+    return sys_safecopyto(endpt, gid, 0, (vir_bytes)&stats, sizeof(stats));
+}
 
-    return OK;
+static int do_recv(endpoint_t endpt, cp_grant_id_t gid) {
+    struct chardriver_batch_stats cbs;
+    struct hq_recv recv;
+    int i;
+
+    chardriver_get_batch_stats(&cbs);
+    memset(&recv, 0, sizeof(recv));
+    recv.batches = cbs.cbs_batches;
+    recv.requests = cbs.cbs_messages;
+    for (i = 0; i < HQ_RECV_MAX && i < CHARDRIVER_BATCH_MAX; i++) {
+        recv.sizes[i] = cbs.cbs_sizes[i];
+    }
+    return sys_safecopyto(endpt, gid, 0, (vir_bytes)&recv, sizeof(recv));
 }
 
-static int do_set(endpoint_t endpt, cp_grant_id_t gid) {
-    char msg[MSG_SIZE];
+static int do_nread(struct hq_queue *q, struct hq_cursor *c, endpoint_t endpt,
+                    cp_grant_id_t gid) {
+    size_t avail = queue_avail(q, c);
+    int size;
+
+    /* A read from the queue takes what one lane gives. */
+    if (c == NULL && q->lanes != NULL && avail > 0) lane_pick(q, &avail);
+
+    size = q->framed ? frame_next(q) : avail;
+    return sys_safecopyto(endpt, gid, 0, (vir_bytes)&size, sizeof(size));
+}
+
+static void op_res(struct hq_queue *q) {
+    int i;
+
+    /* Every cursor starts over at the new contents. */
+    q->base += queue_length(q);
+    for (i = 0; i < q->nr_cursors; i++) {
+        q->heap[i]->pos = q->base;
+    }
+
+    /* The pattern costs nothing until it is read or changed. */
+    queue_truncate(q, 0);
+    q->virt = DEVICE_SIZE;
+    q->virt_phase = 0;
+    frame_reset(q, DEVICE_SIZE);
+    lane_reset(q);
+    queue_log(q, HQ_J_RES, NULL, 0);
+}
+
+static int op_set(struct hq_queue *q, const char *msg) {
+    size_t added;
     int ret;
 
-    if ((ret = sys_safecopyfrom(endpt, gid, 0, (vir_bytes)msg, MSG_SIZE)) !=
-        OK) {
+    /* The message may land on virtual bytes. */
+    if (q->size < MSG_SIZE && (ret = queue_materialize(q)) != OK) {
         return ret;
     }
 
-    if (hq_size < MSG_SIZE) {
-        if ((ret = buffer_up(MSG_SIZE - hq_size)) != OK) {
+    if (q->size < MSG_SIZE) {
+        added = MSG_SIZE - q->size;
+        if ((ret = queue_extend(q, added)) != OK) {
             return ret;
         }
-        hq_size = MSG_SIZE;
+        frame_grow(q, added);
     }
-    memcpy(hq_buffer + hq_head + hq_size - MSG_SIZE, msg, MSG_SIZE);
 
+    queue_put(q, q->size - MSG_SIZE, msg, MSG_SIZE);
+    xlat_raw_tail(q, q->size - MSG_SIZE);
+    lane_reset(q);
+    queue_log(q, HQ_J_SET, msg, MSG_SIZE);
     return OK;
 }
 
-static int do_xch(endpoint_t endpt, cp_grant_id_t gid) {
-    char msg[2];
+static int op_xch(struct hq_queue *q, const char *msg) {
     int ret;
 
-    if ((ret = sys_safecopyfrom(endpt, gid, 0, (vir_bytes)msg, 2)) != OK) {
-        return ret;
-    }
+    if ((ret = queue_materialize(q)) != OK) return ret;
 
-    size_t i = hq_head, end = hq_head + hq_size;
-    for (; i < end; i++) {
-        if (hq_buffer[i] == msg[0]) {
-            hq_buffer[i] = msg[1];
-        }
-    }
+    /* Applied when the bytes are read, deleted or saved. */
+    xlat_exchange(q, msg[0], msg[1]);
+    queue_log(q, HQ_J_XCH, msg, 2);
 
     return OK;
 }
 
-static int do_del() {
-    int shift = 0;
-    size_t i = hq_head, j = 1, end = hq_head + hq_size;
+static int do_del(struct hq_queue *q) {
+    struct hq_cursor *c;
+    struct hq_pos src, dst;
+    char *sp = NULL, *dp = NULL;
+    size_t slen = 0, dlen = 0, kept = 0, n;
+    size_t i = 0, j = 0;
+    int k, ret;
+
+    if ((ret = queue_materialize(q)) != OK) return ret;
+    xlat_apply(q, q->size);
+
+    /* Walk the queue with a read and a write position, one segment at a
+     * time, so no byte is ever looked up from the start of the queue. */
+    queue_pos(&src, 0);
+    queue_pos(&dst, 0);
+    while (i < q->size) {
+        if (slen == 0) {
+            slen = queue_segment(q, &src, q->size - i, &sp);
+            src.off += slen;
+        }
+        if (dlen == 0) {
+            dlen = queue_segment(q, &dst, q->size - kept, &dp);
+            dst.off += dlen;
+        }
 
-    for (; i < end; i++) {
-        if (j == 3) {
-            j = 1;
-            shift++;
+        /* Whole groups of three that fit both segments go to the kernel. */
+        n = MIN(slen / 3, dlen / 2);
+        if (j == 0 && n > 0) {
+            hq_del(dp, sp, 3 * n);
+            sp += 3 * n;
+            slen -= 3 * n;
+            dp += 2 * n;
+            dlen -= 2 * n;
+            i += 3 * n;
+            kept += 2 * n;
             continue;
         }
-        hq_buffer[i - shift] = hq_buffer[i];
-        j++;
+
+        /* Single bytes around segment boundaries. */
+        if (j != 2) {
+            *dp++ = *sp;
+            dlen--;
+            kept++;
+        }
+        sp++;
+        slen--;
+        i++;
+        j = (j == 2) ? 0 : j + 1;
+    }
+
+    queue_truncate(q, kept);
+    stats_move(q, kept);
+    frame_del(q);
+
+    /* Cursors stay on the same bytes, or on the next kept one. The order of
+     * the cursors does not change, so neither does the heap. */
+    for (k = 0; k < q->nr_cursors; k++) {
+        c = q->heap[k];
+        c->pos -= (c->pos - q->base) / 3;
     }
-    hq_size -= shift;
+    lane_reset(q);
+    queue_log(q, HQ_J_DEL, NULL, 0);
     return OK;
 }
 
 static int sef_cb_lu_state_save(int UNUSED(state)) {
-    /* Save the state. */
-    u32_t size = hq_size;
-    ds_publish_u32("hq_size", size, DSF_OVERWRITE);
-    ds_publish_mem("hq_mem", hq_buffer + hq_head, hq_size, DSF_OVERWRITE);
+    /* Save the state. Any error aborts the update, so that the requests
+     * and contents stay with this instance instead of getting lost. */
+    char key[DS_MAX_KEYLEN];
+    struct hq_queue *q;
+    int minor, r;
+
+    r = ds_publish_u32("hq_minors", hq_nr_minors, DSF_OVERWRITE);
+    if (r != OK) return r;
+
+    for (minor = 0; minor < hq_nr_minors; minor++) {
+        if ((q = hq_queues[minor]) == NULL) continue;
+
+        /* Whatever the producer ring holds goes with the contents. */
+        queue_sync(q);
+        if ((r = shm_lu_save(q)) != OK) return r;
+
+        snprintf(key, sizeof(key), "hq_size.%d", minor);
+        if ((r = ds_publish_u32(key, q->size, DSF_OVERWRITE)) != OK) return r;
+        xlat_apply(q, q->size);
+
+        /* A large ring buffer is handed over as it is, page by page. */
+        if (ring_lu_save(q) != OK && (r = lu_save_contents(q)) != OK)
+            return r;
+
+        snprintf(key, sizeof(key), "hq_stats.%d", minor);
+        r = ds_publish_mem(key, &q->stats, sizeof(q->stats), DSF_OVERWRITE);
+        if (r != OK) return r;
+
+        /* Virtual bytes are saved as their number alone. */
+        if (q->virt > 0) {
+            snprintf(key, sizeof(key), "hq_virt.%d", minor);
+            if ((r = ds_publish_u32(key, q->virt, DSF_OVERWRITE)) != OK)
+                return r;
+            snprintf(key, sizeof(key), "hq_virt_phase.%d", minor);
+            if ((r = ds_publish_u32(key, q->virt_phase, DSF_OVERWRITE)) != OK)
+                return r;
+        }
+
+        if ((r = frame_lu_save(q)) != OK ||
+            (r = lu_save_waiters(minor, &q->wait)) != OK ||
+            (r = lu_save_requests("writers", minor, q->writers)) != OK ||
+            (q->fanout && (r = lu_save_cursors(q)) != OK) ||
+            (q->lanes != NULL && (r = lu_save_lanes(q)) != OK)) {
+            return r;
+        }
+    }
+
+    /* Writes held back for the journal are answered by this instance. */
+    if (journal_full()) hq_snapshot();
+    journal_sync();
+    return OK;
+}
+
+static int lu_save_requests(const char *name, devminor_t minor,
+                            struct hq_request *list) {
+    char key[DS_MAX_KEYLEN];
+    struct hq_request *r, *saved;
+    u32_t nr = 0;
+    int ret;
+
+    /* Suspended requests are replied to by the new instance. */
+    for (r = list; r != NULL; r = r->next) nr++;
+    if (nr == 0) return OK;
+    if ((saved = malloc(nr * sizeof(*r))) == NULL) return ENOMEM;
+
+    for (r = list, nr = 0; r != NULL; r = r->next) {
+        saved[nr++] = *r;
+    }
+    snprintf(key, sizeof(key), "hq_nr_%s.%d", name, minor);
+    if ((ret = ds_publish_u32(key, nr, DSF_OVERWRITE)) == OK) {
+        snprintf(key, sizeof(key), "hq_%s.%d", name, minor);
+        ret = ds_publish_mem(key, saved, nr * sizeof(*r), DSF_OVERWRITE);
+    }
+    free(saved);
+    return ret;
+}
+
+static void lu_restore_requests(const char *name, devminor_t minor,
+                                struct hq_request ***tail) {
+    char key[DS_MAX_KEYLEN];
+    struct hq_request *saved;
+    size_t length;
+    u32_t nr, i;
+
+    snprintf(key, sizeof(key), "hq_nr_%s.%d", name, minor);
+    if (ds_retrieve_u32(key, &nr) != OK) return;
+    ds_delete_u32(key);
+
+    length = nr * sizeof(*saved);
+    snprintf(key, sizeof(key), "hq_%s.%d", name, minor);
+    if ((saved = malloc(length)) != NULL &&
+        ds_retrieve_mem(key, (char *)saved, &length) == OK) {
+        for (i = 0; i < length / sizeof(*saved); i++) {
+            request_suspend(tail, saved[i].endpt, saved[i].grant,
+                            saved[i].size, saved[i].lane, saved[i].id);
+        }
+    }
+    free(saved);
+    ds_delete_mem(key);
+}
+
+static int lu_save_waiters(devminor_t minor, struct hq_waiters *w) {
+    char key[DS_MAX_KEYLEN];
+    int r;
+
+    if ((r = lu_save_requests("readers", minor, w->readers)) != OK) return r;
+    if (w->select_ops != 0) {
+        snprintf(key, sizeof(key), "hq_select.%d", minor);
+        if ((r = ds_publish_u32(key, w->select_ops, DSF_OVERWRITE)) != OK)
+            return r;
+        snprintf(key, sizeof(key), "hq_select_endpt.%d", minor);
+        r = ds_publish_u32(key, w->select_endpt, DSF_OVERWRITE);
+    }
+    return r;
+}
+
+static int lu_save_cursors(struct hq_queue *q) {
+    char key[DS_MAX_KEYLEN];
+    struct hq_lu_cursor saved[HQ_MAX_CURSORS];
+    int i, r;
+
+    /* VFS knows the cursors by their minor numbers, which must stay. */
+    for (i = 0; i < q->nr_cursors; i++) {
+        saved[i].minor = q->heap[i]->minor;
+        saved[i].pos = q->heap[i]->pos;
+        if ((r = lu_save_waiters(saved[i].minor, &q->heap[i]->wait)) != OK)
+            return r;
+    }
+
+    snprintf(key, sizeof(key), "hq_fanout.%d", q->minor);
+    if ((r = ds_publish_u32(key, q->nr_cursors, DSF_OVERWRITE)) != OK)
+        return r;
+    snprintf(key, sizeof(key), "hq_base.%d", q->minor);
+    r = ds_publish_mem(key, &q->base, sizeof(q->base), DSF_OVERWRITE);
+    if (r == OK && q->nr_cursors > 0) {
+        snprintf(key, sizeof(key), "hq_cursors.%d", q->minor);
+        r = ds_publish_mem(key, saved, q->nr_cursors * sizeof(saved[0]),
+                           DSF_OVERWRITE);
+    }
+    return r;
+}
+
+static int lu_save_lanes(struct hq_queue *q) {
+    char key[DS_MAX_KEYLEN];
+    struct hq_queue *s;
+    devminor_t minor;
+    int i, r;
+
+    snprintf(key, sizeof(key), "hq_lanes.%d", q->minor);
+    if ((r = ds_publish_u32(key, q->nr_lanes, DSF_OVERWRITE)) != OK) return r;
+    snprintf(key, sizeof(key), "hq_fair.%d", q->minor);
+    if ((r = ds_publish_u32(key, q->fair, DSF_OVERWRITE)) != OK) return r;
+
+    /* Every lane is saved like a queue, under a number of its own. */
+    for (i = 1; i < q->nr_lanes; i++) {
+        s = q->lanes[i].store;
+        snprintf(key, sizeof(key), "hq_size.%d", s->minor);
+        if ((r = ds_publish_u32(key, s->size, DSF_OVERWRITE)) != OK)
+            return r;
+        if (ring_lu_save(s) != OK && (r = lu_save_contents(s)) != OK)
+            return r;
+    }
+
+    if ((r = lane_lu_save(q)) != OK) return r;
+
+    /* The select()s of the files are saved under their minors. */
+    for (minor = HQ_FILE_MINOR; minor < HQ_FILE_MINOR + HQ_MAX_FILES;
+         minor++) {
+        if (lane_file_get(minor, NULL) == q &&
+            (r = lu_save_waiters(minor, lane_file_wait(minor))) != OK) {
+            return r;
+        }
+    }
     return OK;
 }
 
-static int lu_state_restore() {
+static int lu_save_contents(struct hq_queue *q) {
+    char key[DS_MAX_KEYLEN];
+    struct hq_pos pos;
+    char *ptr, *stage = NULL;
+    size_t piece, len;
+    u32_t i;
+    int r;
+
+    /* The contents are saved in at most HQ_LU_MAX_PIECES pieces, walking
+     * the storage segment by segment. A piece lying in one segment is
+     * published straight from the queue, others are staged first. */
+    piece = (q->size + HQ_LU_MAX_PIECES - 1) / HQ_LU_MAX_PIECES;
+    if (piece < HQ_LU_PIECE) piece = HQ_LU_PIECE;
+
+    snprintf(key, sizeof(key), "hq_piece.%d", q->minor);
+    if ((r = ds_publish_u32(key, piece, DSF_OVERWRITE)) != OK) return r;
+
+    queue_pos(&pos, 0);
+    for (i = 0; pos.off < q->size; i++, pos.off += len) {
+        len = MIN(piece, q->size - pos.off);
+        snprintf(key, sizeof(key), "hq_mem.%d.%u", q->minor, i);
+
+        if (queue_segment(q, &pos, len, &ptr) < len) {
+            if (stage == NULL && (stage = malloc(piece)) == NULL) {
+                r = ENOMEM;
+                break;
+            }
+            queue_get(q, pos.off, stage, len);
+            ptr = stage;
+        }
+        if ((r = ds_publish_mem(key, ptr, len, DSF_OVERWRITE)) != OK) break;
+    }
+
+    free(stage);
+    return r;
+}
+
+static int lu_restore_contents(struct hq_queue *q, u32_t size) {
+    char key[DS_MAX_KEYLEN];
+    struct hq_pos pos;
+    char *ptr, *stage = NULL;
+    size_t len, length;
+    u32_t piece, i;
+    int ret = OK;
+
+    snprintf(key, sizeof(key), "hq_piece.%d", q->minor);
+    if (ds_retrieve_u32(key, &piece) != OK || piece == 0) return EINVAL;
+    ds_delete_u32(key);
+
+    for (i = 0; q->size < size; i++) {
+        len = MIN(piece, size - q->size);
+        snprintf(key, sizeof(key), "hq_mem.%d.%u", q->minor, i);
+
+        if ((ret = queue_extend(q, len)) != OK) break;
+
+        /* Retrieve straight into the queue when the piece fits. */
+        queue_pos(&pos, q->size - len);
+        if (queue_segment(q, &pos, len, &ptr) < len) {
+            if (stage == NULL && (stage = malloc(piece)) == NULL) {
+                ret = ENOMEM;
+                break;
+            }
+            length = len;
+            ret = ds_retrieve_mem(key, stage, &length);
+            if (ret == OK) queue_put(q, pos.off, stage, len);
+        } else {
+            length = len;
+            ret = ds_retrieve_mem(key, ptr, &length);
+        }
+        ds_delete_mem(key);
+        if (ret == OK && length != len) ret = EIO;
+        if (ret != OK) {
+            /* The piece never arrived, so it does not stay. */
+            queue_truncate(q, q->size - len);
+            break;
+        }
+    }
+
+    free(stage);
+    return ret;
+}
+
+static int lu_state_restore(endpoint_t old_endpt) {
     /* Restore the state. */
-    u32_t size;
+    char key[DS_MAX_KEYLEN];
+    struct hq_queue *q;
+    struct hq_stats stats;
+    u32_t size, minors, value;
+    size_t length, capacity;
+    int minor, r;
+
+    /* Keep the queues of the old instance, even if it had more minors. */
+    if (ds_retrieve_u32("hq_minors", &minors) != OK) return OK;
+    ds_delete_u32("hq_minors");
+    if (minors > HQ_MAX_MINORS) minors = HQ_MAX_MINORS;
+
+    if ((int)minors > hq_nr_minors) {
+        struct hq_queue **queues =
+            realloc(hq_queues, minors * sizeof(*hq_queues));
+        if (queues == NULL) return ENOMEM;
+        memset(queues + hq_nr_minors, 0,
+               (minors - hq_nr_minors) * sizeof(*hq_queues));
+        hq_queues = queues;
+        hq_nr_minors = minors;
+    }
+
+    for (minor = 0; minor < (int)minors; minor++) {
+        snprintf(key, sizeof(key), "hq_size.%d", minor);
+        if (ds_retrieve_u32(key, &size) != OK) continue;
+        ds_delete_u32(key);
+
+        if ((q = queue_alloc(minor)) == NULL) return ENOMEM;
+        if (ring_lu_restore(q, old_endpt) != OK &&
+            (r = lu_restore_contents(q, size)) != OK) {
+            printf("hello_queue: contents of minor %d lost\n", minor);
+            queue_destroy(q);
+            return r;
+        }
+
+        /* The capacity is that of the new storage. */
+        snprintf(key, sizeof(key), "hq_stats.%d", minor);
+        length = sizeof(stats);
+        if (ds_retrieve_mem(key, (char *)&stats, &length) == OK &&
+            length == sizeof(stats)) {
+            capacity = q->stats.capacity;
+            q->stats = stats;
+            stats_capacity(q, capacity);
+        }
+        ds_delete_mem(key);
+
+        snprintf(key, sizeof(key), "hq_virt.%d", minor);
+        if (ds_retrieve_u32(key, &value) == OK) {
+            q->virt = value;
+            ds_delete_u32(key);
+            snprintf(key, sizeof(key), "hq_virt_phase.%d", minor);
+            if (ds_retrieve_u32(key, &value) == OK) q->virt_phase = value % 3;
+            ds_delete_u32(key);
+        }
+
+        /* The records cover the virtual bytes too. */
+        frame_lu_restore(q);
+
+        lu_restore_waiters(minor, &q->wait);
+        lu_restore_requests("writers", minor, &q->writers_tail);
+        lu_restore_cursors(q);
+        if ((r = lu_restore_lanes(q, old_endpt)) != OK) {
+            queue_destroy(q);
+            return r;
+        }
+        queue_throttle(q);
+
+        hq_queues[minor] = q;
+    }
+
+    /* Moving a producer ring takes it away from the old instance, so that
+     * comes last, once nothing can make the update roll back. */
+    for (minor = 0; minor < (int)minors; minor++) {
+        if ((q = hq_queues[minor]) != NULL &&
+            shm_lu_restore(q, old_endpt) != OK) {
+            printf("hello_queue: producer ring of minor %d lost\n", minor);
+        }
+    }
+
+    return OK;
+}
+
+static int lu_restore_waiters(devminor_t minor, struct hq_waiters *w) {
+    char key[DS_MAX_KEYLEN];
+    u32_t value;
+
+    lu_restore_requests("readers", minor, &w->readers_tail);
+
+    snprintf(key, sizeof(key), "hq_select.%d", minor);
+    if (ds_retrieve_u32(key, &value) == OK) {
+        w->select_ops = value;
+        ds_delete_u32(key);
+        snprintf(key, sizeof(key), "hq_select_endpt.%d", minor);
+        ds_retrieve_u32(key, &value);
+        w->select_endpt = value;
+        ds_delete_u32(key);
+    }
+
+    return w->readers != NULL || w->select_ops != 0;
+}
+
+static void lu_restore_cursors(struct hq_queue *q) {
+    char key[DS_MAX_KEYLEN];
+    struct hq_lu_cursor saved[HQ_MAX_CURSORS];
+    struct hq_cursor *c;
     size_t length;
+    u32_t nr_cursors, i;
+
+    /* A queue keeps its mode, whatever the new instance was started with:
+     * open files rely on it. */
+    snprintf(key, sizeof(key), "hq_fanout.%d", q->minor);
+    if (ds_retrieve_u32(key, &nr_cursors) != OK) {
+        q->fanout = FALSE;
+        return;
+    }
+    ds_delete_u32(key);
+    q->fanout = TRUE;
+
+    snprintf(key, sizeof(key), "hq_base.%d", q->minor);
+    length = sizeof(q->base);
+    if (ds_retrieve_mem(key, (char *)&q->base, &length) != OK ||
+        length != sizeof(q->base)) {
+        q->base = 0;
+    }
+    ds_delete_mem(key);
+
+    if (nr_cursors == 0) return;
+
+    snprintf(key, sizeof(key), "hq_cursors.%d", q->minor);
+    length = sizeof(saved);
+    if (ds_retrieve_mem(key, (char *)saved, &length) != OK) length = 0;
+    ds_delete_mem(key);
+
+    for (i = 0; i < length / sizeof(saved[0]); i++) {
+        if ((c = cursor_restore(q, saved[i].minor, saved[i].pos)) == NULL) {
+            printf("hello_queue: cannot restore cursor %d\n", saved[i].minor);
+            continue;
+        }
+        if (lu_restore_waiters(c->minor, &c->wait)) cursor_wait(c);
+    }
+}
 
-    ds_retrieve_u32("hq_size", &size);
-    ds_delete_u32("hq_size");
+static int lu_restore_lanes(struct hq_queue *q, endpoint_t old_endpt) {
+    char key[DS_MAX_KEYLEN];
+    struct hq_queue *s;
+    u32_t nr, fair = FALSE, size;
+    devminor_t minor;
+    int i, r;
+
+    /* Like fan-out mode, the lanes are kept whatever the new instance was
+     * started with. The write times of lane 0 are not. */
+    snprintf(key, sizeof(key), "hq_lanes.%d", q->minor);
+    if (ds_retrieve_u32(key, &nr) != OK) {
+        lane_cleanup(q);
+        return OK;
+    }
+    ds_delete_u32(key);
+    snprintf(key, sizeof(key), "hq_fair.%d", q->minor);
+    if (ds_retrieve_u32(key, &fair) == OK) ds_delete_u32(key);
+
+    nr = MIN(nr, HQ_MAX_LANES);
+    if ((int)nr != q->nr_lanes) {
+        lane_cleanup(q);
+        if ((r = lane_init(q, nr, fair)) != OK) {
+            printf("hello_queue: lanes of minor %d lost\n", q->minor);
+            return r;
+        }
+    }
+    q->fair = fair;
+
+    for (i = 1; i < q->nr_lanes; i++) {
+        s = q->lanes[i].store;
+        snprintf(key, sizeof(key), "hq_size.%d", s->minor);
+        if (ds_retrieve_u32(key, &size) != OK) continue;
+        ds_delete_u32(key);
+
+        if (ring_lu_restore(s, old_endpt) != OK &&
+            (r = lu_restore_contents(s, size)) != OK) {
+            printf("hello_queue: lane %d of minor %d lost\n", i, q->minor);
+            return r;
+        }
+        q->lanes_size += s->size;
+    }
+
+    lane_reset(q);
+    lane_lu_restore(q);
+
+    for (minor = HQ_FILE_MINOR; minor < HQ_FILE_MINOR + HQ_MAX_FILES;
+         minor++) {
+        if (lane_file_get(minor, NULL) == q) {
+            lu_restore_waiters(minor, lane_file_wait(minor));
+        }
+    }
+    return OK;
+}
+
+static int journal_apply(int type, devminor_t minor, const char *data,
+                         size_t len) {
+    struct hq_queue *q;
+    struct hq_jsnap snap;
+    size_t size;
+    int lane, ret;
+
+    /* Records that make no sense are skipped. Running out of memory stops
+     * the replay, as the queue would come back without its contents. */
+    if (minor < 0 || minor >= hq_nr_minors) return OK;
+
+    /* A snapshot replaces the queue. Anything else was done to a queue
+     * made by the first open, or by an earlier record. */
+    if (type == HQ_J_SNAP) {
+        if (len < sizeof(snap)) return OK;
+        if (hq_queues[minor] != NULL) queue_destroy(hq_queues[minor]);
+        if ((q = hq_queues[minor] = queue_alloc(minor)) == NULL) {
+            return ENOMEM;
+        }
+
+        memcpy(&snap, data, sizeof(snap));
+        q->virt = snap.virt;
+        q->virt_phase = snap.virt_phase % 3;
+        len -= sizeof(snap);
+        if ((ret = queue_extend(q, len)) != OK) return ret;
+        queue_put(q, 0, data + sizeof(snap), len);
+        return OK;
+    }
+
+    if ((q = hq_queues[minor]) == NULL &&
+        (q = hq_queues[minor] = queue_create(minor)) == NULL) {
+        return ENOMEM;
+    }
 
-    hq_size = size;
-    hq_capacity = 2 * hq_size;
-    hq_head = 0;
-    hq_buffer = malloc(hq_capacity);
+    switch (type) {
+        case HQ_J_ENQ:
+            if ((ret = queue_extend(q, len)) != OK) return ret;
+            queue_put(q, q->size - len, data, len);
+            break;
+        case HQ_J_DEQ:
+            if (len != sizeof(size)) break;
+            memcpy(&size, data, sizeof(size));
+            queue_drop(q, MIN(size, queue_length(q)));
+            break;
+        case HQ_J_RES:
+            op_res(q);
+            break;
+        case HQ_J_SET:
+            if (len == MSG_SIZE) op_set(q, data);
+            break;
+        case HQ_J_XCH:
+            if (len == 2) op_xch(q, data);
+            break;
+        case HQ_J_DEL:
+            do_del(q);
+            break;
+        case HQ_J_LANE:
+        case HQ_J_LDEQ:
+            /* Lanes the driver no longer has fall back to lane 0. */
+            if (len < 1) break;
+            lane = (unsigned char)data[0];
+            if (lane >= q->nr_lanes) lane = 0;
+            data++;
+            len--;
+
+            if (type == HQ_J_LANE) {
+                if (lane > 0) return lane_put(q, lane, data, len);
+                if ((ret = queue_extend(q, len)) != OK) return ret;
+                queue_put(q, q->size - len, data, len);
+                break;
+            }
+            if (len != sizeof(size)) break;
+            memcpy(&size, data, sizeof(size));
+            if (lane > 0) {
+                lane_consume(q, lane, MIN(size, lane_length(q, lane)));
+            } else {
+                queue_drop(q, MIN(size, queue_length(q)));
+            }
+            break;
+    }
+    return OK;
+}
 
-    length = hq_size;
-    ds_retrieve_mem("hq_mem", hq_buffer, &length);
-    ds_delete_mem("hq_mem");
+static int hq_journal_init(int type) {
+    int minor, ret;
+
+    /* Readers and cursors died with the old instance; the records come
+     * back as one. If they do not all make it, the journal is left as it
+     * is for the next try. */
+    if (type == SEF_INIT_RESTART) {
+        if ((ret = journal_replay(journal_apply)) != OK) return ret;
+        for (minor = 0; minor < hq_nr_minors; minor++) {
+            if (hq_queues[minor] == NULL) continue;
+            frame_reset(hq_queues[minor], queue_length(hq_queues[minor]));
+            lane_reset(hq_queues[minor]);
+            queue_throttle(hq_queues[minor]);
+        }
+    }
 
+    /* The journal starts over from the queues as they are, which are on
+     * the device before the first request is served. */
+    hq_snapshot();
+    journal_sync();
     return OK;
 }
 
@@ -253,32 +2055,135 @@ static void sef_local_startup() {
     sef_startup();
 }
 
-static int sef_cb_init(int type, sef_init_info_t *UNUSED(info)) {
+static int sef_cb_init(int type, sef_init_info_t *info) {
     /* Initialize the hello driver. */
     int do_announce_driver = TRUE;
+    long minors = HQ_DEFAULT_MINORS, fanout = 0, framed = 0, lanes = 1;
+    long fair = 0, batch = 1;
+    long cap = 0, hiwat = 0, lowat = -1, shrink = HQ_SHRINK_MS, jdev = 0;
+    char backend[16], label[32];
+    size_t limit;
+    int i, ret;
+
+    /* The number of minor devices is set with "-args minors=N". */
+    (void)env_parse("minors", "d", 0, &minors, 1, HQ_MAX_MINORS);
+    hq_nr_minors = minors;
+
+    /* Every open file reads all data on its own with "-args fanout=1". */
+    (void)env_parse("fanout", "d", 0, &fanout, 0, 1);
+    hq_fanout = fanout;
+
+    /* Every write is one record with "-args framed=1". */
+    (void)env_parse("framed", "d", 0, &framed, 0, 1);
+    if (fanout && framed) {
+        printf("hello_queue: fan-out queues cannot be framed\n");
+        return EINVAL;
+    }
+    hq_framed = framed;
+
+    /* Writes go to one of N priority lanes with "-args lanes=N", the
+     * highest lane being read first, or in turns with "-args fair=1". */
+    (void)env_parse("lanes", "d", 0, &lanes, 1, HQ_MAX_LANES);
+    (void)env_parse("fair", "d", 0, &fair, 0, 1);
+    if (lanes > 1 && (fanout || framed)) {
+        printf("hello_queue: queues with lanes cannot be fan-out or "
+               "framed\n");
+        return EINVAL;
+    }
+    hq_lanes = lanes;
+    hq_fair = fair;
+
+    /* Up to N waiting requests are handled per receive with "-args
+     * batch=N", their replies going out together. */
+    (void)env_parse("batch", "d", 0, &batch, 1, HQ_RECV_MAX);
+    chardriver_set_batch(batch);
+
+    /* Memory limits: "-args cap=N,hiwat=N,lowat=N,shrink=MS". The high
+     * watermark defaults to the cap and the low one to half of it. */
+    (void)env_parse("cap", "d", 0, &cap, 0, LONG_MAX);
+
+    /* Queues survive a crash with "-args 'journal=LABEL journal_dev=DEV'",
+     * DEV being the number of a block device of driver LABEL. Every queue
+     * must then fit in a quarter of a journal half, so that snapshotting
+     * them all leaves room for the records after. */
+    if (env_get_param("journal", label, sizeof(label)) == OK) {
+        (void)env_parse("journal_dev", "c", 0, &jdev, 0, LONG_MAX);
+        if ((ret = journal_open(label, (dev_t)jdev)) != OK) {
+            printf("hello_queue: cannot open journal on %s: %d\n", label,
+                   ret);
+            return ret;
+        }
+        limit = journal_space() / (4 * hq_nr_minors);
+        if (cap == 0 || (size_t)cap > limit) cap = MIN(limit, LONG_MAX);
+    }
+
+    (void)env_parse("hiwat", "d", 0, &hiwat, 0, LONG_MAX);
+    (void)env_parse("lowat", "d", 0, &lowat, 0, LONG_MAX);
+    (void)env_parse("shrink", "d", 0, &shrink, 0, INT_MAX / 1000);
+    if (hiwat == 0 || (cap > 0 && hiwat > cap)) hiwat = cap;
+    if (lowat < 0) lowat = hiwat / 2;
+    if (hiwat > 0 && lowat >= hiwat) {
+        printf("hello_queue: low watermark must be under the high one\n");
+        return EINVAL;
+    }
+    hq_limits.cap = cap;
+    hq_limits.hiwat = hiwat;
+    hq_limits.lowat = lowat;
+    hq_limits.shrink = shrink * sys_hz() / 1000;
+
+    hq_kernels_init();
+
+    for (i = 0; i < HQ_PATTERN_SIZE; i++) {
+        hq_pattern[i] = "xyz"[i % 3];
+    }
+
+    /* Very large queues are better kept in chunks: "-args backend=chunk". */
+    if (env_get_param("backend", backend, sizeof(backend)) == OK) {
+        if (!strcmp(backend, hq_chunk_backend.name)) {
+            hq_backend = &hq_chunk_backend;
+        } else if (!strcmp(backend, hq_ring_backend.name)) {
+            hq_backend = &hq_ring_backend;
+        } else {
+            printf("hello_queue: unknown backend '%s'\n", backend);
+            return EINVAL;
+        }
+    }
+
+    /* Queues themselves are allocated on the first open. */
+    hq_queues = calloc(hq_nr_minors, sizeof(*hq_queues));
+    if (hq_queues == NULL) return ENOMEM;
 
     switch (type) {
         case SEF_INIT_FRESH:
-            hq_buffer = malloc(DEVICE_SIZE);
-            if (hq_buffer == NULL) return ENOMEM;
-            hq_capacity = DEVICE_SIZE;
-            hq_size = DEVICE_SIZE;
-            hq_head = 0;
-
-            fill_buffer();
             break;
 
         case SEF_INIT_LU:
-            /* Restore the state. */
-            lu_state_restore();
+            /* Restore the state. If it does not all make it, RS rolls the
+             * update back and the old instance keeps serving. */
+            if ((ret = lu_state_restore(info->old_endpoint)) != OK) {
+                printf("hello_queue: cannot restore the state: %d\n", ret);
+                return ret;
+            }
             do_announce_driver = FALSE;
             break;
 
         case SEF_INIT_RESTART:
-            lu_state_restore();
+            /* The pages of a producer ring died with the old instance. With
+             * a journal, the queues come from there instead. There is
+             * nothing to go back to, so what is left is kept. */
+            if (journal_space() == 0 &&
+                (ret = lu_state_restore(NONE)) != OK) {
+                printf("hello_queue: state partly lost on restart: %d\n",
+                       ret);
+            }
             break;
     }
 
+    if (journal_space() > 0 && (ret = hq_journal_init(type)) != OK) {
+        printf("hello_queue: cannot replay the journal: %d\n", ret);
+        return ret;
+    }
+
     /* Announce we are up when necessary. */
     if (do_announce_driver) {
         chardriver_announce();
@@ -288,71 +2193,65 @@ static int sef_cb_init(int type, sef_init_info_t *UNUSED(info)) {
     return OK;
 }
 
-static void fill_buffer() {
-    static char *pattern = "xyz";
-
-    u64_t i = 0, j = 0;
-    for (; i < hq_capacity; i++, j++) {
-        if (j == 3) {
-            j = 0;
-        }
-        hq_buffer[i] = pattern[j];
-    }
-}
-
-static void buffer_down(u64_t size) {
-    hq_head += size;
-    hq_size -= size;
-
-    if (hq_size < hq_capacity / 4) {
-        if (hq_size > 0 && hq_head != 0) {
-            memmove(hq_buffer, hq_buffer + hq_head, hq_size);
+static void fill_pattern(struct hq_queue *q, size_t off, size_t size,
+                         unsigned int phase) {
+    struct hq_pos pos;
+    char *p;
+    size_t len, done, n;
+
+    for (queue_pos(&pos, off); pos.off < off + size; pos.off += len) {
+        len = queue_segment(q, &pos, off + size - pos.off, &p);
+        for (done = 0; done < len; done += n) {
+            n = MIN(len - done, HQ_PATTERN_SIZE - phase);
+            memcpy(p + done, hq_pattern + phase, n);
+            phase = (phase + n) % 3;
         }
-        hq_head = 0;
-
-        size_t new_capacity = hq_capacity / 2;
-
-        if (new_capacity < 1) return;
-
-        char *ptr = realloc(hq_buffer, new_capacity);
-
-        if (ptr == NULL) return;
-        hq_buffer = ptr;
-        hq_capacity = new_capacity;
     }
 }
 
-static int buffer_up(u64_t size) {
-    if (hq_head != 0 && (hq_head + hq_size + size > hq_capacity)) {
-        memmove(hq_buffer, hq_buffer + hq_head, hq_size);
-        hq_head = 0;
-    }
-
-    if (hq_size + size > hq_capacity) {
-        size_t new_capacity = hq_capacity;
-        while (new_capacity <= hq_size + size) {
-            new_capacity *= 2;
+static int copy_pattern(endpoint_t endpt, cp_grant_id_t grant, size_t size,
+                        unsigned int phase) {
+    struct vscp_vec vec[SCPVEC_NR];
+    size_t off = 0, len;
+    int n = 0, ret;
+
+    /* Every vector but the first starts at the front of the block. */
+    for (; off < size; off += len, phase = 0) {
+        len = MIN(size - off, HQ_PATTERN_SIZE - phase);
+
+        vec[n].v_from = SELF;
+        vec[n].v_to = endpt;
+        vec[n].v_gid = grant;
+        vec[n].v_offset = off;
+        vec[n].v_addr = (vir_bytes)(hq_pattern + phase);
+        vec[n].v_bytes = len;
+
+        if (++n == SCPVEC_NR) {
+            if ((ret = sys_vsafecopy(vec, n)) != OK) return ret;
+            n = 0;
         }
-        char *ptr = realloc(hq_buffer, new_capacity);
-        if (ptr == NULL) return ENOMEM;
-        hq_buffer = ptr;
-        hq_capacity = new_capacity;
-        hq_head = 0;
     }
 
-    return OK;
+    return n > 0 ? sys_vsafecopy(vec, n) : OK;
 }
 
-int main(void) {
+int main(int argc, char **argv) {
+    int minor;
+
     /*
      * Perform initialization.
      */
+    env_setargs(argc, argv);
     sef_local_startup();
 
     /*
      * Run the main loop.
      */
     chardriver_task(&hello_tab);
-    free(hq_buffer);
+
+    for (minor = 0; minor < hq_nr_minors; minor++) {
+        if (hq_queues[minor] != NULL) queue_destroy(hq_queues[minor]);
+    }
+    free(hq_queues);
     return OK;
 }
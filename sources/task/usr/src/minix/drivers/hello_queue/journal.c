@@ -0,0 +1,478 @@
+#include "queue.h"
+
+#include <minix/bdev.h>
+#include <minix/partition.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioc_disk.h>
+
+// The device is written in whole sectors. The superblock takes the first
+// one; the rest is split into two halves, one of which is in use.
+#define JOURNAL_BLOCK 512
+
+// Largest single transfer to the device.
+#define JOURNAL_IO (64 * 1024)
+
+// Smallest half worth journaling to.
+#define JOURNAL_MIN_HALF (4 * JOURNAL_IO)
+
+#define JOURNAL_MAGIC 0x4c4e4a48 /* "HJNL" */
+#define JOURNAL_VERSION 1
+
+#define JOURNAL_ROUND(n) \
+    (((n) + JOURNAL_BLOCK - 1) & ~(u64_t)(JOURNAL_BLOCK - 1))
+
+// Superblock. It names the half in use and its generation, which every
+// record in that half carries.
+struct journal_super {
+    u32_t magic;
+    u32_t version;
+    u32_t gen;
+    u32_t half;
+    u32_t sum;
+};
+
+// Header of a record, followed by len bytes of data. sum covers both, with
+// sum itself taken as 0.
+struct journal_rec {
+    u32_t magic;
+    u32_t gen;
+    u32_t sum;
+    u16_t type;
+    u16_t minor;
+    u32_t len;
+};
+
+// Part of a half read in during replay, from start up to end.
+struct journal_window {
+    char *buf;
+    size_t cap;
+    u64_t start, end;
+};
+
+// Journal state. Records are collected in buf[cur], which starts at half
+// offset start, and go to the device a group at a time: while one group is
+// being written, the next one builds up in the other buffer. The group
+// starts with the tail of the last sector of the one before, which is
+// written again.
+static struct {
+    dev_t dev;
+    int open;     // the device is open
+    int valid;    // the superblock on the device is ours
+    int on;       // records are being journaled
+    int full;     // a record did not fit in the half
+
+    u32_t gen;
+    u32_t half;
+    u64_t half_size;
+
+    char *buf[2];
+    size_t cap[2];
+    int cur;
+    u64_t start;
+    size_t len;     // bytes in buf[cur]
+    size_t sealed;  // bytes of buf[cur] with their sums filled in
+    int super;      // the superblock is due after buf[cur]
+
+    // Replies due once buf[cur] is written, and once the group being
+    // written is.
+    struct hq_request *waiting, **waiting_tail;
+    struct hq_request *flushing;
+
+    // The write under way, if busy.
+    int busy;
+    bdev_id_t io_id;
+    char *io_buf;
+    u64_t io_pos;
+    size_t io_len, io_off;
+    int io_super;
+
+    char sblock[JOURNAL_BLOCK];
+} jn;
+
+static void journal_next(void);
+
+static u32_t journal_sum(const char *p, size_t len, u32_t h) {
+    u32_t w;
+
+    /* FNV-1a, a word at a time. */
+    for (; len >= sizeof(w); p += sizeof(w), len -= sizeof(w)) {
+        memcpy(&w, p, sizeof(w));
+        h = (h ^ w) * 16777619;
+    }
+    for (; len > 0; p++, len--) {
+        h = (h ^ (unsigned char)*p) * 16777619;
+    }
+    return h;
+}
+
+// Returns the sum of the record at p.
+static u32_t journal_rec_sum(const char *p) {
+    struct journal_rec rec;
+
+    memcpy(&rec, p, sizeof(rec));
+    rec.sum = 0;
+    return journal_sum(p + sizeof(rec), rec.len,
+                       journal_sum((char *)&rec, sizeof(rec), 2166136261U));
+}
+
+// Makes buffer i hold at least size bytes, in whole sectors.
+static int journal_grow(int i, size_t size) {
+    size_t cap = jn.cap[i] > 0 ? jn.cap[i] : JOURNAL_IO;
+    char *buf;
+
+    size = JOURNAL_ROUND(size);
+    if (size <= jn.cap[i]) return OK;
+
+    while (cap < size) cap *= 2;
+    if ((buf = realloc(jn.buf[i], cap)) == NULL) return ENOMEM;
+
+    jn.buf[i] = buf;
+    jn.cap[i] = cap;
+    return OK;
+}
+
+static void journal_reply(struct hq_request *list) {
+    struct hq_request *r;
+
+    while ((r = list) != NULL) {
+        list = r->next;
+        chardriver_reply_task(r->endpt, r->id, (ssize_t)r->size);
+        free(r);
+    }
+}
+
+int journal_open(char *label, dev_t dev) {
+    struct part_geom geom;
+    struct journal_super super;
+    ssize_t n;
+    u32_t sum;
+    int ret;
+
+    bdev_driver(dev, label);
+    if ((ret = bdev_open(dev, BDEV_R_BIT | BDEV_W_BIT)) != OK) return ret;
+
+    if ((ret = bdev_ioctl(dev, DIOCGETP, &geom, NONE)) != OK) {
+        bdev_close(dev);
+        return ret;
+    }
+    jn.half_size = geom.size > JOURNAL_BLOCK
+                       ? (geom.size - JOURNAL_BLOCK) / 2 &
+                             ~(u64_t)(JOURNAL_BLOCK - 1)
+                       : 0;
+    if (jn.half_size < JOURNAL_MIN_HALF) {
+        bdev_close(dev);
+        return ENOSPC;
+    }
+
+    n = bdev_read(dev, 0, jn.sblock, JOURNAL_BLOCK, 0);
+    if (n != JOURNAL_BLOCK) {
+        bdev_close(dev);
+        return n < 0 ? n : EIO;
+    }
+
+    /* Anything else on the device is overwritten once the journal starts. */
+    memcpy(&super, jn.sblock, sizeof(super));
+    sum = super.sum;
+    super.sum = 0;
+    jn.valid = super.magic == JOURNAL_MAGIC &&
+               super.version == JOURNAL_VERSION && super.half < 2 &&
+               sum == journal_sum((char *)&super, sizeof(super), 2166136261U);
+    jn.gen = jn.valid ? super.gen : 0;
+    jn.half = jn.valid ? super.half : 0;
+
+    jn.dev = dev;
+    jn.open = TRUE;
+    jn.waiting_tail = &jn.waiting;
+    return OK;
+}
+
+size_t journal_space(void) {
+    return jn.open ? MIN(jn.half_size, SIZE_MAX) : 0;
+}
+
+// Makes sure window w holds len bytes at half offset off, which lies in
+// the window or right after it.
+static int journal_window(struct journal_window *w, u64_t off, size_t len) {
+    u64_t base = JOURNAL_BLOCK + jn.half * jn.half_size, start, end;
+    size_t n;
+    ssize_t ret;
+    char *buf;
+
+    if (off + len <= w->end) return OK;
+
+    /* What lies in front of the sector of off is done with. */
+    start = off & ~(u64_t)(JOURNAL_BLOCK - 1);
+    memmove(w->buf, w->buf + (start - w->start), w->end - start);
+    w->start = start;
+
+    end = MIN(MAX(JOURNAL_ROUND(off + len), w->end + JOURNAL_IO),
+              jn.half_size);
+    if (end - start > w->cap) {
+        if ((buf = realloc(w->buf, end - start)) == NULL) return ENOMEM;
+        w->buf = buf;
+        w->cap = end - start;
+    }
+
+    for (; w->end < end; w->end += ret) {
+        n = MIN(end - w->end, JOURNAL_IO);
+        ret = bdev_read(jn.dev, base + w->end, w->buf + (w->end - w->start),
+                        n, 0);
+        if (ret <= 0 || ret % JOURNAL_BLOCK) return ret < 0 ? ret : EIO;
+    }
+    return OK;
+}
+
+int journal_replay(int (*apply)(int type, devminor_t minor, const char *data,
+                                size_t len)) {
+    struct journal_window w = {NULL, 0, 0, 0};
+    struct journal_rec rec;
+    u64_t off = 0;
+    unsigned int nr = 0;
+    char *p;
+    int ret = OK;
+
+    if (!jn.valid) return OK;
+
+    /* The half ends at the first record that is not whole: the rest was
+     * never acknowledged, or belongs to an older generation. */
+    while (off + sizeof(rec) <= jn.half_size) {
+        if ((ret = journal_window(&w, off, sizeof(rec))) != OK) break;
+        memcpy(&rec, w.buf + (off - w.start), sizeof(rec));
+        if (rec.magic != JOURNAL_MAGIC || rec.gen != jn.gen ||
+            rec.type < HQ_J_SNAP || rec.type >= HQ_J_NR ||
+            rec.len > jn.half_size - off - sizeof(rec)) {
+            break;
+        }
+
+        if ((ret = journal_window(&w, off, sizeof(rec) + rec.len)) != OK) {
+            break;
+        }
+        p = w.buf + (off - w.start);
+        if (journal_rec_sum(p) != rec.sum) break;
+
+        if ((ret = apply(rec.type, rec.minor, p + sizeof(rec), rec.len)) !=
+            OK) {
+            break;
+        }
+        off += sizeof(rec) + rec.len;
+        nr++;
+    }
+
+    free(w.buf);
+    if (ret != OK) printf("hello_queue: journal replay failed: %d\n", ret);
+    printf("hello_queue: replayed %u journal records\n", nr);
+    return ret;
+}
+
+void *journal_add(int type, devminor_t minor, size_t len) {
+    struct journal_rec rec;
+    size_t need = sizeof(rec) + len;
+    char *p;
+
+    if (!jn.on || jn.full) return NULL;
+
+    /* Whatever does not fit goes into the snapshot that starts the next
+     * half. */
+    if (jn.start + jn.len + need > jn.half_size ||
+        journal_grow(jn.cur, jn.len + need) != OK) {
+        jn.full = TRUE;
+        return NULL;
+    }
+
+    rec.magic = JOURNAL_MAGIC;
+    rec.gen = jn.gen;
+    rec.sum = 0;
+    rec.type = type;
+    rec.minor = minor;
+    rec.len = len;
+
+    p = jn.buf[jn.cur] + jn.len;
+    memcpy(p, &rec, sizeof(rec));
+    jn.len += need;
+    return p + sizeof(rec);
+}
+
+int journal_full(void) { return jn.on && jn.full; }
+
+void journal_switch(void) {
+    if (!jn.open) return;
+
+    /* The records not written yet are dropped; the snapshot covers them.
+     * The half goes into use with the superblock, after the snapshot. */
+    jn.half = !jn.half;
+    jn.gen++;
+    jn.start = 0;
+    jn.len = 0;
+    jn.sealed = 0;
+    jn.full = FALSE;
+    jn.super = TRUE;
+    jn.on = TRUE;
+}
+
+int journal_wait(endpoint_t endpt, cdev_id_t id, ssize_t result) {
+    struct hq_request *r;
+
+    if (!jn.on || result < 0) return result;
+
+    /* Without memory to hold the reply back, the records go to the device
+     * before it is sent. */
+    if ((r = malloc(sizeof(*r))) == NULL) {
+        journal_sync();
+        return result;
+    }
+    r->endpt = endpt;
+    r->grant = GRANT_INVALID;
+    r->size = result;
+    r->id = id;
+    r->next = NULL;
+    *jn.waiting_tail = r;
+    jn.waiting_tail = &r->next;
+    return EDONTREPLY;
+}
+
+void journal_flush(void) {
+    struct journal_super super;
+    struct journal_rec rec;
+    size_t off, carry;
+    int next;
+
+    if (!jn.on || jn.busy) return;
+
+    /* Nothing new: whatever the waiting replies are for is on the device. */
+    if (jn.len == jn.sealed && !jn.super) {
+        journal_reply(jn.waiting);
+        jn.waiting = NULL;
+        jn.waiting_tail = &jn.waiting;
+        return;
+    }
+
+    for (off = jn.sealed; off < jn.len; off += sizeof(rec) + rec.len) {
+        memcpy(&rec, jn.buf[jn.cur] + off, sizeof(rec));
+        rec.sum = journal_rec_sum(jn.buf[jn.cur] + off);
+        memcpy(jn.buf[jn.cur] + off, &rec, sizeof(rec));
+    }
+
+    /* The replies of this group, and the superblock as it is now: a later
+     * switch does not concern this group. */
+    jn.flushing = jn.waiting;
+    jn.waiting = NULL;
+    jn.waiting_tail = &jn.waiting;
+    if ((jn.io_super = jn.super)) {
+        memset(jn.sblock, 0, sizeof(jn.sblock));
+        super.magic = JOURNAL_MAGIC;
+        super.version = JOURNAL_VERSION;
+        super.gen = jn.gen;
+        super.half = jn.half;
+        super.sum = 0;
+        super.sum = journal_sum((char *)&super, sizeof(super), 2166136261U);
+        memcpy(jn.sblock, &super, sizeof(super));
+        jn.super = FALSE;
+    }
+
+    /* A zero header after the last record ends the half on replay. */
+    jn.io_buf = jn.buf[jn.cur];
+    jn.io_pos = JOURNAL_BLOCK + jn.half * jn.half_size + jn.start;
+    jn.io_len = JOURNAL_ROUND(jn.len);
+    jn.io_off = 0;
+    memset(jn.io_buf + jn.len, 0, jn.io_len - jn.len);
+
+    /* The next group builds up in the other buffer, from the last sector
+     * of this one. */
+    next = !jn.cur;
+    carry = jn.len % JOURNAL_BLOCK;
+    if (journal_grow(next, JOURNAL_BLOCK) != OK) {
+        journal_stop();
+        return;
+    }
+    memcpy(jn.buf[next], jn.io_buf + jn.len - carry, carry);
+    jn.start += jn.len - carry;
+    jn.len = jn.sealed = carry;
+    jn.cur = next;
+
+    jn.busy = TRUE;
+    journal_next();
+}
+
+static void journal_fail(int ret) {
+    printf("hello_queue: journal write failed: %d, journaling off\n", ret);
+    journal_stop();
+}
+
+static void journal_done(dev_t UNUSED(dev), bdev_id_t UNUSED(id),
+                         bdev_param_t UNUSED(param), int result) {
+    if (!jn.on) return;
+    if (result <= 0) {
+        journal_fail(result < 0 ? result : EIO);
+        return;
+    }
+
+    jn.io_off += result;
+    journal_next();
+}
+
+// Goes on with the group being written: its records a piece at a time,
+// then the superblock if it is due, then the replies.
+static void journal_next(void) {
+    struct hq_request *done;
+    bdev_id_t id;
+
+    /* The half a switch went to is in use once the superblock says so. */
+    if (jn.io_off == jn.io_len && jn.io_super) {
+        jn.io_super = FALSE;
+        jn.io_buf = jn.sblock;
+        jn.io_pos = 0;
+        jn.io_len = JOURNAL_BLOCK;
+        jn.io_off = 0;
+    }
+
+    if (jn.io_off < jn.io_len) {
+        if ((id = bdev_write_asyn(jn.dev, jn.io_pos + jn.io_off,
+                                  jn.io_buf + jn.io_off,
+                                  MIN(jn.io_len - jn.io_off, JOURNAL_IO), 0,
+                                  journal_done, NULL)) < 0) {
+            journal_fail(id);
+            return;
+        }
+        jn.io_id = id;
+        return;
+    }
+
+    done = jn.flushing;
+    jn.flushing = NULL;
+    jn.busy = FALSE;
+    journal_reply(done);
+
+    /* What came in meanwhile is the next group. */
+    journal_flush();
+}
+
+void journal_sync(void) {
+    int ret;
+
+    journal_flush();
+    while (jn.busy) {
+        if ((ret = bdev_wait_asyn(jn.io_id)) != OK) {
+            journal_fail(ret);
+            return;
+        }
+    }
+}
+
+void journal_stop(void) {
+    struct hq_request *list;
+
+    if (!jn.on) return;
+
+    /* Writes waiting for the journal go on without it. */
+    jn.on = FALSE;
+    jn.busy = FALSE;
+    list = jn.flushing;
+    jn.flushing = NULL;
+    journal_reply(list);
+    list = jn.waiting;
+    jn.waiting = NULL;
+    jn.waiting_tail = &jn.waiting;
+    journal_reply(list);
+}
@@ -0,0 +1,112 @@
+#include "kernels.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef HQ_SSE2
+#include <minix/cpufeature.h>
+#endif
+
+// Every byte of a word set to 0x01, and to 0x80.
+#define ONES ((unsigned long)-1 / 0xff)
+#define HIGHS (ONES * 0x80)
+
+hq_xch_fn hq_xch = hq_xch_swar;
+hq_del_fn hq_del = hq_del_swar;
+
+int hq_have_sse2(void) {
+#ifdef HQ_SSE2
+    return _cpufeature(_CPUF_I386_SSE2);
+#else
+    return 0;
+#endif
+}
+
+void hq_kernels_init(void) {
+#ifdef HQ_SSE2
+    if (hq_have_sse2()) {
+        hq_xch = hq_xch_sse2;
+        hq_del = hq_del_sse2;
+        return;
+    }
+#endif
+    hq_xch = hq_xch_swar;
+    hq_del = hq_del_swar;
+}
+
+void hq_xch_scalar(char *p, size_t len, char from, char to) {
+    char *end = p + len;
+
+    for (; p < end; p++) {
+        if (*p == from) {
+            *p = to;
+        }
+    }
+}
+
+void hq_xch_swar(char *p, size_t len, char from, char to) {
+    unsigned long w, x, m;
+    unsigned long f = ONES * (unsigned char)from;
+    unsigned long t = ONES * (unsigned char)to;
+    char *end = p + len;
+
+    for (; (size_t)(end - p) >= sizeof(w); p += sizeof(w)) {
+        memcpy(&w, p, sizeof(w));
+
+        /* Set the high bit of every byte equal to from, with no carries
+         * between bytes, then widen it to the whole byte. */
+        x = w ^ f;
+        m = ~(((x & ~HIGHS) + ~HIGHS) | x) & HIGHS;
+        if (m == 0) continue;
+        m = (m >> 7) * 0xff;
+
+        w = (w & ~m) | (t & m);
+        memcpy(p, &w, sizeof(w));
+    }
+
+    hq_xch_scalar(p, end - p, from, to);
+}
+
+size_t hq_del_scalar(char *dst, const char *src, size_t n) {
+    char *d = dst;
+    size_t i = 0, j = 1;
+
+    for (; i < n; i++) {
+        if (j == 3) {
+            j = 1;
+            continue;
+        }
+        *d++ = src[i];
+        j++;
+    }
+    return d - dst;
+}
+
+size_t hq_del_swar(char *dst, const char *src, size_t n) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    const char *end = src + n;
+    char *d = dst;
+    uint64_t a, b, c, w0, w1;
+
+    /* Squeeze 24 bytes into 16, keeping bytes 0,1,3,4,6,7,... */
+    for (; end - src >= 24; src += 24, d += 16) {
+        memcpy(&a, src, 8);
+        memcpy(&b, src + 8, 8);
+        memcpy(&c, src + 16, 8);
+
+        w0 = (a & 0xffffULL) | ((a >> 8) & 0xffff0000ULL) |
+             ((a >> 16) & 0xffff00000000ULL) |
+             ((b << 40) & 0xffff000000000000ULL);
+        w1 = ((b >> 32) & 0xffffULL) | ((b >> 40) & 0xff0000ULL) |
+             ((c << 24) & 0xff000000ULL) | ((c << 16) & 0xffff00000000ULL) |
+             ((c << 8) & 0xffff000000000000ULL);
+
+        memcpy(d, &w0, 8);
+        memcpy(d + 8, &w1, 8);
+    }
+
+    return (d - dst) + hq_del_scalar(d, src, end - src);
+#else
+    return hq_del_scalar(dst, src, n);
+#endif
+}
@@ -0,0 +1,37 @@
+#ifndef __HELLO_QUEUE_KERNELS_H
+#define __HELLO_QUEUE_KERNELS_H
+
+#include <stddef.h>
+
+// Byte kernels behind HQIOCXCH and HQIOCDEL. Every kernel has a plain
+// scalar version, a word-at-a-time (SWAR) version and, on i386, an SSE2
+// version. hq_kernels_init() picks the fastest one the CPU supports.
+
+// Replaces every from byte in p[0..len) with to.
+typedef void (*hq_xch_fn)(char *p, size_t len, char from, char to);
+
+// Copies the bytes of src[0..n) whose index is not 2 modulo 3 to dst and
+// returns their number. dst may not start after src within the same buffer.
+typedef size_t (*hq_del_fn)(char *dst, const char *src, size_t n);
+
+extern hq_xch_fn hq_xch;
+extern hq_del_fn hq_del;
+
+// Selects the kernels for the running CPU.
+void hq_kernels_init(void);
+
+// Returns TRUE if the CPU can run the SSE2 kernels.
+int hq_have_sse2(void);
+
+void hq_xch_scalar(char *p, size_t len, char from, char to);
+void hq_xch_swar(char *p, size_t len, char from, char to);
+
+size_t hq_del_scalar(char *dst, const char *src, size_t n);
+size_t hq_del_swar(char *dst, const char *src, size_t n);
+
+#ifdef HQ_SSE2
+void hq_xch_sse2(char *p, size_t len, char from, char to);
+size_t hq_del_sse2(char *dst, const char *src, size_t n);
+#endif
+
+#endif /* __HELLO_QUEUE_KERNELS_H */
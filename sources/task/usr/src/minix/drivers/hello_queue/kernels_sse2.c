@@ -0,0 +1,66 @@
+#include "kernels.h"
+
+#include <emmintrin.h>
+
+// Built with -msse2; only called after hq_have_sse2() said so.
+
+// The same 64-bit value in both lanes.
+#define LANES(m) \
+    _mm_set_epi32((int)((m) >> 32), (int)(m), (int)((m) >> 32), (int)(m))
+
+void hq_xch_sse2(char *p, size_t len, char from, char to) {
+    __m128i f = _mm_set1_epi8(from), t = _mm_set1_epi8(to);
+    __m128i v, m;
+    char *end = p + len;
+
+    for (; end - p >= 16; p += 16) {
+        v = _mm_loadu_si128((__m128i *)p);
+        m = _mm_cmpeq_epi8(v, f);
+        if (_mm_movemask_epi8(m) == 0) continue;
+
+        v = _mm_or_si128(_mm_andnot_si128(m, v), _mm_and_si128(m, t));
+        _mm_storeu_si128((__m128i *)p, v);
+    }
+
+    hq_xch_swar(p, end - p, from, to);
+}
+
+size_t hq_del_sse2(char *dst, const char *src, size_t n) {
+    const __m128i m0 = LANES(0xffffULL), m1 = LANES(0xffff0000ULL),
+                  m2 = LANES(0xffff00000000ULL),
+                  m3 = LANES(0xffff000000000000ULL), m4 = LANES(0xff0000ULL),
+                  m5 = LANES(0xff000000ULL);
+    const char *end = src + n;
+    char *d = dst;
+    __m128i x, y, z, a, b, c, w0, w1;
+
+    /* Two 24-byte groups per step. Each 64-bit lane holds one group, then
+     * the lanes are squeezed the same way hq_del_swar() does it. */
+    for (; end - src >= 48; src += 48, d += 32) {
+        x = _mm_loadu_si128((const __m128i *)src);
+        y = _mm_loadu_si128((const __m128i *)(src + 16));
+        z = _mm_loadu_si128((const __m128i *)(src + 32));
+
+        a = _mm_unpacklo_epi64(x, _mm_srli_si128(y, 8)); /* 0-7, 24-31 */
+        b = _mm_unpackhi_epi64(x, _mm_slli_si128(z, 8)); /* 8-15, 32-39 */
+        c = _mm_unpacklo_epi64(y, _mm_srli_si128(z, 8)); /* 16-23, 40-47 */
+
+        w0 = _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(a, m0),
+                         _mm_and_si128(_mm_srli_epi64(a, 8), m1)),
+            _mm_or_si128(_mm_and_si128(_mm_srli_epi64(a, 16), m2),
+                         _mm_and_si128(_mm_slli_epi64(b, 40), m3)));
+        w1 = _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(_mm_srli_epi64(b, 32), m0),
+                         _mm_and_si128(_mm_srli_epi64(b, 40), m4)),
+            _mm_or_si128(
+                _mm_and_si128(_mm_slli_epi64(c, 24), m5),
+                _mm_or_si128(_mm_and_si128(_mm_slli_epi64(c, 16), m2),
+                             _mm_and_si128(_mm_slli_epi64(c, 8), m3))));
+
+        _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi64(w0, w1));
+        _mm_storeu_si128((__m128i *)(d + 16), _mm_unpackhi_epi64(w0, w1));
+    }
+
+    return (d - dst) + hq_del_swar(d, src, end - src);
+}
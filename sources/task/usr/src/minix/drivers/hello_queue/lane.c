@@ -0,0 +1,349 @@
+#include "queue.h"
+
+#include <minix/ds.h>
+#include <minix/minlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// An open file of a queue with lanes.
+struct hq_file {
+    struct hq_queue *q;
+    int lane;               // written to
+    struct hq_waiters wait;  // select()s, answered under the file's minor
+};
+
+// A file as saved on live update.
+struct lane_lu_file {
+    devminor_t minor;
+    int lane;
+};
+
+// Open files indexed by minor number, counted from HQ_FILE_MINOR.
+static struct hq_file *files[HQ_MAX_FILES];
+static int nr_files;
+
+#define STAMP_AT(l, i) \
+    ((l)->stamps[((l)->stamps_head + (i)) % HQ_LANE_STAMPS])
+
+static u64_t lane_now(void) {
+    u64_t tsc;
+
+    read_tsc_64(&tsc);
+    return tsc;
+}
+
+// Notes that the bytes up to stream offset end were written at tsc.
+static void lane_stamp(struct hq_lane *l, u64_t end, u64_t tsc) {
+    /* Out of room, the newest bytes are taken as older than they are. */
+    if (l->nr_stamps == HQ_LANE_STAMPS) {
+        STAMP_AT(l, l->nr_stamps - 1).end = end;
+        return;
+    }
+
+    l->nr_stamps++;
+    STAMP_AT(l, l->nr_stamps - 1).end = end;
+    STAMP_AT(l, l->nr_stamps - 1).tsc = tsc;
+}
+
+int lane_init(struct hq_queue *q, int nr, int fair) {
+    struct hq_queue *s;
+    int i;
+
+    q->lanes = NULL;
+    q->nr_lanes = 1;
+    q->fair = fair;
+    q->turn = 0;
+    q->lanes_size = 0;
+    if (nr <= 1) return OK;
+
+    if ((q->lanes = calloc(nr, sizeof(*q->lanes))) == NULL) return ENOMEM;
+    q->nr_lanes = nr;
+    q->turn = nr - 1;
+
+    /* The other lanes keep their bytes like the queue does, but they have
+     * nothing else: no virtual bytes, translations or waiters. */
+    for (i = 1; i < nr; i++) {
+        if ((s = calloc(1, sizeof(*s))) == NULL) break;
+        s->minor = HQ_LANE_MINOR(q->minor, i);
+        s->backend = q->backend;
+        xlat_init(s);
+        if (s->backend->init(s) != OK) {
+            free(s);
+            break;
+        }
+        q->lanes[i].store = s;
+    }
+    if (i < nr) {
+        lane_cleanup(q);
+        return ENOMEM;
+    }
+    return OK;
+}
+
+void lane_cleanup(struct hq_queue *q) {
+    int i;
+
+    for (i = 0; i < HQ_MAX_FILES; i++) {
+        if (files[i] != NULL && files[i]->q == q) {
+            lane_file_close(HQ_FILE_MINOR + i);
+        }
+    }
+
+    for (i = 1; q->lanes != NULL && i < q->nr_lanes; i++) {
+        if (q->lanes[i].store == NULL) continue;
+        q->lanes[i].store->backend->cleanup(q->lanes[i].store);
+        free(q->lanes[i].store);
+    }
+    free(q->lanes);
+    q->lanes = NULL;
+    q->nr_lanes = 1;
+    q->lanes_size = 0;
+}
+
+size_t lane_length(struct hq_queue *q, int lane) {
+    if (lane == 0) return q->virt + q->size;
+
+    return q->lanes[lane].store->size;
+}
+
+int lane_pick(struct hq_queue *q, size_t *size) {
+    struct hq_lane *l;
+    int lane, i;
+
+    if (!q->fair) {
+        for (lane = q->nr_lanes - 1; lane > 0; lane--) {
+            if (lane_length(q, lane) > 0) break;
+        }
+        *size = MIN(*size, lane_length(q, lane));
+        return lane;
+    }
+
+    /* Deficit round robin, from the highest lane down. A lane keeps its
+     * turn until it has given its quantum or runs empty. */
+    for (i = 0; i <= q->nr_lanes; i++) {
+        l = &q->lanes[q->turn];
+        if (lane_length(q, q->turn) > 0) {
+            if (l->deficit == 0) {
+                l->deficit = (q->turn + 1) * HQ_LANE_QUANTUM;
+            }
+            break;
+        }
+        l->deficit = 0;
+        q->turn = q->turn > 0 ? q->turn - 1 : q->nr_lanes - 1;
+    }
+
+    lane = q->turn;
+    *size = MIN(*size, MIN(lane_length(q, lane), q->lanes[lane].deficit));
+    return lane;
+}
+
+void lane_done(struct hq_queue *q, int lane, size_t size) {
+    struct hq_lane *l;
+    u64_t tsc, delay;
+
+    if (q->lanes == NULL || size == 0) return;
+    l = &q->lanes[lane];
+
+    /* The first byte read is covered by the first write time kept. */
+    if (l->nr_stamps > 0 && (tsc = STAMP_AT(l, 0).tsc) != 0) {
+        delay = lane_now() - tsc;
+        l->stats.delay[stats_bucket(delay)]++;
+        if (delay > l->stats.max_delay) l->stats.max_delay = delay;
+    }
+    l->stats.reads++;
+    l->stats.bytes_out += size;
+
+    l->out += size;
+    while (l->nr_stamps > 0 && STAMP_AT(l, 0).end <= l->out) {
+        l->stamps_head = (l->stamps_head + 1) % HQ_LANE_STAMPS;
+        l->nr_stamps--;
+    }
+
+    if (!q->fair) return;
+
+    l->deficit -= MIN(size, l->deficit);
+    if (l->deficit == 0 || lane_length(q, lane) == 0) {
+        l->deficit = 0;
+        q->turn = q->turn > 0 ? q->turn - 1 : q->nr_lanes - 1;
+    }
+}
+
+void lane_wrote(struct hq_queue *q, int lane, size_t size) {
+    struct hq_lane *l;
+
+    if (q->lanes == NULL || size == 0) return;
+    l = &q->lanes[lane];
+
+    l->stats.bytes_in += size;
+    lane_stamp(l, l->out + lane_length(q, lane), lane_now());
+}
+
+void lane_reset(struct hq_queue *q) {
+    struct hq_lane *l;
+
+    if (q->lanes == NULL) return;
+    l = &q->lanes[0];
+
+    l->stamps_head = 0;
+    l->nr_stamps = 0;
+    if (lane_length(q, 0) > 0) lane_stamp(l, l->out + lane_length(q, 0), 0);
+}
+
+int lane_append(struct hq_queue *q, int lane, endpoint_t endpt,
+                cp_grant_id_t grant, size_t size) {
+    int ret;
+
+    if ((ret = queue_append(q->lanes[lane].store, endpt, grant, size)) != OK) {
+        return ret;
+    }
+    q->lanes_size += size;
+    return OK;
+}
+
+int lane_put(struct hq_queue *q, int lane, const char *data, size_t size) {
+    struct hq_queue *s = q->lanes[lane].store;
+    int ret;
+
+    if ((ret = queue_extend(s, size)) != OK) return ret;
+
+    queue_put(s, s->size - size, data, size);
+    q->lanes_size += size;
+    return OK;
+}
+
+void lane_consume(struct hq_queue *q, int lane, size_t size) {
+    queue_consume(q->lanes[lane].store, size);
+    q->lanes_size -= size;
+}
+
+void lane_stats(struct hq_queue *q, struct hq_lanes *stats) {
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->nr_lanes = q->nr_lanes;
+    for (i = 0; q->lanes != NULL && i < q->nr_lanes; i++) {
+        stats->lane[i] = q->lanes[i].stats;
+    }
+}
+
+// Sets up a file in the given slot.
+static int lane_file_insert(struct hq_queue *q, int slot, int lane) {
+    if ((files[slot] = malloc(sizeof(*files[slot]))) == NULL) return ENOMEM;
+
+    files[slot]->q = q;
+    files[slot]->lane = lane;
+    files[slot]->wait.readers = NULL;
+    files[slot]->wait.readers_tail = &files[slot]->wait.readers;
+    files[slot]->wait.select_endpt = NONE;
+    files[slot]->wait.select_ops = 0;
+    nr_files++;
+    return OK;
+}
+
+int lane_file_open(struct hq_queue *q, int max, devminor_t *minorp) {
+    int slot, ret;
+
+    if (nr_files >= MIN(max, HQ_MAX_FILES)) return ENFILE;
+
+    for (slot = 0; files[slot] != NULL; slot++)
+        ;
+
+    if ((ret = lane_file_insert(q, slot, 0)) != OK) return ret;
+    *minorp = HQ_FILE_MINOR + slot;
+    return OK;
+}
+
+struct hq_queue *lane_file_get(devminor_t minor, int *lanep) {
+    int slot = minor - HQ_FILE_MINOR;
+
+    if (slot < 0 || slot >= HQ_MAX_FILES || files[slot] == NULL) return NULL;
+
+    if (lanep != NULL) *lanep = files[slot]->lane;
+    return files[slot]->q;
+}
+
+struct hq_waiters *lane_file_wait(devminor_t minor) {
+    if (lane_file_get(minor, NULL) == NULL) return NULL;
+
+    return &files[minor - HQ_FILE_MINOR]->wait;
+}
+
+int lane_file_set(devminor_t minor, int lane) {
+    struct hq_queue *q = lane_file_get(minor, NULL);
+
+    if (q == NULL || lane < 0 || lane >= q->nr_lanes) return EINVAL;
+
+    files[minor - HQ_FILE_MINOR]->lane = lane;
+    return OK;
+}
+
+void lane_file_close(devminor_t minor) {
+    int slot = minor - HQ_FILE_MINOR;
+
+    if (lane_file_get(minor, NULL) == NULL) return;
+
+    free(files[slot]);
+    files[slot] = NULL;
+    nr_files--;
+}
+
+int lane_lu_save(struct hq_queue *q) {
+    char key[DS_MAX_KEYLEN];
+    struct lane_lu_file saved[HQ_MAX_FILES];
+    struct hq_lanes stats;
+    int i, r, nr = 0;
+
+    /* VFS knows the files by their minor numbers, which must stay. */
+    for (i = 0; i < HQ_MAX_FILES; i++) {
+        if (files[i] == NULL || files[i]->q != q) continue;
+        saved[nr].minor = HQ_FILE_MINOR + i;
+        saved[nr].lane = files[i]->lane;
+        nr++;
+    }
+    if (nr > 0) {
+        snprintf(key, sizeof(key), "hq_files.%d", q->minor);
+        r = ds_publish_mem(key, saved, nr * sizeof(saved[0]), DSF_OVERWRITE);
+        if (r != OK) return r;
+    }
+
+    lane_stats(q, &stats);
+    snprintf(key, sizeof(key), "hq_lane_stats.%d", q->minor);
+    return ds_publish_mem(key, stats.lane,
+                          q->nr_lanes * sizeof(stats.lane[0]), DSF_OVERWRITE);
+}
+
+void lane_lu_restore(struct hq_queue *q) {
+    char key[DS_MAX_KEYLEN];
+    struct lane_lu_file saved[HQ_MAX_FILES];
+    struct hq_lanes stats;
+    size_t length;
+    int i, slot;
+
+    snprintf(key, sizeof(key), "hq_files.%d", q->minor);
+    length = sizeof(saved);
+    if (ds_retrieve_mem(key, (char *)saved, &length) != OK) length = 0;
+    ds_delete_mem(key);
+
+    for (i = 0; i < (int)(length / sizeof(saved[0])); i++) {
+        slot = saved[i].minor - HQ_FILE_MINOR;
+        if (slot < 0 || slot >= HQ_MAX_FILES || files[slot] != NULL ||
+            lane_file_insert(q, slot,
+                             MIN(MAX(saved[i].lane, 0), q->nr_lanes - 1)) !=
+                OK) {
+            printf("hello_queue: cannot restore file %d\n", saved[i].minor);
+        }
+    }
+
+    snprintf(key, sizeof(key), "hq_lane_stats.%d", q->minor);
+    length = sizeof(stats.lane);
+    if (q->lanes != NULL &&
+        ds_retrieve_mem(key, (char *)stats.lane, &length) == OK) {
+        for (i = 0; i < (int)(length / sizeof(stats.lane[0])) &&
+                    i < q->nr_lanes;
+             i++) {
+            q->lanes[i].stats = stats.lane[i];
+        }
+    }
+    ds_delete_mem(key);
+}
@@ -0,0 +1,146 @@
+#include "queue.h"
+
+#include <stdint.h>
+#include <string.h>
+
+struct hq_limits hq_limits;
+
+// Time the alarm goes off, 0 if it is not set.
+static clock_t alarm_due;
+
+void queue_alarm(clock_t ticks) {
+    clock_t now;
+
+    /* All queues share the one alarm of the process, which is set for the
+     * earliest time any of them asked for. */
+    getticks(&now);
+    if (alarm_due != 0 && alarm_due - now <= ticks) return;
+
+    if ((alarm_due = now + ticks) == 0) alarm_due = 1;
+    sys_setalarm(ticks, FALSE);
+}
+
+void queue_alarm_fired(void) {
+    alarm_due = 0;
+}
+
+void queue_pos(struct hq_pos *pos, size_t off) {
+    pos->off = off;
+    pos->chunk = NULL;
+    pos->chunk_off = 0;
+}
+
+size_t queue_segment(struct hq_queue *q, struct hq_pos *pos, size_t size,
+                     char **ptr) {
+    size_t len = q->backend->segment(q, pos, ptr);
+
+    return len < size ? len : size;
+}
+
+int queue_copy(struct hq_queue *q, size_t off, size_t size, endpoint_t endpt,
+               cp_grant_id_t grant, size_t grant_off, int to_user) {
+    struct vscp_vec vec[SCPVEC_NR];
+    struct hq_pos pos;
+    char *ptr;
+    size_t len;
+    int n = 0, ret;
+
+    /* Copy up to SCPVEC_NR segments per kernel call. */
+    for (queue_pos(&pos, off); size > 0; pos.off += len, size -= len) {
+        len = queue_segment(q, &pos, size, &ptr);
+
+        vec[n].v_from = to_user ? SELF : endpt;
+        vec[n].v_to = to_user ? endpt : SELF;
+        vec[n].v_gid = grant;
+        vec[n].v_offset = grant_off;
+        vec[n].v_addr = (vir_bytes)ptr;
+        vec[n].v_bytes = len;
+        grant_off += len;
+
+        if (++n == SCPVEC_NR) {
+            if ((ret = sys_vsafecopy(vec, n)) != OK) return ret;
+            n = 0;
+        }
+    }
+
+    return n > 0 ? sys_vsafecopy(vec, n) : OK;
+}
+
+void queue_put(struct hq_queue *q, size_t off, const char *src, size_t size) {
+    struct hq_pos pos;
+    char *ptr;
+    size_t len;
+
+    for (queue_pos(&pos, off); size > 0; pos.off += len, size -= len) {
+        len = queue_segment(q, &pos, size, &ptr);
+        memcpy(ptr, src, len);
+        src += len;
+    }
+}
+
+void queue_get(struct hq_queue *q, size_t off, char *dst, size_t size) {
+    struct hq_pos pos;
+    char *ptr;
+    size_t len;
+
+    for (queue_pos(&pos, off); size > 0; pos.off += len, size -= len) {
+        len = queue_segment(q, &pos, size, &ptr);
+        memcpy(dst, ptr, len);
+        dst += len;
+    }
+}
+
+int queue_extend(struct hq_queue *q, size_t size) {
+    int ret;
+
+    if ((ret = q->backend->reserve(q, size)) != OK) return ret;
+
+    q->size += size;
+    xlat_raw_tail(q, q->size - size);
+    return OK;
+}
+
+int queue_append(struct hq_queue *q, endpoint_t endpt, cp_grant_id_t grant,
+                 size_t size) {
+    int ret;
+
+    if ((ret = q->backend->reserve(q, size)) != OK) return ret;
+
+    if ((ret = queue_copy(q, q->size, size, endpt, grant, 0, FALSE)) != OK)
+        return ret;
+
+    q->size += size;
+    xlat_raw_tail(q, q->size - size);
+    return OK;
+}
+
+void queue_consume(struct hq_queue *q, size_t size) {
+    q->backend->consume(q, size);
+    xlat_consume(q, size);
+}
+
+void queue_truncate(struct hq_queue *q, size_t size) {
+    q->backend->truncate(q, size);
+    xlat_truncate(q);
+}
+
+size_t queue_room(struct hq_queue *q) {
+    size_t length = q->virt + q->size + q->lanes_size;
+
+    if (q->throttled) return 0;
+    if (hq_limits.cap == 0) return SIZE_MAX;
+
+    return length < hq_limits.cap ? hq_limits.cap - length : 0;
+}
+
+void queue_throttle(struct hq_queue *q) {
+    size_t length = q->virt + q->size + q->lanes_size;
+
+    if (hq_limits.hiwat == 0) return;
+
+    if (length >= hq_limits.hiwat) {
+        q->throttled = TRUE;
+    } else if (length <= hq_limits.lowat) {
+        q->throttled = FALSE;
+    }
+}
@@ -0,0 +1,567 @@
+#ifndef __HELLO_QUEUE_QUEUE_H
+#define __HELLO_QUEUE_QUEUE_H
+
+#include <minix/chardriver.h>
+#include <minix/drivers.h>
+#include <sys/ioc_hello_queue.h>
+
+struct hq_queue;
+struct hq_chunk;
+struct hq_ring;
+struct hq_cursor;
+
+// Position inside a queue, used to walk its storage one contiguous segment
+// at a time. Positions are invalidated by any change to the storage other
+// than writing through the returned segments.
+struct hq_pos {
+    size_t off;  // offset from the front of the queue
+
+    // Backend specific, set up by the first lookup.
+    struct hq_chunk *chunk;
+    size_t chunk_off;
+};
+
+// Storage backend of a queue. The queue contents are a sequence of bytes;
+// the backend decides how they are laid out in memory.
+struct hq_backend {
+    const char *name;
+
+    // Sets up empty storage.
+    int (*init)(struct hq_queue *q);
+
+    // Releases all storage.
+    void (*cleanup)(struct hq_queue *q);
+
+    // Makes room for size more bytes after the end of the queue.
+    int (*reserve)(struct hq_queue *q, size_t size);
+
+    // Returns the length of the contiguous storage at pos and stores its
+    // address in *ptr. The segment may reach past the end of the queue into
+    // reserved space.
+    size_t (*segment)(struct hq_queue *q, struct hq_pos *pos, char **ptr);
+
+    // Removes size bytes from the front of the queue.
+    void (*consume)(struct hq_queue *q, size_t size);
+
+    // Removes bytes from the end of the queue, so that size bytes remain.
+    void (*truncate)(struct hq_queue *q, size_t size);
+
+    // Gives back storage the queue has not needed for the shrink window.
+    // Called on every alarm; NULL if the backend never holds on to any.
+    // Returns the clock ticks until it wants to be called again, or 0.
+    clock_t (*trim)(struct hq_queue *q);
+};
+
+extern const struct hq_backend hq_ring_backend;
+extern const struct hq_backend hq_chunk_backend;
+
+// Memory limits of every queue, set with service arguments.
+struct hq_limits {
+    // Most bytes a queue may hold, 0 for no limit. Writes over it wait.
+    size_t cap;
+
+    // Writes stop once a queue holds hiwat bytes, and go on when it is
+    // down to lowat bytes. No flow control if hiwat is 0.
+    size_t hiwat;
+    size_t lowat;
+
+    // Clock ticks a queue must stay under a quarter of its storage before
+    // the storage shrinks.
+    clock_t shrink;
+};
+
+extern struct hq_limits hq_limits;
+
+// Largest number of translation epochs kept per queue.
+#define HQ_XLAT_MAX 8
+
+// HQIOCXCH translation not yet applied to the bytes from start up to the
+// start of the next epoch, or to the end of the queue. Bytes in front of
+// the first epoch are stored as they are.
+struct hq_xlat {
+    size_t start;
+
+    int nr_exchanges;       // 0 if the map changes nothing
+    char from, to;          // the exchange, if there was exactly one
+    unsigned char map[256];
+};
+
+// A read suspended until data arrives, or a write until there is room.
+struct hq_request {
+    endpoint_t endpt;
+    cp_grant_id_t grant;
+    size_t size;
+    cdev_id_t id;
+    int lane;  // of a write
+    struct hq_request *next;
+};
+
+// Reads and select()s waiting on one minor device.
+struct hq_waiters {
+    // Suspended reads, served in arrival order.
+    struct hq_request *readers;
+    struct hq_request **readers_tail;
+
+    // Process to notify when select()ed operations become ready.
+    endpoint_t select_endpt;
+    unsigned int select_ops;
+};
+
+// Largest number of fan-out cursors open at once, over all queues.
+#define HQ_MAX_CURSORS 64
+
+// Minor number of the first cursor. Cursors have minor numbers of their
+// own, given out when their queue is opened, above those of the queues.
+#define HQ_CURSOR_MINOR MAX_NR_OPEN_DEVICES
+
+// Read position of one open file of a fan-out queue.
+struct hq_cursor {
+    devminor_t minor;
+    struct hq_queue *q;
+    u64_t pos;    // stream offset of the next byte to read
+    int heap;     // index in q->heap
+
+    struct hq_waiters wait;
+    int waiting;  // on q->waiting
+    struct hq_cursor *next_waiting;
+};
+
+// Minor number of the first open file of a queue with lanes. Like cursors,
+// such files are told apart by minor numbers of their own.
+#define HQ_FILE_MINOR (HQ_CURSOR_MINOR + HQ_MAX_CURSORS)
+
+// Largest number of open files of queues with lanes, over all queues.
+#define HQ_MAX_FILES 64
+
+// Number under which the storage of lane lane of the queue of minor is
+// saved on live update. Never the number of a device.
+#define HQ_LANE_MINOR(minor, lane) (-((lane) * MAX_NR_OPEN_DEVICES + (minor)))
+
+// Largest number of write times kept per lane.
+#define HQ_LANE_STAMPS 32
+
+// One priority lane of a queue.
+struct hq_lane {
+    // Storage of the lane; NULL for lane 0, whose bytes are the queue's.
+    struct hq_queue *store;
+
+    // Bytes the lane may still give in its turn, in fair mode.
+    size_t deficit;
+
+    // Write times, oldest first: the bytes up to stream offset end were
+    // written at tsc, 0 if unknown. out is the stream offset of the front
+    // of the lane. Once there are HQ_LANE_STAMPS, the last one grows.
+    struct {
+        u64_t end;
+        u64_t tsc;
+    } stamps[HQ_LANE_STAMPS];
+    int stamps_head, nr_stamps;
+    u64_t out;
+
+    struct hq_lane_stats stats;
+};
+
+// State of a single queue. Every minor device has its own queue.
+struct hq_queue {
+    devminor_t minor;
+
+    // The queue holds virt bytes of the repeating "xyz" pattern, which take
+    // no storage, followed by size stored bytes. virt_phase is the pattern
+    // index of the first virtual byte.
+    size_t virt;
+    unsigned int virt_phase;
+
+    const struct hq_backend *backend;
+    size_t size;
+
+    union {
+        // Ring buffer. The queue starts at head and may wrap around the end
+        // of the buffer. capacity is always a power of two, so positions are
+        // reduced with a mask instead of a division.
+        // low_since is the time the queue dropped under a quarter of the
+        // buffer, 0 if it is not under.
+        struct {
+            char *buffer;
+            size_t capacity;
+            size_t head;
+            clock_t low_since;
+        } ring;
+
+        // List of fixed-size chunks. The queue starts head bytes into the
+        // first chunk.
+        struct {
+            struct hq_chunk *first;
+            struct hq_chunk *last;
+            size_t head;
+            size_t nr_chunks;
+        } chunk;
+    } u;
+
+    // Exchanges applied lazily, oldest epoch first.
+    struct hq_xlat xlat[HQ_XLAT_MAX];
+    int nr_xlat;
+
+    // Reads and select()s waiting on the empty queue.
+    struct hq_waiters wait;
+
+    // Writes waiting for room, served in arrival order, through any minor
+    // device of the queue. throttled is set from reaching the high
+    // watermark until the queue is down to the low one.
+    struct hq_request *writers;
+    struct hq_request **writers_tail;
+    int throttled;
+
+    // Fan-out mode: every open file reads through a cursor of its own, and
+    // bytes stay until the last cursor has read them. base is the stream
+    // offset of the front of the queue. The cursors form a min-heap on
+    // their positions, so the slowest one is always at the top.
+    int fanout;
+    u64_t base;
+    struct hq_cursor **heap;
+    int nr_cursors;
+
+    // Cursors with reads or select()s waiting for data.
+    struct hq_cursor *waiting;
+
+    // Framed mode: every write is one record and every read takes one. The
+    // record lengths are kept oldest first in a ring of frames_cap entries,
+    // a power of two; the first record starts at the front of the queue and
+    // together they cover the whole queue.
+    int framed;
+    size_t *frames;
+    size_t frames_cap;
+    size_t frames_head;
+    size_t nr_frames;
+
+    // Priority lanes, NULL if there is only one. lanes_size is the number of
+    // bytes in all lanes but lane 0. turn is the lane being served in fair
+    // mode.
+    struct hq_lane *lanes;
+    int nr_lanes;
+    int fair;
+    int turn;
+    size_t lanes_size;
+
+    // Producer ring shared with shm_endpt, NULL if there is none. The
+    // mapping is shm_len bytes long, at shm_addr in the producer. shm_head
+    // is the driver's own copy of the head index.
+    struct hq_ring *shm;
+    size_t shm_len;
+    u32_t shm_size;
+    u32_t shm_head;
+    endpoint_t shm_endpt;
+    vir_bytes shm_addr;
+
+    // Counters reported by HQIOCSTATS.
+    struct hq_stats stats;
+};
+
+/* queue.c */
+
+// Starts a walk over the storage at queue offset off.
+void queue_pos(struct hq_pos *pos, size_t off);
+
+// Returns the length of the contiguous storage at pos, at most size bytes.
+size_t queue_segment(struct hq_queue *q, struct hq_pos *pos, size_t size,
+                     char **ptr);
+
+// Copies size bytes between the grant and the queue at queue offset off.
+int queue_copy(struct hq_queue *q, size_t off, size_t size, endpoint_t endpt,
+               cp_grant_id_t grant, size_t grant_off, int to_user);
+
+// Copies size bytes from src into the queue at queue offset off.
+void queue_put(struct hq_queue *q, size_t off, const char *src, size_t size);
+
+// Copies size bytes at queue offset off to dst.
+void queue_get(struct hq_queue *q, size_t off, char *dst, size_t size);
+
+// Grows the queue by size bytes of unspecified contents.
+int queue_extend(struct hq_queue *q, size_t size);
+
+// Appends size bytes copied from the grant.
+int queue_append(struct hq_queue *q, endpoint_t endpt, cp_grant_id_t grant,
+                 size_t size);
+
+// Removes size bytes from the front of the queue.
+void queue_consume(struct hq_queue *q, size_t size);
+
+// Removes bytes from the end of the queue, so that size bytes remain.
+void queue_truncate(struct hq_queue *q, size_t size);
+
+// Returns the number of bytes that may be added to the queue now.
+size_t queue_room(struct hq_queue *q);
+
+// Updates the flow control state after the length of the queue changed.
+void queue_throttle(struct hq_queue *q);
+
+// Makes the alarm go off within ticks clock ticks, unless it is set to go
+// off sooner already.
+void queue_alarm(clock_t ticks);
+
+// Notes that the alarm went off.
+void queue_alarm_fired(void);
+
+/* ring.c */
+
+// Hands the ring buffer over to the new instance on live update, without
+// copying it. Fails if the queue does not keep its contents in a ring
+// buffer with pages of its own.
+int ring_lu_save(struct hq_queue *q);
+
+// Takes over the ring buffer handed over by the old instance old_endpt.
+// Fails, and leaves the queue as it is, if there is none.
+int ring_lu_restore(struct hq_queue *q, endpoint_t old_endpt);
+
+/* xlat.c */
+
+// Starts with no pending translation.
+void xlat_init(struct hq_queue *q);
+
+// Records an exchange of from to to over the whole queue, without touching
+// the stored bytes.
+void xlat_exchange(struct hq_queue *q, char from, char to);
+
+// Marks the bytes from queue offset off to the end as freshly written.
+void xlat_raw_tail(struct hq_queue *q, size_t off);
+
+// Applies the pending translation to the first size bytes of the queue.
+void xlat_apply(struct hq_queue *q, size_t size);
+
+// Follows the removal of size bytes from the front of the queue.
+void xlat_consume(struct hq_queue *q, size_t size);
+
+// Follows the removal of bytes from the end of the queue.
+void xlat_truncate(struct hq_queue *q);
+
+/* shm.c */
+
+// Starts with no producer ring.
+void shm_init(struct hq_queue *q);
+
+// Sets up a ring with a data area of size bytes, shared with endpt, and
+// stores its address in the producer in *addr.
+int shm_attach(struct hq_queue *q, endpoint_t endpt, size_t size,
+               vir_bytes *addr);
+
+// Unmaps the ring from the producer and from the driver.
+void shm_detach(struct hq_queue *q);
+
+// Moves the records in the ring to the end of the queue. Returns the number
+// of bytes added.
+size_t shm_drain(struct hq_queue *q);
+
+// Saves the ring to DS on live update, after it has been drained.
+int shm_lu_save(struct hq_queue *q);
+
+// Moves the ring saved by the old instance old_endpt into pages of our own,
+// at the same address in the producer.
+int shm_lu_restore(struct hq_queue *q, endpoint_t old_endpt);
+
+/* fanout.c */
+
+// Opens a cursor at the position of the slowest reader, or at the front of
+// the queue if there is none, and stores it in *cp. At most max cursors may
+// be open at once.
+int cursor_open(struct hq_queue *q, int max, struct hq_cursor **cp);
+
+// Opens a cursor with the given minor number and position, on live update.
+struct hq_cursor *cursor_restore(struct hq_queue *q, devminor_t minor,
+                                 u64_t pos);
+
+// Returns the cursor with the given minor number, or NULL.
+struct hq_cursor *cursor_get(devminor_t minor);
+
+// Removes the cursor from its queue and frees it.
+void cursor_close(struct hq_cursor *c);
+
+// Moves the cursor forward by size bytes.
+void cursor_advance(struct hq_cursor *c, size_t size);
+
+// Returns the position of the slowest cursor of the queue. The queue must
+// have a cursor.
+u64_t cursor_min(struct hq_queue *q);
+
+/* frame.c */
+
+// Starts in byte mode, with no records.
+void frame_init(struct hq_queue *q);
+
+// Releases the record index and goes back to byte mode.
+void frame_cleanup(struct hq_queue *q);
+
+// Switches framed mode on or off. The contents of a queue that becomes
+// framed are one record.
+int frame_set(struct hq_queue *q, int framed);
+
+// Makes room in the index for one more record.
+int frame_reserve(struct hq_queue *q);
+
+// Records the last size bytes appended as one record, in framed mode. Room
+// must have been made with frame_reserve().
+void frame_push(struct hq_queue *q, size_t size);
+
+// Returns the length of the first record, 0 if there is none.
+size_t frame_next(struct hq_queue *q);
+
+// Removes the first record from the index. There must be one.
+void frame_pop(struct hq_queue *q);
+
+// Adds the last size bytes appended to the last record, in framed mode.
+void frame_grow(struct hq_queue *q, size_t size);
+
+// Replaces all records with one of size bytes, in framed mode.
+void frame_reset(struct hq_queue *q, size_t size);
+
+// Follows HQIOCDEL, which removed every third byte of the queue.
+void frame_del(struct hq_queue *q);
+
+// Saves the records to DS on live update.
+int frame_lu_save(struct hq_queue *q);
+
+// Restores the records saved by frame_lu_save(), after the contents.
+void frame_lu_restore(struct hq_queue *q);
+
+/* journal.c */
+
+// Journal record types. A snapshot replaces the queue; the others repeat
+// what was done to it.
+enum {
+    HQ_J_SNAP = 1,  // struct hq_jsnap, then the stored bytes
+    HQ_J_ENQ,       // the bytes appended
+    HQ_J_DEQ,       // size_t number of bytes removed from the front
+    HQ_J_RES,
+    HQ_J_SET,       // the message
+    HQ_J_XCH,       // the two characters
+    HQ_J_DEL,
+    HQ_J_LANE,      // the lane, one byte, then the bytes appended to it
+    HQ_J_LDEQ,      // the lane, one byte, then size_t bytes removed
+    HQ_J_NR
+};
+
+// Start of a snapshot record.
+struct hq_jsnap {
+    size_t virt;
+    u32_t virt_phase;
+};
+
+// Opens the journal on block device dev of driver label, and reads its
+// superblock.
+int journal_open(char *label, dev_t dev);
+
+// Returns the size of the records one half of the journal holds, 0 if
+// there is no journal.
+size_t journal_space(void);
+
+// Passes every whole record of the half in use to apply, oldest first, up
+// to the first one apply fails.
+int journal_replay(int (*apply)(int type, devminor_t minor, const char *data,
+                                size_t len));
+
+// Adds a record of len bytes of data and returns where the data goes, or
+// NULL if nothing is journaled or the record did not fit. The pointer is
+// good until the next call.
+void *journal_add(int type, devminor_t minor, size_t len);
+
+// Returns TRUE if a record did not fit, so the queues must be snapshotted.
+int journal_full(void);
+
+// Moves to the other half, which the snapshots of all queues must start.
+// Also turns journaling on.
+void journal_switch(void);
+
+// Holds back the reply to a request until the records added so far are on
+// the device. Returns EDONTREPLY, or result if there is no need to wait or
+// the records had to be written out at once.
+int journal_wait(endpoint_t endpt, cdev_id_t id, ssize_t result);
+
+// Starts writing the records added so far, unless a write is under way; the
+// records added meanwhile go in one group after it.
+void journal_flush(void);
+
+// Writes all records and waits until they are on the device.
+void journal_sync(void);
+
+// Turns journaling off and sends the replies held back.
+void journal_stop(void);
+
+/* lane.c */
+
+// Gives the queue nr lanes, served in fair mode if fair is set. A queue
+// with a single lane has no lanes at all.
+int lane_init(struct hq_queue *q, int nr, int fair);
+
+// Frees the lanes and closes the open files of the queue.
+void lane_cleanup(struct hq_queue *q);
+
+// Returns the number of bytes in a lane.
+size_t lane_length(struct hq_queue *q, int lane);
+
+// Returns the lane the next read takes bytes from, and lowers *size to what
+// that lane gives now. There must be bytes in some lane.
+int lane_pick(struct hq_queue *q, size_t *size);
+
+// Follows a read of size bytes from a lane.
+void lane_done(struct hq_queue *q, int lane, size_t size);
+
+// Follows a write of size bytes to a lane.
+void lane_wrote(struct hq_queue *q, int lane, size_t size);
+
+// Follows a change to lane 0 other than a read or a write; the bytes in it
+// are no longer timed.
+void lane_reset(struct hq_queue *q);
+
+// Appends size bytes copied from the grant to a lane other than 0.
+int lane_append(struct hq_queue *q, int lane, endpoint_t endpt,
+                cp_grant_id_t grant, size_t size);
+
+// Appends size bytes from data to a lane other than 0.
+int lane_put(struct hq_queue *q, int lane, const char *data, size_t size);
+
+// Removes size bytes from the front of a lane other than 0.
+void lane_consume(struct hq_queue *q, int lane, size_t size);
+
+// Fills in the statistics of all lanes.
+void lane_stats(struct hq_queue *q, struct hq_lanes *stats);
+
+// Opens a file of a queue with lanes and stores its minor number in
+// *minorp. At most max files may be open at once.
+int lane_file_open(struct hq_queue *q, int max, devminor_t *minorp);
+
+// Returns the queue of an open file of a queue with lanes, or NULL, and
+// stores the lane it writes to in *lanep, unless lanep is NULL.
+struct hq_queue *lane_file_get(devminor_t minor, int *lanep);
+
+// Returns the select() waiters of an open file of a queue with lanes, or
+// NULL.
+struct hq_waiters *lane_file_wait(devminor_t minor);
+
+// Sets the lane an open file writes to.
+int lane_file_set(devminor_t minor, int lane);
+
+// Closes an open file of a queue with lanes.
+void lane_file_close(devminor_t minor);
+
+// Saves the open files and statistics of the lanes to DS on live update.
+int lane_lu_save(struct hq_queue *q);
+
+// Restores what lane_lu_save() saved.
+void lane_lu_restore(struct hq_queue *q);
+
+/* stats.c */
+
+// Returns the histogram bucket of a time of cycles TSC cycles.
+int stats_bucket(u64_t cycles);
+
+// Returns the TSC value marking the start of a request.
+u64_t stats_start(void);
+
+// Counts a request of the given HQ_STAT_* kind started at start.
+void stats_done(struct hq_queue *q, int kind, u64_t start);
+
+// Counts a copy of size stored bytes to a new place.
+void stats_move(struct hq_queue *q, size_t size);
+
+// Follows a change of the storage allocated for the queue.
+void stats_capacity(struct hq_queue *q, size_t capacity);
+
+#endif /* __HELLO_QUEUE_QUEUE_H */
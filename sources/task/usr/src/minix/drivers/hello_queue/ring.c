@@ -0,0 +1,237 @@
+#include "queue.h"
+
+#include <machine/vmparam.h>
+#include <minix/ds.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Smallest capacity the buffer shrinks to.
+#define RING_MIN_CAPACITY 64
+
+// Buffers of at least this many bytes get pages of their own, which can be
+// handed over to the new instance on live update.
+#define RING_MAP_MIN PAGE_SIZE
+
+// Buffer handed over to the new instance on live update.
+struct ring_lu {
+    vir_bytes addr;  // the buffer in the old instance
+    size_t capacity;
+    size_t head;
+    size_t size;
+};
+
+#define RING_MASK(q, i) ((i) & ((q)->u.ring.capacity - 1))
+
+// Smallest power of two not less than size.
+static size_t round_capacity(size_t size) {
+    size_t capacity = RING_MIN_CAPACITY;
+
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+// Allocates a buffer of the given capacity, from the heap if it is small.
+static char *ring_alloc(size_t capacity) {
+    void *buffer;
+
+    if (capacity < RING_MAP_MIN) return malloc(capacity);
+
+    buffer = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_ANON, -1, 0);
+    return buffer != MAP_FAILED ? buffer : NULL;
+}
+
+static void ring_free(char *buffer, size_t capacity) {
+    if (buffer == NULL) return;
+
+    if (capacity < RING_MAP_MIN) {
+        free(buffer);
+    } else {
+        munmap(buffer, capacity);
+    }
+}
+
+// Move the queue into a new buffer of the given capacity. Only the live part
+// is copied, so growing and shrinking by halves is amortised O(1).
+static int ring_resize(struct hq_queue *q, size_t capacity) {
+    char *buffer;
+
+    if ((buffer = ring_alloc(capacity)) == NULL) return ENOMEM;
+
+    if (q->size > 0) {
+        queue_get(q, 0, buffer, q->size);
+        stats_move(q, q->size);
+    }
+
+    ring_free(q->u.ring.buffer, q->u.ring.capacity);
+    q->u.ring.buffer = buffer;
+    q->u.ring.capacity = capacity;
+    q->u.ring.head = 0;
+
+    q->stats.allocs++;
+    stats_capacity(q, capacity);
+    return OK;
+}
+
+// Shrink the buffer once it has been less than a quarter full for the
+// shrink window, so a bursty producer does not make it grow and shrink on
+// every burst. The alarm asked for here comes back to the queue even if
+// nothing else happens to it.
+static void ring_shrink(struct hq_queue *q) {
+    if (q->size >= q->u.ring.capacity / 4 ||
+        q->u.ring.capacity / 2 < RING_MIN_CAPACITY) {
+        q->u.ring.low_since = 0;
+        return;
+    }
+
+    if (hq_limits.shrink == 0) {
+        ring_resize(q, round_capacity(2 * q->size));
+    } else if (q->u.ring.low_since == 0) {
+        getticks(&q->u.ring.low_since);
+        queue_alarm(hq_limits.shrink);
+    }
+}
+
+static clock_t ring_trim(struct hq_queue *q) {
+    clock_t now, low;
+
+    if (q->u.ring.low_since == 0) return 0;
+
+    getticks(&now);
+    if ((low = now - q->u.ring.low_since) < hq_limits.shrink) {
+        return hq_limits.shrink - low;
+    }
+
+    q->u.ring.low_since = 0;
+    ring_resize(q, round_capacity(2 * q->size));
+    return 0;
+}
+
+static int ring_init(struct hq_queue *q) {
+    q->u.ring.buffer = NULL;
+    q->u.ring.capacity = 0;
+    q->u.ring.head = 0;
+    q->u.ring.low_since = 0;
+    return OK;
+}
+
+static void ring_cleanup(struct hq_queue *q) {
+    ring_free(q->u.ring.buffer, q->u.ring.capacity);
+    q->u.ring.buffer = NULL;
+    q->u.ring.capacity = 0;
+    stats_capacity(q, 0);
+}
+
+static int ring_reserve(struct hq_queue *q, size_t size) {
+    if (q->size + size >= q->u.ring.capacity / 4) q->u.ring.low_since = 0;
+
+    if (q->size + size > q->u.ring.capacity) {
+        return ring_resize(q, round_capacity(q->size + size));
+    }
+
+    return OK;
+}
+
+static size_t ring_segment(struct hq_queue *q, struct hq_pos *pos,
+                           char **ptr) {
+    size_t start = RING_MASK(q, q->u.ring.head + pos->off);
+
+    *ptr = q->u.ring.buffer + start;
+    return q->u.ring.capacity - start;
+}
+
+static void ring_consume(struct hq_queue *q, size_t size) {
+    q->u.ring.head = RING_MASK(q, q->u.ring.head + size);
+    q->size -= size;
+
+    if (q->size == 0) {
+        q->u.ring.head = 0;
+    }
+
+    ring_shrink(q);
+}
+
+static void ring_truncate(struct hq_queue *q, size_t size) {
+    q->size = size;
+
+    if (q->size == 0) {
+        q->u.ring.head = 0;
+    }
+
+    ring_shrink(q);
+}
+
+const struct hq_backend hq_ring_backend = {
+    .name = "ring",
+    .init = ring_init,
+    .cleanup = ring_cleanup,
+    .reserve = ring_reserve,
+    .segment = ring_segment,
+    .consume = ring_consume,
+    .truncate = ring_truncate,
+    .trim = ring_trim,
+};
+
+int ring_lu_save(struct hq_queue *q) {
+    char key[DS_MAX_KEYLEN];
+    struct ring_lu lu;
+
+    /* Small buffers are cheaper to copy than to map. */
+    if (q->backend != &hq_ring_backend || q->u.ring.capacity < RING_MAP_MIN)
+        return EINVAL;
+
+    lu.addr = (vir_bytes)q->u.ring.buffer;
+    lu.capacity = q->u.ring.capacity;
+    lu.head = q->u.ring.head;
+    lu.size = q->size;
+
+    snprintf(key, sizeof(key), "hq_ring.%d", q->minor);
+    return ds_publish_mem(key, &lu, sizeof(lu), DSF_OVERWRITE);
+}
+
+int ring_lu_restore(struct hq_queue *q, endpoint_t old_endpt) {
+    char key[DS_MAX_KEYLEN];
+    struct ring_lu lu;
+    size_t length = sizeof(lu), first;
+    char *shared, *buffer;
+
+    snprintf(key, sizeof(key), "hq_ring.%d", q->minor);
+    if (ds_retrieve_mem(key, (char *)&lu, &length) != OK) return ENOENT;
+    ds_delete_mem(key);
+    if (length != sizeof(lu) || old_endpt == NONE) return EINVAL;
+
+    /* Map the pages of the old instance while it still exists. */
+    shared = vm_remap(sef_self(), old_endpt, NULL, (void *)lu.addr,
+                      lu.capacity);
+    if (shared == MAP_FAILED) {
+        printf("hello_queue: cannot take over the queue of minor %d\n",
+               q->minor);
+        return ENOMEM;
+    }
+
+    /* A shared region cannot be remapped on the next update, and goes bad
+     * once the old instance is gone, so the live part moves into pages of
+     * our own before the old instance lets go of its. */
+    if ((buffer = ring_alloc(lu.capacity)) == NULL) {
+        munmap(shared, lu.capacity);
+        return ENOMEM;
+    }
+    first = MIN(lu.size, lu.capacity - lu.head);
+    memcpy(buffer, shared + lu.head, first);
+    memcpy(buffer + first, shared, lu.size - first);
+    munmap(shared, lu.capacity);
+
+    /* The queue was saved from a ring, whatever new queues use. */
+    q->backend->cleanup(q);
+    q->backend = &hq_ring_backend;
+    q->u.ring.buffer = buffer;
+    q->u.ring.capacity = lu.capacity;
+    q->u.ring.head = 0;
+    q->u.ring.low_since = 0;
+    q->size = lu.size;
+    stats_capacity(q, lu.capacity);
+    return OK;
+}
@@ -0,0 +1,254 @@
+#include "queue.h"
+
+#include <machine/vmparam.h>
+#include <minix/ds.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioc_hello_queue.h>
+#include <sys/mman.h>
+
+// Ring state handed over to the new instance on live update.
+struct shm_lu {
+    endpoint_t endpt;
+    vir_bytes addr;
+    vir_bytes self_addr;  // the mapping in the old instance
+    size_t len;
+    u32_t size;
+    u32_t head;
+};
+
+// Drops a ring whose indices or records make no sense.
+static void shm_bad(struct hq_queue *q) {
+    printf("hello_queue: bad producer ring on minor %d, detached\n",
+           q->minor);
+    shm_detach(q);
+}
+
+void shm_init(struct hq_queue *q) {
+    q->shm = NULL;
+    q->shm_len = 0;
+    q->shm_size = 0;
+    q->shm_head = 0;
+    q->shm_endpt = NONE;
+    q->shm_addr = 0;
+}
+
+int shm_attach(struct hq_queue *q, endpoint_t endpt, size_t size,
+               vir_bytes *addr) {
+    struct hq_ring *r;
+    void *remote;
+    size_t len;
+
+    if (size < HQ_RING_MIN || size > HQ_RING_MAX || (size & (size - 1)))
+        return EINVAL;
+
+    /* A ring left behind by a process that is gone may be taken over. */
+    if (q->shm != NULL) {
+        if (q->shm_endpt != endpt && getnpid(q->shm_endpt) >= 0) {
+            return EBUSY;
+        }
+        shm_detach(q);
+    }
+
+    /* Users cannot grant memory of their own, so the driver allocates the
+     * pages and maps them into the producer, the way IPC does for shmat. */
+    len = sizeof(*r) + size;
+    if (len % PAGE_SIZE) len += PAGE_SIZE - len % PAGE_SIZE;
+
+    r = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANON, -1, 0);
+    if (r == MAP_FAILED) return ENOMEM;
+    memset(r, 0, len);
+    r->size = size;
+    r->need_kick = 1;
+
+    remote = vm_remap(endpt, sef_self(), NULL, r, len);
+    if (remote == MAP_FAILED) {
+        munmap(r, len);
+        return ENOMEM;
+    }
+
+    q->shm = r;
+    q->shm_len = len;
+    q->shm_size = size;
+    q->shm_head = 0;
+    q->shm_endpt = endpt;
+    q->shm_addr = (vir_bytes)remote;
+
+    *addr = q->shm_addr;
+    return OK;
+}
+
+void shm_detach(struct hq_queue *q) {
+    if (q->shm == NULL) return;
+
+    /* The producer may have unmapped it, or exited, already. */
+    (void)vm_unmap(q->shm_endpt, (void *)q->shm_addr);
+    munmap(q->shm, q->shm_len);
+    shm_init(q);
+}
+
+size_t shm_drain(struct hq_queue *q) {
+    struct hq_ring *r = q->shm;
+    char *data;
+    u32_t head, tail, mask, len, rec, off, n, consumed = 0;
+    size_t added = 0;
+
+    if (r == NULL) return 0;
+
+    data = HQ_RING_DATA(r);
+    mask = q->shm_size - 1;
+    head = q->shm_head;
+
+    for (;;) {
+        tail = r->tail;
+        __sync_synchronize(); /* read the records only after tail */
+
+        if (tail == head) {
+            /* Ask for the doorbell, then look again: a record added in
+             * between would not ring it. */
+            r->need_kick = 1;
+            __sync_synchronize();
+            if (r->tail == head) break;
+            continue;
+        }
+
+        /* One ring's worth per call, so a busy producer cannot keep the
+         * driver here forever. The next doorbell brings it back. */
+        if (consumed >= q->shm_size) {
+            r->need_kick = 1;
+            break;
+        }
+
+        if (tail - head > q->shm_size || (tail - head) % HQ_RING_ALIGN) {
+            shm_bad(q);
+            return added;
+        }
+
+        for (; head != tail; head += rec, consumed += rec) {
+            /* Headers are aligned, so they never wrap. */
+            memcpy(&len, data + (head & mask), sizeof(len));
+            if (len > tail - head ||
+                (rec = HQ_RING_RECORD(len)) > tail - head) {
+                shm_bad(q);
+                return added;
+            }
+
+            /* Out of room or memory: the rest stays in the ring for later.
+             * A record larger than the cap still goes into an empty queue,
+             * or it would block the ring for good. */
+            if ((queue_room(q) < len && q->virt + q->size > 0) ||
+                frame_reserve(q) != OK || queue_extend(q, len) != OK) {
+                r->need_kick = 1;
+                break;
+            }
+
+            off = (head + sizeof(len)) & mask;
+            n = MIN(len, q->shm_size - off);
+            queue_put(q, q->size - len, data + off, n);
+            queue_put(q, q->size - len + n, data, len - n);
+            frame_push(q, len);
+            queue_throttle(q);
+            added += len;
+        }
+
+        /* Hand the space back only after the payload has been copied. */
+        __sync_synchronize();
+        r->head = q->shm_head = head;
+        if (head != tail) break;
+    }
+
+    return added;
+}
+
+int shm_lu_save(struct hq_queue *q) {
+    char key[DS_MAX_KEYLEN];
+    struct shm_lu lu;
+
+    if (q->shm == NULL) return OK;
+
+    lu.endpt = q->shm_endpt;
+    lu.addr = q->shm_addr;
+    lu.self_addr = (vir_bytes)q->shm;
+    lu.len = q->shm_len;
+    lu.size = q->shm_size;
+    lu.head = q->shm_head;
+
+    snprintf(key, sizeof(key), "hq_shm.%d", q->minor);
+    return ds_publish_mem(key, &lu, sizeof(lu), DSF_OVERWRITE);
+}
+
+// Copies the bytes from head up to tail of the data area of one ring of the
+// given size to another. A producer may have set tail to anything, so it
+// copies at most the whole area.
+static void shm_copy(struct hq_ring *to, const struct hq_ring *from,
+                     u32_t size, u32_t head, u32_t tail) {
+    u32_t off = head & (size - 1);
+    u32_t len = MIN(tail - head, size), n = MIN(len, size - off);
+
+    memcpy(HQ_RING_DATA(to) + off, HQ_RING_DATA(from) + off, n);
+    memcpy(HQ_RING_DATA(to), HQ_RING_DATA(from), len - n);
+}
+
+int shm_lu_restore(struct hq_queue *q, endpoint_t old_endpt) {
+    char key[DS_MAX_KEYLEN];
+    struct shm_lu lu;
+    size_t length = sizeof(lu);
+    struct hq_ring *old, *r;
+    void *remote;
+    u32_t tail;
+
+    snprintf(key, sizeof(key), "hq_shm.%d", q->minor);
+    if (ds_retrieve_mem(key, (char *)&lu, &length) != OK) return OK;
+    ds_delete_mem(key);
+    if (length != sizeof(lu) || old_endpt == NONE) return EINVAL;
+
+    /* The old instance is the source of the producer's mapping, which goes
+     * bad once it is gone, so the ring moves into pages of our own while
+     * it still exists. Map the old pages for the copy. */
+    old = vm_remap(sef_self(), old_endpt, NULL, (void *)lu.self_addr, lu.len);
+    if (old == MAP_FAILED) {
+        printf("hello_queue: cannot keep the producer ring of minor %d\n",
+               q->minor);
+        (void)vm_unmap(lu.endpt, (void *)lu.addr);
+        return ENOMEM;
+    }
+
+    r = mmap(NULL, lu.len, PROT_READ | PROT_WRITE, MAP_ANON, -1, 0);
+    if (r == MAP_FAILED) {
+        munmap(old, lu.len);
+        (void)vm_unmap(lu.endpt, (void *)lu.addr);
+        return ENOMEM;
+    }
+
+    /* Copy the records while the producer may still add to them, then
+     * take the old pages away from it and copy whatever came in since.
+     * Nothing gets lost, and the producer only faults if it touches the
+     * ring in the short time before the new pages are in place. */
+    tail = old->tail;
+    __sync_synchronize();
+    r->size = lu.size;
+    shm_copy(r, old, lu.size, lu.head, tail);
+    (void)vm_unmap(lu.endpt, (void *)lu.addr);
+    if (old->tail != tail) shm_copy(r, old, lu.size, tail, old->tail);
+    r->head = old->head;
+    r->tail = old->tail;
+    r->need_kick = old->need_kick;
+    munmap(old, lu.len);
+
+    /* The producer finds the ring where it left it. */
+    remote = vm_remap(lu.endpt, sef_self(), (void *)lu.addr, r, lu.len);
+    if (remote == MAP_FAILED) {
+        printf("hello_queue: cannot give the producer ring of minor %d "
+               "back\n", q->minor);
+        munmap(r, lu.len);
+        return ENOMEM;
+    }
+
+    q->shm = r;
+    q->shm_len = lu.len;
+    q->shm_size = lu.size;
+    q->shm_head = lu.head;
+    q->shm_endpt = lu.endpt;
+    q->shm_addr = (vir_bytes)remote;
+    return OK;
+}
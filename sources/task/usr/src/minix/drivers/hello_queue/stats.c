@@ -0,0 +1,37 @@
+#include "queue.h"
+
+#include <minix/minlib.h>
+
+int stats_bucket(u64_t cycles) {
+    int bucket;
+
+    if (cycles <= 1) return 0;
+
+    bucket = 63 - __builtin_clzll(cycles);
+    return bucket < HQ_HIST_BUCKETS ? bucket : HQ_HIST_BUCKETS - 1;
+}
+
+u64_t stats_start(void) {
+    u64_t tsc;
+
+    read_tsc_64(&tsc);
+    return tsc;
+}
+
+void stats_done(struct hq_queue *q, int kind, u64_t start) {
+    u64_t tsc;
+
+    read_tsc_64(&tsc);
+    q->stats.ops[kind]++;
+    q->stats.hist[kind][stats_bucket(tsc - start)]++;
+}
+
+void stats_move(struct hq_queue *q, size_t size) {
+    q->stats.moves++;
+    q->stats.bytes_moved += size;
+}
+
+void stats_capacity(struct hq_queue *q, size_t capacity) {
+    q->stats.capacity = capacity;
+    if (capacity > q->stats.peak_capacity) q->stats.peak_capacity = capacity;
+}
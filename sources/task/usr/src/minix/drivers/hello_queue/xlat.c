@@ -0,0 +1,143 @@
+#include "kernels.h"
+#include "queue.h"
+
+#include <string.h>
+
+static void xlat_identity(struct hq_xlat *x, size_t start) {
+    int i;
+
+    x->start = start;
+    x->nr_exchanges = 0;
+    for (i = 0; i < 256; i++) {
+        x->map[i] = i;
+    }
+}
+
+// End of the bytes covered by epoch i.
+static size_t xlat_end(struct hq_queue *q, int i) {
+    return i + 1 < q->nr_xlat ? q->xlat[i + 1].start : q->size;
+}
+
+static void xlat_remove(struct hq_queue *q, int i) {
+    memmove(&q->xlat[i], &q->xlat[i + 1],
+            (q->nr_xlat - i - 1) * sizeof(q->xlat[0]));
+    q->nr_xlat--;
+}
+
+// Translates the bytes in [from, to) with the map of epoch x.
+static void xlat_range(struct hq_queue *q, struct hq_xlat *x, size_t from,
+                       size_t to) {
+    struct hq_pos pos;
+    char *p, *end;
+    size_t len;
+
+    if (x->nr_exchanges == 0) return;
+
+    for (queue_pos(&pos, from); pos.off < to; pos.off += len) {
+        len = queue_segment(q, &pos, to - pos.off, &p);
+
+        /* A single exchange is what the XCH kernels do best. */
+        if (x->nr_exchanges == 1) {
+            hq_xch(p, len, x->from, x->to);
+            continue;
+        }
+        for (end = p + len; p < end; p++) {
+            *p = x->map[(unsigned char)*p];
+        }
+    }
+}
+
+// Drops epochs that cover no bytes or that leave their bytes unchanged at
+// the front, where untranslated bytes are the default anyway.
+static void xlat_prune(struct hq_queue *q) {
+    int i;
+
+    for (i = 0; i < q->nr_xlat;) {
+        if (q->xlat[i].start >= xlat_end(q, i) ||
+            (i == 0 && q->xlat[i].nr_exchanges == 0) ||
+            (i > 0 && q->xlat[i].nr_exchanges == 0 &&
+             q->xlat[i - 1].nr_exchanges == 0)) {
+            xlat_remove(q, i);
+        } else {
+            i++;
+        }
+    }
+}
+
+// Frees a slot by translating the bytes of the oldest epoch.
+static void xlat_make_room(struct hq_queue *q) {
+    if (q->nr_xlat < HQ_XLAT_MAX) return;
+
+    xlat_range(q, &q->xlat[0], q->xlat[0].start, xlat_end(q, 0));
+    xlat_remove(q, 0);
+}
+
+void xlat_init(struct hq_queue *q) { q->nr_xlat = 0; }
+
+void xlat_exchange(struct hq_queue *q, char from, char to) {
+    struct hq_xlat *x;
+    int i, j;
+
+    if (from == to || q->size == 0) return;
+
+    /* Untranslated bytes at the front get an epoch of their own. */
+    if (q->nr_xlat == 0 || q->xlat[0].start > 0) {
+        xlat_make_room(q);
+        memmove(&q->xlat[1], &q->xlat[0], q->nr_xlat * sizeof(q->xlat[0]));
+        q->nr_xlat++;
+        xlat_identity(&q->xlat[0], 0);
+    }
+
+    /* Compose the exchange into every epoch, 256 steps each. */
+    for (i = 0; i < q->nr_xlat; i++) {
+        x = &q->xlat[i];
+        for (j = 0; j < 256; j++) {
+            if (x->map[j] == (unsigned char)from) x->map[j] = to;
+        }
+        if (x->nr_exchanges++ == 0) {
+            x->from = from;
+            x->to = to;
+        }
+    }
+}
+
+void xlat_raw_tail(struct hq_queue *q, size_t off) {
+    while (q->nr_xlat > 0 && q->xlat[q->nr_xlat - 1].start >= off) {
+        q->nr_xlat--;
+    }
+
+    /* Stop the translation of the last epoch at off. */
+    if (q->nr_xlat > 0 && q->xlat[q->nr_xlat - 1].nr_exchanges > 0 &&
+        off < q->size) {
+        xlat_make_room(q);
+        xlat_identity(&q->xlat[q->nr_xlat++], off);
+    }
+
+    xlat_prune(q);
+}
+
+void xlat_apply(struct hq_queue *q, size_t size) {
+    int i;
+
+    for (i = 0; i < q->nr_xlat && q->xlat[i].start < size; i++) {
+        xlat_range(q, &q->xlat[i], q->xlat[i].start,
+                   MIN(xlat_end(q, i), size));
+    }
+
+    /* The translated bytes are now stored as they are. */
+    for (i = 0; i < q->nr_xlat && q->xlat[i].start < size; i++) {
+        q->xlat[i].start = size;
+    }
+    xlat_prune(q);
+}
+
+void xlat_consume(struct hq_queue *q, size_t size) {
+    int i;
+
+    for (i = 0; i < q->nr_xlat; i++) {
+        q->xlat[i].start -= MIN(q->xlat[i].start, size);
+    }
+    xlat_prune(q);
+}
+
+void xlat_truncate(struct hq_queue *q) { xlat_prune(q); }
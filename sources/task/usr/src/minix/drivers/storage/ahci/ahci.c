@@ -2227,6 +2227,7 @@ static void ahci_get_params(void)
 	/* Retrieve and parse parameters passed to this driver, except the
 	 * device-to-port mapping, which has to be parsed later.
 	 */
+	char sched[16];
 	long v;
 	unsigned int i;
 
@@ -2240,6 +2241,12 @@ static void ahci_get_params(void)
 	(void) env_parse("ahci_verbose", "d", 0, &v, V_NONE, V_REQ);
 	ahci_verbose = (int) v;
 
+	/* Select the request scheduling policy, if given. */
+	if (env_get_param("sched", sched, sizeof(sched)) == OK &&
+			blockdriver_mt_set_sched(sched) != OK)
+		dprintf(V_ERR, ("AHCI%d: unknown scheduling policy '%s'\n",
+			ahci_instance, sched));
+
 	/* Initialize timeout-related values. */
 	for (i = 0; i < sizeof(ahci_timevar) / sizeof(ahci_timevar[0]); i++) {
 		v = ahci_timevar[i].default_ms;
@@ -689,10 +689,15 @@ static int
 sef_cb_init_fresh(int type, sef_init_info_t *info)
 {
 	long instance = 0;
+	char sched[16];
 	int r;
 
 	env_parse("instance", "d", 0, &instance, 0, 255);
 
+	if (env_get_param("sched", sched, sizeof(sched)) == OK &&
+	    blockdriver_mt_set_sched(sched) != OK)
+		dprintf(("unknown scheduling policy '%s'", sched));
+
 	if ((r = virtio_blk_probe((int)instance)) == OK) {
 		blockdriver_announce(type);
 		return OK;
@@ -22,6 +22,15 @@ struct chardriver {
   void (*cdr_other)(message *m_ptr, int ipc_status);
 };
 
+/* Batch sizes seen by chardriver_task() when batching receives. */
+#define CHARDRIVER_BATCH_MAX	32	/* largest batch budget */
+
+struct chardriver_batch_stats {
+  u64_t cbs_batches;			/* number of batches */
+  u64_t cbs_messages;			/* messages handled in batches */
+  u64_t cbs_sizes[CHARDRIVER_BATCH_MAX];	/* batches of size i+1 */
+};
+
 /* Functions defined by libchardriver. */
 void chardriver_announce(void);
 int chardriver_get_minor(message *m, devminor_t *minor);
@@ -29,6 +38,8 @@ void chardriver_process(struct chardriver *cdp, message *m_ptr,
 	int ipc_status);
 void chardriver_terminate(void);
 void chardriver_task(struct chardriver *cdp);
+void chardriver_set_batch(int budget);
+void chardriver_get_batch_stats(struct chardriver_batch_stats *stats);
 
 void chardriver_reply_task(endpoint_t endpt, cdev_id_t id, int r);
 void chardriver_reply_select(endpoint_t endpt, devminor_t minor, int ops);
@@ -0,0 +1,17 @@
+#ifndef _MINIX_CHARDRIVER_MT_H
+#define _MINIX_CHARDRIVER_MT_H
+
+#include <minix/chardriver.h>
+
+#define CHARDRIVER_MAX_DEVICES		32
+
+typedef int cdev_thread_t;
+
+void chardriver_mt_task(struct chardriver *driver_tab);
+void chardriver_mt_sleep(void);
+void chardriver_mt_wakeup(cdev_thread_t id);
+void chardriver_mt_terminate(void);
+void chardriver_mt_set_workers(devminor_t minor, int workers);
+cdev_thread_t chardriver_mt_get_tid(void);
+
+#endif /* _MINIX_CHARDRIVER_MT_H */
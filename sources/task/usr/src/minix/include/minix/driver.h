@@ -25,6 +25,7 @@
 #include <sys/param.h>
 #include <minix/u64.h>
 #include <minix/partition.h>
+#include <minix/bitmap.h>
 
 /* Base and size of a partition in bytes. */
 struct device {
@@ -40,4 +41,21 @@ struct device {
 /* Maximum supported number of concurrently opened minor devices. */
 #define MAX_NR_OPEN_DEVICES 256
 
+/* Set of minor devices, such as those opened since a driver started. Minors
+ * below MAX_NR_OPEN_DEVICES have a bit each, others are hashed. Either way,
+ * a lookup takes constant time.
+ */
+#define MINOR_SET_SLOTS	(2 * MAX_NR_OPEN_DEVICES)	/* hash table size */
+
+struct minor_set {
+	bitchunk_t ms_low[BITMAP_CHUNKS(MAX_NR_OPEN_DEVICES)];
+	bitchunk_t ms_used[BITMAP_CHUNKS(MINOR_SET_SLOTS)];
+	devminor_t ms_high[MINOR_SET_SLOTS];
+	int ms_nr_high;
+};
+
+void minor_set_clear(struct minor_set *set);
+int minor_set_has(const struct minor_set *set, devminor_t minor);
+int minor_set_add(struct minor_set *set, devminor_t minor);
+
 #endif /* _MINIX_DRIVER_H */
@@ -24,9 +24,11 @@
 
 #define DSF_OVERWRITE		0x01000	/* overwrite if entry exists */
 #define DSF_INITIAL		0x02000	/* check subscriptions immediately */
+#define DSF_MAP			0x04000	/* memory range kept in pages */
 
 /* DS constants. */
 #define DS_MAX_KEYLEN 80        /* Max length of a key, including '\0'. */
+#define DS_MAP_MIN (64*1024)    /* Smaller maps are copied instead. */
 
 /* DS events. */
 #define DS_DRIVER_UP		1
@@ -49,12 +51,10 @@ int ds_publish_mem(const char *ds_name, void *vaddr, size_t length, int
 int ds_retrieve_mem(const char *ds_name, char *vaddr, size_t *length);
 int ds_delete_mem(const char *ds_name);
 
-/* MAP */
+/* MAP, a large MEM range kept in pages */
 int ds_publish_map(const char *ds_name, void *vaddr, size_t length, int
 	flags);
-int ds_snapshot_map(const char *ds_name, int *nr_snapshot);
-int ds_retrieve_map(const char *ds_name, char *vaddr, size_t *length,
-	int nr_snapshot, int flags);
+int ds_retrieve_map(const char *ds_name, void **vaddr, size_t *length);
 int ds_delete_map(const char *ds_name);
 
 /* LABEL */
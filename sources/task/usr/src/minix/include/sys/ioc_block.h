@@ -11,5 +11,7 @@
 #define BIOCTRACEBUF	_IOW('b', 1, size_t)
 #define BIOCTRACECTL	_IOW('b', 2, int)
 #define BIOCTRACEGET	_IOR_BIG(3, btrace_entry[BTBUF_SIZE])
+#define BIOCTRACEQ	_IOR('b', 4, btrace_mqstats)
+#define BIOCTRACESTATS	_IOR('b', 5, btrace_stats)
 
 #endif /* _S_I_BLOCK_H */
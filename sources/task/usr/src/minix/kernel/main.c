@@ -281,6 +281,7 @@ void kmain(kinfo_t *local_cbi)
 
   IPCNAME(SEND);
   IPCNAME(RECEIVE);
+  IPCNAME(RECEIVENB);
   IPCNAME(SENDREC);
   IPCNAME(NOTIFY);
   IPCNAME(SENDNB);
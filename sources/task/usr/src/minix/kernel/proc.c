@@ -420,10 +420,11 @@ static int do_sync_ipc(struct proc * caller_ptr, /* who made the call */
   int src_dst_p;				/* Process slot number */
   char *callname;
 
-  /* Check destination. RECEIVE is the only call that accepts ANY (in addition
-   * to a real endpoint). The other calls (SEND, SENDREC, and NOTIFY) require an
-   * endpoint to corresponds to a process. In addition, it is necessary to check
-   * whether a process is allowed to send to a given destination.
+  /* Check destination. RECEIVE and RECEIVENB are the only calls that accept
+   * ANY (in addition to a real endpoint). The other calls (SEND, SENDREC, and
+   * NOTIFY) require an endpoint to corresponds to a process. In addition, it
+   * is necessary to check whether a process is allowed to send to a given
+   * destination.
    */
   assert(call_nr != SENDA);
 
@@ -439,7 +440,7 @@ static int do_sync_ipc(struct proc * caller_ptr, /* who made the call */
 
   if (src_dst_e == ANY)
   {
-	if (call_nr != RECEIVE)
+	if (call_nr != RECEIVE && call_nr != RECEIVENB)
 	{
 #if 0
 		printf("sys_call: %s by %d with bad endpoint %d\n", 
@@ -466,7 +467,7 @@ static int do_sync_ipc(struct proc * caller_ptr, /* who made the call */
 	 * SENDREC or NOTIFY, verify that the caller is allowed to send to
 	 * the given destination. 
 	 */
-	if (call_nr != RECEIVE)
+	if (call_nr != RECEIVE && call_nr != RECEIVENB)
 	{
 		if (!may_send_to(caller_ptr, src_dst_p)) {
 #if DEBUG_ENABLE_IPC_WARNINGS
@@ -492,7 +493,8 @@ static int do_sync_ipc(struct proc * caller_ptr, /* who made the call */
 	return(ETRAPDENIED);		/* trap denied by mask or kernel */
   }
 
-  if (call_nr != SENDREC && call_nr != RECEIVE && iskerneln(src_dst_p)) {
+  if (call_nr != SENDREC && call_nr != RECEIVE && call_nr != RECEIVENB &&
+	iskerneln(src_dst_p)) {
 #if DEBUG_ENABLE_IPC_WARNINGS
       printf("sys_call: trap %s not allowed, caller %d, src_dst %d\n",
            callname, proc_nr(caller_ptr), src_dst_e);
@@ -517,6 +519,11 @@ static int do_sync_ipc(struct proc * caller_ptr, /* who made the call */
 	}
 	result = mini_receive(caller_ptr, src_dst_e, m_ptr, 0);
 	break;
+  case RECEIVENB:
+	caller_ptr->p_misc_flags &= ~MF_REPLY_PEND;
+	IPC_STATUS_CLEAR(caller_ptr);  /* clear IPC status code */
+	result = mini_receive(caller_ptr, src_dst_e, m_ptr, NON_BLOCKING);
+	break;
   case NOTIFY:
 	result = mini_notify(caller_ptr, src_dst_e);
 	break;
@@ -583,6 +590,7 @@ int do_ipc(reg_t r1, reg_t r2, reg_t r3)
    *   - SENDREC: combines SEND and RECEIVE in a single system call
    *   - SEND:    sender blocks until its message has been delivered
    *   - RECEIVE: receiver blocks until an acceptable message has arrived
+   *   - RECEIVENB: nonblocking variant of RECEIVE
    *   - NOTIFY:  asynchronous call; deliver notification or mark pending
    *   - SENDA:   list of asynchronous send requests
    */
@@ -590,6 +598,7 @@ int do_ipc(reg_t r1, reg_t r2, reg_t r3)
   	case SENDREC:
   	case SEND:			
   	case RECEIVE:			
+  	case RECEIVENB:
   	case NOTIFY:
   	case SENDNB:
   	{
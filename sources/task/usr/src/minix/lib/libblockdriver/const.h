@@ -14,4 +14,11 @@
 #define MAIN_THREAD	(MAX_THREADS)			/* main thread ID */
 #define SINGLE_THREAD	(0)				/* single-thread ID */
 
+/* A thread ID is composed of a device ID and a per-device worker thread ID.
+ * All thread IDs must be in the range 0..(MAX_THREADS-1) inclusive.
+ */
+#define MAKE_TID(did, wid)	((did) * MAX_WORKERS + (wid))
+#define TID_DEVICE(tid)		((tid) / MAX_WORKERS)
+#define TID_WORKER(tid)		((tid) % MAX_WORKERS)
+
 #endif /* _BLOCKDRIVER_CONST_H */
@@ -43,13 +43,14 @@
 #include <sys/ioc_block.h>
 #include <sys/ioc_disk.h>
 
+#include "const.h"
 #include "driver.h"
 #include "mq.h"
+#include "sched.h"
 #include "trace.h"
 
 /* Management data for opened devices. */
-static int open_devs[MAX_NR_OPEN_DEVICES];
-static int next_open_devs_slot = 0;
+static struct minor_set open_devs;
 
 /*===========================================================================*
  *				clear_open_devs				     *
@@ -57,7 +58,7 @@ static int next_open_devs_slot = 0;
 static void clear_open_devs(void)
 {
 /* Reset the set of previously opened minor devices. */
-  next_open_devs_slot = 0;
+  minor_set_clear(&open_devs);
 }
 
 /*===========================================================================*
@@ -66,13 +67,7 @@ static void clear_open_devs(void)
 static int is_open_dev(int device)
 {
 /* Check whether the given minor device has previously been opened. */
-  int i;
-
-  for (i = 0; i < next_open_devs_slot; i++)
-	if (open_devs[i] == device)
-		return TRUE;
-
-  return FALSE;
+  return minor_set_has(&open_devs, device);
 }
 
 /*===========================================================================*
@@ -82,11 +77,8 @@ static void set_open_dev(int device)
 {
 /* Mark the given minor device as having been opened. */
 
-  if (next_open_devs_slot >= MAX_NR_OPEN_DEVICES)
+  if (minor_set_add(&open_devs, device) != OK)
 	panic("out of slots for open devices");
-
-  open_devs[next_open_devs_slot] = device;
-  next_open_devs_slot++;
 }
 
 /*===========================================================================*
@@ -320,6 +312,7 @@ static int do_ioctl(struct blockdriver *bdp, message *mp)
   unsigned long request;
   cp_grant_id_t grant;
   endpoint_t user_endpt;
+  device_id_t id;
   int r;
 
   minor = mp->m_lbdev_lblockdriver_msg.minor;
@@ -336,6 +329,21 @@ static int do_ioctl(struct blockdriver *bdp, message *mp)
 
 	break;
 
+  case BIOCTRACEQ:
+  case BIOCTRACESTATS:
+	/* Device statistics. Singlethreaded drivers have one device. */
+	if (bdp->bdr_device == NULL)
+		id = SINGLE_THREAD;
+	else if ((r = (*bdp->bdr_device)(minor, &id)) != OK)
+		break;
+
+	if (request == BIOCTRACEQ)
+		r = trace_mqstats(id, mp->m_source, grant);
+	else
+		r = trace_stats(id, mp->m_source, grant);
+
+	break;
+
   case DIOCSETP:
   case DIOCGETP:
 	/* Handle disk-specific IOCTLs only for disk-type drivers. */
@@ -460,3 +468,62 @@ void blockdriver_process_on_thread(struct blockdriver *bdp, message *m_ptr,
 
   blockdriver_reply(m_ptr, ipc_status, r);
 }
+
+/*===========================================================================*
+ *				blockdriver_process_batch		     *
+ *===========================================================================*/
+void blockdriver_process_batch(struct blockdriver *bdp, struct sched_batch *bp,
+  thread_id_t id)
+{
+/* Carry out one transfer for a batch of adjacent vector requests, whose I/O
+ * vectors the scheduler has copied in already, and reply to each request.
+ */
+  message *m_ptr;
+  devminor_t minor;
+  ssize_t r, left, done;
+  size_t size;
+  int i;
+
+  m_ptr = &bp->cell[0]->mess;
+  minor = m_ptr->m_lbdev_lblockdriver_msg.minor;
+
+  /* Deny requests on devices that have not been opened, as for single ones. */
+  if (!is_open_dev(minor)) {
+	for (i = 0; i < bp->count; i++)
+		blockdriver_reply(&bp->cell[i]->mess, bp->cell[i]->ipc_status,
+			ERESTART);
+
+	return;
+  }
+
+  for (i = size = 0; i < bp->count; i++)
+	size += bp->size[i];
+
+  trace_start(id, m_ptr);
+  trace_setsize(id, size);
+
+  r = (*bdp->bdr_transfer)(minor, m_ptr->m_type == BDEV_SCATTER,
+	m_ptr->m_lbdev_lblockdriver_msg.pos, m_ptr->m_source, bp->iovec,
+	bp->nr_req, m_ptr->m_lbdev_lblockdriver_msg.flags);
+
+  /* Let the driver perform any cleanup. */
+  if (bdp->bdr_cleanup != NULL)
+	(*bdp->bdr_cleanup)();
+
+  trace_finish(id, r);
+
+  /* Hand out the bytes transferred to the requests in order of position, or
+   * the error code to all of them.
+   */
+  left = r;
+
+  for (i = 0; i < bp->count; i++) {
+	if (r >= 0) {
+		done = MIN(left, (ssize_t) bp->size[i]);
+		left -= done;
+	} else
+		done = r;
+
+	blockdriver_reply(&bp->cell[i]->mess, bp->cell[i]->ipc_status, done);
+  }
+}
@@ -9,6 +9,7 @@
  *   blockdriver_mt_sleep:	put the current thread to sleep
  *   blockdriver_mt_wakeup:	wake up a sleeping thread
  *   blockdriver_mt_set_workers:set the number of worker threads
+ *   blockdriver_mt_set_sched:	select the request scheduling policy
  */
 
 #include <minix/blockdriver_mt.h>
@@ -18,13 +19,7 @@
 #include "const.h"
 #include "driver.h"
 #include "mq.h"
-
-/* A thread ID is composed of a device ID and a per-device worker thread ID.
- * All thread IDs must be in the range 0..(MAX_THREADS-1) inclusive.
- */
-#define MAKE_TID(did, wid)	((did) * MAX_WORKERS + (wid))
-#define TID_DEVICE(tid)		((tid) / MAX_WORKERS)
-#define TID_WORKER(tid)		((tid) % MAX_WORKERS)
+#include "sched.h"
 
 typedef int worker_id_t;
 
@@ -66,40 +61,42 @@ static int num_exited = 0;
 /*===========================================================================*
  *				enqueue					     *
  *===========================================================================*/
-static void enqueue(device_t *dp, const message *m_src, int ipc_status)
+static int enqueue(device_t *dp, struct mq_cell *cell)
 {
-/* Enqueue a message into the device's queue, and signal the event.
- * Must be called from the master thread.
+/* Enqueue a message cell into the device's queue, and signal the event. The
+ * queue takes over the cell. Return FALSE, leaving the cell with the caller,
+ * if the queue is full. Must be called from the master thread.
  */
 
-  if (!mq_enqueue(dp->id, m_src, ipc_status))
-	panic("blockdriver_mt: enqueue failed (message queue full)");
+  if (!mq_put(dp->id, cell))
+	return FALSE;
 
   mthread_event_fire(&dp->queue_event);
+
+  return TRUE;
 }
 
 /*===========================================================================*
  *				try_dequeue				     *
  *===========================================================================*/
-static int try_dequeue(device_t *dp, message *m_dst, int *ipc_status)
+static int try_dequeue(device_t *dp, sched_batch_t *bp)
 {
-/* See if a message can be dequeued from the current worker thread's device
- * queue. If so, dequeue the message and return TRUE. If not, return FALSE.
- * Must be called from a worker thread. Does not block.
+/* See if work can be dequeued from the current worker thread's device queue.
+ * If so, let the scheduler fill the batch with it and return TRUE. If not,
+ * return FALSE. Must be called from a worker thread. Does not block.
  */
 
-  return mq_dequeue(dp->id, m_dst, ipc_status);
+  return sched_next(dp->id, bp);
 }
 
 /*===========================================================================*
  *				dequeue					     *
  *===========================================================================*/
-static int dequeue(device_t *dp, worker_t *wp, message *m_dst,
-  int *ipc_status)
+static int dequeue(device_t *dp, worker_t *wp, sched_batch_t *bp)
 {
-/* Dequeue a message from the current worker thread's device queue. Block the
+/* Dequeue work from the current worker thread's device queue. Block the
  * current thread if necessary. Must be called from a worker thread. Either
- * succeeds with a message (TRUE) or indicates that the thread should be
+ * succeeds with a batch (TRUE) or indicates that the thread should be
  * terminated (FALSE).
  */
 
@@ -111,7 +108,7 @@ static int dequeue(device_t *dp, worker_t *wp, message *m_dst,
 	 */
 	if (!running || wp->worker_id >= dp->workers)
 		return FALSE;
-  } while (!try_dequeue(dp, m_dst, ipc_status));
+  } while (!try_dequeue(dp, bp));
 
   return TRUE;
 }
@@ -149,8 +146,9 @@ static void *worker_thread(void *param)
   worker_t *wp;
   device_t *dp;
   thread_id_t tid;
-  message m;
-  int ipc_status, r;
+  sched_batch_t batch;
+  struct mq_cell *cell;
+  int i;
 
   wp = (worker_t *) param;
   assert(wp != NULL);
@@ -163,28 +161,39 @@ static void *worker_thread(void *param)
   while (running && wp->worker_id < dp->workers) {
 
 	/* See if a new message is available right away. */
-	if (!try_dequeue(dp, &m, &ipc_status)) {
+	if (!try_dequeue(dp, &batch)) {
 
 		/* If not, block waiting for a new message or a thread
 		 * termination event.
 		 */
-		if (!dequeue(dp, wp, &m, &ipc_status))
+		if (!dequeue(dp, wp, &batch))
 			break;
 	}
 
+	cell = batch.cell[0];
+
 	/* Even if the thread was stopped before, a new message resumes it. */
 	wp->state = STATE_BUSY;
 
 	/* If the request is a transfer request, we acquire the read barrier
 	 * lock. Otherwise, we acquire the write lock.
 	 */
-	if (is_transfer_req(m.m_type))
+	if (is_transfer_req(cell->mess.m_type))
 		mthread_rwlock_rdlock(&dp->barrier);
 	else
 		mthread_rwlock_wrlock(&dp->barrier);
 
-	/* Handle the request and send a reply. */
-	blockdriver_process_on_thread(bdtab, &m, ipc_status, tid);
+	/* Handle the request(s) and send the replies. The cells are ours now.
+	 * A batch with its I/O vectors copied in makes up a single transfer.
+	 */
+	if (batch.nr_req > 0)
+		blockdriver_process_batch(bdtab, &batch, tid);
+	else
+		blockdriver_process_on_thread(bdtab, &cell->mess,
+			cell->ipc_status, tid);
+
+	for (i = 0; i < batch.count; i++)
+		mq_free(batch.cell[i]);
 
 	/* Switch the thread back to running state, and unlock the barrier. */
 	wp->state = STATE_RUNNING;
@@ -274,17 +283,22 @@ static void master_handle_exits(void)
 /*===========================================================================*
  *				master_handle_message			     *
  *===========================================================================*/
-static void master_handle_message(message *m_ptr, int ipc_status)
+static void master_handle_message(struct mq_cell *cell)
 {
 /* For real request messages, query the device ID, start a thread if none is
  * free and the maximum number of threads for that device has not yet been
- * reached, and enqueue the message in the devices's message queue. All other
- * messages are handled immediately from the main thread.
+ * reached, and enqueue the message cell in the devices's message queue. All
+ * other messages are handled immediately from the main thread. Any cell that
+ * does not end up in a queue is freed.
  */
+  message *m_ptr;
   device_id_t id;
   worker_t *wp;
   device_t *dp;
-  int r, wid;
+  int r, wid, ipc_status;
+
+  m_ptr = &cell->mess;
+  ipc_status = cell->ipc_status;
 
   /* If this is not a block driver request, we cannot get the minor device
    * associated with it, and thus we can not tell which thread should process
@@ -294,6 +308,8 @@ static void master_handle_message(message *m_ptr, int ipc_status)
 	/* Process as 'other' message. */
 	blockdriver_process_on_thread(bdtab, m_ptr, ipc_status, MAIN_THREAD);
 
+	mq_free(cell);
+
 	return;
   }
 
@@ -302,6 +318,8 @@ static void master_handle_message(message *m_ptr, int ipc_status)
   if (r != OK) {
 	blockdriver_reply(m_ptr, ipc_status, r);
 
+	mq_free(cell);
+
 	return;
   }
 
@@ -327,8 +345,14 @@ static void master_handle_message(message *m_ptr, int ipc_status)
 		master_create_worker(wp, wid, dp->id);
   }
 
-  /* Enqueue the message at the device queue. */
-  enqueue(dp, m_ptr, ipc_status);
+  /* Enqueue the message at the device queue. If the queue is full, the
+   * caller is told to try again later.
+   */
+  if (!enqueue(dp, cell)) {
+	blockdriver_reply(m_ptr, ipc_status, EAGAIN);
+
+	mq_free(cell);
+  }
 }
 
 /*===========================================================================*
@@ -402,8 +426,8 @@ void blockdriver_mt_task(struct blockdriver *driver_tab)
 {
 /* The multithreaded driver task.
  */
-  int ipc_status, i;
-  message mess;
+  struct mq_cell *cell;
+  int i;
 
   /* Initialize first if necessary. */
   if (!running) {
@@ -414,11 +438,14 @@ void blockdriver_mt_task(struct blockdriver *driver_tab)
 
   /* The main message loop. */
   while (running) {
-	/* Receive a message. */
-	blockdriver_mt_receive(&mess, &ipc_status);
+	/* Receive a message, straight into a message queue cell. */
+	if ((cell = mq_alloc()) == NULL)
+		panic("blockdriver_mt: out of memory for message queue");
+
+	blockdriver_mt_receive(&cell->mess, &cell->ipc_status);
 
 	/* Dispatch the message. */
-	master_handle_message(&mess, ipc_status);
+	master_handle_message(cell);
 
 	/* Let other threads run. */
 	mthread_yield_all();
@@ -507,3 +534,15 @@ void blockdriver_mt_set_workers(device_id_t id, int workers)
 
   dp->workers = workers;
 }
+
+/*===========================================================================*
+ *				blockdriver_mt_set_sched		     *
+ *===========================================================================*/
+int blockdriver_mt_set_sched(const char *name)
+{
+/* Select the policy by which worker threads take requests from their device
+ * queue: "fifo" (the default), "merge", "sort", or "deadline".
+ */
+
+  return sched_set(name);
+}
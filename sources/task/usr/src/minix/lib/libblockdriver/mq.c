@@ -1,46 +1,192 @@
 /* This file contains a simple message queue implementation to support both
  * the singlethread and the multithreaded driver implementation.
  *
+ * Message cells are allocated in chunks as the queues grow, and are kept for
+ * reuse afterwards. The queue of each device is bounded by MQ_DEV_MAX cells.
+ * The multithreaded driver receives messages straight into cells, and passes
+ * the cells themselves on to the worker threads, so that no message is
+ * copied along the way.
+ *
  * Changes:
  *   Oct 27, 2011   rewritten to use sys/queue.h (D.C. van Moolenbroek)
  *   Aug 27, 2011   integrated into libblockdriver (A. Welzel)
  */
 
 #include <minix/blockdriver_mt.h>
+#include <minix/btrace.h>
+#include <minix/minlib.h>
 #include <sys/queue.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "const.h"
 #include "mq.h"
 
-#define MQ_SIZE		128
+#define MQ_CHUNK	64	/* number of cells allocated at once */
+#define MQ_DEV_MAX	1024	/* maximum number of cells queued per device */
 
-struct mq_cell {
-  message mess;
-  int ipc_status;
-  STAILQ_ENTRY(mq_cell) next;
-};
+static TAILQ_HEAD(queue, mq_cell) queue[MAX_DEVICES];
+static TAILQ_HEAD(free_list, mq_cell) free_list;
 
-static struct mq_cell pool[MQ_SIZE];
-static STAILQ_HEAD(queue, mq_cell) queue[MAX_DEVICES];
-static STAILQ_HEAD(free_list, mq_cell) free_list;
+static btrace_mqstats stats[MAX_DEVICES];
+static u32_t nr_cells = 0;
 
 /*===========================================================================*
  *				mq_init					     *
  *===========================================================================*/
 void mq_init(void)
 {
-/* Initialize the message queues and message cells.
+/* Initialize the message queues. Upon reinitialization, any cells left in the
+ * queues are returned to the free list.
  */
+  struct mq_cell *cell;
   int i;
 
-  STAILQ_INIT(&free_list);
+  if (nr_cells == 0)
+	TAILQ_INIT(&free_list);
+
+  for (i = 0; i < MAX_DEVICES; i++) {
+	if (nr_cells > 0) {
+		while ((cell = TAILQ_FIRST(&queue[i])) != NULL) {
+			TAILQ_REMOVE(&queue[i], cell, next);
+			TAILQ_INSERT_HEAD(&free_list, cell, next);
+		}
+	}
+
+	TAILQ_INIT(&queue[i]);
+
+	memset(&stats[i], 0, sizeof(stats[i]));
+	stats[i].limit = MQ_DEV_MAX;
+  }
+}
+
+/*===========================================================================*
+ *				mq_alloc				     *
+ *===========================================================================*/
+struct mq_cell *mq_alloc(void)
+{
+/* Take a cell from the free list, allocating more cells if the list is empty.
+ * The caller owns the cell until it passes it to mq_put() or mq_free(). Return
+ * NULL if no memory is left.
+ */
+  struct mq_cell *cell;
+  int i;
+
+  if (TAILQ_EMPTY(&free_list)) {
+	if ((cell = malloc(MQ_CHUNK * sizeof(*cell))) == NULL)
+		return NULL;
+
+	for (i = 0; i < MQ_CHUNK; i++)
+		TAILQ_INSERT_HEAD(&free_list, &cell[i], next);
+
+	nr_cells += MQ_CHUNK;
+  }
+
+  cell = TAILQ_FIRST(&free_list);
+  TAILQ_REMOVE(&free_list, cell, next);
+
+  return cell;
+}
+
+/*===========================================================================*
+ *				mq_free					     *
+ *===========================================================================*/
+void mq_free(struct mq_cell *cell)
+{
+/* Return a cell owned by the caller to the free list.
+ */
+
+  TAILQ_INSERT_HEAD(&free_list, cell, next);
+}
+
+/*===========================================================================*
+ *				mq_put					     *
+ *===========================================================================*/
+int mq_put(device_id_t device_id, struct mq_cell *cell)
+{
+/* Add a cell owned by the caller to the message queue of a device. Return
+ * TRUE iff the cell was added, in which case the queue now owns it. If the
+ * queue of the device is full, the caller keeps the cell.
+ */
+
+  assert(device_id >= 0 && device_id < MAX_DEVICES);
+
+  if (stats[device_id].depth == MQ_DEV_MAX) {
+	stats[device_id].overflows++;
+
+	return FALSE;
+  }
+
+  read_tsc_64(&cell->stamp);
+
+  TAILQ_INSERT_TAIL(&queue[device_id], cell, next);
+
+  stats[device_id].enqueued++;
+  if (++stats[device_id].depth > stats[device_id].max_depth)
+	stats[device_id].max_depth = stats[device_id].depth;
+
+  return TRUE;
+}
+
+/*===========================================================================*
+ *				mq_first				     *
+ *===========================================================================*/
+struct mq_cell *mq_first(device_id_t device_id)
+{
+/* Return the oldest cell in the message queue of a device, leaving it in the
+ * queue, or NULL if the queue is empty.
+ */
+
+  assert(device_id >= 0 && device_id < MAX_DEVICES);
+
+  return TAILQ_FIRST(&queue[device_id]);
+}
+
+/*===========================================================================*
+ *				mq_next					     *
+ *===========================================================================*/
+struct mq_cell *mq_next(struct mq_cell *cell)
+{
+/* Return the cell queued after the given one, or NULL if there is none.
+ */
+
+  return TAILQ_NEXT(cell, next);
+}
+
+/*===========================================================================*
+ *				mq_remove				     *
+ *===========================================================================*/
+void mq_remove(device_id_t device_id, struct mq_cell *cell)
+{
+/* Remove a cell from the message queue of a device, and hand it to the
+ * caller, who must pass it to mq_free() when done with it.
+ */
+
+  assert(device_id >= 0 && device_id < MAX_DEVICES);
+
+  TAILQ_REMOVE(&queue[device_id], cell, next);
+
+  stats[device_id].depth--;
+}
+
+/*===========================================================================*
+ *				mq_get					     *
+ *===========================================================================*/
+struct mq_cell *mq_get(device_id_t device_id)
+{
+/* Remove the first cell from the message queue of a device, and hand it to
+ * the caller, who must pass it to mq_free() when done with it. Return NULL if
+ * the queue is empty.
+ */
+  struct mq_cell *cell;
+
+  if ((cell = mq_first(device_id)) == NULL)
+	return NULL;
 
-  for (i = 0; i < MAX_DEVICES; i++)
-	STAILQ_INIT(&queue[i]);
+  mq_remove(device_id, cell);
 
-  for (i = 0; i < MQ_SIZE; i++)
-	STAILQ_INSERT_HEAD(&free_list, &pool[i], next);
+  return cell;
 }
 
 /*===========================================================================*
@@ -54,18 +200,17 @@ int mq_enqueue(device_id_t device_id, const message *mess,
  */
   struct mq_cell *cell;
 
-  assert(device_id >= 0 && device_id < MAX_DEVICES);
-
-  if (STAILQ_EMPTY(&free_list))
+  if ((cell = mq_alloc()) == NULL)
 	return FALSE;
 
-  cell = STAILQ_FIRST(&free_list);
-  STAILQ_REMOVE_HEAD(&free_list, next);
-
   cell->mess = *mess;
   cell->ipc_status = ipc_status;
 
-  STAILQ_INSERT_TAIL(&queue[device_id], cell, next);
+  if (!mq_put(device_id, cell)) {
+	mq_free(cell);
+
+	return FALSE;
+  }
 
   return TRUE;
 }
@@ -80,18 +225,27 @@ int mq_dequeue(device_id_t device_id, message *mess, int *ipc_status)
  */
   struct mq_cell *cell;
 
-  assert(device_id >= 0 && device_id < MAX_DEVICES);
-
-  if (STAILQ_EMPTY(&queue[device_id]))
+  if ((cell = mq_get(device_id)) == NULL)
 	return FALSE;
 
-  cell = STAILQ_FIRST(&queue[device_id]);
-  STAILQ_REMOVE_HEAD(&queue[device_id], next);
-
   *mess = cell->mess;
   *ipc_status = cell->ipc_status;
 
-  STAILQ_INSERT_HEAD(&free_list, cell, next);
+  mq_free(cell);
 
   return TRUE;
 }
+
+/*===========================================================================*
+ *				mq_getstats				     *
+ *===========================================================================*/
+void mq_getstats(device_id_t device_id, btrace_mqstats *mqstats)
+{
+/* Return the queue statistics of a device.
+ */
+
+  assert(device_id >= 0 && device_id < MAX_DEVICES);
+
+  *mqstats = stats[device_id];
+  mqstats->cells = nr_cells;
+}
@@ -1,9 +1,27 @@
 #ifndef _BLOCKDRIVER_MQ_H
 #define _BLOCKDRIVER_MQ_H
 
+#include <sys/queue.h>
+#include <minix/btrace.h>
+
+struct mq_cell {
+  message mess;
+  int ipc_status;
+  u64_t stamp;			/* TSC time at which the cell was queued */
+  TAILQ_ENTRY(mq_cell) next;
+};
+
 void mq_init(void);
+struct mq_cell *mq_alloc(void);
+void mq_free(struct mq_cell *cell);
+int mq_put(device_id_t device_id, struct mq_cell *cell);
+struct mq_cell *mq_get(device_id_t device_id);
+struct mq_cell *mq_first(device_id_t device_id);
+struct mq_cell *mq_next(struct mq_cell *cell);
+void mq_remove(device_id_t device_id, struct mq_cell *cell);
 int mq_enqueue(device_id_t device_id, const message *mess, int
 	ipc_status);
 int mq_dequeue(device_id_t device_id, message *mess, int *ipc_status);
+void mq_getstats(device_id_t device_id, btrace_mqstats *mqstats);
 
 #endif /* _BLOCKDRIVER_MQ_H */
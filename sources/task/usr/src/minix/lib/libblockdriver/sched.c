@@ -0,0 +1,351 @@
+/* This file contains the request scheduler of the multithreaded driver. Of the
+ * requests queued for a device, it decides which one a worker thread takes
+ * next, and it may merge adjacent vector requests into a single transfer.
+ *
+ * The following policies are available:
+ *   fifo:	requests are taken in order of arrival (the default)
+ *   merge:	as fifo, but adjacent requests are merged
+ *   sort:	transfers are taken in order of minor and position, sweeping
+ *		across the device in one direction; adjacent requests are merged
+ *   deadline:	as sort, but a read that has waited longer than its deadline
+ *		is taken first
+ *
+ * Transfers are never moved across other requests (open, close, ioctl), as
+ * the worker threads treat those as barriers. Only vector requests of the same
+ * type, minor device, caller and flags are merged, and only if their positions
+ * and sizes are multiples of the sector size, so that a merged transfer is no
+ * less valid to the driver than the requests it is made of.
+ *
+ * The entry points into this file are:
+ *   sched_set:		select a policy by name
+ *   sched_next:	take the next request, or merged requests, off a queue
+ */
+
+#include <minix/blockdriver_mt.h>
+#include <minix/sysutil.h>
+#include <minix/minlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "const.h"
+#include "mq.h"
+#include "sched.h"
+
+#define SCHED_READ_EXPIRE	100	/* read deadline, in milliseconds */
+#define SCHED_MERGE_BYTES	(128 * 1024)	/* max size of merged transfer */
+
+static struct mq_cell *pick_fifo(device_id_t device_id);
+static struct mq_cell *pick_sort(device_id_t device_id);
+static struct mq_cell *pick_deadline(device_id_t device_id);
+
+static const struct {
+  const char *name;
+  struct mq_cell *(*pick)(device_id_t device_id);
+  int merge;
+} policies[] = {
+  { "fifo",	pick_fifo,	FALSE	},
+  { "merge",	pick_fifo,	TRUE	},
+  { "sort",	pick_sort,	TRUE	},
+  { "deadline",	pick_deadline,	TRUE	},
+};
+
+static int policy = 0;
+
+/* Per device, the minor and position of the last transfer taken. */
+static struct {
+  devminor_t minor;
+  u64_t pos;
+} head[MAX_DEVICES];
+
+static u64_t read_expire = 0;	/* read deadline, in TSC cycles */
+
+/*===========================================================================*
+ *				is_transfer				     *
+ *===========================================================================*/
+static int is_transfer(const message *m_ptr)
+{
+/* Return whether the given message is a transfer request.
+ */
+
+  switch (m_ptr->m_type) {
+  case BDEV_READ:
+  case BDEV_WRITE:
+  case BDEV_GATHER:
+  case BDEV_SCATTER:
+	return TRUE;
+
+  default:
+	return FALSE;
+  }
+}
+
+/*===========================================================================*
+ *				is_before				     *
+ *===========================================================================*/
+static int is_before(const message *m_ptr, devminor_t minor, u64_t pos)
+{
+/* Return whether the given transfer request lies before the given minor and
+ * position.
+ */
+
+  if (m_ptr->m_lbdev_lblockdriver_msg.minor != minor)
+	return m_ptr->m_lbdev_lblockdriver_msg.minor < minor;
+
+  return m_ptr->m_lbdev_lblockdriver_msg.pos < pos;
+}
+
+/*===========================================================================*
+ *				pick_fifo				     *
+ *===========================================================================*/
+static struct mq_cell *pick_fifo(device_id_t device_id)
+{
+/* Pick the oldest request.
+ */
+
+  return mq_first(device_id);
+}
+
+/*===========================================================================*
+ *				pick_sort				     *
+ *===========================================================================*/
+static struct mq_cell *pick_sort(device_id_t device_id)
+{
+/* Pick the transfer that comes first at or after the last one taken, or, if
+ * there is none, the one that comes first overall. Only the transfers queued
+ * before any other request are considered.
+ */
+  struct mq_cell *cell, *next, *lowest;
+  message *m_ptr;
+
+  cell = mq_first(device_id);
+
+  if (cell == NULL || !is_transfer(&cell->mess))
+	return cell;
+
+  next = lowest = NULL;
+
+  for ( ; cell != NULL && is_transfer(&cell->mess); cell = mq_next(cell)) {
+	m_ptr = &cell->mess;
+
+	if (lowest == NULL || is_before(m_ptr,
+		lowest->mess.m_lbdev_lblockdriver_msg.minor,
+		lowest->mess.m_lbdev_lblockdriver_msg.pos))
+		lowest = cell;
+
+	if (is_before(m_ptr, head[device_id].minor, head[device_id].pos))
+		continue;
+
+	if (next == NULL || is_before(m_ptr,
+		next->mess.m_lbdev_lblockdriver_msg.minor,
+		next->mess.m_lbdev_lblockdriver_msg.pos))
+		next = cell;
+  }
+
+  return (next != NULL) ? next : lowest;
+}
+
+/*===========================================================================*
+ *				pick_deadline				     *
+ *===========================================================================*/
+static struct mq_cell *pick_deadline(device_id_t device_id)
+{
+/* Pick the oldest read if it has waited past its deadline, and otherwise pick
+ * a transfer as in sorted order.
+ */
+  struct mq_cell *cell;
+  u64_t now;
+
+  if (read_expire == 0)
+	read_expire = (u64_t) SCHED_READ_EXPIRE * tsc_get_khz();
+
+  read_tsc_64(&now);
+
+  for (cell = mq_first(device_id); cell != NULL && is_transfer(&cell->mess);
+	cell = mq_next(cell)) {
+	if (cell->mess.m_type != BDEV_READ && cell->mess.m_type != BDEV_GATHER)
+		continue;
+
+	if (now - cell->stamp > read_expire)
+		return cell;
+
+	break;
+  }
+
+  return pick_sort(device_id);
+}
+
+/*===========================================================================*
+ *				copy_vector				     *
+ *===========================================================================*/
+static int copy_vector(sched_batch_t *bp, struct mq_cell *cell, size_t total)
+{
+/* Copy in the I/O vector of a vector request, appending it to the vectors of
+ * the batch, and add the request to the batch. Return FALSE, leaving the batch
+ * as it was, if the vector cannot be copied or is not fit for merging.
+ */
+  message *m_ptr;
+  unsigned int nr_req;
+  size_t size;
+  int i;
+
+  m_ptr = &cell->mess;
+  nr_req = m_ptr->m_lbdev_lblockdriver_msg.count;
+
+  if (nr_req == 0 || nr_req > NR_IOREQS - bp->nr_req)
+	return FALSE;
+
+  if (sys_safecopyfrom(m_ptr->m_source, m_ptr->m_lbdev_lblockdriver_msg.grant,
+	0, (vir_bytes) &bp->iovec[bp->nr_req],
+	nr_req * sizeof(bp->iovec[0])) != OK)
+	return FALSE;
+
+  for (i = size = 0; i < nr_req; i++) {
+	if (size + bp->iovec[bp->nr_req + i].iov_size < size)
+		return FALSE;
+	size += bp->iovec[bp->nr_req + i].iov_size;
+  }
+
+  if (size == 0 || size % SECTOR_SIZE != 0 ||
+	size > SCHED_MERGE_BYTES - total)
+	return FALSE;
+
+  bp->nr_req += nr_req;
+  bp->cell[bp->count] = cell;
+  bp->size[bp->count] = size;
+  bp->count++;
+
+  return TRUE;
+}
+
+/*===========================================================================*
+ *				may_merge				     *
+ *===========================================================================*/
+static int may_merge(const message *m1, const message *m2)
+{
+/* Return whether the second vector request may be merged into the first one,
+ * disregarding position.
+ */
+
+  return m1->m_type == m2->m_type && m1->m_source == m2->m_source &&
+	m1->m_lbdev_lblockdriver_msg.minor ==
+	m2->m_lbdev_lblockdriver_msg.minor &&
+	m1->m_lbdev_lblockdriver_msg.flags ==
+	m2->m_lbdev_lblockdriver_msg.flags &&
+	m2->m_lbdev_lblockdriver_msg.pos % SECTOR_SIZE == 0;
+}
+
+/*===========================================================================*
+ *				merge					     *
+ *===========================================================================*/
+static void merge(device_id_t device_id, sched_batch_t *bp)
+{
+/* Merge queued requests that follow on the first request of the batch into
+ * the batch, for as long as they are adjacent.
+ */
+  struct mq_cell *cell;
+  message *m_ptr;
+  size_t total;
+
+  m_ptr = &bp->cell[0]->mess;
+
+  if ((m_ptr->m_type != BDEV_GATHER && m_ptr->m_type != BDEV_SCATTER) ||
+	m_ptr->m_lbdev_lblockdriver_msg.pos % SECTOR_SIZE != 0)
+	return;
+
+  /* Do not bother copying in the vector unless a later request is queued. */
+  for (cell = mq_first(device_id); cell != NULL && is_transfer(&cell->mess);
+	cell = mq_next(cell)) {
+	if (may_merge(m_ptr, &cell->mess) &&
+		cell->mess.m_lbdev_lblockdriver_msg.pos >
+		m_ptr->m_lbdev_lblockdriver_msg.pos)
+		break;
+  }
+
+  if (cell == NULL || !is_transfer(&cell->mess))
+	return;
+
+  bp->count = 0;
+
+  if (!copy_vector(bp, bp->cell[0], 0)) {
+	bp->count = 1;
+
+	return;
+  }
+
+  total = bp->size[0];
+
+  while (bp->count < SCHED_MERGE_MAX) {
+	for (cell = mq_first(device_id);
+		cell != NULL && is_transfer(&cell->mess);
+		cell = mq_next(cell)) {
+		if (may_merge(m_ptr, &cell->mess) &&
+			cell->mess.m_lbdev_lblockdriver_msg.pos ==
+			m_ptr->m_lbdev_lblockdriver_msg.pos + total)
+			break;
+	}
+
+	if (cell == NULL || !is_transfer(&cell->mess) ||
+		!copy_vector(bp, cell, total))
+		break;
+
+	mq_remove(device_id, cell);
+
+	total += bp->size[bp->count - 1];
+  }
+}
+
+/*===========================================================================*
+ *				sched_set				     *
+ *===========================================================================*/
+int sched_set(const char *name)
+{
+/* Select the scheduling policy with the given name.
+ */
+  int i;
+
+  for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+	if (!strcmp(policies[i].name, name)) {
+		policy = i;
+
+		return OK;
+	}
+  }
+
+  return EINVAL;
+}
+
+/*===========================================================================*
+ *				sched_next				     *
+ *===========================================================================*/
+int sched_next(device_id_t device_id, sched_batch_t *bp)
+{
+/* Take the next request off the queue of a device, as the policy sees fit,
+ * along with any requests merged into it. Return FALSE if the queue is empty.
+ * The cells of the batch are owned by the caller afterwards.
+ */
+  struct mq_cell *cell;
+  message *m_ptr;
+
+  assert(device_id >= 0 && device_id < MAX_DEVICES);
+
+  if ((cell = policies[policy].pick(device_id)) == NULL)
+	return FALSE;
+
+  mq_remove(device_id, cell);
+
+  bp->cell[0] = cell;
+  bp->count = 1;
+  bp->nr_req = 0;
+
+  m_ptr = &cell->mess;
+
+  if (is_transfer(m_ptr)) {
+	if (policies[policy].merge)
+		merge(device_id, bp);
+
+	head[device_id].minor = m_ptr->m_lbdev_lblockdriver_msg.minor;
+	head[device_id].pos = m_ptr->m_lbdev_lblockdriver_msg.pos;
+  }
+
+  return TRUE;
+}
@@ -0,0 +1,22 @@
+#ifndef _BLOCKDRIVER_SCHED_H
+#define _BLOCKDRIVER_SCHED_H
+
+#define SCHED_MERGE_MAX		16	/* max nr of requests merged into one */
+
+/* A unit of work for a worker thread: either a single request, or a number of
+ * adjacent vector requests merged into one transfer. For a merged transfer,
+ * the I/O vectors of all requests have been copied in already, one after
+ * another, and size[i] is the number of bytes asked for by request i.
+ */
+typedef struct sched_batch {
+  struct mq_cell *cell[SCHED_MERGE_MAX];
+  size_t size[SCHED_MERGE_MAX];
+  int count;
+  iovec_t iovec[NR_IOREQS];
+  unsigned int nr_req;		/* zero if the vector has not been copied */
+} sched_batch_t;
+
+int sched_set(const char *name);
+int sched_next(device_id_t device_id, sched_batch_t *bp);
+
+#endif /* _BLOCKDRIVER_SCHED_H */
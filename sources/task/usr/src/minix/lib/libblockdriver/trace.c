@@ -1,4 +1,8 @@
-/* This file implements block level tracing support. */
+/* This file implements block level tracing support. Besides the trace buffer,
+ * which is filled only while tracing is enabled, it keeps statistics on the
+ * service times of requests at all times. These cost two TSC reads and a few
+ * counter updates per request.
+ */
 
 #include <minix/drivers.h>
 #include <minix/blockdriver_mt.h>
@@ -8,6 +12,7 @@
 #include <assert.h>
 
 #include "const.h"
+#include "mq.h"
 #include "trace.h"
 
 #define NO_TRACEDEV		((dev_t) -1)
@@ -27,6 +32,17 @@ static u64_t trace_tsc;
  */
 static btrace_entry *trace_ptr[MAX_THREADS + 1] = { NULL };
 
+/* Statistics for each device, and for each thread, the statistics to update
+ * and the start time of the request it is servicing. Like the trace entry
+ * pointers, the statistics pointers are NULL whenever the thread is not
+ * servicing a request for which statistics are kept.
+ */
+static btrace_stats stats[MAX_DEVICES];
+static struct {
+  btrace_hist *hist;
+  u64_t start;
+} stats_ptr[MAX_THREADS + 1];
+
 /*===========================================================================*
  *				trace_gettime				     *
  *===========================================================================*/
@@ -161,6 +177,92 @@ int trace_ctl(dev_t minor, unsigned long request, endpoint_t endpt,
   return EINVAL;
 }
 
+/*===========================================================================*
+ *				trace_mqstats				     *
+ *===========================================================================*/
+int trace_mqstats(device_id_t device_id, endpoint_t endpt, cp_grant_id_t grant)
+{
+/* Copy out the message queue statistics of a device. Unlike request tracing,
+ * these are always kept.
+ */
+  btrace_mqstats mqstats;
+
+  mq_getstats(device_id, &mqstats);
+
+  return sys_safecopyto(endpt, grant, 0, (vir_bytes) &mqstats,
+	sizeof(mqstats));
+}
+
+/*===========================================================================*
+ *				trace_stats				     *
+ *===========================================================================*/
+int trace_stats(device_id_t device_id, endpoint_t endpt, cp_grant_id_t grant)
+{
+/* Copy out the request statistics of a device, along with its message queue
+ * statistics.
+ */
+
+  assert(device_id >= 0 && device_id < MAX_DEVICES);
+
+  mq_getstats(device_id, &stats[device_id].queue);
+
+  return sys_safecopyto(endpt, grant, 0, (vir_bytes) &stats[device_id],
+	sizeof(stats[device_id]));
+}
+
+/*===========================================================================*
+ *				stats_start				     *
+ *===========================================================================*/
+static void stats_start(thread_id_t id, int req)
+{
+/* Start timing a request serviced by the given thread.
+ */
+  btrace_stats *sp;
+
+  /* Requests are serviced on worker threads only. */
+  if (id >= MAX_THREADS) return;
+
+  sp = &stats[TID_DEVICE(id)];
+  if (++sp->busy > sp->max_busy)
+	sp->max_busy = sp->busy;
+
+  stats_ptr[id].hist = &sp->op[req];
+  read_tsc_64(&stats_ptr[id].start);
+}
+
+/*===========================================================================*
+ *				stats_finish				     *
+ *===========================================================================*/
+static void stats_finish(thread_id_t id, int result)
+{
+/* Finish timing a request, and account for it in the statistics.
+ */
+  btrace_hist *hp;
+  u64_t tsc;
+  u32_t time, t;
+  int i;
+
+  if (id >= MAX_THREADS || (hp = stats_ptr[id].hist) == NULL) return;
+
+  read_tsc_64(&tsc);
+  time = tsc_64_to_micros(tsc - stats_ptr[id].start);
+
+  stats[TID_DEVICE(id)].busy--;
+
+  hp->count++;
+  if (result < 0)
+	hp->errors++;
+  hp->total_time += time;
+  if (time > hp->max_time)
+	hp->max_time = time;
+
+  for (i = 0, t = time; t > 0 && i < BTHIST_BUCKETS - 1; i++)
+	t >>= 1;
+  hp->hist[i]++;
+
+  stats_ptr[id].hist = NULL;
+}
+
 /*===========================================================================*
  *				trace_start				     *
  *===========================================================================*/
@@ -174,13 +276,8 @@ void trace_start(thread_id_t id, message *m_ptr)
   size_t size;
   int flags;
 
-  if (!trace_enabled || trace_dev != m_ptr->m_lbdev_lblockdriver_msg.minor) return;
-
   assert(id >= 0 && id < MAX_THREADS + 1);
 
-  if (trace_pos == trace_size)
-	return;
-
   switch (m_ptr->m_type) {
   case BDEV_OPEN:	req = BTREQ_OPEN;	break;
   case BDEV_CLOSE:	req = BTREQ_CLOSE;	break;
@@ -221,6 +318,8 @@ void trace_start(thread_id_t id, message *m_ptr)
 	case BIOCTRACEBUF:
 	case BIOCTRACECTL:
 	case BIOCTRACEGET:
+	case BIOCTRACEQ:
+	case BIOCTRACESTATS:
 		return;
 	}
 
@@ -231,6 +330,14 @@ void trace_start(thread_id_t id, message *m_ptr)
 	return;
   }
 
+  stats_start(id, req);
+
+  if (!trace_enabled || trace_dev != m_ptr->m_lbdev_lblockdriver_msg.minor)
+	return;
+
+  if (trace_pos == trace_size)
+	return;
+
   entry = &trace_buf[trace_pos];
   entry->request = req;
   entry->size = size;
@@ -271,10 +378,12 @@ void trace_finish(thread_id_t id, int result)
  */
   btrace_entry *entry;
 
-  if (!trace_enabled) return;
-
   assert(id >= 0 && id < MAX_THREADS + 1);
 
+  stats_finish(id, result);
+
+  if (!trace_enabled) return;
+
   if ((entry = trace_ptr[id]) == NULL) return;
 
   entry->result = result;
@@ -4,6 +4,11 @@
 int trace_ctl(dev_t minor, unsigned long request, endpoint_t endpt,
 	cp_grant_id_t grant);
 
+int trace_mqstats(device_id_t device_id, endpoint_t endpt,
+	cp_grant_id_t grant);
+int trace_stats(device_id_t device_id, endpoint_t endpt,
+	cp_grant_id_t grant);
+
 void trace_start(thread_id_t thread_id, message *m_ptr);
 void trace_setsize(thread_id_t thread_id, size_t size);
 void trace_finish(thread_id_t thread_id, int r);
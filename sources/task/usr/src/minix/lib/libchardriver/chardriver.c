@@ -52,8 +52,12 @@
 static int running;
 
 /* Management data for opened devices. */
-static devminor_t open_devs[MAX_NR_OPEN_DEVICES];
-static int next_open_devs_slot = 0;
+static struct minor_set open_devs;
+
+/* Receive batching. Batching is off while the budget is at most one. */
+static int batch_budget = 0;
+static int batching;
+static struct chardriver_batch_stats batch_stats;
 
 /*===========================================================================*
  *				clear_open_devs				     *
@@ -61,7 +65,7 @@ static int next_open_devs_slot = 0;
 static void clear_open_devs(void)
 {
 /* Reset the set of previously opened minor devices. */
-  next_open_devs_slot = 0;
+  minor_set_clear(&open_devs);
 }
 
 /*===========================================================================*
@@ -70,13 +74,7 @@ static void clear_open_devs(void)
 static int is_open_dev(devminor_t minor)
 {
 /* Check whether the given minor device has previously been opened. */
-  int i;
-
-  for (i = 0; i < next_open_devs_slot; i++)
-	if (open_devs[i] == minor)
-		return TRUE;
-
-  return FALSE;
+  return minor_set_has(&open_devs, minor);
 }
 
 /*===========================================================================*
@@ -86,11 +84,8 @@ static void set_open_dev(devminor_t minor)
 {
 /* Mark the given minor device as having been opened. */
 
-  if (next_open_devs_slot >= MAX_NR_OPEN_DEVICES)
+  if (minor_set_add(&open_devs, minor) != OK)
 	panic("out of slots for open devices");
-
-  open_devs[next_open_devs_slot] = minor;
-  next_open_devs_slot++;
 }
 
 /*===========================================================================*
@@ -179,8 +174,15 @@ static void send_reply(endpoint_t endpt, message *m_ptr, int ipc_status)
 /* Send a reply message to a request. */
   int r;
 
+  /* While batching, all replies go into the asynsend table, to be sent with
+   * one ipc_senda() at the end of the batch. A reply to SENDREC must satisfy
+   * the caller's receive, so it is not marked AMF_NOREPLY.
+   */
+  if (batching)
+	r = asynsend3(endpt, m_ptr,
+		IPC_STATUS_CALL(ipc_status) == SENDREC ? 0 : AMF_NOREPLY);
   /* If we would block sending the message, send it asynchronously. */
-  if (IPC_STATUS_CALL(ipc_status) == SENDREC)
+  else if (IPC_STATUS_CALL(ipc_status) == SENDREC)
 	r = ipc_sendnb(endpt, m_ptr);
   else
 	r = asynsend3(endpt, m_ptr, AMF_NOREPLY);
@@ -541,6 +543,70 @@ void chardriver_terminate(void)
   sef_cancel();
 }
 
+/*===========================================================================*
+ *				chardriver_set_batch			     *
+ *===========================================================================*/
+void chardriver_set_batch(int budget)
+{
+/* Set the number of messages that chardriver_task() may handle per blocking
+ * receive. A budget of one or less turns batching off.
+ */
+
+  if (budget > CHARDRIVER_BATCH_MAX)
+	budget = CHARDRIVER_BATCH_MAX;
+
+  batch_budget = budget;
+}
+
+/*===========================================================================*
+ *				chardriver_get_batch_stats		     *
+ *===========================================================================*/
+void chardriver_get_batch_stats(struct chardriver_batch_stats *stats)
+{
+/* Return the batch sizes achieved so far. */
+
+  *stats = batch_stats;
+}
+
+/*===========================================================================*
+ *				do_batch				     *
+ *===========================================================================*/
+static void do_batch(struct chardriver *cdp, message *m_ptr, int ipc_status)
+{
+/* Process the given message, and then any further messages that are already
+ * pending, up to the batch budget. The replies to all of them are sent to the
+ * kernel in one go at the end. A live update prepared from within the receive
+ * call sends them before the state is saved, so none are lost.
+ */
+  int r, count;
+
+  asyn_defer();
+  batching = TRUE;
+
+  for (count = 1; ; count++) {
+	chardriver_process(cdp, m_ptr, ipc_status);
+
+	if (!running || count == batch_budget)
+		break;
+
+	if ((r = sef_receive_status_nb(ANY, m_ptr, &ipc_status)) != OK) {
+		if (r == ENOTREADY || (r == EINTR && !running))
+			break;
+
+		panic("chardriver: sef_receive_status_nb failed: %d", r);
+	}
+  }
+
+  batching = FALSE;
+
+  if ((r = asyn_flush()) != OK)
+	printf("chardriver: unable to send replies: %d\n", r);
+
+  batch_stats.cbs_batches++;
+  batch_stats.cbs_messages += count;
+  batch_stats.cbs_sizes[count - 1]++;
+}
+
 /*===========================================================================*
  *				chardriver_task				     *
  *===========================================================================*/
@@ -553,7 +619,8 @@ void chardriver_task(struct chardriver *cdp)
   running = TRUE;
 
   /* Here is the main loop of the character driver task.  It waits for a
-   * message, carries it out, and sends a reply.
+   * message, carries it out, and sends a reply. With batching on, it also
+   * carries out whatever other messages arrived in the meantime.
    */
   while (running) {
 	if ((r = sef_receive_status(ANY, &mess, &ipc_status)) != OK) {
@@ -563,7 +630,10 @@ void chardriver_task(struct chardriver *cdp)
 		panic("chardriver: sef_receive_status failed: %d", r);
 	}
 
-	chardriver_process(cdp, &mess, ipc_status);
+	if (batch_budget > 1)
+		do_batch(cdp, &mess, ipc_status);
+	else
+		chardriver_process(cdp, &mess, ipc_status);
   }
 }
 
@@ -0,0 +1,866 @@
+/* This file contains the multithreaded character driver interface.
+ *
+ * The entry points into this file are:
+ *   chardriver_mt_task:	the main message loop of the driver
+ *   chardriver_mt_terminate:	break out of the main message loop
+ *   chardriver_mt_sleep:	put the current thread to sleep
+ *   chardriver_mt_wakeup:	wake up a sleeping thread
+ *   chardriver_mt_set_workers:	set the number of worker threads of a minor
+ *   chardriver_mt_get_tid:	return the ID of the current thread
+ *
+ * Requests are queued per minor device, and each queue is served by its own
+ * worker threads, so that a request that sleeps only holds up other requests
+ * for the same minor. By default a minor has one worker, and its requests are
+ * processed one at a time, in order. A driver that can handle requests on the
+ * same minor concurrently opts in with chardriver_mt_set_workers(). Open and
+ * close requests never run concurrently with other requests on their minor.
+ *
+ * A minor is served by one device for as long as it has requests queued or in
+ * progress. If more minors are busy than there are devices, the extra minors
+ * share devices, and a minor on a shared device stays there until it drains.
+ * Once every device is shared by MAX_SHARERS minors, requests for yet another
+ * minor are refused with EAGAIN.
+ *
+ * The threads are not preemptive: a worker only gives way to others when it
+ * sleeps, or otherwise blocks on a libmthread primitive.
+ */
+
+#include <minix/chardriver_mt.h>
+#include <minix/mthread.h>
+#include <sys/queue.h>
+#include <stdlib.h>
+#include <assert.h>
+
+/* Thread stack size. Character drivers tend to keep request buffers on the
+ * stack.
+ */
+#define STACK_SIZE	32768
+
+/* Maximum number of minors served apart at the same time. */
+#define MAX_DEVICES	CHARDRIVER_MAX_DEVICES
+
+/* The maximum number of minors sharing one device. */
+#define MAX_SHARERS	8
+
+/* The maximum number of worker threads per minor. */
+#define MAX_WORKERS	8
+
+#define MAX_THREADS	(MAX_DEVICES * MAX_WORKERS)	/* max nr of threads */
+
+/* Queue cells are allocated in chunks as needed. Once MQ_MAX cells are in
+ * use, further requests are refused with EAGAIN, except for open and close
+ * requests, whose number is bounded by the files VFS has open.
+ */
+#define MQ_CHUNK	32	/* number of cells allocated at once */
+#define MQ_MAX		1024	/* max nr of requests queued altogether */
+
+/* A thread ID is composed of a device ID and a per-device worker thread ID.
+ * All thread IDs must be in the range 0..(MAX_THREADS-1) inclusive.
+ */
+#define MAKE_TID(did, wid)	((did) * MAX_WORKERS + (wid))
+#define TID_DEVICE(tid)		((tid) / MAX_WORKERS)
+#define TID_WORKER(tid)		((tid) % MAX_WORKERS)
+
+typedef int device_id_t;
+typedef int worker_id_t;
+
+typedef enum {
+  STATE_DEAD,
+  STATE_RUNNING,
+  STATE_BUSY,
+  STATE_EXITED
+} worker_state;
+
+/* Structure with information about a worker thread. */
+typedef struct {
+  device_id_t device_id;
+  worker_id_t worker_id;
+  worker_state state;
+  devminor_t minor;		/* minor of the request being processed */
+  mthread_thread_t mthread;
+  mthread_event_t sleep_event;
+} worker_t;
+
+/* A queued request. */
+struct mq_cell {
+  message mess;
+  int ipc_status;
+  devminor_t minor;
+  STAILQ_ENTRY(mq_cell) next;
+};
+
+/* Structure with information about a device, that is, a request queue with
+ * its workers. A device serves one minor at a time, for as long as it has
+ * requests queued or in progress for that minor, unless it is shared. Each
+ * minor served keeps a count of those requests; a device without minors is
+ * idle.
+ */
+typedef struct {
+  device_id_t id;
+  struct {
+	devminor_t minor;
+	int pending;		/* requests queued or in progress */
+  } minors[MAX_SHARERS];
+  int nr_minors;		/* number of minors served */
+  unsigned int workers;
+  worker_t worker[MAX_WORKERS];
+  STAILQ_HEAD(, mq_cell) queue;
+  mthread_event_t queue_event;
+  mthread_rwlock_t barrier;
+} device_t;
+
+/* Minors that have been given more than one worker. */
+static struct {
+  devminor_t minor;
+  int workers;
+} concurrent[MAX_DEVICES];
+static int num_concurrent = 0;
+
+static struct chardriver *cdtab;
+static int running = FALSE;
+
+static mthread_key_t worker_key;
+
+static device_t device[MAX_DEVICES];
+
+static STAILQ_HEAD(, mq_cell) free_list;
+static int nr_used = 0;			/* cells queued right now */
+
+static worker_t *exited[MAX_THREADS];
+static int num_exited = 0;
+
+/*===========================================================================*
+ *				minor_workers				     *
+ *===========================================================================*/
+static int minor_workers(devminor_t minor)
+{
+/* Return the number of worker threads set for the given minor.
+ */
+  int i;
+
+  for (i = 0; i < num_concurrent; i++)
+	if (concurrent[i].minor == minor)
+		return concurrent[i].workers;
+
+  return 1;
+}
+
+/*===========================================================================*
+ *				set_device_workers			     *
+ *===========================================================================*/
+static void set_device_workers(device_t *dp, int workers)
+{
+/* Change the number of worker threads of a device.
+ */
+
+  /* Wake up all threads waiting on a queue event, so that the extra ones
+   * terminate.
+   */
+  if (dp->workers > workers)
+	mthread_event_fire_all(&dp->queue_event);
+
+  dp->workers = workers;
+}
+
+/*===========================================================================*
+ *				is_exclusive_req			     *
+ *===========================================================================*/
+static int is_exclusive_req(int type)
+{
+/* Return whether the given character device request must not run alongside
+ * others on the same minor.
+ */
+
+  switch (type) {
+  case CDEV_OPEN:
+  case CDEV_CLOSE:
+	return TRUE;
+
+  default:
+	return FALSE;
+  }
+}
+
+/*===========================================================================*
+ *				find_minor				     *
+ *===========================================================================*/
+static int find_minor(device_t *dp, devminor_t minor)
+{
+/* Return the index of the given minor in the table of minors served by the
+ * given device, or -1 if the device does not serve the minor.
+ */
+  int i;
+
+  for (i = 0; i < dp->nr_minors; i++)
+	if (dp->minors[i].minor == minor)
+		return i;
+
+  return -1;
+}
+
+/*===========================================================================*
+ *				add_pending				     *
+ *===========================================================================*/
+static void add_pending(device_t *dp, devminor_t minor)
+{
+/* Count one more request for the given minor on the given device. The device
+ * serves the minor already, or has room for it.
+ */
+  int i;
+
+  if ((i = find_minor(dp, minor)) < 0) {
+	assert(dp->nr_minors < MAX_SHARERS);
+
+	i = dp->nr_minors++;
+	dp->minors[i].minor = minor;
+	dp->minors[i].pending = 0;
+  }
+
+  dp->minors[i].pending++;
+}
+
+/*===========================================================================*
+ *				drop_pending				     *
+ *===========================================================================*/
+static void drop_pending(device_t *dp, devminor_t minor)
+{
+/* Count one request less for the given minor on the given device. Once the
+ * minor has none left, the device no longer serves it.
+ */
+  int i;
+
+  i = find_minor(dp, minor);
+  assert(i >= 0 && dp->minors[i].pending > 0);
+
+  if (--dp->minors[i].pending == 0)
+	dp->minors[i] = dp->minors[--dp->nr_minors];
+}
+
+/*===========================================================================*
+ *				get_device				     *
+ *===========================================================================*/
+static device_t *get_device(devminor_t minor)
+{
+/* Return the device to queue a request for the given minor on. That is the
+ * device serving the minor already, or else an idle one. If all devices are
+ * busy, the minor shares one with others. Return NULL if all devices are
+ * shared by as many minors as they can take.
+ */
+  device_t *dp, *idle = NULL;
+  int i;
+
+  /* A minor keeps using the same device until its requests there are done,
+   * so that they are still processed in order, and open and close still
+   * stand alone.
+   */
+  for (i = 0; i < MAX_DEVICES; i++) {
+	dp = &device[i];
+	if (dp->nr_minors == 0) {
+		if (idle == NULL)
+			idle = dp;
+	} else if (find_minor(dp, minor) >= 0)
+		return dp;
+  }
+
+  if (idle != NULL) {
+	set_device_workers(idle, minor_workers(minor));
+
+	return idle;
+  }
+
+  /* Otherwise the minor shares the device it maps to, or else the first one
+   * with room left.
+   */
+  dp = &device[(unsigned int) minor % MAX_DEVICES];
+
+  for (i = 0; dp->nr_minors == MAX_SHARERS; i++) {
+	if (i == MAX_DEVICES)
+		return NULL;
+	dp = &device[i];
+  }
+
+  /* A shared device processes one request at a time, as a minor that shares
+   * it may not have opted in to concurrent requests.
+   */
+  set_device_workers(dp, 1);
+
+  return dp;
+}
+
+/*===========================================================================*
+ *				alloc_cell				     *
+ *===========================================================================*/
+static struct mq_cell *alloc_cell(int type)
+{
+/* Take a cell from the free list for a request of the given type, allocating
+ * more cells if the list is empty. Return NULL if the request has to be
+ * refused.
+ */
+  struct mq_cell *cell;
+  int i;
+
+  if (nr_used >= MQ_MAX && !is_exclusive_req(type))
+	return NULL;
+
+  if (STAILQ_EMPTY(&free_list)) {
+	if ((cell = malloc(MQ_CHUNK * sizeof(*cell))) == NULL)
+		return NULL;
+
+	for (i = 0; i < MQ_CHUNK; i++)
+		STAILQ_INSERT_HEAD(&free_list, &cell[i], next);
+  }
+
+  cell = STAILQ_FIRST(&free_list);
+  STAILQ_REMOVE_HEAD(&free_list, next);
+  nr_used++;
+
+  return cell;
+}
+
+/*===========================================================================*
+ *				free_cell				     *
+ *===========================================================================*/
+static void free_cell(struct mq_cell *cell)
+{
+/* Return a cell to the free list.
+ */
+
+  STAILQ_INSERT_HEAD(&free_list, cell, next);
+  nr_used--;
+}
+
+/*===========================================================================*
+ *				enqueue					     *
+ *===========================================================================*/
+static void enqueue(device_t *dp, struct mq_cell *cell)
+{
+/* Enqueue a cell into the device's queue, and signal the event.
+ * Must be called from the master thread.
+ */
+
+  STAILQ_INSERT_TAIL(&dp->queue, cell, next);
+  add_pending(dp, cell->minor);
+
+  mthread_event_fire(&dp->queue_event);
+}
+
+/*===========================================================================*
+ *				reply_busy				     *
+ *===========================================================================*/
+static void reply_busy(const message *m_ptr)
+{
+/* Refuse a request for which no queue cell is available.
+ */
+  cdev_id_t id;
+
+  if (is_exclusive_req(m_ptr->m_type))
+	id = m_ptr->m_vfs_lchardriver_openclose.id;
+  else
+	id = m_ptr->m_vfs_lchardriver_readwrite.id;
+
+  chardriver_reply_task(m_ptr->m_source, id, EAGAIN);
+}
+
+/*===========================================================================*
+ *				try_dequeue				     *
+ *===========================================================================*/
+static int try_dequeue(device_t *dp, message *m_dst, int *ipc_status)
+{
+/* See if a message can be dequeued from the current worker thread's device
+ * queue. If so, dequeue the message and return TRUE. If not, return FALSE.
+ * Must be called from a worker thread. Does not block.
+ */
+  struct mq_cell *cell;
+
+  if (STAILQ_EMPTY(&dp->queue))
+	return FALSE;
+
+  cell = STAILQ_FIRST(&dp->queue);
+  STAILQ_REMOVE_HEAD(&dp->queue, next);
+
+  *m_dst = cell->mess;
+  *ipc_status = cell->ipc_status;
+
+  free_cell(cell);
+
+  return TRUE;
+}
+
+/*===========================================================================*
+ *				dequeue					     *
+ *===========================================================================*/
+static int dequeue(device_t *dp, worker_t *wp, message *m_dst,
+  int *ipc_status)
+{
+/* Dequeue a message from the current worker thread's device queue. Block the
+ * current thread if necessary. Must be called from a worker thread. Either
+ * succeeds with a message (TRUE) or indicates that the thread should be
+ * terminated (FALSE).
+ */
+
+  do {
+	mthread_event_wait(&dp->queue_event);
+
+	/* If we were woken up as a result of terminate or set_workers, break
+	 * out of the loop and terminate the thread.
+	 */
+	if (!running || wp->worker_id >= dp->workers)
+		return FALSE;
+  } while (!try_dequeue(dp, m_dst, ipc_status));
+
+  return TRUE;
+}
+
+/*===========================================================================*
+ *				cancel_queued				     *
+ *===========================================================================*/
+static int cancel_queued(const message *m_ptr)
+{
+/* A request that is still queued cannot be known to the driver, so cancel it
+ * here: drop it, and reply EINTR to it. Return TRUE if the request was found.
+ */
+  struct mq_cell *cell;
+  device_t *dp;
+  int i;
+
+  for (i = 0; i < MAX_DEVICES; i++) {
+	dp = &device[i];
+	if (dp->nr_minors == 0)
+		continue;
+
+	STAILQ_FOREACH(cell, &dp->queue, next) {
+		switch (cell->mess.m_type) {
+		case CDEV_READ:
+		case CDEV_WRITE:
+		case CDEV_IOCTL:
+			break;
+		default:
+			continue;
+		}
+		if (cell->mess.m_source == m_ptr->m_source &&
+		    cell->mess.m_vfs_lchardriver_readwrite.minor ==
+		    m_ptr->m_vfs_lchardriver_cancel.minor &&
+		    cell->mess.m_vfs_lchardriver_readwrite.id ==
+		    m_ptr->m_vfs_lchardriver_cancel.id)
+			break;
+	}
+	if (cell == NULL)
+		continue;
+
+	STAILQ_REMOVE(&dp->queue, cell, mq_cell, next);
+	drop_pending(dp, cell->minor);
+	free_cell(cell);
+
+	/* The reply to the cancel request is the reply to the request. */
+	chardriver_reply_task(m_ptr->m_source,
+		m_ptr->m_vfs_lchardriver_cancel.id, EINTR);
+
+	return TRUE;
+  }
+
+  return FALSE;
+}
+
+/*===========================================================================*
+ *				worker_thread				     *
+ *===========================================================================*/
+static void *worker_thread(void *param)
+{
+/* The worker thread loop. Set up the thread-specific reference to itself and
+ * start looping. The loop consists of blocking dequeing and handling messages.
+ * After handling a message, the thread might have been stopped, so we check
+ * for this condition and exit if so.
+ */
+  worker_t *wp;
+  device_t *dp;
+  message m;
+  int ipc_status;
+
+  wp = (worker_t *) param;
+  assert(wp != NULL);
+  dp = &device[wp->device_id];
+
+  if (mthread_setspecific(worker_key, wp))
+	panic("chardriver_mt: could not save local thread pointer");
+
+  while (running && wp->worker_id < dp->workers) {
+
+	/* See if a new message is available right away. */
+	if (!try_dequeue(dp, &m, &ipc_status)) {
+
+		/* If not, block waiting for a new message or a thread
+		 * termination event.
+		 */
+		if (!dequeue(dp, wp, &m, &ipc_status))
+			break;
+	}
+
+	/* Even if the thread was stopped before, a new message resumes it. */
+	wp->state = STATE_BUSY;
+	(void) chardriver_get_minor(&m, &wp->minor);
+
+	/* Open and close requests acquire the write barrier lock, all others
+	 * the read lock.
+	 */
+	if (is_exclusive_req(m.m_type))
+		mthread_rwlock_wrlock(&dp->barrier);
+	else
+		mthread_rwlock_rdlock(&dp->barrier);
+
+	/* Handle the request and send a reply. */
+	chardriver_process(cdtab, &m, ipc_status);
+
+	/* Switch the thread back to running state, and unlock the barrier. */
+	wp->state = STATE_RUNNING;
+	mthread_rwlock_unlock(&dp->barrier);
+
+	drop_pending(dp, wp->minor);
+  }
+
+  /* Clean up and terminate this thread. */
+  if (mthread_setspecific(worker_key, NULL))
+	panic("chardriver_mt: could not delete local thread pointer");
+
+  wp->state = STATE_EXITED;
+
+  exited[num_exited++] = wp;
+
+  return NULL;
+}
+
+/*===========================================================================*
+ *				master_create_worker			     *
+ *===========================================================================*/
+static void master_create_worker(worker_t *wp, worker_id_t worker_id,
+  device_id_t device_id)
+{
+/* Start a new worker thread.
+ */
+  mthread_attr_t attr;
+  int r;
+
+  wp->device_id = device_id;
+  wp->worker_id = worker_id;
+  wp->state = STATE_RUNNING;
+
+  /* Initialize synchronization primitives. */
+  mthread_event_init(&wp->sleep_event);
+
+  r = mthread_attr_init(&attr);
+  if (r != 0)
+	panic("chardriver_mt: could not initialize attributes (%d)", r);
+
+  r = mthread_attr_setstacksize(&attr, STACK_SIZE);
+  if (r != 0)
+	panic("chardriver_mt: could not set stack size (%d)", r);
+
+  r = mthread_create(&wp->mthread, &attr, worker_thread, (void *) wp);
+  if (r != 0)
+	panic("chardriver_mt: could not start thread %d (%d)", worker_id, r);
+
+  mthread_attr_destroy(&attr);
+}
+
+/*===========================================================================*
+ *				master_destroy_worker			     *
+ *===========================================================================*/
+static void master_destroy_worker(worker_t *wp)
+{
+/* Clean up resources used by an exited worker thread.
+ */
+
+  assert(wp != NULL);
+  assert(wp->state == STATE_EXITED);
+
+  /* Join the thread. */
+  if (mthread_join(wp->mthread, NULL))
+	panic("chardriver_mt: could not join thread %d", wp->worker_id);
+
+  /* Destroy resources. */
+  mthread_event_destroy(&wp->sleep_event);
+
+  wp->state = STATE_DEAD;
+}
+
+/*===========================================================================*
+ *				master_handle_exits			     *
+ *===========================================================================*/
+static void master_handle_exits(void)
+{
+/* Destroy the remains of all exited threads.
+ */
+  int i;
+
+  for (i = 0; i < num_exited; i++)
+	master_destroy_worker(exited[i]);
+
+  num_exited = 0;
+}
+
+/*===========================================================================*
+ *				master_handle_message			     *
+ *===========================================================================*/
+static void master_handle_message(message *m_ptr, int ipc_status)
+{
+/* For real request messages, find the device serving the minor, start a
+ * thread if none is free and the maximum number of threads for that device
+ * has not yet been reached, and enqueue the message in the devices's message
+ * queue. All other messages are handled immediately from the main thread.
+ */
+  struct mq_cell *cell;
+  devminor_t minor;
+  worker_t *wp;
+  device_t *dp;
+  int wid;
+
+  /* Notifications and other messages are not tied to a minor. Select
+   * requests must not wait behind the requests they are about, so they are
+   * handled right away as well.
+   */
+  if (is_ipc_notify(ipc_status) || !IS_CDEV_RQ(m_ptr->m_type) ||
+	m_ptr->m_type == CDEV_SELECT) {
+	chardriver_process(cdtab, m_ptr, ipc_status);
+
+	return;
+  }
+
+  /* The same goes for cancel requests. If the request being cancelled is in
+   * progress, the cancel hook may wake up the thread that processes it.
+   */
+  if (m_ptr->m_type == CDEV_CANCEL) {
+	if (!cancel_queued(m_ptr))
+		chardriver_process(cdtab, m_ptr, ipc_status);
+
+	return;
+  }
+
+  if (chardriver_get_minor(m_ptr, &minor) != OK)
+	return;
+
+  /* Refuse the request if too many are queued already, rather than let any
+   * caller exhaust the driver's memory, or if no device can take its minor.
+   */
+  if ((cell = alloc_cell(m_ptr->m_type)) == NULL) {
+	reply_busy(m_ptr);
+
+	return;
+  }
+
+  if ((dp = get_device(minor)) == NULL) {
+	free_cell(cell);
+	reply_busy(m_ptr);
+
+	return;
+  }
+
+  cell->mess = *m_ptr;
+  cell->ipc_status = ipc_status;
+  cell->minor = minor;
+
+  /* Find the first non-busy worker thread. */
+  for (wid = 0; wid < dp->workers; wid++)
+	if (dp->worker[wid].state != STATE_BUSY)
+		break;
+
+  /* If the worker thread is dead, start a thread now, unless we have already
+   * reached the maximum number of threads.
+   */
+  if (wid < dp->workers) {
+	wp = &dp->worker[wid];
+
+	assert(wp->state != STATE_EXITED);
+
+	/* If the non-busy thread has not yet been created, create one now. */
+	if (wp->state == STATE_DEAD)
+		master_create_worker(wp, wid, dp->id);
+  }
+
+  /* Enqueue the message at the device queue. */
+  enqueue(dp, cell);
+}
+
+/*===========================================================================*
+ *				master_init				     *
+ *===========================================================================*/
+static void master_init(struct chardriver *cdp)
+{
+/* Initialize the state of the master thread.
+ */
+  int i, j;
+
+  assert(cdp != NULL);
+
+  cdtab = cdp;
+
+  STAILQ_INIT(&free_list);
+
+  /* Initialize device-specific data structures. */
+  for (i = 0; i < MAX_DEVICES; i++) {
+	device[i].id = i;
+	device[i].nr_minors = 0;
+	device[i].workers = 1;
+	STAILQ_INIT(&device[i].queue);
+	mthread_event_init(&device[i].queue_event);
+	mthread_rwlock_init(&device[i].barrier);
+
+	for (j = 0; j < MAX_WORKERS; j++)
+		device[i].worker[j].state = STATE_DEAD;
+  }
+
+  /* Initialize a per-thread key, where each worker thread stores its own
+   * reference to the worker structure.
+   */
+  if (mthread_key_create(&worker_key, NULL))
+	panic("chardriver_mt: error initializing worker key");
+}
+
+/*===========================================================================*
+ *				chardriver_mt_get_tid			     *
+ *===========================================================================*/
+cdev_thread_t chardriver_mt_get_tid(void)
+{
+/* Return back the ID of this thread.
+ */
+  worker_t *wp;
+
+  wp = (worker_t *) mthread_getspecific(worker_key);
+
+  if (wp == NULL)
+	panic("chardriver_mt: master thread cannot query thread ID\n");
+
+  return MAKE_TID(wp->device_id, wp->worker_id);
+}
+
+/*===========================================================================*
+ *				chardriver_mt_task			     *
+ *===========================================================================*/
+void chardriver_mt_task(struct chardriver *driver_tab)
+{
+/* The multithreaded driver task.
+ */
+  int r, ipc_status, i;
+  message mess;
+
+  /* Initialize first if necessary. */
+  if (!running) {
+	master_init(driver_tab);
+
+	running = TRUE;
+  }
+
+  /* The main message loop. */
+  while (running) {
+	/* Receive a message. */
+	if ((r = sef_receive_status(ANY, &mess, &ipc_status)) != OK) {
+		if (r == EINTR && !running)
+			break;
+
+		panic("chardriver_mt: sef_receive_status failed: %d", r);
+	}
+
+	/* Dispatch the message. */
+	master_handle_message(&mess, ipc_status);
+
+	/* Let other threads run. */
+	mthread_yield_all();
+
+	/* Clean up any exited threads. */
+	if (num_exited > 0)
+		master_handle_exits();
+  }
+
+  /* Free up resources. */
+  for (i = 0; i < MAX_DEVICES; i++)
+	mthread_event_destroy(&device[i].queue_event);
+}
+
+/*===========================================================================*
+ *				chardriver_mt_terminate			     *
+ *===========================================================================*/
+void chardriver_mt_terminate(void)
+{
+/* Instruct libchardriver to shut down.
+ */
+
+  running = FALSE;
+
+  sef_cancel();
+}
+
+/*===========================================================================*
+ *				chardriver_mt_sleep			     *
+ *===========================================================================*/
+void chardriver_mt_sleep(void)
+{
+/* Let the current thread sleep until it gets woken up by another thread.
+ */
+  worker_t *wp;
+
+  wp = (worker_t *) mthread_getspecific(worker_key);
+
+  if (wp == NULL)
+	panic("chardriver_mt: master thread cannot sleep");
+
+  mthread_event_wait(&wp->sleep_event);
+}
+
+/*===========================================================================*
+ *				chardriver_mt_wakeup			     *
+ *===========================================================================*/
+void chardriver_mt_wakeup(cdev_thread_t id)
+{
+/* Wake up a sleeping worker thread.
+ */
+  worker_t *wp;
+  device_id_t device_id;
+  worker_id_t worker_id;
+
+  device_id = TID_DEVICE(id);
+  worker_id = TID_WORKER(id);
+
+  assert(device_id >= 0 && device_id < MAX_DEVICES);
+  assert(worker_id >= 0 && worker_id < MAX_WORKERS);
+
+  wp = &device[device_id].worker[worker_id];
+
+  assert(wp->state == STATE_RUNNING || wp->state == STATE_BUSY);
+
+  mthread_event_fire(&wp->sleep_event);
+}
+
+/*===========================================================================*
+ *				chardriver_mt_set_workers		     *
+ *===========================================================================*/
+void chardriver_mt_set_workers(devminor_t minor, int workers)
+{
+/* Set the number of worker threads for the given minor, and with that the
+ * number of its requests that may be processed concurrently.
+ */
+  int i;
+
+  if (workers < 1)
+	workers = 1;
+  if (workers > MAX_WORKERS)
+	workers = MAX_WORKERS;
+
+  for (i = 0; i < num_concurrent; i++)
+	if (concurrent[i].minor == minor)
+		break;
+
+  if (workers == 1) {
+	if (i < num_concurrent)
+		concurrent[i] = concurrent[--num_concurrent];
+  } else {
+	if (i == num_concurrent) {
+		if (num_concurrent == MAX_DEVICES)
+			panic("chardriver_mt: too many concurrent minors");
+		concurrent[num_concurrent++].minor = minor;
+	}
+	concurrent[i].workers = workers;
+  }
+
+  /* Apply the new setting to a device serving the minor right now. */
+  for (i = 0; i < MAX_DEVICES; i++)
+	if (device[i].nr_minors == 1 && device[i].minors[0].minor == minor)
+		set_device_workers(&device[i], workers);
+}
@@ -18,6 +18,7 @@
 static asynmsg_t msgtable[ASYN_NR];
 static int first_slot = 0, next_slot = 0;
 static int initialized = 0;
+static int deferred = 0, pending = 0;
 
 #define DEBUG 0
 
@@ -139,10 +140,45 @@ int fl;
 
   inside = 0;
 
+  /* Leave the table to asyn_flush() if the caller is collecting messages */
+  if (deferred) {
+	pending = 1;
+	return(OK);
+  }
+
   /* Tell the kernel to rescan the table */
   return ipc_senda(&msgtable[first_slot], len);
 }
 
+/*===========================================================================*
+ *				asyn_defer				     *
+ *===========================================================================*/
+void asyn_defer(void)
+{
+/* Collect the messages of subsequent asynsend3() calls in the table without
+ * telling the kernel, until asyn_flush() hands them over in one ipc_senda().
+ */
+  deferred = 1;
+}
+
+/*===========================================================================*
+ *				asyn_flush				     *
+ *===========================================================================*/
+int asyn_flush(void)
+{
+/* Stop collecting messages, and have the kernel rescan the table if any were
+ * added since asyn_defer().
+ */
+  deferred = 0;
+
+  if (!pending)
+	return(OK);
+
+  pending = 0;
+
+  return ipc_senda(&msgtable[first_slot], next_slot - first_slot);
+}
+
 /*===========================================================================*
  *				asyn_geterror				     *
  *===========================================================================*/
@@ -1,6 +1,7 @@
 
 #include <minix/ds.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include "syslib.h"
 
@@ -89,6 +90,25 @@ int ds_publish_mem(const char *ds_name, void *vaddr, size_t length, int flags)
 	return ds_publish_raw(ds_name, vaddr, length, flags | DSF_TYPE_MEM);
 }
 
+int ds_publish_map(const char *ds_name, void *vaddr, size_t length, int flags)
+{
+/* Hand a memory range over to DS. The range must be a whole region from
+ * mmap(), which is gone from the caller once this succeeds.
+ */
+	int r;
+
+	/* Small ranges are cheaper to keep on the heap of DS. */
+	if(length < DS_MAP_MIN)
+		r = ds_publish_mem(ds_name, vaddr, length, flags);
+	else
+		r = ds_publish_raw(ds_name, vaddr, length,
+			flags | DSF_TYPE_MEM | DSF_MAP);
+
+	if(r == OK)
+		munmap(vaddr, length);
+	return r;
+}
+
 int ds_retrieve_label_name(char *ds_name, endpoint_t endpoint)
 {
 	message m;
@@ -161,6 +181,35 @@ int ds_retrieve_mem(const char *ds_name, char *vaddr, size_t *length)
 	return ds_retrieve_raw(ds_name, vaddr, length, DSF_TYPE_MEM);
 }
 
+int ds_retrieve_map(const char *ds_name, void **vaddr, size_t *length)
+{
+/* Copy a memory range from DS into a fresh mapping. The caller munmap()s it. */
+	message m;
+	size_t len;
+	char *data;
+	int r;
+
+	/* Ask for the length first, to size the mapping. */
+	memset(&m, 0, sizeof(m));
+	m.m_ds_req.flags = DSF_TYPE_MEM | DSF_MAP;
+	if((r = do_invoke_ds(&m, DS_RETRIEVE, ds_name)) != OK)
+		return r;
+	len = m.m_ds_reply.val_len;
+	if(len == 0)
+		return EINVAL;
+
+	data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANON, -1, 0);
+	if(data == MAP_FAILED)
+		return ENOMEM;
+	*length = len;
+	if((r = ds_retrieve_mem(ds_name, data, length)) != OK) {
+		munmap(data, len);
+		return r;
+	}
+	*vaddr = data;
+	return OK;
+}
+
 int ds_delete_u32(const char *ds_name)
 {
 	message m;
@@ -188,6 +237,11 @@ int ds_delete_mem(const char *ds_name)
 	return do_invoke_ds(&m, DS_DELETE, ds_name);
 }
 
+int ds_delete_map(const char *ds_name)
+{
+	return ds_delete_mem(ds_name);
+}
+
 int ds_delete_label(const char *ds_name)
 {
 	message m;
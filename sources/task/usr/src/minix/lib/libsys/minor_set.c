@@ -0,0 +1,85 @@
+/* A set of minor device numbers, used by the driver libraries to remember
+ * which minors have been opened since the driver (re)started.
+ */
+
+#include <minix/driver.h>
+
+/*===========================================================================*
+ *				minor_set_hash				     *
+ *===========================================================================*/
+static unsigned minor_set_hash(devminor_t minor)
+{
+/* Mix the bits of a minor number, as the high minors of a driver tend to lie
+ * close together.
+ */
+  unsigned h = (unsigned) minor;
+
+  h ^= h >> 16;
+  h *= 0x45d9f3bU;
+  h ^= h >> 16;
+
+  return h % MINOR_SET_SLOTS;
+}
+
+/*===========================================================================*
+ *				minor_set_clear				     *
+ *===========================================================================*/
+void minor_set_clear(struct minor_set *set)
+{
+/* Make the set empty. */
+  memset(set->ms_low, 0, sizeof(set->ms_low));
+  memset(set->ms_used, 0, sizeof(set->ms_used));
+  set->ms_nr_high = 0;
+}
+
+/*===========================================================================*
+ *				minor_set_has				     *
+ *===========================================================================*/
+int minor_set_has(const struct minor_set *set, devminor_t minor)
+{
+/* Check whether the given minor is in the set. */
+  unsigned i;
+
+  if (minor >= 0 && minor < MAX_NR_OPEN_DEVICES)
+	return GET_BIT(set->ms_low, minor) ? TRUE : FALSE;
+
+  /* The table is never more than half full, so a free slot ends the probe. */
+  for (i = minor_set_hash(minor); GET_BIT(set->ms_used, i);
+	i = (i + 1) % MINOR_SET_SLOTS)
+	if (set->ms_high[i] == minor)
+		return TRUE;
+
+  return FALSE;
+}
+
+/*===========================================================================*
+ *				minor_set_add				     *
+ *===========================================================================*/
+int minor_set_add(struct minor_set *set, devminor_t minor)
+{
+/* Add the given minor to the set. Return OK, or ENOSPC if the set has no room
+ * left for it.
+ */
+  unsigned i;
+
+  if (minor >= 0 && minor < MAX_NR_OPEN_DEVICES) {
+	SET_BIT(set->ms_low, minor);
+	return OK;
+  }
+
+  if (minor_set_has(set, minor))
+	return OK;
+
+  if (set->ms_nr_high >= MAX_NR_OPEN_DEVICES)
+	return ENOSPC;
+
+  for (i = minor_set_hash(minor); GET_BIT(set->ms_used, i);
+	i = (i + 1) % MINOR_SET_SLOTS)
+	;
+
+  SET_BIT(set->ms_used, i);
+  set->ms_high[i] = minor;
+  set->ms_nr_high++;
+
+  return OK;
+}
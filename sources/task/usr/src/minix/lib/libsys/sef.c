@@ -120,11 +120,14 @@ void sef_startup()
 }
 
 /*===========================================================================*
- *				sef_receive_status			     *
+ *				sef_receive_common			     *
  *===========================================================================*/
-int sef_receive_status(endpoint_t src, message *m_ptr, int *status_ptr)
+static int sef_receive_common(endpoint_t src, message *m_ptr, int *status_ptr,
+	int nonblock)
 {
-/* SEF receive() interface for system services. */
+/* Receive a message, handling any SEF requests on the way. If 'nonblock' is
+ * set, return ENOTREADY rather than block when no message is pending.
+ */
   int r, status;
 
   sef_self_receiving = TRUE;
@@ -142,7 +145,10 @@ int sef_receive_status(endpoint_t src, message *m_ptr, int *status_ptr)
 #endif
 
       /* Receive and return in case of error. */
-      r = ipc_receive(src, m_ptr, &status);
+      if(nonblock)
+          r = ipc_receivenb(src, m_ptr, &status);
+      else
+          r = ipc_receive(src, m_ptr, &status);
       if(status_ptr) *status_ptr = status;
       if(!sef_self_first_receive_done) sef_self_first_receive_done = TRUE;
       if(r != OK) {
@@ -204,6 +210,28 @@ int sef_receive_status(endpoint_t src, message *m_ptr, int *status_ptr)
   return r;
 }
 
+/*===========================================================================*
+ *				sef_receive_status			     *
+ *===========================================================================*/
+int sef_receive_status(endpoint_t src, message *m_ptr, int *status_ptr)
+{
+/* SEF receive() interface for system services. */
+
+  return sef_receive_common(src, m_ptr, status_ptr, FALSE);
+}
+
+/*===========================================================================*
+ *				sef_receive_status_nb			     *
+ *===========================================================================*/
+int sef_receive_status_nb(endpoint_t src, message *m_ptr, int *status_ptr)
+{
+/* Nonblocking SEF receive() interface for system services. Returns ENOTREADY
+ * if no message is pending.
+ */
+
+  return sef_receive_common(src, m_ptr, status_ptr, TRUE);
+}
+
 /*===========================================================================*
  *				sef_self				     *
  *===========================================================================*/
@@ -134,11 +134,14 @@ static void sef_lu_ready(int result)
   sef_lu_debug_end();
 #endif
 
-  /* If result is OK, let the callback code save
+  /* If result is OK, send the messages held back by asyn_defer(), which
+   * would be lost with this version, and let the callback code save
    * any state that must be carried over to the new version.
    */
   if(result == OK) {
-      r = sef_cbs.sef_cb_lu_state_save(sef_lu_state);
+      r = asyn_flush();
+      if(r == OK)
+          r = sef_cbs.sef_cb_lu_state_save(sef_lu_state);
       if(r != OK) {
           /* Abort update if callback returned error. */
           result = r;
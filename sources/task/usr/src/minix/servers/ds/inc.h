@@ -10,6 +10,7 @@
 #include <limits.h>
 #include <errno.h>
 #include <regex.h>
+#include <sys/mman.h>
 
 #include <minix/callnr.h>
 #include <minix/config.h>
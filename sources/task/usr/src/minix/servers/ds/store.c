@@ -1,24 +1,275 @@
 #include "inc.h"
 #include "store.h"
 
-/* Allocate space for the data store. */
-static struct data_store ds_store[NR_DS_KEYS];
-static struct subscription ds_subs[NR_DS_SUBS];
+/* Allocate space for the data store. Both tables start out with NR_DS_KEYS
+ * and NR_DS_SUBS slots, and double whenever they are full.
+ */
+static struct data_store *ds_store;
+static struct subscription *ds_subs;
+static int nr_ds_keys;
+static int nr_ds_subs;
+
+/* Stack of the free data slots, so that a slot is found without a scan. */
+static int *free_keys;
+static int nr_free_keys;
+
+/* For every data slot, the subscriptions whose type and regular expression
+ * match its key. Only these can be interested in a change to the entry.
+ */
+static struct key_subs {
+	int *sub;
+	int nr, max;
+} *key_subs;
+
+/* Hash tables indexing the data store: entries by key, label entries by
+ * endpoint, and subscriptions by owner. Every slot holds the number of an
+ * entry or subscription, or one of the values below. The tables are open
+ * addressed with linear probing and are rebuilt before half of their slots
+ * are taken, so a probe sequence always ends.
+ */
+#define HASH_FREE	(-1)	/* never used, ends a probe sequence */
+#define HASH_DELETED	(-2)	/* used before, probing goes past it */
+
+struct ds_hash {
+	int *slot;
+	unsigned size;		/* a power of two */
+	unsigned used;		/* slots that are not HASH_FREE */
+};
+
+static struct ds_hash key_hash, label_hash, sub_hash;
 
 /*===========================================================================*
- *			      alloc_data_slot				     *
+ *				hash_key				     *
  *===========================================================================*/
-static struct data_store *alloc_data_slot(void)
+static unsigned hash_key(const char *key)
 {
-/* Allocate a new data slot. */
-  int i;
+/* Hash a key name, FNV-1a. Entries with the same key but different types
+ * share a probe sequence, so lookups by a mask of types keep working.
+ */
+  unsigned h = 2166136261U;
+
+  while (*key != '\0')
+	h = (h ^ (unsigned char) *key++) * 16777619U;
+
+  return h;
+}
 
-  for (i = 0; i < NR_DS_KEYS; i++) {
+/*===========================================================================*
+ *				hash_label				     *
+ *===========================================================================*/
+static unsigned hash_label(unsigned num)
+{
+/* Hash an endpoint. Endpoints differ mostly in their high bits. */
+  num ^= num >> 16;
+  num *= 0x45d9f3bU;
+  num ^= num >> 16;
+
+  return num;
+}
+
+/*===========================================================================*
+ *				hash_alloc				     *
+ *===========================================================================*/
+static int hash_alloc(struct ds_hash *h, int nr)
+{
+/* Make an empty table with room for nr elements at a quarter load. */
+  unsigned size, i;
+  int *slot;
+
+  for (size = 4; size < 4 * (unsigned) nr; size <<= 1)
+	;
+  if (size != h->size) {
+	if ((slot = malloc(size * sizeof(*slot))) == NULL)
+		return ENOMEM;
+	free(h->slot);
+	h->slot = slot;
+	h->size = size;
+  }
+
+  for (i = 0; i < h->size; i++)
+	h->slot[i] = HASH_FREE;
+  h->used = 0;
+
+  return OK;
+}
+
+/*===========================================================================*
+ *				hash_insert				     *
+ *===========================================================================*/
+static void hash_insert(struct ds_hash *h, unsigned hash, int nr)
+{
+/* Add element nr, which is not in the table yet. */
+  unsigned i;
+
+  for (i = hash & (h->size - 1); h->slot[i] >= 0; i = (i + 1) & (h->size - 1))
+	;
+  if (h->slot[i] == HASH_FREE)
+	h->used++;
+  h->slot[i] = nr;
+}
+
+/*===========================================================================*
+ *				hash_remove				     *
+ *===========================================================================*/
+static void hash_remove(struct ds_hash *h, unsigned hash, int nr)
+{
+/* Remove element nr from the table. */
+  unsigned i;
+
+  for (i = hash & (h->size - 1); h->slot[i] != HASH_FREE;
+	i = (i + 1) & (h->size - 1)) {
+	if (h->slot[i] == nr) {
+		h->slot[i] = HASH_DELETED;
+		return;
+	}
+  }
+}
+
+/*===========================================================================*
+ *				rehash_keys				     *
+ *===========================================================================*/
+static int rehash_keys(void)
+{
+/* Rebuild the entry tables for the current size of the data store. */
+  int i, r;
+
+  if ((r = hash_alloc(&key_hash, nr_ds_keys)) != OK ||
+	(r = hash_alloc(&label_hash, nr_ds_keys)) != OK)
+	return r;
+
+  for (i = 0; i < nr_ds_keys; i++) {
 	if (!(ds_store[i].flags & DSF_IN_USE))
-		return &ds_store[i];
+		continue;
+	hash_insert(&key_hash, hash_key(ds_store[i].key), i);
+	if (ds_store[i].flags & DSF_TYPE_LABEL)
+		hash_insert(&label_hash, hash_label(ds_store[i].u.u32), i);
   }
 
-  return NULL;
+  return OK;
+}
+
+/*===========================================================================*
+ *				rehash_subs				     *
+ *===========================================================================*/
+static int rehash_subs(void)
+{
+/* Rebuild the subscription table for the current number of slots. */
+  int i, r;
+
+  if ((r = hash_alloc(&sub_hash, nr_ds_subs)) != OK)
+	return r;
+
+  for (i = 0; i < nr_ds_subs; i++) {
+	if (ds_subs[i].flags & DSF_IN_USE)
+		hash_insert(&sub_hash, hash_key(ds_subs[i].owner), i);
+  }
+
+  return OK;
+}
+
+/*===========================================================================*
+ *				index_entry				     *
+ *===========================================================================*/
+static void index_entry(struct data_store *dsp)
+{
+/* Add an entry that has just been set to the hash tables. */
+  int nr = dsp - ds_store;
+
+  hash_insert(&key_hash, hash_key(dsp->key), nr);
+  if (dsp->flags & DSF_TYPE_LABEL)
+	hash_insert(&label_hash, hash_label(dsp->u.u32), nr);
+
+  /* Deleted slots pile up; clearing them out needs no new memory. */
+  if (key_hash.used > key_hash.size / 2 ||
+	label_hash.used > label_hash.size / 2)
+	rehash_keys();
+}
+
+/*===========================================================================*
+ *				unindex_entry				     *
+ *===========================================================================*/
+static void unindex_entry(struct data_store *dsp)
+{
+/* Remove an entry from the hash tables, before its key or label changes. */
+  int nr = dsp - ds_store;
+
+  hash_remove(&key_hash, hash_key(dsp->key), nr);
+  if (dsp->flags & DSF_TYPE_LABEL)
+	hash_remove(&label_hash, hash_label(dsp->u.u32), nr);
+}
+
+/*===========================================================================*
+ *				grow_store				     *
+ *===========================================================================*/
+static int grow_store(void)
+{
+/* Double the number of data slots. Nothing changes unless all of it fits. */
+  int nr = 2 * nr_ds_keys;
+  size_t chunks = BITMAP_CHUNKS(nr_ds_keys), new_chunks = BITMAP_CHUNKS(nr);
+  struct data_store *store;
+  struct key_subs *subs;
+  bitchunk_t *bits;
+  int *keys;
+  int i;
+
+  /* The subscription bitmaps only get longer, so they can go first. */
+  for (i = 0; i < nr_ds_subs; i++) {
+	if (!(ds_subs[i].flags & DSF_IN_USE))
+		continue;
+	bits = realloc(ds_subs[i].old_subs, new_chunks * sizeof(*bits));
+	if (bits == NULL)
+		return ENOMEM;
+	memset(bits + chunks, 0, (new_chunks - chunks) * sizeof(*bits));
+	ds_subs[i].old_subs = bits;
+  }
+
+  if ((store = realloc(ds_store, nr * sizeof(*store))) == NULL)
+	return ENOMEM;
+  ds_store = store;
+  if ((subs = realloc(key_subs, nr * sizeof(*subs))) == NULL)
+	return ENOMEM;
+  key_subs = subs;
+  if ((keys = realloc(free_keys, nr * sizeof(*keys))) == NULL)
+	return ENOMEM;
+  free_keys = keys;
+
+  memset(ds_store + nr_ds_keys, 0, (nr - nr_ds_keys) * sizeof(*store));
+  memset(key_subs + nr_ds_keys, 0, (nr - nr_ds_keys) * sizeof(*subs));
+  for (i = nr - 1; i >= nr_ds_keys; i--)
+	free_keys[nr_free_keys++] = i;
+
+  nr_ds_keys = nr;
+  if (rehash_keys() != OK)
+	panic("DS: cannot rebuild the key tables");
+
+  return OK;
+}
+
+/*===========================================================================*
+ *			      alloc_data_slot				     *
+ *===========================================================================*/
+static struct data_store *alloc_data_slot(void)
+{
+/* Allocate a new data slot. It is in use once index_entry() is called. */
+  if (nr_free_keys == 0 && grow_store() != OK)
+	return NULL;
+
+  return &ds_store[free_keys[--nr_free_keys]];
+}
+
+/*===========================================================================*
+ *			      release_data_slot				     *
+ *===========================================================================*/
+static void release_data_slot(struct data_store *dsp)
+{
+/* Give back a data slot from alloc_data_slot(), in use or not. */
+  int nr = dsp - ds_store;
+
+  if (dsp->flags & DSF_IN_USE)
+	unindex_entry(dsp);
+  dsp->flags = 0;
+  key_subs[nr].nr = 0;
+  free_keys[nr_free_keys++] = nr;
 }
 
 /*===========================================================================*
@@ -26,15 +277,33 @@ static struct data_store *alloc_data_slot(void)
  *===========================================================================*/
 static struct subscription *alloc_sub_slot(void)
 {
-/* Allocate a new subscription slot. */
-  int i;
+/* Allocate a new subscription slot, with a bitmap for every data slot. */
+  struct subscription *subs;
+  bitchunk_t *bits;
+  int i, nr;
 
-  for (i = 0; i < NR_DS_SUBS; i++) {
+  for (i = 0; i < nr_ds_subs; i++) {
 	if (!(ds_subs[i].flags & DSF_IN_USE))
-		return &ds_subs[i];
+		break;
   }
 
-  return NULL;
+  if (i == nr_ds_subs) {
+	nr = 2 * nr_ds_subs;
+	if ((subs = realloc(ds_subs, nr * sizeof(*subs))) == NULL)
+		return NULL;
+	memset(subs + nr_ds_subs, 0, (nr - nr_ds_subs) * sizeof(*subs));
+	ds_subs = subs;
+	nr_ds_subs = nr;
+	if (rehash_subs() != OK)
+		panic("DS: cannot rebuild the subscription table");
+  }
+
+  if ((bits = calloc(BITMAP_CHUNKS(nr_ds_keys), sizeof(*bits))) == NULL)
+	return NULL;
+  free(ds_subs[i].old_subs);
+  ds_subs[i].old_subs = bits;
+
+  return &ds_subs[i];
 }
 
 /*===========================================================================*
@@ -43,13 +312,18 @@ static struct subscription *alloc_sub_slot(void)
 static struct data_store *lookup_entry(const char *key_name, int type)
 {
 /* Lookup an existing entry by key and type. */
-  int i;
-
-  for (i = 0; i < NR_DS_KEYS; i++) {
-	if ((ds_store[i].flags & DSF_IN_USE) /* used */
-		&& (ds_store[i].flags & type) /* same type*/
-		&& !strcmp(ds_store[i].key, key_name)) /* same key*/
-		return &ds_store[i];
+  unsigned i, mask = key_hash.size - 1;
+  struct data_store *dsp;
+  int nr;
+
+  for (i = hash_key(key_name) & mask; (nr = key_hash.slot[i]) != HASH_FREE;
+	i = (i + 1) & mask) {
+	if (nr < 0)
+		continue;
+	dsp = &ds_store[nr];
+	if ((dsp->flags & type) /* same type*/
+		&& !strcmp(dsp->key, key_name)) /* same key*/
+		return dsp;
   }
 
   return NULL;
@@ -61,13 +335,13 @@ static struct data_store *lookup_entry(const char *key_name, int type)
 static struct data_store *lookup_label_entry(unsigned num)
 {
 /* Lookup an existing label entry by num. */
-  int i;
+  unsigned i, mask = label_hash.size - 1;
+  int nr;
 
-  for (i = 0; i < NR_DS_KEYS; i++) {
-	if ((ds_store[i].flags & DSF_IN_USE)
-		&& (ds_store[i].flags & DSF_TYPE_LABEL)
-		&& (ds_store[i].u.u32 == num))
-		return &ds_store[i];
+  for (i = hash_label(num) & mask; (nr = label_hash.slot[i]) != HASH_FREE;
+	i = (i + 1) & mask) {
+	if (nr >= 0 && ds_store[nr].u.u32 == num)
+		return &ds_store[nr];
   }
 
   return NULL;
@@ -79,12 +353,13 @@ static struct data_store *lookup_label_entry(unsigned num)
 static struct subscription *lookup_sub(const char *owner)
 {
 /* Lookup an existing subscription given its owner. */
-  int i;
+  unsigned i, mask = sub_hash.size - 1;
+  int nr;
 
-  for (i = 0; i < NR_DS_SUBS; i++) {
-	if ((ds_subs[i].flags & DSF_IN_USE) /* used */
-		&& !strcmp(ds_subs[i].owner, owner)) /* same key*/
-		return &ds_subs[i];
+  for (i = hash_key(owner) & mask; (nr = sub_hash.slot[i]) != HASH_FREE;
+	i = (i + 1) & mask) {
+	if (nr >= 0 && !strcmp(ds_subs[nr].owner, owner))
+		return &ds_subs[nr];
   }
 
   return NULL;
@@ -154,7 +429,7 @@ static int get_key_name(const message *m_ptr, char *key_name)
 
   /* Copy name from caller. */
   r = sys_safecopyfrom(m_ptr->m_source,
-	(cp_grant_id_t) m_ptr->m_ds_req.key_grant, 0, 
+	(cp_grant_id_t) m_ptr->m_ds_req.key_grant, 0,
 	(vir_bytes) key_name, m_ptr->m_ds_req.key_len);
   if(r != OK) {
 	printf("DS: publish: copy failed from %d: %d\n", m_ptr->m_source, r);
@@ -178,6 +453,89 @@ static int check_sub_match(const struct subscription *subp,
 	  ? 1 : 0;
 }
 
+/*===========================================================================*
+ *				add_key_sub				     *
+ *===========================================================================*/
+static void add_key_sub(int nr, int sub)
+{
+/* Note that subscription sub matches the key of entry nr. */
+  struct key_subs *ks = &key_subs[nr];
+  int *list;
+
+  if (ks->nr == ks->max) {
+	list = realloc(ks->sub, (ks->max ? 2 * ks->max : 4) * sizeof(*list));
+	if (list == NULL) {
+		printf("DS: no memory, %s will miss updates to %s\n",
+			ds_subs[sub].owner, ds_store[nr].key);
+		return;
+	}
+	ks->sub = list;
+	ks->max = ks->max ? 2 * ks->max : 4;
+  }
+  ks->sub[ks->nr++] = sub;
+}
+
+/*===========================================================================*
+ *				key_sub_matches				     *
+ *===========================================================================*/
+static int key_sub_matches(int nr, int sub)
+{
+/* Check if the type and regular expression of subscription sub match entry
+ * nr, leaving out permissions, which may change with the entry.
+ */
+  return (ds_subs[sub].flags & ds_store[nr].flags & DSF_MASK_TYPE)
+	&& regexec(&ds_subs[sub].regex, ds_store[nr].key, 0, NULL, 0) == 0;
+}
+
+/*===========================================================================*
+ *				match_key_subs				     *
+ *===========================================================================*/
+static void match_key_subs(struct data_store *dsp)
+{
+/* Find the subscriptions matching the key of a new entry. */
+  int i, nr = dsp - ds_store;
+
+  key_subs[nr].nr = 0;
+  for (i = 0; i < nr_ds_subs; i++) {
+	if ((ds_subs[i].flags & DSF_IN_USE) && key_sub_matches(nr, i))
+		add_key_sub(nr, i);
+  }
+}
+
+/*===========================================================================*
+ *				match_sub_keys				     *
+ *===========================================================================*/
+static void match_sub_keys(struct subscription *subp)
+{
+/* Add a new subscription to the entries whose keys it matches. */
+  int i, sub = subp - ds_subs;
+
+  for (i = 0; i < nr_ds_keys; i++) {
+	if ((ds_store[i].flags & DSF_IN_USE) && key_sub_matches(i, sub))
+		add_key_sub(i, sub);
+  }
+}
+
+/*===========================================================================*
+ *				drop_sub				     *
+ *===========================================================================*/
+static void drop_sub(struct subscription *subp)
+{
+/* Remove a subscription from the entries it matches. */
+  struct key_subs *ks;
+  int i, j, sub = subp - ds_subs;
+
+  for (i = 0; i < nr_ds_keys; i++) {
+	ks = &key_subs[i];
+	for (j = 0; j < ks->nr; j++) {
+		if (ks->sub[j] == sub) {
+			ks->sub[j] = ks->sub[--ks->nr];
+			break;
+		}
+	}
+  }
+}
+
 /*===========================================================================*
  *			     update_subscribers				     *
  *===========================================================================*/
@@ -186,29 +544,84 @@ static void update_subscribers(struct data_store *dsp, int set)
 /* If set = 1, set bit in the sub bitmap of any subscription matching the given
  * entry, otherwise clear it. In both cases, notify the subscriber.
  */
+	struct subscription *subp;
+	struct key_subs *ks;
 	int i;
 	int nr = dsp - ds_store;
 	endpoint_t ep;
 
-	for(i = 0; i < NR_DS_SUBS; i++) {
-		if(!(ds_subs[i].flags & DSF_IN_USE))
-			continue;
-		if(!(ds_subs[i].flags & dsp->flags & DSF_MASK_TYPE))
-			continue;
+	/* The key and type of the entry were matched when it was created. */
+	ks = &key_subs[nr];
+	for(i = 0; i < ks->nr; i++) {
+		subp = &ds_subs[ks->sub[i]];
 
-		ep = ds_getprocep(ds_subs[i].owner);
-		if(!check_sub_match(&ds_subs[i], dsp, ep))
+		ep = ds_getprocep(subp->owner);
+		if(!check_auth(dsp, ep, DSF_PRIV_SUBSCRIBE))
 			continue;
 
 		if(set == 1) {
-			SET_BIT(ds_subs[i].old_subs, nr);
+			SET_BIT(subp->old_subs, nr);
 		} else {
-			UNSET_BIT(ds_subs[i].old_subs, nr);
+			UNSET_BIT(subp->old_subs, nr);
 		}
 		ipc_notify(ep);
 	}
 }
 
+/*===========================================================================*
+ *				free_mem				     *
+ *===========================================================================*/
+static void free_mem(struct data_store *dsp)
+{
+/* Free the data of a string or memory range entry. */
+  if(dsp->u.mem.mapped)
+	munmap(dsp->u.mem.data, dsp->u.mem.reallen);
+  else
+	free(dsp->u.mem.data);
+
+  dsp->u.mem.data = NULL;
+  dsp->u.mem.reallen = 0;
+  dsp->u.mem.mapped = FALSE;
+}
+
+/*===========================================================================*
+ *				map_mem					     *
+ *===========================================================================*/
+static int map_mem(struct data_store *dsp, const message *m_ptr, int is_new)
+{
+/* Copy a large memory range into pages of DS's own. Unlike the heap, these
+ * go back to VM as a whole once the entry is gone.
+ */
+  size_t length = m_ptr->m_ds_req.val_len;
+  char *data;
+  int r;
+
+  if(!(m_ptr->m_ds_req.flags & DSF_TYPE_MEM) || length == 0)
+	return EINVAL;
+
+  data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_ANON, -1, 0);
+  if(data == MAP_FAILED)
+	return ENOMEM;
+
+  r = sys_safecopyfrom(m_ptr->m_source, m_ptr->m_ds_req.val_in.grant, 0,
+	(vir_bytes) data, length);
+  if(r != OK) {
+	printf("DS: publish: map copy failed from %d: %d\n",
+		m_ptr->m_source, r);
+	munmap(data, length);
+	return r;
+  }
+
+  if(!is_new)
+	free_mem(dsp);
+  dsp->u.mem.data = data;
+  dsp->u.mem.length = length;
+  dsp->u.mem.reallen = length;
+  dsp->u.mem.mapped = TRUE;
+
+  return OK;
+}
+
 /*===========================================================================*
  *		               map_service                                   *
  *===========================================================================*/
@@ -227,6 +640,8 @@ static int map_service(const struct rprocpub *rpub)
   dsp->u.u32 = (u32_t) rpub->endpoint;
   strcpy(dsp->owner, "rs");
   dsp->flags = DSF_IN_USE | DSF_TYPE_LABEL;
+  index_entry(dsp);
+  match_key_subs(dsp);
 
   /* Update subscribers having a matching subscription. */
   update_subscribers(dsp, 1);
@@ -244,11 +659,17 @@ int sef_cb_init_fresh(int UNUSED(type), sef_init_info_t *info)
 	struct rprocpub rprocpub[NR_BOOT_PROCS];
 
 	/* Reset data store: data and subscriptions. */
-	for(i = 0; i < NR_DS_KEYS; i++) {
-		ds_store[i].flags = 0;
-	}
-	for(i = 0; i < NR_DS_SUBS; i++) {
-		ds_subs[i].flags = 0;
+	nr_ds_keys = NR_DS_KEYS;
+	nr_ds_subs = NR_DS_SUBS;
+	ds_store = calloc(nr_ds_keys, sizeof(*ds_store));
+	ds_subs = calloc(nr_ds_subs, sizeof(*ds_subs));
+	key_subs = calloc(nr_ds_keys, sizeof(*key_subs));
+	free_keys = malloc(nr_ds_keys * sizeof(*free_keys));
+	if(ds_store == NULL || ds_subs == NULL || key_subs == NULL ||
+		free_keys == NULL || rehash_keys() != OK || rehash_subs() != OK)
+		panic("DS: cannot allocate the data store");
+	for(i = nr_ds_keys - 1; i >= 0; i--) {
+		free_keys[nr_free_keys++] = i;
 	}
 
 	/* Map all the services in the boot image. */
@@ -274,15 +695,19 @@ int do_publish(message *m_ptr)
 {
   struct data_store *dsp;
   char key_name[DS_MAX_KEYLEN];
-  char *source;
+  char source[DS_MAX_KEYLEN];
+  char *name;
   int flags = m_ptr->m_ds_req.flags;
   size_t length;
-  int r;
+  int r, is_new = FALSE, rekeyed = FALSE;
 
-  /* Lookup the source. */
-  source = ds_getprocname(m_ptr->m_source);
-  if(source == NULL)
+  /* Lookup the source. The name is copied, as a new data slot may move
+   * the entry it lives in.
+   */
+  name = ds_getprocname(m_ptr->m_source);
+  if(name == NULL)
 	  return EPERM;
+  strcpy(source, name);
 
   /* Only RS can publish labels. */
   if((flags & DSF_TYPE_LABEL) && m_ptr->m_source != RS_PROC_NR)
@@ -302,6 +727,7 @@ int do_publish(message *m_ptr)
 	/* The entry doesn't exist, allocate a new data slot. */
 	if((dsp = alloc_data_slot()) == NULL)
 		return ENOMEM;
+	is_new = TRUE;
   } else if (flags & DSF_OVERWRITE) {
 	/* Overwrite. */
 	if(!check_auth(dsp, m_ptr->m_source, DSF_PRIV_OVERWRITE))
@@ -317,16 +743,38 @@ int do_publish(message *m_ptr)
 	dsp->u.u32 = m_ptr->m_ds_req.val_in.u32;
 	break;
   case DSF_TYPE_LABEL:
+	/* A label may get a new key or endpoint; the tables follow. */
+	if(!is_new) {
+		rekeyed = strcmp(dsp->key, key_name) != 0;
+		unindex_entry(dsp);
+	}
 	dsp->u.u32 = m_ptr->m_ds_req.val_in.ep;
 	break;
   case DSF_TYPE_STR:
   case DSF_TYPE_MEM:
 	length = m_ptr->m_ds_req.val_len;
+	/* A map is kept in pages, not on the heap. */
+	if(flags & DSF_MAP) {
+		if((r = map_mem(dsp, m_ptr, is_new)) != OK) {
+			if(is_new)
+				release_data_slot(dsp);
+			return r;
+		}
+		break;
+	}
+
+	/* The pages of a map are not heap memory to reuse. */
+	if(!is_new && dsp->u.mem.mapped)
+		free_mem(dsp);
+
 	/* Allocate a new data buffer if necessary. */
-	if(!(dsp->flags & DSF_IN_USE)) {
-		if((dsp->u.mem.data = malloc(length)) == NULL)
+	if(is_new) {
+		if((dsp->u.mem.data = malloc(length)) == NULL) {
+			release_data_slot(dsp);
 			return ENOMEM;
+		}
 		dsp->u.mem.reallen = length;
+		dsp->u.mem.mapped = FALSE;
 	} else if(length > dsp->u.mem.reallen) {
 		free(dsp->u.mem.data);
 		if((dsp->u.mem.data = malloc(length)) == NULL)
@@ -341,6 +789,8 @@ int do_publish(message *m_ptr)
 		printf("DS: publish: memory map/copy failed from %d: %d\n",
 			m_ptr->m_source, r);
 		free(dsp->u.mem.data);
+		if(is_new)
+			release_data_slot(dsp);
 		return r;
 	}
 	dsp->u.mem.length = length;
@@ -349,6 +799,8 @@ int do_publish(message *m_ptr)
 	}
 	break;
   default:
+	if(is_new)
+		release_data_slot(dsp);
 	return EINVAL;
   }
 
@@ -356,6 +808,10 @@ int do_publish(message *m_ptr)
   strcpy(dsp->key, key_name);
   strcpy(dsp->owner, source);
   dsp->flags = DSF_IN_USE | (flags & DSF_MASK_INTERNAL);
+  if(is_new || (flags & DSF_TYPE_LABEL))
+	index_entry(dsp);
+  if(is_new || rekeyed)
+	match_key_subs(dsp);
 
   /* Update subscribers having a matching subscription. */
   update_subscribers(dsp, 1);
@@ -395,11 +851,17 @@ int do_retrieve(message *m_ptr)
 	break;
   case DSF_TYPE_STR:
   case DSF_TYPE_MEM:
+	/* A map retrieval only asks for the length, to size the copy. */
+	if(flags & DSF_MAP) {
+		m_ptr->m_ds_reply.val_len = dsp->u.mem.length;
+		break;
+	}
+
 	length = MIN(m_ptr->m_ds_req.val_len, dsp->u.mem.length);
 	r = sys_safecopyto(m_ptr->m_source, m_ptr->m_ds_req.val_in.grant, 0,
 		(vir_bytes) dsp->u.mem.data, length);
 	if(r != OK) {
-		printf("DS: retrieve: copy failed to %d: %d\n",	
+		printf("DS: retrieve: copy failed to %d: %d\n",
 			m_ptr->m_source, r);
 		return r;
 	}
@@ -443,10 +905,11 @@ int do_subscribe(message *m_ptr)
 {
   char regex[DS_MAX_KEYLEN+2];
   struct subscription *subp;
+  regex_t compiled;
   char errbuf[80];
   char *owner;
   int type_set;
-  int r, e, b;
+  int r, e, is_new = FALSE;
 
   /* Find the owner. */
   owner = ds_getprocname(m_ptr->m_source);
@@ -454,11 +917,8 @@ int do_subscribe(message *m_ptr)
 	  return ESRCH;
 
   /* See if the owner already has an existing subscription. */
-  if((subp = lookup_sub(owner)) == NULL) {
-	/* The subscription doesn't exist, allocate a new one. */
-	if((subp = alloc_sub_slot()) == NULL)
-		return EAGAIN;
-  } else if(!(m_ptr->m_ds_req.flags & DSF_OVERWRITE)) {
+  if((subp = lookup_sub(owner)) != NULL &&
+	!(m_ptr->m_ds_req.flags & DSF_OVERWRITE)) {
 	/* The subscription exists but we can't overwrite, return error. */
 	return EEXIST;
   }
@@ -473,12 +933,28 @@ int do_subscribe(message *m_ptr)
   strcat(regex, "$");
 
   /* Compile regular expression. */
-  if((e=regcomp(&subp->regex, regex, REG_EXTENDED)) != 0) {
-	regerror(e, &subp->regex, errbuf, sizeof(errbuf));
+  if((e=regcomp(&compiled, regex, REG_EXTENDED)) != 0) {
+	regerror(e, &compiled, errbuf, sizeof(errbuf));
 	printf("DS: subscribe: regerror: %s\n", errbuf);
 	return EINVAL;
   }
 
+  if(subp == NULL) {
+	/* The subscription doesn't exist, allocate a new one. */
+	if((subp = alloc_sub_slot()) == NULL) {
+		regfree(&compiled);
+		return EAGAIN;
+	}
+	is_new = TRUE;
+  } else {
+	/* The old expression goes, along with what it matched. */
+	drop_sub(subp);
+	regfree(&subp->regex);
+	memset(subp->old_subs, 0,
+		BITMAP_CHUNKS(nr_ds_keys) * sizeof(*subp->old_subs));
+  }
+  subp->regex = compiled;
+
   /* If type_set = 0, then subscribe all types. */
   type_set = m_ptr->m_ds_req.flags & DSF_MASK_TYPE;
   if(type_set == 0)
@@ -486,13 +962,17 @@ int do_subscribe(message *m_ptr)
 
   subp->flags = DSF_IN_USE | type_set;
   strcpy(subp->owner, owner);
-  for(b = 0; b < BITMAP_CHUNKS(NR_DS_KEYS); b++)
-	subp->old_subs[b] = 0;
+  if(is_new) {
+	hash_insert(&sub_hash, hash_key(owner), subp - ds_subs);
+	if(sub_hash.used > sub_hash.size / 2)
+		rehash_subs();
+  }
+  match_sub_keys(subp);
 
   /* See if caller requested an instant initial list. */
   if(m_ptr->m_ds_req.flags & DSF_INITIAL) {
 	int i, match_found = FALSE;
-	for(i = 0; i < NR_DS_KEYS; i++) {
+	for(i = 0; i < nr_ds_keys; i++) {
 		if(!(ds_store[i].flags & DSF_IN_USE))
 			continue;
 		if(!(ds_store[i].flags & type_set))
@@ -532,16 +1012,16 @@ int do_check(message *m_ptr)
 	return ESRCH;
 
   /* Look for an updated entry the subscriber is interested in. */
-  for(i = 0; i < NR_DS_KEYS; i++) {
+  for(i = 0; i < nr_ds_keys; i++) {
 	if(GET_BIT(subp->old_subs, i))
 		break;
   }
-  if(i == NR_DS_KEYS)
+  if(i == nr_ds_keys)
 	return ENOENT;
 
   /* Copy the key name. */
   r = sys_safecopyto(m_ptr->m_source,
-	(cp_grant_id_t) m_ptr->m_ds_req.key_grant, (vir_bytes) 0, 
+	(cp_grant_id_t) m_ptr->m_ds_req.key_grant, (vir_bytes) 0,
 	(vir_bytes) ds_store[i].key, strlen(ds_store[i].key) + 1);
   if(r != OK) {
 	printf("DS: check: copy failed from %d: %d\n", m_ptr->m_source, r);
@@ -565,6 +1045,7 @@ int do_check(message *m_ptr)
 int do_delete(message *m_ptr)
 {
   struct data_store *dsp;
+  struct subscription *subp;
   char key_name[DS_MAX_KEYLEN];
   char *source;
   char *label;
@@ -595,26 +1076,31 @@ int do_delete(message *m_ptr)
 	label = dsp->key;
 
 	/* Clean up subscriptions. */
-	for (i = 0; i < NR_DS_SUBS; i++) {
-		if ((ds_subs[i].flags & DSF_IN_USE)
-			&& !strcmp(ds_subs[i].owner, label)) {
-			ds_subs[i].flags = 0;
-		}
+	if ((subp = lookup_sub(label)) != NULL) {
+		drop_sub(subp);
+		hash_remove(&sub_hash, hash_key(subp->owner), subp - ds_subs);
+		regfree(&subp->regex);
+		free(subp->old_subs);
+		subp->old_subs = NULL;
+		subp->flags = 0;
 	}
 
 	/* Clean up data entries. */
-	for (i = 0; i < NR_DS_KEYS; i++) {
+	for (i = 0; i < nr_ds_keys; i++) {
 		if ((ds_store[i].flags & DSF_IN_USE)
+			&& &ds_store[i] != dsp
 			&& !strcmp(ds_store[i].owner, label)) {
 			update_subscribers(&ds_store[i], 0);
 
-			ds_store[i].flags = 0;
+			if(ds_store[i].flags & (DSF_TYPE_STR | DSF_TYPE_MEM))
+				free_mem(&ds_store[i]);
+			release_data_slot(&ds_store[i]);
 		}
 	}
 	break;
   case DSF_TYPE_STR:
   case DSF_TYPE_MEM:
-	free(dsp->u.mem.data);
+	free_mem(dsp);
 	break;
   default:
 	return EINVAL;
@@ -624,7 +1110,7 @@ int do_delete(message *m_ptr)
   update_subscribers(dsp, 0);
 
   /* Clear the entry. */
-  dsp->flags = 0;
+  release_data_slot(dsp);
 
   return OK;
 }
@@ -638,17 +1124,22 @@ int do_getsysinfo(const message *m_ptr)
   size_t length;
   int s;
 
+  /* The caller gets as many slots as it has room for; the data store
+   * never has fewer than NR_DS_KEYS.
+   */
   switch(m_ptr->m_lsys_getsysinfo.what) {
   case SI_DATA_STORE:
 	src_addr = (vir_bytes)ds_store;
-	length = sizeof(struct data_store) * NR_DS_KEYS;
+	length = sizeof(struct data_store) * nr_ds_keys;
 	break;
   default:
   	return EINVAL;
   }
 
-  if (length != m_ptr->m_lsys_getsysinfo.size)
+  if (m_ptr->m_lsys_getsysinfo.size > length ||
+	m_ptr->m_lsys_getsysinfo.size % sizeof(struct data_store) != 0)
 	return EINVAL;
+  length = m_ptr->m_lsys_getsysinfo.size;
 
   if (OK != (s=sys_datacopy(SELF, src_addr,
 		m_ptr->m_source, m_ptr->m_lsys_getsysinfo.where, length))) {
@@ -658,4 +1149,3 @@ int do_getsysinfo(const message *m_ptr)
 
   return OK;
 }
-
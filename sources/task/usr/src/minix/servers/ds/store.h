@@ -9,6 +9,7 @@
 #include <minix/param.h>
 #include <regex.h>
 
+/* Initial sizes of the tables, which double whenever they fill up. */
 #define NR_DS_KEYS	(2*NR_SYS_PROCS)	/* number of entries */
 #define NR_DS_SUBS	(4*NR_SYS_PROCS)	/* number of subscriptions */
 
@@ -24,6 +25,7 @@ struct data_store {
 			void *data;
 			size_t length;
 			size_t reallen;
+			int mapped;	/* data are mmap()ed pages, not heap */
 		} mem;
 	} u;
 };
@@ -32,7 +34,7 @@ struct subscription {
 	int		flags;
 	char		owner[DS_MAX_KEYLEN];
 	regex_t		regex;
-	bitchunk_t	old_subs[BITMAP_CHUNKS(NR_DS_KEYS)];	
+	bitchunk_t	*old_subs;	/* one bit per data store entry */
 };
 
 #endif /* _DS_STORE_H_ */
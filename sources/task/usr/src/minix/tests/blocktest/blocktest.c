@@ -42,6 +42,11 @@ static int max_size = 131072;		/* maximum total size of any req */
  * it to a value lower than the driver supports.
  */
 
+#define QUEUE_MAX	64		/* maximum number of queued requests */
+#define QUEUE_BLOCK	4096		/* size of each queued request */
+static int queue_depth = 0;		/* nr of requests to queue (0 = off) */
+static int queue_rounds = 16;		/* nr of rounds of queued requests */
+
 /* These settings are used for automated test runs. */
 static int contig = TRUE;		/* allocate contiguous DMA memory? */
 static int silent = FALSE;		/* do not produce console output? */
@@ -69,6 +74,8 @@ static struct optset optset_table[] = {
 	{ "min_read",	OPT_INT,	&min_read,	10		     },
 	{ "min_write",	OPT_INT,	&min_write,	10		     },
 	{ "max",	OPT_INT,	&max_size,	10		     },
+	{ "queue",	OPT_INT,	&queue_depth,	10		     },
+	{ "rounds",	OPT_INT,	&queue_rounds,	10		     },
 	{ "nocontig",	OPT_BOOL,	&contig,	FALSE		     },
 	{ "silent",	OPT_BOOL,	&silent,	TRUE		     },
 	{ NULL,		0,		NULL,		0		     }
@@ -2614,6 +2621,170 @@ static void high_pos(void)
 	high_lba_pos2();
 }
 
+static void queued_reads_sub(u64_t base_pos, u8_t *ref_ptr, u8_t *buf_ptr,
+	size_t size, int depth, result_t *res)
+{
+	/* Perform one round of queued reads: send a read request for each of
+	 * 'depth' adjacent blocks in one go, in descending order of position,
+	 * and only then collect the replies. This gives the driver the chance
+	 * to reorder and merge the requests. Check the data against the
+	 * reference copy.
+	 */
+	cp_grant_id_t grant[QUEUE_MAX], iov_grant[QUEUE_MAX];
+	iovec_s_t iovec[QUEUE_MAX];
+	int done[QUEUE_MAX];
+	message m;
+	int i, r, id, ipc_status;
+
+	for (i = 0; i < depth; i++) {
+		if ((grant[i] = cpf_grant_direct(driver_endpt,
+				(vir_bytes) (buf_ptr + size * i), size,
+				CPF_WRITE)) == GRANT_INVALID)
+			panic("unable to allocate grant");
+
+		iovec[i].iov_grant = grant[i];
+		iovec[i].iov_size = size;
+
+		if ((iov_grant[i] = cpf_grant_direct(driver_endpt,
+				(vir_bytes) &iovec[i], sizeof(iovec[i]),
+				CPF_READ)) == GRANT_INVALID)
+			panic("unable to allocate grant");
+
+		done[i] = FALSE;
+	}
+
+	fill_rand(buf_ptr, size * depth);
+
+	/* Hand all requests to the kernel with a single call. */
+	asyn_defer();
+
+	for (i = depth - 1; i >= 0; i--) {
+		memset(&m, 0, sizeof(m));
+		m.m_type = BDEV_GATHER;
+		m.m_lbdev_lblockdriver_msg.minor = driver_minor;
+		m.m_lbdev_lblockdriver_msg.pos = base_pos + size * i;
+		m.m_lbdev_lblockdriver_msg.count = 1;
+		m.m_lbdev_lblockdriver_msg.grant = iov_grant[i];
+		m.m_lbdev_lblockdriver_msg.id = i;
+
+		if ((r = asynsend3(driver_endpt, &m, AMF_NOREPLY)) != OK)
+			panic("unable to queue request: %d", r);
+	}
+
+	if ((r = asyn_flush()) != OK)
+		panic("unable to send requests: %d", r);
+
+	for (i = 0; i < depth; i++) {
+		if ((r = ipc_receive(driver_endpt, &m, &ipc_status)) != OK) {
+			set_result(res, RESULT_COMMFAIL, r);
+			break;
+		}
+
+		if (m.m_type != BDEV_REPLY) {
+			set_result(res, RESULT_BADTYPE, m.m_type);
+			continue;
+		}
+
+		id = m.m_lblockdriver_lbdev_reply.id;
+		if (id < 0 || id >= depth || done[id]) {
+			set_result(res, RESULT_BADID, id);
+			continue;
+		}
+		done[id] = TRUE;
+
+		if (m.m_lblockdriver_lbdev_reply.status < 0)
+			set_result(res, RESULT_BADSTATUS,
+				m.m_lblockdriver_lbdev_reply.status);
+		else if (m.m_lblockdriver_lbdev_reply.status != size)
+			set_result(res, RESULT_TRUNC,
+				size - m.m_lblockdriver_lbdev_reply.status);
+	}
+
+	for (i = 0; i < depth; i++) {
+		if (cpf_revoke(iov_grant[i]) != OK ||
+				cpf_revoke(grant[i]) != OK)
+			panic("unable to revoke grant");
+	}
+
+	if (res->type == RESULT_OK && memcmp(ref_ptr, buf_ptr, size * depth))
+		set_result(res, RESULT_CORRUPT, 0);
+}
+
+static void queued_reads(void)
+{
+	/* Measure how fast the driver handles many read requests queued at
+	 * once, which depends on how it schedules them. The blocks are read
+	 * in the opposite order of their positions, so that a driver serving
+	 * requests in order of arrival is at a disadvantage. This test group
+	 * is only run if the "queue" option is given.
+	 */
+	u8_t *ref_ptr, *buf_ptr;
+	size_t size, buf_size, chunk;
+	clock_t start, end;
+	result_t res;
+	int i, r, depth;
+
+	depth = queue_depth;
+
+	test_group("queued reads", depth > 0);
+
+	if (depth <= 0)
+		return;
+
+	if (depth > QUEUE_MAX)
+		depth = QUEUE_MAX;
+
+	/* Each request covers a whole number of sectors. */
+	size = (QUEUE_BLOCK + sector_size - 1) / sector_size * sector_size;
+	buf_size = size * depth;
+
+	if (part.size < buf_size) {
+		output("WARNING: small partition, not running queued reads\n");
+		return;
+	}
+
+	ref_ptr = alloc_dma_memory(buf_size);
+	buf_ptr = alloc_dma_memory(buf_size);
+
+	/* Obtain the reference contents of the area with ordinary requests. */
+	set_result(&res, RESULT_OK, 0);
+
+	for (i = 0; i < depth && res.type == RESULT_OK; i += chunk / size) {
+		chunk = MIN(buf_size - size * i, max_size / size * size);
+
+		simple_xfer(driver_minor, (u64_t)size * i, ref_ptr + size * i,
+			chunk, FALSE, chunk, &res);
+	}
+
+	got_result(&res, "read reference area");
+
+	if (res.type != RESULT_OK) {
+		free_dma_memory(buf_ptr, buf_size);
+		free_dma_memory(ref_ptr, buf_size);
+		return;
+	}
+
+	if ((r = getticks(&start)) != OK)
+		panic("unable to get uptime: %d", r);
+
+	set_result(&res, RESULT_OK, 0);
+
+	for (i = 0; i < queue_rounds && res.type == RESULT_OK; i++)
+		queued_reads_sub(0ULL, ref_ptr, buf_ptr, size, depth, &res);
+
+	if ((r = getticks(&end)) != OK)
+		panic("unable to get uptime: %d", r);
+
+	got_result(&res, "queued reads");
+
+	if (res.type == RESULT_OK)
+		output("- %d rounds of %d x %u bytes: %u ticks (%u Hz)\n",
+			queue_rounds, depth, size, end - start, sys_hz());
+
+	free_dma_memory(buf_ptr, buf_size);
+	free_dma_memory(ref_ptr, buf_size);
+}
+
 static void open_primary(void)
 {
 	/* Open the primary device. This call has its own test group.
@@ -2667,6 +2838,8 @@ static void do_tests(void)
 
 	high_pos();
 
+	queued_reads();
+
 	close_primary();
 }
 
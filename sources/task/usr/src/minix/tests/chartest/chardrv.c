@@ -0,0 +1,230 @@
+/* Test driver for the multithreaded character driver interface. Reads sleep
+ * until the test client releases or cancels them, and then return the ID of
+ * the thread that served them, so that the client can tell which minors share
+ * a device. Writes complete right away.
+ */
+#include <minix/drivers.h>
+#include <minix/chardriver_mt.h>
+
+#include "chartest.h"
+
+/* Maximum number of reads sleeping at the same time. */
+#define NR_WAITERS	(2 * CHARDRIVER_MAX_DEVICES)
+
+static struct waiter {
+	int busy;			/* is a read sleeping here? */
+	int done;			/* has it been released or cancelled? */
+	int cancelled;			/* has it been cancelled? */
+	unsigned int seq;		/* order in which the reads started */
+	devminor_t minor;
+	endpoint_t endpt;
+	cdev_id_t id;
+	cdev_thread_t tid;
+} waiter[NR_WAITERS];
+
+static unsigned int next_seq = 0;
+
+static int ct_open(devminor_t minor, int access, endpoint_t user_endpt);
+static int ct_close(devminor_t minor);
+static ssize_t ct_read(devminor_t minor, u64_t position, endpoint_t endpt,
+	cp_grant_id_t grant, size_t size, int flags, cdev_id_t id);
+static ssize_t ct_write(devminor_t minor, u64_t position, endpoint_t endpt,
+	cp_grant_id_t grant, size_t size, int flags, cdev_id_t id);
+static int ct_cancel(devminor_t minor, endpoint_t endpt, cdev_id_t id);
+static void ct_other(message *m_ptr, int ipc_status);
+
+static struct chardriver ct_tab = {
+	.cdr_open	= ct_open,
+	.cdr_close	= ct_close,
+	.cdr_read	= ct_read,
+	.cdr_write	= ct_write,
+	.cdr_cancel	= ct_cancel,
+	.cdr_other	= ct_other
+};
+
+/*===========================================================================*
+ *				ct_open					     *
+ *===========================================================================*/
+static int ct_open(devminor_t minor, int UNUSED(access),
+	endpoint_t UNUSED(user_endpt))
+{
+	if (minor < 0 || minor >= CT_NR_MINORS)
+		return ENXIO;
+
+	return OK;
+}
+
+/*===========================================================================*
+ *				ct_close				     *
+ *===========================================================================*/
+static int ct_close(devminor_t UNUSED(minor))
+{
+	return OK;
+}
+
+/*===========================================================================*
+ *				ct_read					     *
+ *===========================================================================*/
+static ssize_t ct_read(devminor_t minor, u64_t UNUSED(position),
+	endpoint_t endpt, cp_grant_id_t UNUSED(grant), size_t UNUSED(size),
+	int UNUSED(flags), cdev_id_t id)
+{
+	struct waiter *wp;
+	int i;
+
+	for (i = 0; i < NR_WAITERS; i++)
+		if (!waiter[i].busy)
+			break;
+	if (i == NR_WAITERS)
+		return ENOMEM;
+
+	wp = &waiter[i];
+	wp->busy = TRUE;
+	wp->done = FALSE;
+	wp->cancelled = FALSE;
+	wp->seq = next_seq++;
+	wp->minor = minor;
+	wp->endpt = endpt;
+	wp->id = id;
+	wp->tid = chardriver_mt_get_tid();
+
+	while (!wp->done)
+		chardriver_mt_sleep();
+
+	wp->busy = FALSE;
+
+	/* The cancel hook has replied for us. */
+	if (wp->cancelled)
+		return EDONTREPLY;
+
+	return wp->tid;
+}
+
+/*===========================================================================*
+ *				ct_write				     *
+ *===========================================================================*/
+static ssize_t ct_write(devminor_t UNUSED(minor), u64_t UNUSED(position),
+	endpoint_t UNUSED(endpt), cp_grant_id_t UNUSED(grant), size_t size,
+	int UNUSED(flags), cdev_id_t UNUSED(id))
+{
+	return size;
+}
+
+/*===========================================================================*
+ *				ct_cancel				     *
+ *===========================================================================*/
+static int ct_cancel(devminor_t minor, endpoint_t endpt, cdev_id_t id)
+{
+	struct waiter *wp;
+	int i;
+
+	for (i = 0; i < NR_WAITERS; i++) {
+		wp = &waiter[i];
+		if (wp->busy && !wp->done && wp->minor == minor &&
+		    wp->endpt == endpt && wp->id == id) {
+			wp->done = TRUE;
+			wp->cancelled = TRUE;
+			chardriver_mt_wakeup(wp->tid);
+
+			return EINTR;
+		}
+	}
+
+	/* The read has finished already. */
+	return EDONTREPLY;
+}
+
+/*===========================================================================*
+ *				release					     *
+ *===========================================================================*/
+static void release(devminor_t minor)
+{
+/* Finish the oldest read sleeping on the given minor, if any. */
+	struct waiter *wp, *oldest = NULL;
+	int i;
+
+	for (i = 0; i < NR_WAITERS; i++) {
+		wp = &waiter[i];
+		if (wp->busy && !wp->done && wp->minor == minor &&
+		    (oldest == NULL || (int) (wp->seq - oldest->seq) < 0))
+			oldest = wp;
+	}
+
+	if (oldest != NULL) {
+		oldest->done = TRUE;
+		chardriver_mt_wakeup(oldest->tid);
+	}
+}
+
+/*===========================================================================*
+ *				ct_other				     *
+ *===========================================================================*/
+static void ct_other(message *m_ptr, int UNUSED(ipc_status))
+{
+	message m;
+	int r;
+
+	switch (m_ptr->m_type) {
+	case CT_RELEASE:
+		release(CT_MINOR(m_ptr));
+		break;
+
+	case CT_SYNC:
+		/* The master thread gets here only after all the workers that
+		 * could run have run, so all their replies are out already.
+		 */
+		memset(&m, 0, sizeof(m));
+		m.m_type = CT_SYNC_REPLY;
+		if ((r = asynsend3(m_ptr->m_source, &m, AMF_NOREPLY)) != OK)
+			printf("CHARDRV: unable to reply to sync: %d\n", r);
+		break;
+
+	default:
+		printf("CHARDRV: unexpected message %d from %d\n",
+			m_ptr->m_type, m_ptr->m_source);
+	}
+}
+
+/*===========================================================================*
+ *			       sef_cb_init_fresh			     *
+ *===========================================================================*/
+static int sef_cb_init_fresh(int UNUSED(type), sef_init_info_t *UNUSED(info))
+{
+	chardriver_mt_set_workers(CT_CONC_MINOR, 2);
+
+	return OK;
+}
+
+/*===========================================================================*
+ *			       sef_cb_signal_handler			     *
+ *===========================================================================*/
+static void sef_cb_signal_handler(int signo)
+{
+	if (signo == SIGTERM)
+		chardriver_mt_terminate();
+}
+
+/*===========================================================================*
+ *			       sef_local_startup			     *
+ *===========================================================================*/
+static void sef_local_startup(void)
+{
+	/* Let SEF perform startup. */
+	sef_setcb_init_fresh(sef_cb_init_fresh);
+	sef_setcb_signal_handler(sef_cb_signal_handler);
+
+	sef_startup();
+}
+
+/*===========================================================================*
+ *				main					     *
+ *===========================================================================*/
+int main(void)
+{
+	/* SEF local startup. */
+	sef_local_startup();
+
+	chardriver_mt_task(&ct_tab);
+
+	return 0;
+}
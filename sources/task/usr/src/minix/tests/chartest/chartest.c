@@ -0,0 +1,553 @@
+/* Test for the multithreaded character driver interface. It talks to the
+ * chardrv test driver the way VFS would, so start that driver first:
+ *
+ *   service up /usr/sbin/chardrv -label chardrv
+ *   service up /usr/sbin/chartest
+ *
+ * Replies are sent asynchronously and may arrive in any order, so each test
+ * gathers the replies to what it did so far, and checks them by request ID.
+ */
+#define _SYSTEM		1
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include <minix/config.h>
+#include <minix/com.h>
+#include <minix/type.h>
+#include <minix/const.h>
+#include <minix/endpoint.h>
+#include <minix/ds.h>
+#include <minix/syslib.h>
+#include <minix/chardriver_mt.h>
+
+#include "chartest.h"
+
+/* The queue limit of libchardriver. */
+#define MQ_MAX		1024
+
+/* Maximum number of replies gathered at once. */
+#define NR_GOT		64
+
+#define NO_REPLY	INT_MIN		/* status if no reply came in */
+
+static endpoint_t driver_endpt;
+static cdev_id_t next_id = 1;
+
+static struct {
+	cdev_id_t id;
+	int status;
+} got[NR_GOT];
+static int nr_got = 0;
+
+static const char *test_name;
+static int failures = 0;
+
+/*===========================================================================*
+ *				send_req				     *
+ *===========================================================================*/
+static cdev_id_t send_req(int type, devminor_t minor)
+{
+/* Send a character device request for the given minor, and return its ID. */
+	message m;
+	cdev_id_t id;
+	int r;
+
+	id = next_id++;
+
+	memset(&m, 0, sizeof(m));
+	m.m_type = type;
+
+	if (type == CDEV_OPEN || type == CDEV_CLOSE) {
+		m.m_vfs_lchardriver_openclose.id = id;
+		m.m_vfs_lchardriver_openclose.user = sef_self();
+		m.m_vfs_lchardriver_openclose.minor = minor;
+		m.m_vfs_lchardriver_openclose.access = CDEV_R_BIT | CDEV_W_BIT;
+	} else {
+		m.m_vfs_lchardriver_readwrite.id = id;
+		m.m_vfs_lchardriver_readwrite.user = sef_self();
+		m.m_vfs_lchardriver_readwrite.minor = minor;
+		m.m_vfs_lchardriver_readwrite.grant = GRANT_INVALID;
+		m.m_vfs_lchardriver_readwrite.count = 1;
+	}
+
+	if ((r = ipc_send(driver_endpt, &m)) != OK)
+		panic("CHARTEST: unable to send request: %d", r);
+
+	return id;
+}
+
+/*===========================================================================*
+ *				send_cancel				     *
+ *===========================================================================*/
+static void send_cancel(devminor_t minor, cdev_id_t id)
+{
+	message m;
+	int r;
+
+	memset(&m, 0, sizeof(m));
+	m.m_type = CDEV_CANCEL;
+	m.m_vfs_lchardriver_cancel.id = id;
+	m.m_vfs_lchardriver_cancel.minor = minor;
+
+	if ((r = ipc_send(driver_endpt, &m)) != OK)
+		panic("CHARTEST: unable to send cancel: %d", r);
+}
+
+/*===========================================================================*
+ *				release					     *
+ *===========================================================================*/
+static void release(devminor_t minor)
+{
+/* Have the driver finish the oldest read sleeping on the given minor. */
+	message m;
+	int r;
+
+	memset(&m, 0, sizeof(m));
+	m.m_type = CT_RELEASE;
+	CT_MINOR(&m) = minor;
+
+	if ((r = ipc_send(driver_endpt, &m)) != OK)
+		panic("CHARTEST: unable to send release: %d", r);
+}
+
+/*===========================================================================*
+ *				add_reply				     *
+ *===========================================================================*/
+static void add_reply(const message *m_ptr)
+{
+	if (m_ptr->m_type != CDEV_REPLY) {
+		printf("CHARTEST: %s: unexpected message %d\n", test_name,
+			m_ptr->m_type);
+		failures++;
+		return;
+	}
+
+	if (nr_got == NR_GOT)
+		panic("CHARTEST: too many replies");
+
+	got[nr_got].id = m_ptr->m_lchardriver_vfs_reply.id;
+	got[nr_got].status = m_ptr->m_lchardriver_vfs_reply.status;
+	nr_got++;
+}
+
+/*===========================================================================*
+ *				sync_replies				     *
+ *===========================================================================*/
+static void sync_replies(void)
+{
+/* Gather all replies to the requests sent so far, as far as the driver has
+ * finished them. The driver answers a sync request only after every request
+ * that could proceed has done so.
+ */
+	message m;
+	int r, ipc_status;
+
+	memset(&m, 0, sizeof(m));
+	m.m_type = CT_SYNC;
+
+	if ((r = ipc_send(driver_endpt, &m)) != OK)
+		panic("CHARTEST: unable to send sync: %d", r);
+
+	for (;;) {
+		if ((r = ipc_receive(driver_endpt, &m, &ipc_status)) != OK)
+			panic("CHARTEST: unable to receive: %d", r);
+
+		if (m.m_type == CT_SYNC_REPLY)
+			break;
+
+		add_reply(&m);
+	}
+
+	/* A reply sent before the sync reply may still come after it. */
+	while (ipc_receivenb(driver_endpt, &m, &ipc_status) == OK)
+		add_reply(&m);
+}
+
+/*===========================================================================*
+ *				take_reply				     *
+ *===========================================================================*/
+static int take_reply(cdev_id_t id)
+{
+/* Return the status of the gathered reply to the given request, and forget
+ * about the reply. Return NO_REPLY if there is none.
+ */
+	int i, status;
+
+	for (i = 0; i < nr_got; i++) {
+		if (got[i].id == id) {
+			status = got[i].status;
+			got[i] = got[--nr_got];
+
+			return status;
+		}
+	}
+
+	return NO_REPLY;
+}
+
+/*===========================================================================*
+ *				expect					     *
+ *===========================================================================*/
+static void expect(cdev_id_t id, int status)
+{
+	int r;
+
+	if ((r = take_reply(id)) != status) {
+		if (r == NO_REPLY)
+			printf("CHARTEST: %s: no reply to request %d\n",
+				test_name, id);
+		else
+			printf("CHARTEST: %s: request %d: status %d, not %d\n",
+				test_name, id, r, status);
+		failures++;
+	}
+}
+
+/*===========================================================================*
+ *				expect_read				     *
+ *===========================================================================*/
+static cdev_thread_t expect_read(cdev_id_t id)
+{
+/* A read that was released returns the ID of the thread that served it. */
+	int r;
+
+	if ((r = take_reply(id)) < 0) {
+		if (r == NO_REPLY)
+			printf("CHARTEST: %s: no reply to read %d\n",
+				test_name, id);
+		else
+			printf("CHARTEST: %s: read %d: status %d\n",
+				test_name, id, r);
+		failures++;
+	}
+
+	return r;
+}
+
+/*===========================================================================*
+ *				expect_done				     *
+ *===========================================================================*/
+static void expect_done(void)
+{
+	int i;
+
+	for (i = 0; i < nr_got; i++) {
+		printf("CHARTEST: %s: unexpected reply to request %d: %d\n",
+			test_name, got[i].id, got[i].status);
+		failures++;
+	}
+
+	nr_got = 0;
+}
+
+/*===========================================================================*
+ *				test_open				     *
+ *===========================================================================*/
+static void test_open(void)
+{
+/* Open all minors. */
+	cdev_id_t id[CT_NR_MINORS];
+	int i;
+
+	test_name = "open";
+
+	for (i = 0; i < CT_NR_MINORS; i++)
+		id[i] = send_req(CDEV_OPEN, i);
+	sync_replies();
+	for (i = 0; i < CT_NR_MINORS; i++)
+		expect(id[i], OK);
+	expect_done();
+}
+
+/*===========================================================================*
+ *				test_apart				     *
+ *===========================================================================*/
+static void test_apart(void)
+{
+/* A read that sleeps holds up no requests for other minors. */
+	cdev_id_t r, w;
+
+	test_name = "apart";
+
+	r = send_req(CDEV_READ, 0);
+	w = send_req(CDEV_WRITE, 1);
+	sync_replies();
+	expect(w, 1);
+	expect_done();
+
+	release(0);
+	sync_replies();
+	expect_read(r);
+	expect_done();
+}
+
+/*===========================================================================*
+ *				test_order				     *
+ *===========================================================================*/
+static void test_order(void)
+{
+/* A read that sleeps holds up later requests for its own minor. */
+	cdev_id_t r, w;
+
+	test_name = "order";
+
+	r = send_req(CDEV_READ, 1);
+	w = send_req(CDEV_WRITE, 1);
+	sync_replies();
+	expect_done();
+
+	release(1);
+	sync_replies();
+	expect_read(r);
+	expect(w, 1);
+	expect_done();
+}
+
+/*===========================================================================*
+ *				test_workers				     *
+ *===========================================================================*/
+static void test_workers(void)
+{
+/* A minor with two workers has two requests in progress at once, but no
+ * more.
+ */
+	cdev_id_t r1, r2, w1, w2;
+	cdev_thread_t t1, t2;
+
+	test_name = "workers";
+
+	r1 = send_req(CDEV_READ, CT_CONC_MINOR);
+	w1 = send_req(CDEV_WRITE, CT_CONC_MINOR);
+	sync_replies();
+	expect(w1, 1);
+	expect_done();
+
+	r2 = send_req(CDEV_READ, CT_CONC_MINOR);
+	w2 = send_req(CDEV_WRITE, CT_CONC_MINOR);
+	sync_replies();
+	expect_done();
+
+	release(CT_CONC_MINOR);
+	sync_replies();
+	t1 = expect_read(r1);
+	expect(w2, 1);
+	expect_done();
+
+	release(CT_CONC_MINOR);
+	sync_replies();
+	t2 = expect_read(r2);
+	expect_done();
+
+	if (t1 == t2) {
+		printf("CHARTEST: %s: both reads ran on thread %d\n",
+			test_name, t1);
+		failures++;
+	}
+}
+
+/*===========================================================================*
+ *				test_cancel				     *
+ *===========================================================================*/
+static void test_cancel(void)
+{
+/* Cancel a queued request and one in progress, and one that is gone. */
+	cdev_id_t r, w;
+
+	test_name = "cancel";
+
+	r = send_req(CDEV_READ, 3);
+	w = send_req(CDEV_WRITE, 3);
+	sync_replies();
+	expect_done();
+
+	/* The queued write is cancelled by libchardriver itself. */
+	send_cancel(3, w);
+	sync_replies();
+	expect(w, EINTR);
+	expect_done();
+
+	/* The read in progress is cancelled by the driver. */
+	send_cancel(3, r);
+	sync_replies();
+	expect(r, EINTR);
+	expect_done();
+
+	/* A request that is done cannot be cancelled. */
+	send_cancel(3, w);
+	sync_replies();
+	expect_done();
+
+	/* Neither cancel left the minor stuck. */
+	w = send_req(CDEV_WRITE, 3);
+	sync_replies();
+	expect(w, 1);
+	expect_done();
+}
+
+/*===========================================================================*
+ *				test_shared				     *
+ *===========================================================================*/
+static void test_shared(void)
+{
+/* Keep every device busy, so that further minors have to share. Minor N is
+ * then queued on the device of minor (N % CHARDRIVER_MAX_DEVICES), and stays
+ * there until it drains.
+ */
+	cdev_id_t r[CHARDRIVER_MAX_DEVICES], rs, ws, wt;
+	cdev_thread_t t0, ts;
+	devminor_t ms, mt;
+	int i;
+
+	test_name = "shared";
+
+	ms = CHARDRIVER_MAX_DEVICES;
+	mt = CHARDRIVER_MAX_DEVICES + 1;
+
+	for (i = 0; i < CHARDRIVER_MAX_DEVICES; i++)
+		r[i] = send_req(CDEV_READ, i);
+	rs = send_req(CDEV_READ, ms);
+	ws = send_req(CDEV_WRITE, ms);
+	wt = send_req(CDEV_WRITE, mt);
+	sync_replies();
+	expect_done();
+
+	/* Once minor 0 is done, the shared minor gets to run on its device. */
+	release(0);
+	sync_replies();
+	t0 = expect_read(r[0]);
+	expect_done();
+
+	release(ms);
+	sync_replies();
+	ts = expect_read(rs);
+	expect(ws, 1);
+	expect_done();
+
+	if (ts != t0) {
+		printf("CHARTEST: %s: minor %d ran on thread %d, not %d\n",
+			test_name, ms, ts, t0);
+		failures++;
+	}
+
+	/* The other shared minor is still held up by minor 1. */
+	for (i = 2; i < CHARDRIVER_MAX_DEVICES; i++)
+		release(i);
+	sync_replies();
+	for (i = 2; i < CHARDRIVER_MAX_DEVICES; i++)
+		expect_read(r[i]);
+	expect_done();
+
+	release(1);
+	sync_replies();
+	expect_read(r[1]);
+	expect(wt, 1);
+	expect_done();
+}
+
+/*===========================================================================*
+ *				test_limit				     *
+ *===========================================================================*/
+static void test_limit(void)
+{
+/* Once MQ_MAX requests are queued, further ones are refused, except for open
+ * and close requests.
+ */
+	static cdev_id_t w[MQ_MAX];
+	cdev_id_t r, x;
+	int i;
+
+	test_name = "limit";
+
+	r = send_req(CDEV_READ, 4);
+	for (i = 0; i < MQ_MAX; i++)
+		w[i] = send_req(CDEV_WRITE, 4);
+	sync_replies();
+	expect_done();
+
+	x = send_req(CDEV_WRITE, 4);
+	sync_replies();
+	expect(x, EAGAIN);
+	expect_done();
+
+	x = send_req(CDEV_CLOSE, 5);
+	sync_replies();
+	expect(x, OK);
+	expect_done();
+
+	x = send_req(CDEV_OPEN, 5);
+	sync_replies();
+	expect(x, OK);
+	expect_done();
+
+	/* Cancel the writes one at a time, rather than have the driver send
+	 * more replies at once than its asynsend table holds.
+	 */
+	for (i = 0; i < MQ_MAX; i++) {
+		send_cancel(4, w[i]);
+		sync_replies();
+		expect(w[i], EINTR);
+		expect_done();
+	}
+
+	send_cancel(4, r);
+	sync_replies();
+	expect(r, EINTR);
+	expect_done();
+
+	x = send_req(CDEV_WRITE, 4);
+	sync_replies();
+	expect(x, 1);
+	expect_done();
+}
+
+/*===========================================================================*
+ *			       sef_cb_init_fresh			     *
+ *===========================================================================*/
+static int sef_cb_init_fresh(int UNUSED(type), sef_init_info_t *UNUSED(info))
+{
+	int r;
+
+	if ((r = ds_retrieve_label_endpt(CT_LABEL, &driver_endpt)) != OK) {
+		printf("CHARTEST: driver %s not found: %d\n", CT_LABEL, r);
+		return r;
+	}
+
+	/* Run all the tests. */
+	test_open();
+	test_apart();
+	test_order();
+	test_workers();
+	test_cancel();
+	test_shared();
+	test_limit();
+
+	if (failures > 0)
+		printf("CHARTEST: %d checks failed\n", failures);
+	else
+		printf("CHARTEST: all tests successful!\n");
+
+	return OK;
+}
+
+/*===========================================================================*
+ *			       sef_local_startup			     *
+ *===========================================================================*/
+static void sef_local_startup(void)
+{
+	/* Let SEF perform startup. */
+	sef_setcb_init_fresh(sef_cb_init_fresh);
+
+	sef_startup();
+}
+
+/*===========================================================================*
+ *				main					     *
+ *===========================================================================*/
+int main(void)
+{
+	/* SEF local startup. */
+	sef_local_startup();
+
+	return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef _CHARTEST_H
+#define _CHARTEST_H
+
+/* Label of the test driver. */
+#define CT_LABEL	"chardrv"
+
+/* Messages from the test client to the test driver, besides the character
+ * device requests.
+ */
+#define CT_RQ_BASE	0x1f00
+
+#define CT_RELEASE	(CT_RQ_BASE + 0)	/* finish oldest read on a minor */
+#define CT_SYNC		(CT_RQ_BASE + 1)	/* reply after all done so far */
+#define CT_SYNC_REPLY	(CT_RQ_BASE + 2)	/* reply to CT_SYNC */
+
+#define CT_MINOR(m)	((m)->m_u32.data[0])	/* minor of CT_RELEASE */
+
+/* The driver has more minors than libchardriver has devices, so that some
+ * have to share. One minor may have two requests in progress at once.
+ */
+#define CT_NR_MINORS	(CHARDRIVER_MAX_DEVICES + 8)
+#define CT_CONC_MINOR	2
+
+#endif /* _CHARTEST_H */
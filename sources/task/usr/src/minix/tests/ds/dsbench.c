@@ -0,0 +1,155 @@
+#include "inc.h"
+#include <minix/sysutil.h>
+
+/* Stress benchmark for DS. Publishes, retrieves, overwrites and deletes more
+ * keys than DS starts out with room for, and reports operations per second:
+ *
+ *	minix-service up /usr/sbin/dsbench -args "keys=1000 rounds=20 subs=1"
+ *
+ * With subs=1 the benchmark subscribes to its own keys first, so every
+ * change also goes through the subscriber index.
+ */
+static long nr_keys = 1000;
+static long nr_rounds = 20;
+static long subs = 0;
+
+/* SEF functions and variables. */
+static void sef_local_startup(void);
+
+/*===========================================================================*
+ *				report					     *
+ *===========================================================================*/
+static void report(const char *op, long ops, clock_t start)
+{
+	clock_t now;
+	u32_t ticks;
+
+	getticks(&now);
+	ticks = now - start;
+	if(ticks == 0)
+		ticks = 1;
+
+	printf("DSBENCH: %-8s %8ld ops %6u ms %10lu ops/s\n", op, ops,
+		(unsigned) (ticks * 1000 / sys_hz()),
+		(unsigned long) ((u64_t) ops * sys_hz() / ticks));
+}
+
+/*===========================================================================*
+ *				drain					     *
+ *===========================================================================*/
+static void drain(void)
+{
+/* Pick up the changes DS has queued for the subscription. */
+	char key[DS_MAX_KEYLEN];
+	int type;
+
+	while(ds_check(key, &type, NULL) == OK)
+		;
+}
+
+/*===========================================================================*
+ *				run					     *
+ *===========================================================================*/
+static void run(void)
+{
+	char key[DS_MAX_KEYLEN];
+	clock_t start;
+	u32_t value;
+	long i, round;
+	int r;
+
+	if(subs) {
+		r = ds_subscribe("dsbench\\..*", DSF_OVERWRITE);
+		assert(r == OK);
+	}
+
+	getticks(&start);
+	for(i = 0; i < nr_keys; i++) {
+		snprintf(key, sizeof(key), "dsbench.%ld", i);
+		r = ds_publish_u32(key, i, 0);
+		assert(r == OK);
+	}
+	report("publish", nr_keys, start);
+
+	getticks(&start);
+	for(round = 0; round < nr_rounds; round++) {
+		for(i = 0; i < nr_keys; i++) {
+			snprintf(key, sizeof(key), "dsbench.%ld", i);
+			r = ds_retrieve_u32(key, &value);
+			assert(r == OK && value == (u32_t) i);
+		}
+	}
+	report("retrieve", nr_rounds * nr_keys, start);
+
+	/* A miss has to probe until it finds a free slot. */
+	getticks(&start);
+	for(round = 0; round < nr_rounds; round++) {
+		for(i = 0; i < nr_keys; i++) {
+			snprintf(key, sizeof(key), "dsbench.miss.%ld", i);
+			r = ds_retrieve_u32(key, &value);
+			assert(r == ESRCH);
+		}
+	}
+	report("miss", nr_rounds * nr_keys, start);
+
+	getticks(&start);
+	for(round = 0; round < nr_rounds; round++) {
+		for(i = 0; i < nr_keys; i++) {
+			snprintf(key, sizeof(key), "dsbench.%ld", i);
+			r = ds_publish_u32(key, round, DSF_OVERWRITE);
+			assert(r == OK);
+		}
+		if(subs)
+			drain();
+	}
+	report("update", nr_rounds * nr_keys, start);
+
+	getticks(&start);
+	for(i = 0; i < nr_keys; i++) {
+		snprintf(key, sizeof(key), "dsbench.%ld", i);
+		r = ds_delete_u32(key);
+		assert(r == OK);
+	}
+	report("delete", nr_keys, start);
+
+	if(subs)
+		drain();
+}
+
+/*===========================================================================*
+ *			       sef_cb_init_fresh			     *
+ *===========================================================================*/
+static int sef_cb_init_fresh(int UNUSED(type), sef_init_info_t *UNUSED(info))
+{
+	env_parse("keys", "d", 0, &nr_keys, 1, 1000000);
+	env_parse("rounds", "d", 0, &nr_rounds, 1, 1000000);
+	env_parse("subs", "d", 0, &subs, 0, 1);
+
+	run();
+
+	return OK;
+}
+
+/*===========================================================================*
+ *		            sef_local_startup				     *
+ *===========================================================================*/
+static void sef_local_startup(void)
+{
+	/* Let SEF perform startup. */
+	sef_setcb_init_fresh(sef_cb_init_fresh);
+
+	sef_startup();
+}
+
+/*===========================================================================*
+ *				main					     *
+ *===========================================================================*/
+int main(int argc, char **argv)
+{
+	env_setargs(argc, argv);
+
+	/* SEF local startup. */
+	sef_local_startup();
+
+	return 0;
+}
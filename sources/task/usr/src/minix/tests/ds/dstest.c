@@ -3,6 +3,7 @@
 char *key_u32 = "test_u32";
 char *key_str = "test_str";
 char *key_mem = "test_mem";
+char *key_map = "test_map";
 char *key_label = "test_label";
 
 /*===========================================================================*
@@ -117,6 +118,53 @@ void test_mem(void)
 	printf("DSTEST: MEM test successful!\n");
 }
 
+/*===========================================================================*
+ *				test_map				     *
+ *===========================================================================*/
+void test_map(void)
+{
+	size_t len, sizes[] = { 100, DS_MAP_MIN, 4 * DS_MAP_MIN + 100 };
+	size_t get_len;
+	char *buf, *map;
+	int i, r;
+
+	for(i = 0; i < (int) (sizeof(sizes) / sizeof(sizes[0])); i++) {
+		len = sizes[i];
+		buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANON, -1, 0);
+		assert(buf != MAP_FAILED);
+		memset(buf, 'a' + i, len);
+
+		/* Publish, small ranges go on the heap of DS. */
+		r = ds_publish_map(key_map, buf, len, DSF_OVERWRITE);
+		assert(r == OK);
+
+		/* Get it back in a mapping of our own. */
+		r = ds_retrieve_map(key_map, (void **) &map, &get_len);
+		assert(r == OK && get_len == len);
+		assert(map[0] == 'a' + i && map[len - 1] == 'a' + i);
+
+		/* A map is a memory range as well. */
+		buf = malloc(len);
+		assert(buf != NULL);
+		get_len = len;
+		r = ds_retrieve_mem(key_map, buf, &get_len);
+		assert(r == OK && get_len == len);
+		assert(memcmp(buf, map, len) == 0);
+		free(buf);
+
+		/* The mapping stays after the entry is gone. */
+		r = ds_delete_map(key_map);
+		assert(r == OK);
+		assert(map[len / 2] == 'a' + i);
+		munmap(map, len);
+	}
+
+	r = ds_retrieve_map(key_map, (void **) &map, &get_len);
+	assert(r == ESRCH);
+
+	printf("DSTEST: MAP test successful!\n");
+}
+
 /*===========================================================================*
  *				test_label				     *
  *===========================================================================*/
@@ -150,6 +198,7 @@ static int sef_cb_init_fresh(int UNUSED(type), sef_init_info_t *UNUSED(info))
 	test_u32();
 	test_str();
 	test_mem();
+	test_map();
 	test_label();
 
 	return OK;
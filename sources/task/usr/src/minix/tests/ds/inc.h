@@ -4,6 +4,8 @@
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 
 #include <minix/config.h>
 #include <minix/com.h>
@@ -0,0 +1,117 @@
+// Compares a sequence of single hello_queue ioctls with one HQIOCBATCH
+// request doing the same work.
+//
+//     clang bench_batch.c -o bench_batch
+//     ./bench_batch [rounds]
+//
+// The driver has to be running.
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioc_hello_queue.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Operations per round, i.e. per batch.
+int batch_sizes[] = {1, 4, 16, HQ_BATCH_MAX};
+
+struct hq_batch batch;
+
+double now() {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// The k-th operation of a round: SET and XCH, with a DEL and a RES now
+// and then to keep the queue small.
+void make_op(struct hq_op *op, int k) {
+    memset(op, 0, sizeof(*op));
+    switch (k % 8) {
+        case 3:
+            op->op = HQ_OP_DEL;
+            break;
+        case 7:
+            op->op = HQ_OP_RES;
+            break;
+        case 1:
+        case 5:
+            op->op = HQ_OP_XCH;
+            op->arg[0] = 'x';
+            op->arg[1] = 'a' + k % 26;
+            break;
+        default:
+            op->op = HQ_OP_SET;
+            memset(op->arg, 'a' + k % 26, MSG_SIZE);
+    }
+}
+
+int single(int fd, struct hq_op *op) {
+    switch (op->op) {
+        case HQ_OP_RES:
+            return ioctl(fd, HQIOCRES);
+        case HQ_OP_SET:
+            return ioctl(fd, HQIOCSET, op->arg);
+        case HQ_OP_XCH:
+            return ioctl(fd, HQIOCXCH, op->arg);
+        case HQ_OP_DEL:
+            return ioctl(fd, HQIOCDEL);
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+    double start, t_single, t_batch;
+
+    int fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    printf("%8s %14s %14s %8s\n", "ops", "single us/op", "batch us/op",
+           "speedup");
+
+    for (size_t b = 0; b < sizeof(batch_sizes) / sizeof(batch_sizes[0]); b++) {
+        int n = batch_sizes[b];
+
+        batch.nr_ops = n;
+        for (int k = 0; k < n; k++) {
+            make_op(&batch.ops[k], k);
+        }
+
+        ioctl(fd, HQIOCRES);
+        start = now();
+        for (int r = 0; r < rounds; r++) {
+            for (int k = 0; k < n; k++) {
+                if (single(fd, &batch.ops[k]) < 0) {
+                    perror("ioctl");
+                    return 1;
+                }
+            }
+        }
+        t_single = now() - start;
+
+        ioctl(fd, HQIOCRES);
+        start = now();
+        for (int r = 0; r < rounds; r++) {
+            if (ioctl(fd, HQIOCBATCH, &batch) < 0) {
+                perror("HQIOCBATCH");
+                return 1;
+            }
+        }
+        t_batch = now() - start;
+
+        printf("%8d %14.2f %14.2f %8.2f\n", n, t_single * 1e6 / rounds / n,
+               t_batch * 1e6 / rounds / n, t_single / t_batch);
+    }
+
+    ioctl(fd, HQIOCRES);
+
+    close(fd);
+    return 0;
+}
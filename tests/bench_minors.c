@@ -0,0 +1,97 @@
+// Times the check the driver libraries make on every request, that its
+// minor is open, against the array scan it replaced. Build it straight from
+// the libsys source:
+//
+//     lib=/usr/src/minix/lib/libsys
+//     clang -O2 bench_minors.c ${lib}/minor_set.c -o bench_minors
+//     ./bench_minors [lookups]
+//
+// Low minors have a bit each; high ones, such as the clones of a driver
+// with lanes, are hashed. For both, and more and more minors open, it times
+// the lookup of the minor opened first and of the one opened last, which
+// is the one the scan finds last.
+#include <minix/driver.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+// First minor of the high ones.
+#define HIGH_BASE 0x10000
+
+// Minors open when measuring.
+int nr_open[] = {1, 8, 32, 64, 128, MAX_NR_OPEN_DEVICES};
+
+struct minor_set set;
+
+devminor_t list[MAX_NR_OPEN_DEVICES];
+int nr_list;
+
+// Keeps the lookups from being optimized away.
+volatile int found;
+
+int set_has(devminor_t minor) { return minor_set_has(&set, minor); }
+
+// The check as it was.
+int list_has(devminor_t minor) {
+    for (int i = 0; i < nr_list; i++) {
+        if (list[i] == minor) return TRUE;
+    }
+    return FALSE;
+}
+
+double now() {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Times lookups of the given minor, in nanoseconds per lookup.
+double measure(int (*has)(devminor_t), devminor_t minor, int lookups) {
+    double start;
+
+    start = now();
+    for (int r = 0; r < lookups; r++) {
+        found = has(minor);
+    }
+    if (!found) {
+        printf("minor %d not found\n", minor);
+        exit(1);
+    }
+    return (now() - start) * 1e9 / lookups;
+}
+
+int main(int argc, char **argv) {
+    int lookups = argc > 1 ? atoi(argv[1]) : 1000000;
+    devminor_t base, first, last;
+
+    printf("%6s %5s %12s %12s %12s %12s\n", "minors", "open", "set first",
+           "set last", "scan first", "scan last");
+
+    for (int high = 0; high < 2; high++) {
+        base = high ? HIGH_BASE : 0;
+        minor_set_clear(&set);
+        nr_list = 0;
+
+        for (size_t i = 0; i < sizeof(nr_open) / sizeof(nr_open[0]); i++) {
+            while (nr_list < nr_open[i]) {
+                if (minor_set_add(&set, base + nr_list) != OK) {
+                    printf("minor %d does not fit\n", base + nr_list);
+                    return 1;
+                }
+                list[nr_list] = base + nr_list;
+                nr_list++;
+            }
+
+            first = list[0];
+            last = list[nr_list - 1];
+            printf("%6s %5d %12.2f %12.2f %12.2f %12.2f\n",
+                   high ? "high" : "low", nr_list,
+                   measure(set_has, first, lookups),
+                   measure(set_has, last, lookups),
+                   measure(list_has, first, lookups),
+                   measure(list_has, last, lookups));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,431 @@
+// Throughput and latency of hello_queue over a fixed set of workloads:
+// producers and consumers streaming messages of 1 B to 1 MiB, HQIOCXCH and
+// HQIOCDEL on large queues, and storms of HQIOCRES.
+//
+//     clang bench_queue.c -o bench_queue
+//     ./bench_queue ['service args'] > results.csv
+//
+// The driver must not be running; it is started with the given "-args"
+// string, if any, and stopped at the end. Every workload prints a line of
+// comma-separated values per kind of request it times; lines starting with
+// '#' are comments. Latencies are taken with the TSC, calibrated against
+// gettimeofday() at start. bench_sizes.sh runs this against drivers built
+// with other DEVICE_SIZE and MSG_SIZE values.
+#include <fcntl.h>
+#include <minix/minlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioc_hello_queue.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Bytes written by a streaming workload, over all producers.
+#define STREAM_BYTES (16 << 20)
+
+// Bounds on the number of requests timed per process.
+#define MIN_OPS 16
+#define MAX_OPS 20000
+
+// Requests per process in the ioctl workloads.
+#define IOCTL_OPS 200
+#define RESET_OPS 5000
+
+// Bytes read after every HQIOCRES of a reset storm.
+#define RESET_READ 64
+
+#define MAX_PROCS 8
+
+#define BUFFER_SIZE (1 << 20)
+char buffer[BUFFER_SIZE];
+
+enum { STREAM, XCHDEL, RESET };
+
+struct workload {
+    const char *name;
+    int kind;
+    int producers;  // or processes, for the ioctl workloads
+    int consumers;
+    size_t size;    // of a message, or of the queue for XCHDEL
+};
+
+struct workload workloads[] = {
+    {"stream", STREAM, 1, 1, 1},
+    {"stream", STREAM, 1, 1, 64},
+    {"stream", STREAM, 1, 1, 4 << 10},
+    {"stream", STREAM, 1, 1, 64 << 10},
+    {"stream", STREAM, 1, 1, 1 << 20},
+    {"stream", STREAM, 4, 1, 64},
+    {"stream", STREAM, 4, 1, 4 << 10},
+    {"stream", STREAM, 1, 4, 64},
+    {"stream", STREAM, 1, 4, 4 << 10},
+    {"stream", STREAM, 4, 4, 64},
+    {"stream", STREAM, 4, 4, 4 << 10},
+    {"xchdel", XCHDEL, 1, 0, 64 << 10},
+    {"xchdel", XCHDEL, 1, 0, 1 << 20},
+    {"xchdel", XCHDEL, 1, 0, 16 << 20},
+    {"reset", RESET, 1, 0, RESET_READ},
+    {"reset", RESET, 4, 0, RESET_READ},
+};
+
+// What a process sends back over its pipe: this, then nr_ops latencies.
+struct result {
+    size_t nr_ops;
+    u64_t bytes;
+    u64_t end;  // TSC at the end of the last request
+};
+
+// Latencies of the requests of one kind, over all processes.
+struct samples {
+    u64_t *cycles;
+    size_t nr;
+    u64_t bytes;
+    u64_t end;
+};
+
+double cycles_per_us;
+size_t device_size;
+
+u64_t tsc() {
+    u64_t t;
+
+    read_tsc_64(&t);
+    return t;
+}
+
+double now() {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Measures the TSC rate over a fifth of a second.
+void calibrate() {
+    double start = now(), end;
+    u64_t t = tsc();
+
+    while ((end = now()) - start < 0.2)
+        ;
+    cycles_per_us = (tsc() - t) / ((end - start) * 1e6);
+}
+
+int open_queue(int flags) {
+    int fd = open("/dev/hello_queue", flags);
+
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    return fd;
+}
+
+// Reads the queue empty. Returns the number of bytes read.
+size_t drain(int fd) {
+    size_t total = 0;
+    ssize_t n;
+
+    while ((n = read(fd, buffer, BUFFER_SIZE)) > 0) {
+        total += n;
+    }
+    return total;
+}
+
+// Writes all of size bytes, however many requests it takes.
+int write_all(int fd, size_t size) {
+    ssize_t n;
+
+    for (; size > 0; size -= n) {
+        n = write(fd, buffer, size < BUFFER_SIZE ? size : BUFFER_SIZE);
+        if (n <= 0) return -1;
+    }
+    return 0;
+}
+
+size_t stream_ops(struct workload *w) {
+    size_t ops = STREAM_BYTES / w->size / w->producers;
+
+    return ops < MIN_OPS ? MIN_OPS : ops > MAX_OPS ? MAX_OPS : ops;
+}
+
+// Writes ops messages, timing every write.
+size_t producer(struct workload *w, u64_t *lat, u64_t *bytes) {
+    int fd = open_queue(O_WRONLY);
+    size_t ops = stream_ops(w), i;
+    u64_t t;
+
+    for (i = 0; i < ops; i++) {
+        t = tsc();
+        if (write_all(fd, w->size) < 0) {
+            perror("write");
+            exit(1);
+        }
+        lat[i] = tsc() - t;
+    }
+    *bytes = ops * w->size;
+    close(fd);
+    return ops;
+}
+
+// Reads consumer k's share of what the producers write, timing every read.
+size_t consumer(struct workload *w, int k, u64_t *lat, size_t max,
+                u64_t *bytes) {
+    int fd = open_queue(O_RDONLY);
+    u64_t total = (u64_t)stream_ops(w) * w->size * w->producers;
+    u64_t share = total / w->consumers, left;
+    size_t i = 0;
+    ssize_t n;
+    u64_t t;
+
+    if (k == w->consumers - 1) share += total % w->consumers;
+
+    for (left = share; left > 0; left -= n) {
+        t = tsc();
+        n = read(fd, buffer, left < w->size ? left : w->size);
+        if (n <= 0) {
+            perror("read");
+            exit(1);
+        }
+        if (i < max) lat[i++] = tsc() - t;
+    }
+    *bytes = share;
+    close(fd);
+    return i;
+}
+
+// Exchanges and deletes on a queue of w->size bytes, putting back what
+// every HQIOCDEL takes so the queue stays large.
+size_t xchdel(struct workload *w, u64_t *lat, u64_t *bytes) {
+    int fd = open_queue(O_RDWR | O_NONBLOCK);
+    size_t length = w->size, i;
+    char xch[2];
+    u64_t t;
+    int ret;
+
+    memset(buffer, 'a', BUFFER_SIZE);
+    if (write_all(fd, length) < 0) {
+        perror("write");
+        exit(1);
+    }
+
+    *bytes = 0;
+    for (i = 0; i < IOCTL_OPS; i++) {
+        xch[0] = 'a' + i % 2;
+        xch[1] = 'b' - i % 2;
+
+        t = tsc();
+        ret = i % 3 == 2 ? ioctl(fd, HQIOCDEL) : ioctl(fd, HQIOCXCH, xch);
+        lat[i] = tsc() - t;
+        if (ret < 0) {
+            perror("ioctl");
+            exit(1);
+        }
+        *bytes += length;
+
+        if (i % 3 == 2 && write_all(fd, length / 3) < 0) {
+            perror("write");
+            exit(1);
+        }
+    }
+    drain(fd);
+    close(fd);
+    return IOCTL_OPS;
+}
+
+// Resets the queue and reads the front of it, again and again.
+size_t reset(struct workload *w, u64_t *lat, u64_t *bytes) {
+    int fd = open_queue(O_RDWR | O_NONBLOCK);
+    size_t i;
+    ssize_t n;
+    u64_t t;
+
+    *bytes = 0;
+    for (i = 0; i < RESET_OPS; i++) {
+        t = tsc();
+        if (ioctl(fd, HQIOCRES) < 0) {
+            perror("ioctl");
+            exit(1);
+        }
+        lat[i] = tsc() - t;
+        if ((n = read(fd, buffer, w->size)) > 0) *bytes += n;
+    }
+    close(fd);
+    return RESET_OPS;
+}
+
+// Runs process k of the workload, once go is closed, and sends its
+// results over out.
+void child(struct workload *w, int k, int go, int out) {
+    struct result r;
+    size_t max = MAX_OPS > RESET_OPS ? MAX_OPS : RESET_OPS;
+    u64_t *lat = malloc(max * sizeof(*lat));
+    char c;
+
+    if (lat == NULL) exit(1);
+    memset(buffer, 'a', BUFFER_SIZE);
+    (void)read(go, &c, 1);
+
+    switch (w->kind) {
+        case STREAM:
+            r.nr_ops = k < w->producers
+                           ? producer(w, lat, &r.bytes)
+                           : consumer(w, k - w->producers, lat, max, &r.bytes);
+            break;
+        case XCHDEL:
+            r.nr_ops = xchdel(w, lat, &r.bytes);
+            break;
+        default:
+            r.nr_ops = reset(w, lat, &r.bytes);
+    }
+    r.end = tsc();
+
+    if (write(out, &r, sizeof(r)) != sizeof(r) ||
+        write(out, lat, r.nr_ops * sizeof(*lat)) !=
+            (ssize_t)(r.nr_ops * sizeof(*lat))) {
+        exit(1);
+    }
+    exit(0);
+}
+
+// Reads exactly size bytes from the pipe.
+int read_pipe(int fd, void *buf, size_t size) {
+    ssize_t n;
+
+    for (; size > 0; size -= n, buf = (char *)buf + n) {
+        if ((n = read(fd, buf, size)) <= 0) return -1;
+    }
+    return 0;
+}
+
+int compare(const void *a, const void *b) {
+    u64_t x = *(const u64_t *)a, y = *(const u64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+double percentile(struct samples *s, double p) {
+    size_t i = (size_t)(p * s->nr);
+
+    if (s->nr == 0) return 0;
+    if (i >= s->nr) i = s->nr - 1;
+    return s->cycles[i] / cycles_per_us;
+}
+
+void report(struct workload *w, const char *op, struct samples *s,
+            u64_t start) {
+    double seconds = (s->end - start) / cycles_per_us / 1e6;
+
+    qsort(s->cycles, s->nr, sizeof(*s->cycles), compare);
+    printf("%s,%s,%zu,%d,%d,%d,%zu,%zu,%.6f,%.1f,%.3f,%.2f,%.2f,%.2f\n",
+           w->name, op, device_size, MSG_SIZE, w->producers, w->consumers,
+           w->size, s->nr, seconds, s->nr / seconds,
+           s->bytes / seconds / 1e6, percentile(s, 0.5),
+           percentile(s, 0.99), percentile(s, 0.999));
+}
+
+// Runs one workload in processes of its own and reports on it.
+int run(struct workload *w) {
+    const char *ops[] = {"write", "read", "xchdel", "res"};
+    struct samples samples[2];
+    struct result r;
+    int nr = w->producers + w->consumers, go[2], out[MAX_PROCS], p[2];
+    int k, status, failed = 0;
+    struct samples *s;
+    u64_t start;
+    pid_t pid;
+
+    memset(samples, 0, sizeof(samples));
+    for (k = 0; k < 2; k++) {
+        samples[k].cycles = malloc(MAX_PROCS * MAX_OPS * sizeof(u64_t));
+        if (samples[k].cycles == NULL) return -1;
+    }
+
+    if (pipe(go) < 0) return -1;
+    for (k = 0; k < nr; k++) {
+        if (pipe(p) < 0 || (pid = fork()) < 0) return -1;
+        if (pid == 0) {
+            close(go[1]);
+            close(p[0]);
+            child(w, k, go[0], p[1]);
+        }
+        close(p[1]);
+        out[k] = p[0];
+    }
+    close(go[0]);
+
+    /* Everyone starts at once. */
+    start = tsc();
+    close(go[1]);
+
+    for (k = 0; k < nr; k++) {
+        s = &samples[w->kind == STREAM && k >= w->producers];
+        if (read_pipe(out[k], &r, sizeof(r)) < 0 ||
+            read_pipe(out[k], s->cycles + s->nr, r.nr_ops * sizeof(u64_t)) <
+                0) {
+            failed = 1;
+        } else {
+            s->nr += r.nr_ops;
+            s->bytes += r.bytes;
+            if (r.end > s->end) s->end = r.end;
+        }
+        close(out[k]);
+    }
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+    }
+
+    if (!failed) {
+        if (w->kind == STREAM) {
+            report(w, ops[0], &samples[0], start);
+            report(w, ops[1], &samples[1], start);
+        } else {
+            report(w, ops[w->kind == XCHDEL ? 2 : 3], &samples[0], start);
+        }
+    }
+    free(samples[0].cycles);
+    free(samples[1].cycles);
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+    char cmd[256];
+    int fd, failed = 0;
+
+    snprintf(cmd, sizeof(cmd),
+             "service up /service/hello_queue -dev /dev/hello_queue%s%s",
+             argc > 1 ? " -args " : "", argc > 1 ? argv[1] : "");
+    if (system(cmd) != 0) {
+        fprintf(stderr, "cannot start driver\n");
+        return 1;
+    }
+
+    /* The initial contents tell the DEVICE_SIZE the driver was built with. */
+    fd = open_queue(O_RDWR | O_NONBLOCK);
+    device_size = drain(fd);
+    calibrate();
+
+    printf("# args: %s\n", argc > 1 ? argv[1] : "");
+    printf("# tsc: %.1f cycles/us\n", cycles_per_us);
+    printf("workload,op,device_size,msg_size,producers,consumers,size,ops,"
+           "seconds,ops_per_s,mb_per_s,p50_us,p99_us,p999_us\n");
+    fflush(stdout);
+
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if (run(&workloads[i]) < 0) {
+            fprintf(stderr, "%s with size %zu failed\n", workloads[i].name,
+                    workloads[i].size);
+            failed++;
+        }
+        fflush(stdout);
+
+        /* Whatever a failed workload left behind goes. */
+        ioctl(fd, HQIOCRES);
+        drain(fd);
+    }
+
+    close(fd);
+    system("service down hello_queue");
+    return failed;
+}
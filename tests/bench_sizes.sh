@@ -0,0 +1,51 @@
+# Runs bench_queue against drivers built with other DEVICE_SIZE and
+# MSG_SIZE values, overriding the two headers that set them for each build.
+# The headers are put back, and the driver rebuilt, at the end.
+#
+#     sh bench_sizes.sh ['service args'] > results.csv
+#
+# Every variant is DEVICE_SIZE:MSG_SIZE. Large messages of HQIOCBATCH must
+# keep the request under the ioctl size limit, hence MSG_SIZE <= 55.
+variants="61:7 0:7 1:1 4096:7 1048576:48"
+
+driver=/usr/src/minix/drivers/hello_queue
+headers="${driver}/hello_queue.h /usr/include/sys/ioc_hello_queue.h"
+
+for h in ${headers}; do
+    cp ${h} ${h}.orig || exit 1
+done
+
+restore() {
+    for h in ${headers}; do
+        mv ${h}.orig ${h}
+    done
+    (cd ${driver} && make >/dev/null && make install >/dev/null)
+}
+trap restore EXIT
+
+build() {
+    sed "s/^#define DEVICE_SIZE .*/#define DEVICE_SIZE $1/" \
+        ${driver}/hello_queue.h.orig >${driver}/hello_queue.h
+    sed "s/^#define MSG_SIZE .*/#define MSG_SIZE $2/" \
+        /usr/include/sys/ioc_hello_queue.h.orig \
+        >/usr/include/sys/ioc_hello_queue.h
+    (cd ${driver} && make clean >/dev/null && make >/dev/null &&
+        make install >/dev/null) || return 1
+    clang bench_queue.c -o bench_queue
+}
+
+header=1
+for v in ${variants}; do
+    if ! build ${v%:*} ${v#*:}; then
+        echo "cannot build variant ${v}" >&2
+        exit 1
+    fi
+
+    # One CSV header for all variants.
+    if [ ${header} = 1 ]; then
+        ./bench_queue "$@"
+        header=0
+    else
+        ./bench_queue "$@" | grep -v '^workload,'
+    fi
+done
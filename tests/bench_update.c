@@ -0,0 +1,111 @@
+// Measures how long "service update" of hello_queue takes, against the
+// number of bytes in the queue.
+//
+//     clang bench_update.c -o bench_update
+//     ./bench_update [backend]
+//
+// The driver must not be running; it is started with the given storage
+// backend, ring by default, and stopped at the end.
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioc_hello_queue.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Queue sizes to measure, in bytes.
+size_t sizes[] = {0, 4 << 10, 64 << 10, 1 << 20, 4 << 20, 16 << 20};
+
+// Updates per queue size.
+#define ROUNDS 5
+
+#define BUFFER_SIZE (1 << 20)
+char buffer[BUFFER_SIZE];
+
+double now() {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Fills the empty queue with size bytes.
+int fill(int fd, size_t size) {
+    size_t n;
+
+    for (; size > 0; size -= n) {
+        n = size < BUFFER_SIZE ? size : BUFFER_SIZE;
+        if (write(fd, buffer, n) != (ssize_t)n) {
+            perror("write");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Reads the queue empty. Returns the number of bytes read.
+size_t drain(int fd) {
+    size_t total = 0;
+    ssize_t n;
+
+    while ((n = read(fd, buffer, BUFFER_SIZE)) > 0) {
+        total += n;
+    }
+    return total;
+}
+
+int main(int argc, char **argv) {
+    const char *backend = argc > 1 ? argv[1] : "ring";
+    char cmd[256];
+    double start, best, total;
+
+    snprintf(cmd, sizeof(cmd),
+             "service up /service/hello_queue -dev /dev/hello_queue "
+             "-args backend=%s",
+             backend);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "cannot start driver\n");
+        return 1;
+    }
+
+    int fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    drain(fd);
+    memset(buffer, 'a', BUFFER_SIZE);
+
+    printf("%10s %12s %12s\n", "bytes", "best ms", "mean ms");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        if (fill(fd, sizes[s]) < 0) return 1;
+
+        best = total = 0;
+        for (int r = 0; r < ROUNDS; r++) {
+            start = now();
+            if (system("service update /service/hello_queue") != 0) {
+                fprintf(stderr, "update failed\n");
+                return 1;
+            }
+            start = now() - start;
+
+            total += start;
+            if (r == 0 || start < best) best = start;
+        }
+
+        // The contents must have survived every update.
+        if (drain(fd) != sizes[s]) {
+            fprintf(stderr, "queue of %zu bytes not kept\n", sizes[s]);
+            return 1;
+        }
+
+        printf("%10zu %12.2f %12.2f\n", sizes[s], best * 1e3,
+               total * 1e3 / ROUNDS);
+    }
+
+    close(fd);
+    system("service down hello_queue");
+    return 0;
+}
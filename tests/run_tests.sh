@@ -1,2 +1,8 @@
 clang test1.c -o test1
 ./test1
+
+# The kernel test is built straight from the driver sources.
+driver=/usr/src/minix/drivers/hello_queue
+clang -DHQ_SSE2 -msse2 -I${driver} test_kernels.c ${driver}/kernels.c \
+    ${driver}/kernels_sse2.c -o test_kernels
+./test_kernels
@@ -1,10 +1,13 @@
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioc_hello_queue.h>
 #include <sys/ioctl.h>
+#include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "assert.h"
@@ -20,6 +23,17 @@ typedef struct {
 
 char *driver_up = "service up /service/hello_queue -dev /dev/hello_queue";
 char *driver_down = "service down hello_queue";
+char *driver_up_minors =
+    "service up /service/hello_queue -dev /dev/hello_queue -args minors=2";
+char *driver_up_chunk =
+    "service up /service/hello_queue -dev /dev/hello_queue -args "
+    "backend=chunk";
+char *driver_up_cap =
+    "service up /service/hello_queue -dev /dev/hello_queue -args cap=100";
+char *driver_up_fanout =
+    "service up /service/hello_queue -dev /dev/hello_queue -args fanout=1";
+char *driver_up_lanes =
+    "service up /service/hello_queue -dev /dev/hello_queue -args lanes=2";
 
 #define ASSERT(pred, msg)                                            \
     do {                                                             \
@@ -72,7 +86,7 @@ int fd;
 #define TEST_INIT()                                                   \
     do {                                                              \
         START_DRIVER();                                               \
-        fd = open("/dev/hello_queue", O_RDWR);                        \
+        fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);           \
         ASSERT_NOT(fd < 0, "cannot open hello_queue");                \
         ASSERT(0 < read(fd, buffer, BUFFER_SIZE), "init read error"); \
     } while (0)
@@ -81,7 +95,7 @@ int fd;
 int test_init_state() {
     START_DRIVER();
 
-    fd = open("/dev/hello_queue", O_RDWR);
+    fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);
     ASSERT_NOT(fd < 0, "cannot open hello_queue");
 
     int size = read(fd, buffer, BUFFER_SIZE);
@@ -183,6 +197,28 @@ int test_iocres_2() {
     return 0;
 }
 
+int test_iocres_partial_read() {
+    TEST_INIT();
+
+    ASSERT_EQ(3, write(fd, "abc", 3));
+    ASSERT_NEQ(-1, ioctl(fd, HQIOCRES));
+
+    // The pattern continues where the last read stopped.
+    ASSERT_EQ(2, read(fd, buffer, 2));
+    ASSERT_MEM_EQ("xy", buffer, 2);
+    ASSERT_EQ(3, write(fd, "abz", 3));
+
+    char xch[2] = {'z', 'Z'};
+    ASSERT_NEQ(-1, ioctl(fd, HQIOCXCH, xch));
+    ASSERT_EQ(4, read(fd, buffer, 4));
+    ASSERT_MEM_EQ("ZxyZ", buffer, 4);
+
+    ASSERT_EQ(58, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("abZ", buffer + 55, 3);
+
+    return 0;
+}
+
 int test_ioset_1() {
     TEST_INIT();
 
@@ -214,7 +250,7 @@ int test_ioset_2() {
 
 int test_ioset_3() {
     START_DRIVER();
-    fd = open("/dev/hello_queue", O_RDWR);
+    fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);
     ASSERT_NEQ(-1, fd);
 
     // Empty queueu slowly, so it can raect to change size.
@@ -232,7 +268,7 @@ int test_ioset_3() {
 
 int test_read_slowly() {
     START_DRIVER();
-    fd = open("/dev/hello_queue", O_RDWR);
+    fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);
     ASSERT_NEQ(-1, fd);
 
     int n = 10;
@@ -261,7 +297,7 @@ int test_read_slowly() {
 
 int test_xch() {
     START_DRIVER();
-    fd = open("/dev/hello_queue", O_RDWR);
+    fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);
     ASSERT_NEQ(-1, fd);
 
     char xch[2] = {'x', 'a'};
@@ -279,7 +315,7 @@ int test_xch() {
 
 int test_del() {
     START_DRIVER();
-    fd = open("/dev/hello_queue", O_RDWR);
+    fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);
     ASSERT_NEQ(-1, fd);
 
     ASSERT_NEQ(-1, ioctl(fd, HQIOCDEL));
@@ -294,6 +330,589 @@ int test_del() {
     return 0;
 }
 
+int test_xch_after_writes() {
+    TEST_INIT();
+
+    // Exchanges must not reach bytes written after them.
+    ASSERT_EQ(9, write(fd, "abcabcabc", 9));
+    char xch[2] = {'a', 'b'};
+    ASSERT_NEQ(-1, ioctl(fd, HQIOCXCH, xch));
+    ASSERT_EQ(4, write(fd, "aabb", 4));
+    xch[0] = 'b';
+    xch[1] = 'c';
+    ASSERT_NEQ(-1, ioctl(fd, HQIOCXCH, xch));
+
+    char msg[7] = {'A', 'B', 'C', 'D', 'E', 'F', 'b'};
+    ASSERT_NEQ(-1, ioctl(fd, HQIOCSET, msg));
+    xch[1] = 'y';
+    ASSERT_NEQ(-1, ioctl(fd, HQIOCXCH, xch));
+
+    ASSERT_EQ(5, read(fd, buffer, 5));
+    ASSERT_MEM_EQ("ccccc", buffer, 5);
+
+    ASSERT_EQ(1, write(fd, "b", 1));
+    xch[0] = 'c';
+    xch[1] = 'a';
+    ASSERT_NEQ(-1, ioctl(fd, HQIOCXCH, xch));
+
+    ASSERT_EQ(9, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("aABCDEFyb", buffer, 9);
+
+    return 0;
+}
+
+int test_batch() {
+    TEST_INIT();
+
+    ASSERT_EQ(12, write(fd, "abcabcabcabc", 12));
+
+    struct hq_batch batch;
+    batch.nr_ops = 5;
+    batch.ops[0].op = HQ_OP_XCH;
+    batch.ops[0].arg[0] = 'a';
+    batch.ops[0].arg[1] = 'z';
+    batch.ops[1].op = HQ_OP_DEL;
+    batch.ops[2].op = HQ_OP_SET;
+    memcpy(batch.ops[2].arg, "ABCDEFG", 7);
+    batch.ops[3].op = 99;
+    batch.ops[4].op = HQ_OP_RES;
+
+    // The bad operation stops the batch.
+    ASSERT_EQ(-1, ioctl(fd, HQIOCBATCH, &batch));
+    ASSERT_EQ(EINVAL, errno);
+    ASSERT_EQ(0, batch.ops[0].status);
+    ASSERT_EQ(0, batch.ops[1].status);
+    ASSERT_EQ(0, batch.ops[2].status);
+    ASSERT_EQ(EINVAL, batch.ops[3].status);
+    ASSERT_EQ(ECANCELED, batch.ops[4].status);
+
+    ASSERT_EQ(8, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("zABCDEFG", buffer, 8);
+
+    return 0;
+}
+
+// Adds a record to a producer ring, ringing the doorbell when asked to.
+int ring_put(struct hq_ring *r, const char *data, unsigned int len) {
+    unsigned int tail = r->tail, mask = r->size - 1;
+
+    if (r->size - (tail - r->head) < HQ_RING_RECORD(len)) return -1;
+
+    memcpy(HQ_RING_DATA(r) + (tail & mask), &len, sizeof(len));
+    for (unsigned int i = 0; i < len; i++) {
+        HQ_RING_DATA(r)[(tail + sizeof(len) + i) & mask] = data[i];
+    }
+    __sync_synchronize();
+    r->tail = tail + HQ_RING_RECORD(len);
+    __sync_synchronize();
+
+    if (r->need_kick) {
+        r->need_kick = 0;
+        return ioctl(fd, HQIOCKICK);
+    }
+    return 0;
+}
+
+int test_shm_ring() {
+    TEST_INIT();
+
+    struct hq_ring_setup setup = {256, NULL};
+    ASSERT_EQ(-1, ioctl(fd, HQIOCKICK));
+    ASSERT_EQ(ENXIO, errno);
+    ASSERT_EQ(0, ioctl(fd, HQIOCRING, &setup));
+
+    struct hq_ring *r = setup.addr;
+    ASSERT_EQ(256, r->size);
+    for (size_t off = 0; off < sizeof(*r) + r->size; off += 4096) {
+        ((volatile char *)r)[off];
+    }
+
+    // Records and write(2) keep the order they were issued in.
+    ASSERT_EQ(0, ring_put(r, "abc", 3));
+    ASSERT_EQ(2, write(fd, "de", 2));
+    ASSERT_EQ(0, ring_put(r, "fgh", 3));
+    ASSERT_EQ(0, ring_put(r, "", 0));
+    ASSERT_EQ(8, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("abcdefgh", buffer, 8);
+
+    // Enough records to wrap around the ring a few times.
+    for (int i = 0; i < 100; i++) {
+        ASSERT_EQ(0, ring_put(r, "0123456789", 10));
+    }
+    ASSERT_EQ(1000, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("0123456789", buffer + 990, 10);
+
+    setup.size = 0;
+    ASSERT_EQ(0, ioctl(fd, HQIOCRING, &setup));
+
+    return 0;
+}
+
+int test_stats() {
+    TEST_INIT();
+
+    ASSERT_EQ(10, write(fd, "0123456789", 10));
+    ASSERT_EQ(0, ioctl(fd, HQIOCXCH, "0a"));
+    ASSERT_EQ(10, read(fd, buffer, BUFFER_SIZE));
+
+    struct hq_stats stats;
+    ASSERT_EQ(0, ioctl(fd, HQIOCSTATS, &stats));
+
+    // TEST_INIT() read the initial contents.
+    ASSERT_EQ(2, stats.ops[HQ_STAT_READ]);
+    ASSERT_EQ(1, stats.ops[HQ_STAT_WRITE]);
+    ASSERT_EQ(1, stats.ops[HQ_STAT_XCH]);
+    ASSERT_EQ(0, stats.ops[HQ_STAT_DEL]);
+    ASSERT_EQ(10, stats.bytes_in);
+    ASSERT_EQ(61 + 10, stats.bytes_out);
+    ASSERT(stats.peak_capacity >= 10, "peak capacity too small");
+
+    for (int op = 0; op < HQ_STAT_NR; op++) {
+        unsigned long long total = 0;
+        for (int b = 0; b < HQ_HIST_BUCKETS; b++) {
+            total += stats.hist[op][b];
+        }
+        ASSERT_EQ(stats.ops[op], total);
+    }
+
+    return 0;
+}
+
+int test_ring_wrap() {
+    TEST_INIT();
+
+    // Move the head forward, so the next write wraps around the buffer.
+    memset(buffer, 'a', 50);
+    ASSERT_EQ(50, write(fd, buffer, 50));
+    ASSERT_EQ(40, read(fd, buffer, 40));
+    ASSERT_EQ(40, write(fd, "0123456789x123456789x123456789x123456789", 40));
+
+    char xch[2] = {'x', '-'};
+    ASSERT_NEQ(-1, ioctl(fd, HQIOCXCH, xch));
+
+    char msg[7] = "ABCDEF";
+    ASSERT_NEQ(-1, ioctl(fd, HQIOCSET, msg));
+
+    ASSERT_NEQ(-1, ioctl(fd, HQIOCDEL));
+
+    // REMEMBER ABOUT \0!!!
+    char expected[] = "aaaaaaa0235689124578-134679-2ACDF";
+    ASSERT_EQ(sizeof(expected), read(fd, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ(expected, buffer, sizeof(expected));
+
+    ASSERT_EQ(0, read(fd, buffer, BUFFER_SIZE));
+
+    return 0;
+}
+
+int test_minors() {
+    ASSERT(system(driver_up_minors) == 0, "cannot start driver");
+
+    fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);
+    ASSERT_NOT(fd < 0, "cannot open hello_queue");
+    int fd1 = open("/dev/hello_queue1", O_RDWR | O_NONBLOCK);
+    ASSERT_NOT(fd1 < 0, "cannot open hello_queue1");
+
+    // Both queues start with their own xyz pattern.
+    ASSERT_EQ(61, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_EQ(10, write(fd1, "0123456789", 10));
+    ASSERT_NEQ(-1, ioctl(fd1, HQIOCDEL));
+
+    // Nothing written to the second queue shows up in the first one.
+    ASSERT_EQ(0, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_EQ(48, read(fd1, buffer, BUFFER_SIZE));
+
+    close(fd1);
+    return 0;
+}
+
+int test_chunk_backend() {
+    ASSERT(system(driver_up_chunk) == 0, "cannot start driver");
+
+    fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);
+    ASSERT_NOT(fd < 0, "cannot open hello_queue");
+    ASSERT_EQ(61, read(fd, buffer, BUFFER_SIZE));
+
+    // Large enough to span many chunks.
+    int size = 300000;
+    for (int i = 0; i < size; i++) {
+        buffer[i] = 'a' + i % 26;
+    }
+    ASSERT_EQ(size, write(fd, buffer, size));
+    ASSERT_EQ(size, write(fd, buffer, size));
+    ASSERT_EQ(1000, read(fd, buffer, 1000));
+    ASSERT_NEQ(-1, ioctl(fd, HQIOCDEL));
+
+    // Every third byte of the queue is gone.
+    int left = (2 * size - 1000) - (2 * size - 1000) / 3;
+    ASSERT_EQ(left, read(fd, buffer, BUFFER_SIZE));
+    for (int i = 0, j = 1000; i < left; j++) {
+        if ((j - 1000) % 3 == 2) continue;
+        ASSERT_EQ('a' + (j % size) % 26, buffer[i]);
+        i++;
+    }
+    ASSERT_EQ(0, read(fd, buffer, BUFFER_SIZE));
+
+    return 0;
+}
+
+int test_blocking_read() {
+    TEST_INIT();
+
+    pid_t pid = fork();
+    ASSERT_NEQ(-1, pid);
+    if (pid == 0) {
+        // Give the parent time to block in read.
+        sleep(1);
+        int wfd = open("/dev/hello_queue", O_WRONLY);
+        exit(write(wfd, "0123456789", 10) == 10 ? 0 : 1);
+    }
+
+    int rfd = open("/dev/hello_queue", O_RDONLY);
+    ASSERT_NOT(rfd < 0, "cannot open hello_queue");
+    ASSERT_EQ(10, read(rfd, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("0123456789", buffer, 10);
+
+    int status;
+    ASSERT_EQ(pid, waitpid(pid, &status, 0));
+    ASSERT_EQ(0, WEXITSTATUS(status));
+
+    close(rfd);
+    return 0;
+}
+
+int test_select() {
+    TEST_INIT();
+
+    fd_set rfds;
+    struct timeval tv = {0, 100000};
+
+    // Empty queue is not readable.
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+    ASSERT_EQ(0, select(fd + 1, &rfds, NULL, NULL, &tv));
+
+    pid_t pid = fork();
+    ASSERT_NEQ(-1, pid);
+    if (pid == 0) {
+        sleep(1);
+        int wfd = open("/dev/hello_queue", O_WRONLY);
+        exit(write(wfd, "abc", 3) == 3 ? 0 : 1);
+    }
+
+    // Sleep in select until the writer shows up.
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+    ASSERT_EQ(1, select(fd + 1, &rfds, NULL, NULL, NULL));
+    ASSERT(FD_ISSET(fd, &rfds), "queue not readable");
+    ASSERT_EQ(3, read(fd, buffer, BUFFER_SIZE));
+
+    int status;
+    ASSERT_EQ(pid, waitpid(pid, &status, 0));
+    ASSERT_EQ(0, WEXITSTATUS(status));
+
+    return 0;
+}
+
+int test_fanout() {
+    ASSERT(system(driver_up_fanout) == 0, "cannot start driver");
+
+    fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);
+    ASSERT_NOT(fd < 0, "cannot open hello_queue");
+    int fd1 = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);
+    ASSERT_NOT(fd1 < 0, "cannot open hello_queue");
+
+    // Every reader sees all of the data.
+    ASSERT_EQ(61, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_EQ(10, write(fd, "0123456789", 10));
+    ASSERT_EQ(4, read(fd, buffer, 4));
+    ASSERT_MEM_EQ("0123", buffer, 4);
+    ASSERT_EQ(71, read(fd1, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("0123456789", buffer + 61, 10);
+    ASSERT_EQ(6, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("456789", buffer, 6);
+
+    // A new reader starts where the slowest one is.
+    ASSERT_EQ(3, write(fd1, "abc", 3));
+    ASSERT_EQ(3, read(fd1, buffer, BUFFER_SIZE));
+    int fd2 = open("/dev/hello_queue", O_RDONLY | O_NONBLOCK);
+    ASSERT_NOT(fd2 < 0, "cannot open hello_queue");
+    ASSERT_EQ(3, read(fd2, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("abc", buffer, 3);
+    ASSERT_EQ(3, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_EQ(0, read(fd, buffer, BUFFER_SIZE));
+
+    close(fd2);
+    close(fd1);
+    return 0;
+}
+
+int test_framed() {
+    TEST_INIT();
+
+    int framed = 1, next;
+    ASSERT_NEQ(-1, ioctl(fd, HQIOCFRAMED, &framed));
+
+    // Every write is one record, every read returns at most one.
+    ASSERT_EQ(3, write(fd, "abc", 3));
+    ASSERT_EQ(5, write(fd, "defgh", 5));
+    ASSERT_NEQ(-1, ioctl(fd, FIONREAD, &next));
+    ASSERT_EQ(3, next);
+    ASSERT_EQ(3, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("abc", buffer, 3);
+
+    // The part of a record that does not fit is dropped.
+    ASSERT_EQ(2, read(fd, buffer, 2));
+    ASSERT_MEM_EQ("de", buffer, 2);
+    ASSERT_EQ(0, read(fd, buffer, BUFFER_SIZE));
+
+    // Records lose the bytes HQIOCDEL takes from them.
+    ASSERT_EQ(4, write(fd, "0123", 4));
+    ASSERT_EQ(6, write(fd, "456789", 6));
+    ASSERT_NEQ(-1, ioctl(fd, HQIOCDEL));
+    ASSERT_EQ(3, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("013", buffer, 3);
+    ASSERT_EQ(4, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("4679", buffer, 4);
+
+    // The reset contents are a single record.
+    ASSERT_NEQ(-1, ioctl(fd, HQIOCRES));
+    ASSERT_NEQ(-1, ioctl(fd, FIONREAD, &next));
+    ASSERT_EQ(61, next);
+
+    return 0;
+}
+
+int test_cap() {
+    ASSERT(system(driver_up_cap) == 0, "cannot start driver");
+
+    fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);
+    ASSERT_NOT(fd < 0, "cannot open hello_queue");
+    ASSERT_EQ(61, read(fd, buffer, BUFFER_SIZE));
+
+    // Writes over the cap fail without blocking.
+    memset(buffer, 'a', 200);
+    ASSERT_EQ(100, write(fd, buffer, 100));
+    ASSERT_EQ(-1, write(fd, buffer, 1));
+    ASSERT_EQ(EAGAIN, errno);
+
+    // Writers wait until the queue is down to half the cap.
+    ASSERT_EQ(40, read(fd, buffer, 40));
+    ASSERT_EQ(-1, write(fd, buffer, 1));
+    ASSERT_EQ(10, read(fd, buffer, 10));
+    ASSERT_EQ(50, write(fd, buffer, 50));
+
+    // A blocked writer goes on once a reader makes room.
+    pid_t pid = fork();
+    ASSERT_NEQ(-1, pid);
+    if (pid == 0) {
+        sleep(1);
+        int rfd = open("/dev/hello_queue", O_RDONLY | O_NONBLOCK);
+        exit(read(rfd, buffer, 60) == 60 ? 0 : 1);
+    }
+    int wfd = open("/dev/hello_queue", O_WRONLY);
+    ASSERT_NOT(wfd < 0, "cannot open hello_queue");
+    ASSERT_EQ(30, write(wfd, buffer, 30));
+
+    int status;
+    ASSERT_EQ(pid, waitpid(pid, &status, 0));
+    ASSERT_EQ(0, WEXITSTATUS(status));
+
+    // Larger writes take what there is room for.
+    ASSERT_EQ(30, read(fd, buffer, 30));
+    ASSERT_EQ(60, write(fd, buffer, 200));
+    ASSERT_EQ(100, read(fd, buffer, BUFFER_SIZE));
+
+    close(wfd);
+    return 0;
+}
+
+int test_journal() {
+    struct stat st;
+    char cmd[256];
+
+    // The journal goes to a ramdisk of the memory driver.
+    ASSERT(system("ramdisk 1024 /dev/ram1 >/dev/null") == 0,
+           "cannot set up ramdisk");
+    ASSERT_EQ(0, stat("/dev/ram1", &st));
+    snprintf(cmd, sizeof(cmd),
+             "service up /service/hello_queue -dev /dev/hello_queue "
+             "-args 'journal=memory journal_dev=%d'",
+             (int)st.st_rdev);
+    ASSERT(system(cmd) == 0, "cannot start driver");
+
+    fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);
+    ASSERT_NOT(fd < 0, "cannot open hello_queue");
+    ASSERT_EQ(61, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_EQ(3, write(fd, "abc", 3));
+    ASSERT_EQ(4, write(fd, "defg", 4));
+    ASSERT_EQ(2, read(fd, buffer, 2));
+    close(fd);
+
+    // A restarted driver finds the queue as it was.
+    ASSERT(system("service refresh hello_queue") == 0,
+           "cannot restart driver");
+    sleep(1);
+    fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);
+    ASSERT_NOT(fd < 0, "cannot open hello_queue");
+    ASSERT_EQ(5, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("cdefg", buffer, 5);
+
+    // Again, from the snapshot the restart began with.
+    ASSERT_EQ(2, write(fd, "hi", 2));
+    close(fd);
+    ASSERT(system("service refresh hello_queue") == 0,
+           "cannot restart driver");
+    sleep(1);
+    fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);
+    ASSERT_NOT(fd < 0, "cannot open hello_queue");
+    ASSERT_EQ(2, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("hi", buffer, 2);
+    return 0;
+}
+
+int test_lanes() {
+    ASSERT(system(driver_up_lanes) == 0, "cannot start driver");
+
+    fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);
+    ASSERT_NOT(fd < 0, "cannot open hello_queue");
+    int fd1 = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);
+    ASSERT_NOT(fd1 < 0, "cannot open hello_queue");
+    ASSERT_EQ(61, read(fd, buffer, BUFFER_SIZE));
+
+    // Bytes on the higher lane are read first, whatever came before.
+    int lane = 1;
+    memset(buffer, 'a', 1000);
+    ASSERT_EQ(1000, write(fd, buffer, 1000));
+    ASSERT_NEQ(-1, ioctl(fd1, HQIOCLANE, &lane));
+    ASSERT_EQ(7, write(fd1, "control", 7));
+    ASSERT_EQ(7, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("control", buffer, 7);
+    ASSERT_EQ(1000, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_EQ(0, read(fd, buffer, BUFFER_SIZE));
+
+    struct hq_lanes lanes;
+    ASSERT_EQ(0, ioctl(fd, HQIOCLANES, &lanes));
+    ASSERT_EQ(2, lanes.nr_lanes);
+    ASSERT_EQ(1000, lanes.lane[0].bytes_in);
+    ASSERT_EQ(1061, lanes.lane[0].bytes_out);
+    ASSERT_EQ(7, lanes.lane[1].bytes_in);
+    ASSERT_EQ(1, lanes.lane[1].reads);
+
+    lane = 2;
+    ASSERT_EQ(-1, ioctl(fd1, HQIOCLANE, &lane));
+    ASSERT_EQ(EINVAL, errno);
+
+    close(fd1);
+    return 0;
+}
+
+int test_lanes_select() {
+    ASSERT(system(driver_up_lanes) == 0, "cannot start driver");
+
+    fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK);
+    ASSERT_NOT(fd < 0, "cannot open hello_queue");
+    ASSERT_EQ(61, read(fd, buffer, BUFFER_SIZE));
+
+    pid_t pid = fork();
+    ASSERT_NEQ(-1, pid);
+    if (pid == 0) {
+        sleep(1);
+        int wfd = open("/dev/hello_queue", O_WRONLY);
+        int lane = 1;
+        if (ioctl(wfd, HQIOCLANE, &lane) != 0) exit(1);
+        exit(write(wfd, "abc", 3) == 3 ? 0 : 1);
+    }
+
+    // Every open file has a minor of its own, under which its select() is
+    // answered.
+    fd_set rfds, wfds;
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+    ASSERT_EQ(1, select(fd + 1, &rfds, NULL, NULL, NULL));
+    ASSERT(FD_ISSET(fd, &rfds), "queue not readable");
+    ASSERT_EQ(3, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("abc", buffer, 3);
+
+    int status;
+    ASSERT_EQ(pid, waitpid(pid, &status, 0));
+    ASSERT_EQ(0, WEXITSTATUS(status));
+
+    // There is room on the lane the file writes to.
+    struct timeval tv = {0, 100000};
+    FD_ZERO(&wfds);
+    FD_SET(fd, &wfds);
+    ASSERT_EQ(1, select(fd + 1, NULL, &wfds, NULL, &tv));
+    return 0;
+}
+
+int test_live_update() {
+    TEST_INIT();
+
+    // Enough data for the ring buffer to get pages of its own, which the
+    // new instance maps from the old one instead of going through DS.
+    for (int i = 0; i < 20000; i++) {
+        buffer[i] = 'a' + i % 26;
+    }
+    ASSERT_EQ(20000, write(fd, buffer, 20000));
+    ASSERT_EQ(5000, read(fd, buffer, 5000));
+
+    // The second update takes the buffer over from an instance that took
+    // it over itself.
+    for (int update = 0; update < 2; update++) {
+        ASSERT(system("service update /service/hello_queue") == 0,
+               "cannot update driver");
+
+        // The open file reads on where it was.
+        ASSERT_EQ(5000, read(fd, buffer, 5000));
+        for (int i = 0; i < 5000; i++) {
+            ASSERT(buffer[i] == 'a' + (i + 5000 * (update + 1)) % 26,
+                   "data lost in update");
+        }
+    }
+    ASSERT_EQ(5000, read(fd, buffer, BUFFER_SIZE));
+    for (int i = 0; i < 5000; i++) {
+        ASSERT(buffer[i] == 'a' + (i + 15000) % 26, "data lost in update");
+    }
+
+    // The buffer taken over keeps working.
+    ASSERT_EQ(3, write(fd, "abc", 3));
+    ASSERT_EQ(3, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("abc", buffer, 3);
+    return 0;
+}
+
+int test_live_update_ring() {
+    TEST_INIT();
+
+    struct hq_ring_setup setup = {256, NULL};
+    ASSERT_EQ(0, ioctl(fd, HQIOCRING, &setup));
+    struct hq_ring *r = setup.addr;
+    ASSERT_EQ(0, ring_put(r, "abc", 3));
+
+    // The ring stays where it is in the producer, and keeps working, when
+    // the driver is updated, again and again.
+    for (int update = 0; update < 2; update++) {
+        ASSERT(system("service update /service/hello_queue") == 0,
+               "cannot update driver");
+        ASSERT_EQ(0, ring_put(r, "de", 2));
+        ASSERT_EQ(0, ioctl(fd, HQIOCKICK));
+    }
+    ASSERT_EQ(7, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("abcdede", buffer, 7);
+
+    // Enough records to wrap around the ring taken over.
+    for (int i = 0; i < 100; i++) {
+        ASSERT_EQ(0, ring_put(r, "0123456789", 10));
+    }
+    ASSERT_EQ(1000, read(fd, buffer, BUFFER_SIZE));
+    ASSERT_MEM_EQ("0123456789", buffer + 990, 10);
+
+    setup.size = 0;
+    ASSERT_EQ(0, ioctl(fd, HQIOCRING, &setup));
+    return 0;
+}
+
 // ALL TESTS IN THIS ARRAY WILL RUN.
 test_case tests[] = {
     {"test_init_state", &test_init_state},
@@ -302,11 +921,29 @@ test_case tests[] = {
     {"test_read_slowly", &test_read_slowly},
     {"test_iocres_1", &test_iocres_1},
     {"test_iocres_2", &test_iocres_2},
+    {"test_iocres_partial_read", &test_iocres_partial_read},
     {"test_ioset_1", &test_ioset_1},
     {"test_ioset_2", &test_ioset_2},
     {"test_ioset_3", &test_ioset_3},
     {"test_xch", &test_xch},
     {"test_del", &test_del},
+    {"test_xch_after_writes", &test_xch_after_writes},
+    {"test_batch", &test_batch},
+    {"test_shm_ring", &test_shm_ring},
+    {"test_stats", &test_stats},
+    {"test_ring_wrap", &test_ring_wrap},
+    {"test_minors", &test_minors},
+    {"test_chunk_backend", &test_chunk_backend},
+    {"test_blocking_read", &test_blocking_read},
+    {"test_select", &test_select},
+    {"test_fanout", &test_fanout},
+    {"test_framed", &test_framed},
+    {"test_cap", &test_cap},
+    {"test_journal", &test_journal},
+    {"test_lanes", &test_lanes},
+    {"test_lanes_select", &test_lanes_select},
+    {"test_live_update", &test_live_update},
+    {"test_live_update_ring", &test_live_update_ring},
 
 };
 
@@ -86,7 +86,7 @@ void test1() {
 
     int fd;
 
-    if ((fd = open("/dev/hello_queue", O_RDWR)) < 0) {
+    if ((fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK)) < 0) {
         fprintf(stderr, "Error open\n");
         exit(1);
     }
@@ -109,7 +109,7 @@ void test2() {
 
     int fd;
 
-    if ((fd = open("/dev/hello_queue", O_RDWR)) < 0) {
+    if ((fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK)) < 0) {
         fprintf(stderr, "Error open\n");
         exit(1);
     }
@@ -224,7 +224,7 @@ void test3() {
 
     int fd;
 
-    if ((fd = open("/dev/hello_queue", O_RDWR)) < 0) {
+    if ((fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK)) < 0) {
         fprintf(stderr, "Error open\n");
         exit(1);
     }
@@ -335,7 +335,7 @@ void test4() {
 
     int fd;
 
-    if ((fd = open("/dev/hello_queue", O_RDWR)) < 0) {
+    if ((fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK)) < 0) {
         fprintf(stderr, "Error open\n");
         exit(1);
     }
@@ -356,7 +356,7 @@ void test4() {
     /* Waiting 3 second just to make sure that everything is restarted. */
     sleep(3);
 
-    if ((fd = open("/dev/hello_queue", O_RDWR)) < 0) {
+    if ((fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK)) < 0) {
         fprintf(stderr, "Error open\n");
         exit(1);
     }
@@ -383,7 +383,7 @@ void test4() {
 
 //     int fd;
 
-//     if ((fd = open("/dev/hello_queue", O_RDWR)) < 0) {
+//     if ((fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK)) < 0) {
 //         fprintf(stderr, "Error open\n");
 //         exit(1);
 //     }
@@ -404,7 +404,7 @@ void test4() {
 //     /* Waiting 3 second just to make sure that everything is restarted. */
 //     sleep(3);
 
-//     if ((fd = open("/dev/hello_queue", O_RDWR)) < 0) {
+//     if ((fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK)) < 0) {
 //         fprintf(stderr, "Error open\n");
 //         exit(1);
 //     }
@@ -431,7 +431,7 @@ void test6() {
 
     int fd;
 
-    if ((fd = open("/dev/hello_queue", O_RDWR)) < 0) {
+    if ((fd = open("/dev/hello_queue", O_RDWR | O_NONBLOCK)) < 0) {
         fprintf(stderr, "Error open\n");
         exit(1);
     }
@@ -0,0 +1,116 @@
+// Compares the HQIOCXCH and HQIOCDEL kernels of the driver against the
+// scalar code on random buffers. Build it together with the driver's
+// kernels, see run_tests.sh.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernels.h"
+
+#define ASSERT_EQ(expected, actual)                                  \
+    do {                                                             \
+        long long int e = expected, a = actual;                      \
+        if ((e) != (a)) {                                            \
+            printf("assertion failed %s: %d\n", __FILE__, __LINE__); \
+            printf("expected: %lld, actual: %lld\n", e, a);          \
+            return 1;                                                \
+        }                                                            \
+    } while (0)
+
+#define ASSERT_MEM_EQ(expected, actual, n)                           \
+    do {                                                             \
+        if (memcmp(expected, actual, n) != 0) {                      \
+            printf("assertion failed %s: %d\n", __FILE__, __LINE__); \
+            return 1;                                                \
+        }                                                            \
+    } while (0)
+
+#define ROUNDS 20000
+#define MAX_LEN 600
+
+// Extra bytes around the buffers, to start at any alignment and to catch
+// writes past the end.
+#define SLACK 64
+
+typedef struct {
+    char *name;
+    hq_xch_fn xch;
+    hq_del_fn del;
+} kernel;
+
+char src[MAX_LEN + 2 * SLACK];
+char expected[MAX_LEN + 2 * SLACK];
+char actual[MAX_LEN + 2 * SLACK];
+
+// Few distinct values, so the exchanged byte shows up often.
+void random_fill(char *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        p[i] = rand() % 4 ? 'a' + rand() % 3 : rand();
+    }
+}
+
+int test_xch(kernel *k) {
+    for (int round = 0; round < ROUNDS; round++) {
+        size_t off = rand() % SLACK, len = rand() % MAX_LEN;
+        char from = rand() % 4 ? 'a' : rand(), to = rand();
+
+        random_fill(expected, sizeof(expected));
+        memcpy(actual, expected, sizeof(actual));
+
+        hq_xch_scalar(expected + off, len, from, to);
+        k->xch(actual + off, len, from, to);
+        ASSERT_MEM_EQ(expected, actual, sizeof(actual));
+    }
+    return 0;
+}
+
+int test_del(kernel *k) {
+    for (int round = 0; round < ROUNDS; round++) {
+        size_t off = rand() % SLACK, len = rand() % MAX_LEN;
+        size_t dst_off = rand() % SLACK;
+        size_t n;
+
+        random_fill(src, sizeof(src));
+        random_fill(expected, sizeof(expected));
+        memcpy(actual, expected, sizeof(actual));
+
+        n = hq_del_scalar(expected + dst_off, src + off, len);
+        ASSERT_EQ(len - len / 3, n);
+        ASSERT_EQ(n, k->del(actual + dst_off, src + off, len));
+        ASSERT_MEM_EQ(expected, actual, sizeof(actual));
+
+        // In place, the way the driver compacts a segment.
+        hq_del_scalar(expected, src + off, len);
+        memcpy(actual, src, sizeof(actual));
+        dst_off = off - rand() % (off + 1);
+        ASSERT_EQ(n, k->del(actual + dst_off, actual + off, len));
+        ASSERT_MEM_EQ(expected, actual + dst_off, n);
+    }
+    return 0;
+}
+
+kernel kernels[] = {
+    {"swar", &hq_xch_swar, &hq_del_swar},
+#ifdef HQ_SSE2
+    {"sse2", &hq_xch_sse2, &hq_del_sse2},
+#endif
+};
+
+int main() {
+    int failed = 0;
+
+    srand(1);
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+#ifdef HQ_SSE2
+        if (kernels[i].xch == &hq_xch_sse2 && !hq_have_sse2()) {
+            printf("%s: skipped, no CPU support\n", kernels[i].name);
+            continue;
+        }
+#endif
+        int status = test_xch(&kernels[i]) || test_del(&kernels[i]);
+        printf("%s: %s\n", kernels[i].name, status ? "failed" : "ok");
+        failed |= status;
+    }
+
+    return failed;
+}